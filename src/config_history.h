@@ -0,0 +1,75 @@
+// Config history pack records: card document hashing and compression. No
+// Arduino dependency, so the host tests in test/host can measure what a
+// commit writes.
+//
+// Pack record (little-endian):
+//   u32 hash, u16 rawLength, u16 storedLength, storedLength bytes
+// Stored bytes replace the fixed fragments emitted by serializeCardToJson
+// with single control bytes 0x01..0x1F, which serialized JSON never carries
+// unescaped. storedLength == rawLength means the document is stored as-is.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+const uint32_t kFnv1aSeed = 2166136261UL;
+
+inline uint32_t fnv1a32(uint32_t hash, const void* data, size_t length) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+const size_t kConfigHistoryRecordHeaderBytes = 8;
+const size_t kConfigHistoryMaxCardBytes = 1024;
+const char* const kConfigHistoryDictionary[] = {
+    "{\"id\":",           ",\"type\":\"",         "\",\"index\":",
+    ",\"hwPin\":",        ",\"invert\":",         ",\"setting",
+    ",\"logicalState\":", ",\"physicalState\":",  ",\"triggerFlag\":",
+    ",\"currentValue\":", ",\"startO",            ",\"repeatCounter\":",
+    ",\"mode\":\"Mode_",  "\",\"state\":\"State_", ",\"set",
+    ",\"reset",           "A_ID\":",              "B_ID\":",
+    "A_Operator\":\"Op_", "B_Operator\":\"Op_",   "A_Threshold\":",
+    "B_Threshold\":",     "Combine\":\"Combine_", "\",\"alarm\":",
+    "false",              "true",                 ",\"label\":\"",
+    ",\"engineeringUnit\":\"", ",\"exchangePublish\":", ",\"reportDeadband",
+    "Digital"};
+const uint8_t kConfigHistoryDictionarySize =
+    sizeof(kConfigHistoryDictionary) / sizeof(kConfigHistoryDictionary[0]);
+static_assert(sizeof(kConfigHistoryDictionary) /
+                      sizeof(kConfigHistoryDictionary[0]) <= 0x1F,
+              "config history dictionary tokens must stay below 0x20");
+
+// Returns 0 when the document must be stored as-is.
+inline size_t compressCardDocument(const char* raw, size_t rawLength,
+                                   uint8_t* out) {
+  size_t outLength = 0;
+  for (size_t i = 0; i < rawLength;) {
+    const uint8_t ch = static_cast<uint8_t>(raw[i]);
+    if (ch < 0x20) return 0;
+    uint8_t bestToken = 0;
+    size_t bestLength = 1;
+    for (uint8_t t = 0; t < kConfigHistoryDictionarySize; ++t) {
+      const size_t length = strlen(kConfigHistoryDictionary[t]);
+      if (length > bestLength && length <= rawLength - i &&
+          memcmp(raw + i, kConfigHistoryDictionary[t], length) == 0) {
+        bestToken = t + 1;
+        bestLength = length;
+      }
+    }
+    out[outLength++] = (bestToken != 0) ? bestToken : ch;
+    i += bestLength;
+  }
+  return outLength;
+}
+
+// Text a stored byte of a compressed document stands for, or nullptr when it
+// is a literal byte.
+inline const char* configHistoryToken(uint8_t stored) {
+  if (stored < 1 || stored > kConfigHistoryDictionarySize) return nullptr;
+  return kConfigHistoryDictionary[stored - 1];
+}
@@ -0,0 +1,87 @@
+// Event journal record layout and the sparse time index over its segments.
+// No Arduino dependency, so the host tests in test/host can measure appends
+// and seeks against in-memory segments.
+#pragma once
+
+#include <stdint.h>
+
+struct JournalRecord {
+  uint32_t seq;
+  uint32_t timeS;  // never decreases along seq
+  uint8_t kind;
+  uint8_t code;  // new state, command type, restore source or fault
+  uint16_t cardId;
+  uint8_t origin;
+  uint8_t result;  // command applied
+  uint16_t client;  // WS client number or last octet of the peer address
+  uint32_t detail;
+  uint32_t aux;
+};
+static_assert(sizeof(JournalRecord) == 24, "journal record layout is on flash");
+
+// Every kJournalIndexStride-th record of a segment has its time kept in
+// marks, and readers fetch one stride at a time.
+const uint16_t kJournalIndexStride = 64;
+
+// Indexes records[0..n), which are appended at segment index firstIndex.
+inline void markJournalRecords(uint32_t* marks, uint16_t firstIndex,
+                               const JournalRecord* records, uint16_t n) {
+  for (uint16_t i = 0; i < n; ++i) {
+    const uint16_t index = firstIndex + i;
+    if (index % kJournalIndexStride == 0) {
+      marks[index / kJournalIndexStride] = records[i].timeS;
+    }
+  }
+}
+
+// Segment provides firstSeq, count, lastTimeS and marks; segments are oldest
+// first and seq is contiguous inside each. Both searches return count when
+// every segment is older than the key.
+template <typename Segment>
+uint8_t findJournalSegmentBySeq(const Segment* segments, uint8_t count,
+                                uint32_t fromSeq) {
+  uint8_t lo = 0;
+  uint8_t hi = count;
+  while (lo < hi) {
+    const uint8_t mid = (lo + hi) / 2;
+    if (segments[mid].firstSeq + segments[mid].count <= fromSeq) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+template <typename Segment>
+uint8_t findJournalSegmentByTime(const Segment* segments, uint8_t count,
+                                 uint32_t from) {
+  uint8_t lo = 0;
+  uint8_t hi = count;
+  while (lo < hi) {
+    const uint8_t mid = (lo + hi) / 2;
+    if (segments[mid].lastTimeS < from) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Index in segment to scan from for records at or after from: at most one
+// stride ahead of the first match.
+template <typename Segment>
+uint16_t findJournalIndexByTime(const Segment& segment, uint32_t from) {
+  uint16_t lo = 0;
+  uint16_t hi = (segment.count + kJournalIndexStride - 1) / kJournalIndexStride;
+  while (lo < hi) {
+    const uint16_t mid = (lo + hi) / 2;
+    if (segment.marks[mid] < from) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (lo > 0) ? (lo - 1) * kJournalIndexStride : 0;
+}
@@ -13,42 +13,156 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <LittleFS.h>
+#include <PubSubClient.h>
 #include <WebServer.h>
 #include <WebSocketsServer.h>
 #include <WiFi.h>
+#include <WiFiUdp.h>
+#include <uri/UriBraces.h>
 
+#include <atomic>
 #include <cctype>
+#include <cstdarg>
 #include <cstring>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/sha256.h>
+
+#include "config_history.h"
+#include "journal_index.h"
+#include "modbus_tcp.h"
+#include "mqtt_result.h"
+#include "ota_trial.h"
+#include "script_vm.h"
+#include "serial_codec.h"
+#include "softio_exchange.h"
+#include "time_sync.h"
+
+// Console text goes through gConsole. While the serial link owns the UART
+// (offline only) it is dropped instead of landing between binary frames.
+class ConsoleLog : public Print {
+ public:
+  size_t write(uint8_t byte) override {
+    return muted ? 1 : Serial.write(byte);
+  }
+  size_t write(const uint8_t* data, size_t length) override {
+    return muted ? length : Serial.write(data, length);
+  }
+  volatile bool muted = false;
+};
+ConsoleLog gConsole;
 
 const uint8_t DI_Pins[] = {13, 12, 14, 27};  // Digital Input pins
 const uint8_t DO_Pins[] = {26, 25, 33, 32};  // Digital Output pins
 const uint8_t AI_Pins[] = {35, 34};          // Analog Input pins
-const uint8_t SIO_Pins[] = {255, 255, 255, 255};
-// SoftIO has no physical pins, so we can use 255 as a placeholder for "virtual"
+// SoftIO has no physical pins, so we use 255 as a placeholder for "virtual"
+const uint8_t kVirtualCardPin = 255;
+
+// --- Profile capacities ---
+// Physical families are sized by their channel arrays. Virtual families have
+// no channels, so their capacity is a build flag (e.g. -DAT_SIO_CAPACITY=256).
+// Script cards are off unless AT_SCRIPT_CAPACITY is set; like any capacity
+// change, enabling them changes the shape of the stored config.
+// Plugin cards come from build-time registration: one card per entry of
+// AT_CARD_PLUGINS(X), written X(instance,PluginClass), e.g.
+//   -D'AT_CARD_PLUGINS(X)=X(tankLevel,HysteresisPlugin)'
+// None are registered by default.
+#ifndef AT_SIO_CAPACITY
+#define AT_SIO_CAPACITY 4
+#endif
+#ifndef AT_SCRIPT_CAPACITY
+#define AT_SCRIPT_CAPACITY 0
+#endif
+#ifndef AT_CARD_PLUGINS
+#define AT_CARD_PLUGINS(X)
+#endif
+#define COUNT_CARD_PLUGIN(instance, type) +1
 
 // --- Card counts (can be changed later) ---
-const uint8_t NUM_DI = sizeof(DI_Pins) / sizeof(DI_Pins[0]);
-const uint8_t NUM_DO = sizeof(DO_Pins) / sizeof(DO_Pins[0]);
-const uint8_t NUM_AI = sizeof(AI_Pins) / sizeof(AI_Pins[0]);
-const uint8_t NUM_SIO = sizeof(SIO_Pins) / sizeof(SIO_Pins[0]);
-
-const uint8_t TOTAL_CARDS = NUM_DI + NUM_DO + NUM_AI + NUM_SIO;
-
-const uint8_t DI_START = 0;
-const uint8_t DO_START = DI_START + NUM_DI;
-const uint8_t AI_START = DO_START + NUM_DO;
-const uint8_t SIO_START = AI_START + NUM_AI;
+const uint16_t NUM_DI = sizeof(DI_Pins) / sizeof(DI_Pins[0]);
+const uint16_t NUM_DO = sizeof(DO_Pins) / sizeof(DO_Pins[0]);
+const uint16_t NUM_AI = sizeof(AI_Pins) / sizeof(AI_Pins[0]);
+const uint16_t NUM_SIO = AT_SIO_CAPACITY;
+const uint16_t NUM_SCRIPT = AT_SCRIPT_CAPACITY;
+const uint16_t NUM_PLUGIN = 0 AT_CARD_PLUGINS(COUNT_CARD_PLUGIN);
+
+const uint16_t TOTAL_CARDS =
+    NUM_DI + NUM_DO + NUM_AI + NUM_SIO + NUM_SCRIPT + NUM_PLUGIN;
+// Card ids are 16-bit; 0xFFFF is reserved as the "no card" sentinel.
+const uint16_t kInvalidCardId = 0xFFFF;
+static_assert(static_cast<uint32_t>(NUM_DI) + NUM_DO + NUM_AI + NUM_SIO +
+                      NUM_SCRIPT + NUM_PLUGIN <
+                  kInvalidCardId,
+              "card family capacities exceed 16-bit card id space");
+
+const uint16_t DI_START = 0;
+const uint16_t DO_START = DI_START + NUM_DI;
+const uint16_t AI_START = DO_START + NUM_DO;
+const uint16_t SIO_START = AI_START + NUM_AI;
+const uint16_t SCRIPT_START = SIO_START + NUM_SIO;
+const uint16_t PLUGIN_START = SCRIPT_START + NUM_SCRIPT;
+
+// Remote SoftIO slots fed by the SoftIO exchange. Their ids follow the local
+// cards and may only be used as set/reset references (read-only).
+#ifndef AT_REMOTE_SIO_SLOTS
+#define AT_REMOTE_SIO_SLOTS 8
+#endif
+const uint16_t NUM_REMOTE_SIO = AT_REMOTE_SIO_SLOTS;
+const uint16_t REMOTE_START = TOTAL_CARDS;
+static_assert(static_cast<uint32_t>(TOTAL_CARDS) + AT_REMOTE_SIO_SLOTS <
+                  kInvalidCardId,
+              "remote SoftIO slots exceed 16-bit card id space");
 const char* kConfigPath = "/config.json";
 const char* kStagedConfigPath = "/config_staged.json";
+// Full-copy history of older firmware; imported into the history store once.
 const char* kLkgConfigPath = "/config_lkg.json";
 const char* kSlot1ConfigPath = "/config_slot1.json";
 const char* kSlot2ConfigPath = "/config_slot2.json";
 const char* kSlot3ConfigPath = "/config_slot3.json";
+const char* kConfigHistoryPackPath = "/config_history.pack";
+const char* kConfigHistoryPackTempPath = "/config_history_pack.tmp";
+const char* kConfigHistoryIndexPath = "/config_history.json";
+const char* kConfigHistoryIndexTempPath = "/config_history_index.tmp";
+const char* kConfigHistoryRestorePath = "/config_restore.json";
 const char* kFactoryConfigPath = "/config_factory.json";
 const char* kPortalSettingsPath = "/portal_settings.json";
+const char* kV2SchemaVersion = "2.0.0";
+const char* kV2MigrationManifestPath = "/config_v2_manifest.json";
+const char* kV2MigrationTempPath = "/config_v2_tmp.json";
+struct LegacyV2PathPair {
+  const char* legacyPath;
+  const char* v2Path;
+};
+const LegacyV2PathPair kV2MigrationPaths[] = {
+    {kConfigPath, "/config_v2.json"},
+};
+// Last migration actually run (cache misses only), for /api/diagnostics.
+uint32_t gV2MigrationLastUs = 0;
+uint16_t gV2MigrationLastCards = 0;
+uint32_t gV2MigrationCacheHits = 0;
+const char* const kLegacyHistoryV2Paths[] = {
+    "/config_lkg_v2.json", "/config_slot1_v2.json", "/config_slot2_v2.json",
+    "/config_slot3_v2.json"};
+#ifndef AT_LABEL_POOL_BYTES
+#define AT_LABEL_POOL_BYTES 2048
+#endif
+static_assert(AT_LABEL_POOL_BYTES <= 0xFFFF,
+              "label pool must be addressable by 16-bit handles");
+const size_t kMaxCardLabelLength = 32;
+const size_t kMaxEngineeringUnitLength = 8;
+#ifndef AT_RECIPE_CAPACITY
+#define AT_RECIPE_CAPACITY 4
+#endif
+static_assert(AT_RECIPE_CAPACITY <= 127, "recipe slots use int8_t handles");
+const size_t kMaxRecipeNameLength = 23;
+const char* kRecipeIndexPath = "/recipes.json";
+const char* kActiveRecipePath = "/recipe_active.json";
 const uint32_t kDefaultScanIntervalMs = 500;
 const uint32_t kMinScanIntervalMs = 10;
 const uint32_t kMaxScanIntervalMs = 1000;
@@ -64,7 +178,7 @@ const uint32_t USER_WIFI_TIMEOUT_MS = 180000;
 #endif
 
 #if LOGIC_ENGINE_DEBUG
-#define LOGIC_DEBUG_PRINTLN(x) Serial.println(x)
+#define LOGIC_DEBUG_PRINTLN(x) gConsole.println(x)
 #else
 #define LOGIC_DEBUG_PRINTLN(x) \
   do {                         \
@@ -75,7 +189,9 @@ const uint32_t USER_WIFI_TIMEOUT_MS = 180000;
   X(DigitalInput)          \
   X(DigitalOutput)         \
   X(AnalogInput)           \
-  X(SoftIO)
+  X(SoftIO)                \
+  X(Script)                \
+  X(Plugin)
 
 #define LIST_OPERATORS(X) \
   X(Op_AlwaysTrue)        \
@@ -104,37 +220,122 @@ const uint32_t USER_WIFI_TIMEOUT_MS = 180000;
   X(Mode_AI_Continuous) \
   X(Mode_DO_Normal)     \
   X(Mode_DO_Immediate)  \
-  X(Mode_DO_Gated)
-
-#define LIST_STATES(X)  \
-  X(State_None)         \
-  X(State_DI_Idle)      \
-  X(State_DI_Filtering) \
-  X(State_DI_Qualified) \
-  X(State_DI_Inhibited) \
-  X(State_AI_Streaming) \
-  X(State_DO_Idle)      \
-  X(State_DO_OnDelay)   \
-  X(State_DO_Active)    \
-  X(State_DO_Finished)
+  X(Mode_DO_Gated)      \
+  X(Mode_Script)        \
+  X(Mode_Plugin)
+
+#define LIST_STATES(X)   \
+  X(State_None)          \
+  X(State_DI_Idle)       \
+  X(State_DI_Filtering)  \
+  X(State_DI_Qualified)  \
+  X(State_DI_Inhibited)  \
+  X(State_AI_Streaming)  \
+  X(State_DO_Idle)       \
+  X(State_DO_OnDelay)    \
+  X(State_DO_Active)     \
+  X(State_DO_Finished)   \
+  X(State_Remote_Stale)  \
+  X(State_Script_Idle)   \
+  X(State_Script_Active) \
+  X(State_Plugin_Idle)   \
+  X(State_Plugin_Active) \
+  X(State_Plugin_Faulted)
 
 #define LIST_COMBINE(X) \
   X(Combine_None)       \
   X(Combine_AND)        \
   X(Combine_OR)
 
+#define LIST_DEADBAND_MODES(X) \
+  X(Deadband_None)             \
+  X(Deadband_Absolute)         \
+  X(Deadband_Percent)
+
+#define LIST_HOOK_KINDS(X) \
+  X(Hook_Condition)        \
+  X(Hook_EnterState)       \
+  X(Hook_Watch)
+
+#define LIST_WATCH_FIELDS(X) \
+  X(Field_LogicalState)      \
+  X(Field_PhysicalState)     \
+  X(Field_TriggerFlag)       \
+  X(Field_CurrentValue)      \
+  X(Field_State)             \
+  X(Field_RepeatCounter)
+
+#define LIST_STIMULUS_WAVEFORMS(X) \
+  X(Stimulus_Square)               \
+  X(Stimulus_Pulse)                \
+  X(Stimulus_Ramp)                 \
+  X(Stimulus_Sine)                 \
+  X(Stimulus_Trace)
+
+#define LIST_KERNEL_COMMANDS(X)     \
+  X(KernelCmd_SetRunMode)           \
+  X(KernelCmd_StepOnce)             \
+  X(KernelCmd_SetBreakpoint)        \
+  X(KernelCmd_SetTestMode)          \
+  X(KernelCmd_SetInputForce)        \
+  X(KernelCmd_SetOutputMask)        \
+  X(KernelCmd_SetOutputMaskGlobal)  \
+  X(KernelCmd_SwitchRecipe)         \
+  X(KernelCmd_SetShadowEnabled)     \
+  X(KernelCmd_SetInputStimulus)     \
+  X(KernelCmd_AddBreakpointHook)    \
+  X(KernelCmd_ClearBreakpointHooks) \
+  X(KernelCmd_InspectRewindFrame)   \
+  X(KernelCmd_RewindToFrame)
+
+#define LIST_JOURNAL_KINDS(X) \
+  X(Journal_Boot)             \
+  X(Journal_Transition)       \
+  X(Journal_Command)          \
+  X(Journal_Commit)           \
+  X(Journal_Restore)          \
+  X(Journal_Fault)            \
+  X(Journal_Firmware)
+
+#define LIST_COMMAND_ORIGINS(X) \
+  X(Origin_Internal)            \
+  X(Origin_Http)                \
+  X(Origin_WebSocket)           \
+  X(Origin_Mqtt)                \
+  X(Origin_Modbus)              \
+  X(Origin_Serial)
+
+#define LIST_JOURNAL_FAULTS(X) \
+  X(Fault_ScanOverrun)         \
+  X(Fault_ShadowBudget)        \
+  X(Fault_RemoteStale)         \
+  X(Fault_JournalDropped)      \
+  X(Fault_StorageWrite)        \
+  X(Fault_OtaRejected)         \
+  X(Fault_PluginOverrun)       \
+  X(Fault_PluginFaulted)
+
 #define as_enum(name) name,
 enum logicCardType { LIST_CARD_TYPES(as_enum) };
 enum logicOperator { LIST_OPERATORS(as_enum) };
 enum cardMode { LIST_MODES(as_enum) };
 enum cardState { LIST_STATES(as_enum) };
 enum combineMode { LIST_COMBINE(as_enum) };
+enum stimulusWaveform { LIST_STIMULUS_WAVEFORMS(as_enum) };
+enum hookKind { LIST_HOOK_KINDS(as_enum) };
+enum deadbandMode { LIST_DEADBAND_MODES(as_enum) };
+enum watchField { LIST_WATCH_FIELDS(as_enum) };
+enum kernelCommandType { LIST_KERNEL_COMMANDS(as_enum) };
+enum journalKind { LIST_JOURNAL_KINDS(as_enum) };
+enum commandOrigin { LIST_COMMAND_ORIGINS(as_enum) };
+enum journalFault { LIST_JOURNAL_FAULTS(as_enum) };
 enum runMode { RUN_NORMAL, RUN_STEP, RUN_BREAKPOINT, RUN_SLOW };
 enum inputSourceMode {
   InputSource_Real,
   InputSource_ForcedHigh,
   InputSource_ForcedLow,
-  InputSource_ForcedValue
+  InputSource_ForcedValue,
+  InputSource_Stimulus
 };
 #undef as_enum
 
@@ -214,6 +415,8 @@ const char* toString(inputSourceMode value) {
       return "FORCED_LOW";
     case InputSource_ForcedValue:
       return "FORCED_VALUE";
+    case InputSource_Stimulus:
+      return "STIMULUS";
     default:
       return "REAL";
   }
@@ -249,6 +452,77 @@ bool tryParseCombineMode(const char* s, combineMode& out) {
   return false;
 }
 
+const char* toString(hookKind value) {
+  switch (value) { LIST_HOOK_KINDS(ENUM_TO_STRING_CASE) }
+  return "Hook_Condition";
+}
+
+const char* toString(deadbandMode value) {
+  switch (value) { LIST_DEADBAND_MODES(ENUM_TO_STRING_CASE) }
+  return "Deadband_None";
+}
+
+const char* toString(kernelCommandType value) {
+  switch (value) { LIST_KERNEL_COMMANDS(ENUM_TO_STRING_CASE) }
+  return "KernelCmd_SetRunMode";
+}
+
+const char* toString(journalKind value) {
+  switch (value) { LIST_JOURNAL_KINDS(ENUM_TO_STRING_CASE) }
+  return "Journal_Boot";
+}
+
+bool tryParseJournalKind(const char* s, journalKind& out) {
+  if (s == nullptr) return false;
+  LIST_JOURNAL_KINDS(ENUM_TRY_PARSE_IF)
+  return false;
+}
+
+const char* toString(commandOrigin value) {
+  switch (value) { LIST_COMMAND_ORIGINS(ENUM_TO_STRING_CASE) }
+  return "Origin_Internal";
+}
+
+const char* toString(journalFault value) {
+  switch (value) { LIST_JOURNAL_FAULTS(ENUM_TO_STRING_CASE) }
+  return "Fault_ScanOverrun";
+}
+
+const char* toString(otaTrialState value) {
+  switch (value) { LIST_OTA_TRIAL_STATES(ENUM_TO_STRING_CASE) }
+  return "OtaTrial_None";
+}
+
+bool tryParseOtaTrialState(const char* s, otaTrialState& out) {
+  if (s == nullptr) return false;
+  LIST_OTA_TRIAL_STATES(ENUM_TRY_PARSE_IF)
+  return false;
+}
+
+bool tryParseDeadbandMode(const char* s, deadbandMode& out) {
+  if (s == nullptr) return false;
+  LIST_DEADBAND_MODES(ENUM_TRY_PARSE_IF)
+  return false;
+}
+
+bool tryParseHookKind(const char* s, hookKind& out) {
+  if (s == nullptr) return false;
+  LIST_HOOK_KINDS(ENUM_TRY_PARSE_IF)
+  return false;
+}
+
+bool tryParseWatchField(const char* s, watchField& out) {
+  if (s == nullptr) return false;
+  LIST_WATCH_FIELDS(ENUM_TRY_PARSE_IF)
+  return false;
+}
+
+bool tryParseStimulusWaveform(const char* s, stimulusWaveform& out) {
+  if (s == nullptr) return false;
+  LIST_STIMULUS_WAVEFORMS(ENUM_TRY_PARSE_IF)
+  return false;
+}
+
 logicCardType parseOrDefault(const char* s, logicCardType fallback) {
   logicCardType value = fallback;
   if (tryParseLogicCardType(s, value)) return value;
@@ -284,12 +558,12 @@ combineMode parseOrDefault(const char* s, combineMode fallback) {
 
 struct LogicCard {
   // Global unique card ID used by set/reset reference and lookup.
-  uint8_t id;
+  uint16_t id;
   // Type family of the card (DI, DO, AI, SIO).
   logicCardType type;
   // Position index within its family (e.g. DI0=0, DI1=1, DO0=0, SIO2=2).
-  uint8_t index;
-  // Hardware pin number for physical cards (255 for virtual SoftIO).
+  uint16_t index;
+  // Hardware pin number for physical cards (kVirtualCardPin for SoftIO).
   uint8_t hwPin;
 
   // Active Low / Inverted Polarity flag.
@@ -358,28 +632,45 @@ struct LogicCard {
   cardState state;
 
   // SET Group
-  uint8_t setA_ID;
+  uint16_t setA_ID;
   logicOperator setA_Operator;
   uint32_t setA_Threshold;
 
-  uint8_t setB_ID;
+  uint16_t setB_ID;
   logicOperator setB_Operator;
   uint32_t setB_Threshold;
 
   combineMode setCombine;
 
   // RESET Group
-  uint8_t resetA_ID;
+  uint16_t resetA_ID;
   logicOperator resetA_Operator;
   uint32_t resetA_Threshold;
 
-  uint8_t resetB_ID;
+  uint16_t resetB_ID;
   logicOperator resetB_Operator;
   uint32_t resetB_Threshold;
 
   combineMode resetCombine;
+
+  // AI only: reporting deadband for published values (centiunits or
+  // centi-percent of span). Never used by the kernel's conditions.
+  deadbandMode reportDeadbandMode;
+  uint32_t reportDeadband;
+
+  // Transitions of alarm cards go out on the priority alarm lane.
+  bool alarm;
+
+  // State transitions of journal cards are recorded in the event journal.
+  bool journal;
+
+  // SIO only: publish this card on the SoftIO exchange.
+  bool exchangePublish;
 };
-LogicCard logicCards[TOTAL_CARDS] = {};
+// Double-buffered card bank. The kernel runs from logicCards; Core1 may stage
+// the other bank for a recipe switch that flips the pointer at a scan boundary.
+LogicCard gCardBank[2][TOTAL_CARDS] = {};
+LogicCard* volatile logicCards = gCardBank[0];
 bool gPrevSetCondition[TOTAL_CARDS] = {};
 bool gPrevDISample[TOTAL_CARDS] = {};
 bool gPrevDIPrimed[TOTAL_CARDS] = {};
@@ -387,16 +678,217 @@ bool gCardSetResult[TOTAL_CARDS] = {};
 bool gCardResetResult[TOTAL_CARDS] = {};
 bool gCardResetOverride[TOTAL_CARDS] = {};
 uint32_t gCardEvalCounter[TOTAL_CARDS] = {};
+// Raw DI/AI samples of the current scan (after forcing, before invert/scale),
+// replayed by the shadow kernel so both see the same input image.
+bool gInputImageDI[NUM_DI] = {};
+uint32_t gInputImageAI[NUM_AI] = {};
+// Last published AI values and their publish/suppress counters.
+uint32_t gAIReportedValue[NUM_AI] = {};
+bool gAIReportPrimed[NUM_AI] = {};
+uint32_t gAIPublishedChanges[NUM_AI] = {};
+uint32_t gAISuppressedChanges[NUM_AI] = {};
+// Core1-only WebSocket publish counters.
+uint32_t gWsSnapshotsPublished = 0;
+uint32_t gWsSnapshotsSuppressed = 0;
+uint64_t gWsSnapshotBytesSaved = 0;
+uint32_t gWsFramesSent = 0;
+uint64_t gWsBytesSent = 0;
+// Cost of building one runtime snapshot frame (JSON tree plus text), the
+// per-card part of every publish; reported with the scan cost per card.
+uint32_t gWsSnapshotLastBuildUs = 0;
+uint32_t gWsSnapshotMaxBuildUs = 0;
+uint32_t gWsSnapshotLastBytes = 0;
+
+// --- Script cards ---
+// Compiler, VM and program layout live in script_vm.h.
+#ifndef AT_SCRIPT_SCAN_BUDGET
+#define AT_SCRIPT_SCAN_BUDGET 256
+#endif
+const size_t kMaxScriptSourceLength = 256;
+// Keeps per-script tables well-formed when script cards are compiled out.
+const uint16_t kScriptSlots = (NUM_SCRIPT > 0) ? NUM_SCRIPT : 1;
+// Programs of the active config, indexed by id - SCRIPT_START. Core1 writes
+// them only while the kernel is paused for a config apply.
+ScriptProgram gScriptPrograms[kScriptSlots] = {};
+uint32_t gScriptScanUs = 0;  // kernel-owned; VM time of the current scan
+
+// Target of the per-card scan functions. The live kernel evaluates logicCards
+// with the global tables above; the shadow kernel supplies its own so a staged
+// config runs through the same transition code.
+struct KernelEvalContext {
+  LogicCard* cards;
+  bool* prevSetCondition;
+  bool* prevDISample;
+  bool* prevDIPrimed;
+  bool* setResult;
+  bool* resetResult;
+  bool* resetOverride;
+  // When set, DI/AI samples come from these images instead of hardware.
+  const bool* inputImageDI;
+  const uint32_t* inputImageAI;
+  bool driveOutputs;
+  const ScriptProgram* scripts;
+};
+
+// --- Plugin cards ---
+// Build-time card families for protocol and remote-IO adapters. One plugin
+// object serves every bank (live, shadow, virtual runs), so it keeps no state
+// of its own: whatever must survive between scans lives in the card. The
+// kernel calls evaluate() inside the scan and holds it to budgetUs(); the
+// other hooks run on Core1.
+class CardPlugin {
+ public:
+  CardPlugin(const char* name, uint32_t budgetUs)
+      : name_(name), budgetUs_(budgetUs) {}
+  const char* name() const { return name_; }
+  uint32_t budgetUs() const { return budgetUs_; }
+
+  // Resets the card's runtime fields whenever a config bank is loaded.
+  virtual void init(LogicCard& card) const = 0;
+  // Updates logicalState and currentValue. Other cards are read through
+  // conditionTarget(ctx, id); physicalState/triggerFlag/state are the
+  // kernel's.
+  virtual void evaluate(const KernelEvalContext& ctx, LogicCard& card,
+                        uint32_t nowMs) const = 0;
+  // Static description for the portal, e.g. what setting1..3 mean.
+  virtual void describe(JsonObject out) const = 0;
+  // Plugin-specific view of a snapshot copy of the card.
+  virtual void snapshotFields(const LogicCard& card, JsonObject out) const = 0;
+  // Checks the plugin's settings in a staged card.
+  virtual bool validate(JsonObjectConst card, String& reason) const {
+    (void)card;
+    (void)reason;
+    return true;
+  }
+
+ private:
+  const char* name_;
+  uint32_t budgetUs_;
+};
+
+// Consecutive over-budget evaluations after which a plugin card faults.
+#ifndef AT_PLUGIN_OVERRUN_LIMIT
+#define AT_PLUGIN_OVERRUN_LIMIT 3
+#endif
+static_assert(AT_PLUGIN_OVERRUN_LIMIT >= 1 && AT_PLUGIN_OVERRUN_LIMIT <= 255,
+              "plugin overrun streak is stored in a uint8_t");
+// Keeps per-plugin tables well-formed when no plugin is registered.
+const uint16_t kPluginSlots = (NUM_PLUGIN > 0) ? NUM_PLUGIN : 1;
+// Indexed by id - PLUGIN_START; defined after the plugin classes.
+extern const CardPlugin* const kCardPlugins[kPluginSlots];
+
+// Kernel-owned evaluation cost of each plugin card, copied with the snapshot.
+struct PluginRuntime {
+  uint32_t lastUs;
+  uint32_t maxUs;
+  uint32_t overruns;
+  uint32_t faults;
+  uint8_t overrunStreak;
+};
+PluginRuntime gPluginRuntime[kPluginSlots] = {};
+
+#ifndef AT_SHADOW_BUDGET_PERCENT
+#define AT_SHADOW_BUDGET_PERCENT 25
+#endif
+const uint8_t kShadowOverrunLimit = 3;
+
+#ifndef AT_VIRTUAL_TIMELINE_CAPACITY
+#define AT_VIRTUAL_TIMELINE_CAPACITY 256
+#endif
+const uint16_t kVirtualTimelineCapacity = AT_VIRTUAL_TIMELINE_CAPACITY;
+const uint16_t kVirtualScriptCapacity = 64;
+// A fast-forward run advances in slices from the portal loop; the cap bounds
+// the whole run and the per-pass budget bounds each slice.
+const uint32_t kVirtualMaxSteps = 100000;
+#ifndef AT_VIRTUAL_EVALS_PER_PASS
+#define AT_VIRTUAL_EVALS_PER_PASS 2048
+#endif
+const uint32_t kTimingMaxSteps = 200000;
+const uint16_t kTimingMaxSegments = 128;
+const uint8_t kTimingCacheEntries = 4;
+const uint32_t kRewindInspectTimeoutMs = 250;
+const uint32_t kDiagnosticsPublishMs = 5000;
+
+// Staged config evaluated beside the live one with outputs suppressed.
+// Core1 may write cards only while gShadowActive and gShadowEnableQueued are
+// both false.
+struct ShadowKernel {
+  LogicCard cards[TOTAL_CARDS];
+  bool prevSetCondition[TOTAL_CARDS];
+  bool prevDISample[TOTAL_CARDS];
+  bool prevDIPrimed[TOTAL_CARDS];
+  bool setResult[TOTAL_CARDS];
+  bool resetResult[TOTAL_CARDS];
+  bool resetOverride[TOTAL_CARDS];
+  uint32_t divergences[TOTAL_CARDS];
+  ScriptProgram scripts[kScriptSlots];
+  uint32_t scans;
+  uint32_t divergentScans;
+  uint32_t lastCostUs;
+  uint32_t maxCostUs;
+  uint8_t overrunStreak;
+};
+ShadowKernel gShadow = {};
+volatile bool gShadowActive = false;
+// Set by Core1 when it queues an enable; cleared by the kernel once the
+// shadow runs, so a second load cannot overwrite cards about to be scanned.
+volatile bool gShadowEnableQueued = false;
+const char* volatile gShadowStopReason = nullptr;
+
+// Compact per-output view of the shadow run for the snapshot.
+struct ShadowOutputImage {
+  cardState state;
+  bool logicalState;
+  bool physicalState;
+  uint32_t divergences;
+};
+
+// Interned, read-only label/unit strings and script sources of the active
+// config. Built on Core1 at commit/boot and never read by the kernel, so names
+// stay out of LogicCard and the per-scan snapshot copy. Handle 0 is the empty
+// string.
+struct CardLabelTable {
+  uint32_t hash;
+  uint16_t poolUsed;
+  uint16_t labelRef[TOTAL_CARDS];
+  uint16_t unitRef[TOTAL_CARDS];
+  uint16_t scriptRef[kScriptSlots];
+  char pool[AT_LABEL_POOL_BYTES];
+};
+CardLabelTable gCardLabels = {};
 
 struct SharedRuntimeSnapshot {
   uint32_t seq;
+  uint32_t changeSeq;
   uint32_t tsMs;
   uint32_t lastCompleteScanUs;
   runMode mode;
   bool testModeActive;
   bool globalOutputMask;
   bool breakpointPaused;
+  uint16_t breakpointHitCardId;
+  int8_t breakpointHitHook;
+  hookKind breakpointHitKind;
+  uint8_t breakpointHookCount;
+  uint16_t rewindFrames;
+  uint32_t rewindOldestFrame;
+  uint32_t rewindNewestFrame;
+  uint16_t rewindEntriesUsed;
+  uint32_t rewindLastRecordUs;
+  uint32_t rewindMaxRecordUs;
+  uint32_t rewindOverflows;
   uint16_t scanCursor;
+  int8_t activeRecipeSlot;
+  uint32_t recipeSwitchCount;
+  uint32_t lastRecipeSwapUs;
+  uint32_t lastRecipeSwitchLatencyUs;
+  bool shadowActive;
+  const char* shadowStopReason;
+  uint32_t shadowScans;
+  uint32_t shadowDivergentScans;
+  uint32_t shadowLastCostUs;
+  uint32_t shadowMaxCostUs;
+  ShadowOutputImage shadowOutputs[TOTAL_CARDS];
   LogicCard cards[TOTAL_CARDS];
   inputSourceMode inputSource[TOTAL_CARDS];
   uint32_t forcedAIValue[TOTAL_CARDS];
@@ -405,29 +897,129 @@ struct SharedRuntimeSnapshot {
   bool setResult[TOTAL_CARDS];
   bool resetResult[TOTAL_CARDS];
   bool resetOverride[TOTAL_CARDS];
+  bool prevSetCondition[TOTAL_CARDS];
+  bool prevDISample[TOTAL_CARDS];
+  bool prevDIPrimed[TOTAL_CARDS];
+  bool inputImageDI[NUM_DI];
+  uint32_t inputImageAI[NUM_AI];
   uint32_t evalCounter[TOTAL_CARDS];
+  uint32_t aiReportedValue[NUM_AI];
+  uint32_t aiPublishedChanges[NUM_AI];
+  uint32_t aiSuppressedChanges[NUM_AI];
+  LogicCard remoteCards[NUM_REMOTE_SIO];
+  uint32_t remoteReceivedMs[NUM_REMOTE_SIO];
+  uint32_t exchangeStaleTransitions;
+  PluginRuntime plugins[kPluginSlots];
 };
 
+#ifndef AT_KERNEL_QUEUE_DEPTH
+#define AT_KERNEL_QUEUE_DEPTH 16
+#endif
+
 QueueHandle_t gKernelCommandQueue = nullptr;
 TaskHandle_t gCore0TaskHandle = nullptr;
 TaskHandle_t gCore1TaskHandle = nullptr;
 portMUX_TYPE gSnapshotMux = portMUX_INITIALIZER_UNLOCKED;
 SharedRuntimeSnapshot gSharedSnapshot = {};
+// Core1 scratch copy of gSharedSnapshot. The portal handlers and publishers
+// each refill it before use and never nest, so one copy serves them all; it is
+// too large for the portal task stack at high card capacities.
+SharedRuntimeSnapshot gPortalSnapshot = {};
+// Raised wherever publishable card or runtime state mutates (kernel scan,
+// kernel commands, Core1 config apply) and consumed under gSnapshotMux, so
+// change detection never reads gSharedSnapshot unlocked or rescans every card.
+std::atomic<bool> gPublishDirty(true);
+
+void markPublishDirty() { gPublishDirty.store(true, std::memory_order_relaxed); }
 WebServer gPortalServer(80);
 WebSocketsServer gWsServer(81);
 char gUserSsid[33] = {};
 char gUserPassword[65] = {};
+// MQTT broker settings; an empty host disables the publisher.
+char gMqttHost[65] = {};
+uint16_t gMqttPort = 1883;
+char gMqttTopicRoot[65] = {};
+bool gMqttReconfigureRequested = false;
 bool gPortalReconnectRequested = false;
 bool gPortalServerInitialized = false;
 bool gWsServerInitialized = false;
 volatile bool gKernelPauseRequested = false;
 volatile bool gKernelPaused = false;
 uint32_t gConfigVersionCounter = 1;
+
+// Preloaded alternate card programs (recipes), owned by Core1.
+struct RecipeSlot {
+  bool loaded;
+  char name[kMaxRecipeNameLength + 1];
+  uint32_t cardsHash;
+  LogicCard cards[TOTAL_CARDS];
+};
+RecipeSlot gRecipes[AT_RECIPE_CAPACITY] = {};
+const int8_t kNoRecipe = -1;
+// Set by Core1 once the standby bank is staged; cleared by the kernel after
+// the swap. Core1 must not touch the standby bank while it is set.
+volatile bool gRecipeSwitchPending = false;
+volatile uint32_t gRecipeSwitchRequestedUs = 0;
+// Bumped by Core1 before it writes the standby bank and on every commit. A
+// queued switch carries the value it was staged under and is dropped if it no
+// longer matches, so a stale command can never flip onto a bank in rewrite.
+volatile uint32_t gRecipeSwitchSeq = 0;
+volatile int8_t gStagedRecipeSlot = kNoRecipe;
+uint32_t gLastRecipeStageUs = 0;
+int8_t gPendingRecipeSlot = kNoRecipe;
+int8_t gActiveRecipeSlot = kNoRecipe;
+uint32_t gRecipeSwitchCount = 0;
+uint32_t gLastRecipeSwapUs = 0;
+uint32_t gLastRecipeSwitchLatencyUs = 0;
 char gActiveVersion[16] = "v1";
-char gLkgVersion[16] = "";
-char gSlot1Version[16] = "";
-char gSlot2Version[16] = "";
-char gSlot3Version[16] = "";
+
+// Content-addressed config history. Each distinct card document is stored
+// once, compressed, in an append-only pack keyed by its FNV-1a hash; a
+// version is the list of its card blobs, so a commit appends only the cards
+// that differ from every retained version. configId hashes the card hashes.
+#ifndef AT_CONFIG_HISTORY_VERSIONS
+#define AT_CONFIG_HISTORY_VERSIONS 24
+#endif
+// Two full configs plus 164 changed cards; 192 at the default profile.
+#ifndef AT_CONFIG_HISTORY_BLOBS
+#define AT_CONFIG_HISTORY_BLOBS (2 * TOTAL_CARDS + 164)
+#endif
+static_assert(AT_CONFIG_HISTORY_VERSIONS >= 2 && AT_CONFIG_HISTORY_VERSIONS <= 255,
+              "config history needs 2..255 versions");
+static_assert(AT_CONFIG_HISTORY_BLOBS >= 2 * TOTAL_CARDS &&
+                  AT_CONFIG_HISTORY_BLOBS <= 0xFFFF,
+              "config history pack must hold two full configs");
+
+struct ConfigHistoryBlob {
+  uint32_t hash;
+  uint32_t offset;  // record start in the pack
+  uint16_t rawLength;
+  uint16_t storedLength;  // == rawLength: stored uncompressed
+};
+
+struct ConfigHistoryVersion {
+  uint32_t configId;
+  uint32_t parentId;
+  uint32_t number;
+  uint32_t cardOffsets[TOTAL_CARDS];
+};
+
+// Core1-owned after boot.
+struct ConfigHistoryStore {
+  bool ready;
+  uint16_t blobCount;  // ascending pack offset
+  uint8_t versionCount;  // oldest first
+  uint32_t packBytes;
+  uint32_t appendedBlobs;
+  uint32_t reusedBlobs;
+  uint32_t compactions;
+  // Persist phase of a commit: history append, index and active file.
+  uint32_t lastCommitUs;
+  uint32_t maxCommitUs;
+  ConfigHistoryBlob blobs[AT_CONFIG_HISTORY_BLOBS];
+  ConfigHistoryVersion versions[AT_CONFIG_HISTORY_VERSIONS];
+};
+ConfigHistoryStore gConfigHistory = {};
 
 runMode gRunMode = RUN_NORMAL;
 uint16_t gScanCursor = 0;
@@ -437,16 +1029,571 @@ bool gTestModeActive = false;
 bool gGlobalOutputMask = false;
 
 bool gCardBreakpoint[TOTAL_CARDS] = {};
+
+// Conditional breakpoints and watchpoints. Hooks live in a small shared table
+// and are chained per card, so the scan loop only walks them for armed cards.
+#ifndef AT_BREAKPOINT_HOOKS
+#define AT_BREAKPOINT_HOOKS 16
+#endif
+const uint8_t kMaxBreakpointHooks = AT_BREAKPOINT_HOOKS;
+const uint8_t kNoBreakpointHookSlot = 0xFF;
+const int8_t kNoBreakpointHook = -1;
+static_assert(AT_BREAKPOINT_HOOKS < 0x7F, "hook slots use int8_t handles");
+
+struct BreakpointHook {
+  uint16_t cardId;
+  hookKind kind;
+  logicOperator op;
+  watchField field;
+  uint32_t operand;
+  uint32_t lastValue;
+  uint8_t next;
+};
+BreakpointHook gBreakpointHooks[AT_BREAKPOINT_HOOKS] = {};
+uint8_t gCardHookHead[TOTAL_CARDS] = {};
+uint8_t gBreakpointHookCount = 0;
+uint16_t gBreakpointHitCardId = 0;
+int8_t gBreakpointHitHook = -1;
+
+// Time-travel recorder for test mode. The latest hot-state image is kept in
+// full; each recorded frame stores only the previous values of the cards it
+// changed (an undo delta), so any retained frame is rebuilt by walking back
+// from the latest image. Frames and undo entries live in fixed rings.
+#ifndef AT_REWIND_FRAMES
+#define AT_REWIND_FRAMES 64
+#endif
+#ifndef AT_REWIND_ENTRIES
+#define AT_REWIND_ENTRIES 512
+#endif
+static_assert(AT_REWIND_FRAMES <= 0xFFFF && AT_REWIND_ENTRIES <= 0xFFFF,
+              "rewind rings use 16-bit indices");
+const uint8_t kHotLogical = 0x01;
+const uint8_t kHotPhysical = 0x02;
+const uint8_t kHotTrigger = 0x04;
+const uint8_t kHotPrevSet = 0x08;
+const uint8_t kHotPrevDISample = 0x10;
+const uint8_t kHotPrevDIPrimed = 0x20;
+
+struct CardHotState {
+  uint32_t currentValue;
+  uint32_t startOnMs;
+  uint32_t startOffMs;
+  uint32_t repeatCounter;
+  cardState state;
+  uint8_t flags;
+};
+
+struct RewindUndoEntry {
+  uint16_t cardId;
+  CardHotState before;
+};
+
+struct RewindFrame {
+  uint32_t frame;
+  uint32_t tsMs;
+  uint16_t scanCursor;
+  uint16_t firstEntry;
+  uint16_t entryCount;
+};
+
+struct RewindRecorder {
+  CardHotState latest[TOTAL_CARDS];
+  RewindFrame frames[AT_REWIND_FRAMES];
+  RewindUndoEntry entries[AT_REWIND_ENTRIES];
+  uint16_t frameHead;
+  uint16_t frameCount;
+  uint16_t entryHead;
+  uint16_t entryCount;
+  uint32_t nextFrame;
+  uint32_t lastRecordUs;
+  uint32_t maxRecordUs;
+  uint32_t overflows;
+};
+RewindRecorder gRewind = {};
+
+// Kernel-rebuilt image for one past frame. The kernel rebuilds into a
+// private scratch image and publishes under gSnapshotMux; Core1 copies it out
+// under the same mux before serializing, so a late or overlapping rebuild
+// never races the reader. The state flag only signals completion.
+enum rewindInspectState {
+  RewindInspect_Idle,
+  RewindInspect_Pending,
+  RewindInspect_Ready,
+  RewindInspect_Unavailable
+};
+struct RewindInspectImage {
+  uint32_t frame;
+  uint32_t tsMs;
+  uint16_t scanCursor;
+  CardHotState cards[TOTAL_CARDS];
+};
+RewindInspectImage gRewindInspect = {};
+RewindInspectImage gRewindScratch = {};
+volatile rewindInspectState gRewindInspectState = RewindInspect_Idle;
 bool gCardOutputMask[TOTAL_CARDS] = {};
 inputSourceMode gCardInputSource[TOTAL_CARDS] = {};
 uint32_t gCardForcedAIValue[TOTAL_CARDS] = {};
 uint32_t gScanIntervalMs = kDefaultScanIntervalMs;
 uint32_t gLastCompleteScanUs = 0;
 
+// Scan-duration histogram upper bounds for /metrics; one extra +Inf bucket.
+const uint32_t kScanHistogramBoundsUs[] = {250,  500,   1000,  2000,
+                                           5000, 10000, 20000, 50000};
+const uint8_t kScanHistogramBuckets =
+    sizeof(kScanHistogramBoundsUs) / sizeof(kScanHistogramBoundsUs[0]) + 1;
+
+// Kernel-owned counters, copied to gSharedKernelMetrics with the snapshot.
+struct KernelMetrics {
+  uint32_t scanBuckets[kScanHistogramBuckets];
+  uint64_t scanSumUs;
+  uint32_t scans;
+  uint32_t overruns;
+  uint32_t lateScans;
+  uint32_t maxLatenessMs;
+  uint64_t latenessSumMs;
+  uint32_t commands;
+  uint32_t commandsRejected;
+  uint64_t commandLatencySumUs;
+  uint32_t commandLatencyMaxUs;
+  // Scan release phase against the shared time-sync epoch.
+  bool alignActive;
+  int32_t alignLastErrorUs;
+  uint32_t alignMaxAbsErrorUs;
+  uint32_t alignMeanAbsErrorUs;  // moving average, 1/16 weight
+  uint32_t alignSamples;
+  uint32_t alignSlews;
+  // Start-to-start error of consecutive full scans. The OTA figure covers
+  // the latest firmware transfer and is reset when one starts.
+  uint32_t jitterMaxUs;
+  uint32_t otaJitterMaxUs;
+  // Time spent in script programs per full scan.
+  uint32_t scriptLastUs;
+  uint32_t scriptMaxUs;
+};
+KernelMetrics gKernelMetrics = {};
+KernelMetrics gSharedKernelMetrics = {};
+
 const uint32_t SLOW_SCAN_INTERVAL_MS = 250;
 
-bool isOutputMasked(uint8_t cardId);
-uint8_t scanOrderCardIdFromCursor(uint16_t cursor);
+#ifndef AT_STIMULUS_TRACE_POINTS
+#define AT_STIMULUS_TRACE_POINTS 64
+#endif
+const uint16_t kStimulusTracePoints = AT_STIMULUS_TRACE_POINTS;
+const uint16_t NUM_INPUT_CARDS = NUM_DI + NUM_AI;
+
+struct StimulusTracePoint {
+  uint32_t atMs;
+  uint32_t value;
+};
+
+struct StimulusSpec {
+  stimulusWaveform waveform;
+  uint32_t periodMs;
+  uint32_t widthMs;
+  uint32_t low;
+  uint32_t high;
+  uint16_t traceLength;
+  bool loop;
+};
+
+// Per-input stimulus state, kernel-owned and preallocated for every DI/AI.
+struct StimulusChannel {
+  StimulusSpec spec;
+  uint32_t elapsedMs;
+  uint16_t traceCursor;
+  StimulusTracePoint trace[AT_STIMULUS_TRACE_POINTS];
+};
+StimulusChannel gStimulus[NUM_INPUT_CARDS] = {};
+
+// Core1 -> kernel handoff for one stimulus; Core1 writes it only while
+// gStimulusUploadPending is false, the kernel clears the flag once copied.
+struct StimulusUpload {
+  uint16_t cardId;
+  StimulusSpec spec;
+  StimulusTracePoint trace[AT_STIMULUS_TRACE_POINTS];
+};
+StimulusUpload gStimulusUpload = {};
+volatile bool gStimulusUploadPending = false;
+
+// Incremental per-card maintenance statistics. Windows are ring buckets of
+// AT_STATS_BUCKET_MS; per scan each card touches only the current bucket,
+// older buckets are cleared as time advances.
+#ifndef AT_STATS_BUCKETS
+#define AT_STATS_BUCKETS 12
+#endif
+#ifndef AT_STATS_BUCKET_MS
+#define AT_STATS_BUCKET_MS 300000UL
+#endif
+const uint32_t kStatsPublishMs = 1000;
+const uint16_t NUM_OUTPUT_CARDS = NUM_DO + NUM_SIO;
+
+struct OutputCardStats {
+  uint64_t onMs;
+  uint32_t cycles;
+  uint32_t cycleBuckets[AT_STATS_BUCKETS];
+  bool prevPhysical;
+};
+
+struct DigitalInputStats {
+  uint32_t edgeBuckets[AT_STATS_BUCKETS];
+  bool prevPhysical;
+  bool primed;
+};
+
+struct AnalogInputStats {
+  uint32_t min[AT_STATS_BUCKETS];
+  uint32_t max[AT_STATS_BUCKETS];
+  uint64_t sum[AT_STATS_BUCKETS];
+  uint32_t count[AT_STATS_BUCKETS];
+};
+
+struct CardStatistics {
+  uint32_t startMs;
+  uint32_t lastMs;
+  uint32_t bucketEpoch;
+  uint8_t bucket;
+  bool started;
+  OutputCardStats outputs[NUM_OUTPUT_CARDS];
+  DigitalInputStats di[NUM_DI];
+  AnalogInputStats ai[NUM_AI];
+};
+// Kernel-owned; copied into gSharedStatistics under gSnapshotMux at
+// kStatsPublishMs.
+CardStatistics gStatistics = {};
+CardStatistics gSharedStatistics = {};
+
+// Priority alarm lane: a single-producer (kernel) single-consumer (portal)
+// ring of small transition events. Core1 drains it ahead of the throttled
+// snapshot publisher. Depth must be a power of two.
+#ifndef AT_ALARM_QUEUE_DEPTH
+#define AT_ALARM_QUEUE_DEPTH 32
+#endif
+#ifndef AT_ALARM_LATENCY_BUDGET_US
+#define AT_ALARM_LATENCY_BUDGET_US 20000UL
+#endif
+static_assert((AT_ALARM_QUEUE_DEPTH & (AT_ALARM_QUEUE_DEPTH - 1)) == 0,
+              "AT_ALARM_QUEUE_DEPTH must be a power of two");
+
+struct AlarmEvent {
+  uint32_t seq;
+  uint32_t enqueuedUs;
+  uint16_t cardId;
+  cardState state;
+  bool logicalState;
+  bool physicalState;
+  bool resetOverride;
+};
+
+struct AlarmLane {
+  AlarmEvent events[AT_ALARM_QUEUE_DEPTH];
+  std::atomic<uint32_t> head;  // written by the kernel only
+  std::atomic<uint32_t> tail;  // written by the portal only
+  std::atomic<uint32_t> dropped;
+  uint32_t nextSeq;  // kernel-owned
+  // Portal-owned delivery counters.
+  uint32_t sent;
+  uint32_t lastLatencyUs;
+  uint32_t maxLatencyUs;
+  uint32_t overBudget;
+};
+AlarmLane gAlarmLane;
+
+// SoftIO exchange between controllers over UDP multicast. Settings are read
+// at boot and never change afterwards. Both directions cross cores through
+// seqlocks (odd version = write in progress), so neither side ever waits.
+#ifndef AT_EXCHANGE_PORT
+#define AT_EXCHANGE_PORT 47900
+#endif
+#ifndef AT_EXCHANGE_MAX_PUBLISH
+#define AT_EXCHANGE_MAX_PUBLISH 32
+#endif
+const uint32_t kDefaultRemoteTimeoutMs = 500;
+
+struct RemoteSioBinding {
+  bool bound;
+  uint8_t node;
+  uint16_t sioIndex;
+  uint32_t timeoutMs;
+};
+
+struct ExchangeSettings {
+  bool enabled;
+  uint8_t nodeId;
+  char group[16];
+  uint16_t port;
+  uint8_t timeMaster;  // node serving the shared epoch, 0 = no time sync
+  RemoteSioBinding remotes[NUM_REMOTE_SIO];
+};
+
+// Written by the kernel after each scan, read by Core1.
+struct ExchangeTxImage {
+  std::atomic<uint32_t> version;
+  uint32_t scanSeq;
+  uint16_t count;
+  ExchangeEntry entries[AT_EXCHANGE_MAX_PUBLISH];
+};
+
+ExchangeSettings gExchangeSettings = {};
+ExchangeSettings gStoredExchangeSettings = {};  // Core1: as saved on flash
+bool gExchangeRestartRequired = false;
+ExchangeTxImage gExchangeTx;
+RemoteSioSlot gRemoteSlots[NUM_REMOTE_SIO];
+// Kernel-owned input image of the remote slots.
+LogicCard gRemoteCards[NUM_REMOTE_SIO] = {};
+uint32_t gRemoteReceivedMs[NUM_REMOTE_SIO] = {};
+uint32_t gExchangeStaleTransitions = 0;
+
+// Scan-aligned time sync on exchange port + 1. Every node but timeMaster
+// estimates offset and drift against the master clock with four-timestamp
+// request/response exchanges; the kernel then steers scan release toward
+// master-time multiples of the scan interval, at most 1 ms per scan.
+#ifndef AT_TIMESYNC_INTERVAL_MS
+#define AT_TIMESYNC_INTERVAL_MS 1000
+#endif
+#ifndef AT_TIMESYNC_WINDOW
+#define AT_TIMESYNC_WINDOW 8
+#endif
+#ifndef AT_TIMESYNC_MAX_DELAY_US
+#define AT_TIMESYNC_MAX_DELAY_US 20000
+#endif
+#ifndef AT_TIMESYNC_HOLDOVER_MS
+#define AT_TIMESYNC_HOLDOVER_MS 30000
+#endif
+const uint32_t kTimeSyncDriftSpanMs = 10000;
+const int32_t kScanAlignToleranceUs = 1000;  // one millis() step
+
+// Clock model, Core1 -> kernel through a seqlock:
+//   masterUs = localUs + offsetUs + (localUs - refLocalUs) * driftPpb / 1e9
+struct TimeSyncModel {
+  std::atomic<uint32_t> version;
+  bool valid;
+  int64_t offsetUs;
+  int64_t refLocalUs;
+  int32_t driftPpb;
+  uint32_t updatedMs;
+};
+TimeSyncModel gTimeSyncModel;
+
+// On-device trend store. Core1 samples selected cards into one RAM page per
+// series and writes whole 512-byte pages to a ring on the "trend" data
+// partition. A sector is erased only when the ring reaches it, so every
+// sector wears at the same rate.
+#ifndef AT_TREND_MAX_SERIES
+#define AT_TREND_MAX_SERIES 8
+#endif
+// Age after which a partial page is written anyway, so a power loss drops at
+// most this much of each series. It also caps the span one page covers: with
+// 8 series the 128 KB partition then keeps at least 32 x 4 h, about 5 days,
+// which is what full pages of a noisy 60 s series give as well. 0 keeps pages
+// in RAM until full.
+#ifndef AT_TREND_FLUSH_S
+#define AT_TREND_FLUSH_S 14400
+#endif
+#ifndef AT_TREND_MAX_POINTS
+#define AT_TREND_MAX_POINTS 500
+#endif
+const size_t kTrendPageBytes = 512;
+const size_t kTrendHeaderBytes = 28;
+const size_t kTrendPayloadBytes = kTrendPageBytes - kTrendHeaderBytes;
+const uint32_t kTrendSectorBytes = 4096;
+const uint8_t kTrendPartitionSubtype = 0x40;
+const uint32_t kTrendMaxPeriodS = 3600;
+const uint32_t kWallClockValidEpochS = 1704067200UL;  // 2024-01-01: SNTP has synced
+
+// Wall clock of the trend store and the journal: Unix seconds once SNTP has
+// synced, otherwise the newest stored timestamp plus uptime. Never steps
+// backwards. Core1-owned.
+struct WallClock {
+  bool sntpStarted;
+  uint32_t bootBaseS;
+  uint32_t lastS;
+};
+WallClock gWallClock = {};
+
+struct TrendSeriesConfig {
+  bool active;
+  uint16_t cardId;
+  uint16_t periodS;
+};
+
+// Open page of one series; every page decodes on its own.
+struct TrendOpenPage {
+  uint16_t cardId;
+  uint16_t count;
+  uint32_t t0;
+  uint32_t v0;
+  uint32_t tLast;
+  int32_t prevDelta;
+  uint32_t prevValue;
+  uint8_t prevLeading;  // 0xFF: no XOR window yet
+  uint8_t prevTrailing;
+  uint16_t bits;
+  uint32_t nextDueS;
+  uint8_t payload[kTrendPayloadBytes];
+};
+
+// Core1-owned.
+struct TrendStore {
+  const esp_partition_t* partition;
+  uint32_t pageSlots;
+  uint32_t nextSlot;
+  uint32_t nextSeq;
+  uint32_t samples;
+  uint32_t pagesWritten;
+  uint32_t sectorErases;
+  uint32_t writeFailures;
+  uint32_t lastWriteUs;
+  uint32_t maxWriteUs;
+  TrendSeriesConfig series[AT_TREND_MAX_SERIES];
+  TrendOpenPage pages[AT_TREND_MAX_SERIES];
+};
+TrendStore gTrendStore = {};
+
+// Persistent event journal: card state transitions, kernel commands with
+// their origin, config commits and restores, and faults, as fixed 24-byte
+// records appended to segment files on LittleFS. The kernel hands its events
+// over through an SPSC lane like the alarm lane; Core1 stamps seq and time
+// and writes them behind in batches. A full journal deletes its oldest
+// segment.
+#ifndef AT_JOURNAL_QUEUE_DEPTH
+#define AT_JOURNAL_QUEUE_DEPTH 128
+#endif
+#ifndef AT_JOURNAL_BATCH_RECORDS
+#define AT_JOURNAL_BATCH_RECORDS 128
+#endif
+#ifndef AT_JOURNAL_FLUSH_MS
+#define AT_JOURNAL_FLUSH_MS 5000
+#endif
+#ifndef AT_JOURNAL_SEGMENT_RECORDS
+#define AT_JOURNAL_SEGMENT_RECORDS 1024
+#endif
+#ifndef AT_JOURNAL_SEGMENTS
+#define AT_JOURNAL_SEGMENTS 6
+#endif
+#ifndef AT_JOURNAL_MAX_RESULTS
+#define AT_JOURNAL_MAX_RESULTS 1000
+#endif
+static_assert((AT_JOURNAL_QUEUE_DEPTH & (AT_JOURNAL_QUEUE_DEPTH - 1)) == 0,
+              "AT_JOURNAL_QUEUE_DEPTH must be a power of two");
+static_assert(AT_JOURNAL_SEGMENTS >= 2 && AT_JOURNAL_SEGMENT_RECORDS <= 0xFFFF,
+              "journal needs 2+ segments of at most 65535 records");
+const char* kJournalDir = "/journal";
+const uint16_t kJournalMarksPerSegment =
+    (AT_JOURNAL_SEGMENT_RECORDS + kJournalIndexStride - 1) / kJournalIndexStride;
+const uint16_t kJournalDefaultResults = 100;
+
+struct JournalEvent {
+  uint32_t atMs;
+  JournalRecord record;  // seq and timeS are stamped by Core1
+};
+
+struct JournalLane {
+  JournalEvent events[AT_JOURNAL_QUEUE_DEPTH];
+  std::atomic<uint32_t> head;  // written by the kernel only
+  std::atomic<uint32_t> tail;  // written by the portal only
+  std::atomic<uint32_t> dropped;
+};
+JournalLane gJournalLane;
+
+// Sparse index of one segment: records are contiguous in seq, and the time
+// of every kJournalIndexStride-th record is kept to seek by time.
+struct JournalSegment {
+  uint32_t number;
+  uint32_t firstSeq;
+  uint16_t count;
+  uint32_t lastTimeS;
+  uint32_t marks[kJournalMarksPerSegment];
+};
+
+// Core1-owned.
+struct JournalStore {
+  bool ready;
+  bool sealed;  // next flush starts a new segment
+  uint8_t segmentCount;  // oldest first
+  uint32_t nextSeq;
+  uint32_t lastTimeS;
+  uint32_t reportedDrops;
+  uint16_t pending;
+  uint32_t pendingSinceMs;
+  uint32_t appended;
+  uint32_t overflowed;
+  uint32_t flushes;
+  uint32_t evictions;
+  uint32_t writeFailures;
+  uint32_t lastFlushUs;
+  uint32_t maxFlushUs;
+  uint32_t queries;
+  uint32_t lastQueryUs;
+  uint32_t maxQueryUs;
+  JournalSegment segments[AT_JOURNAL_SEGMENTS];
+  JournalRecord batch[AT_JOURNAL_BATCH_RECORDS];
+};
+JournalStore gJournalStore = {};
+
+// Streaming OTA. The request body goes to the inactive app partition in
+// sector-sized chunks, each written right after a scan completes so the
+// flash stall falls into the idle part of the scan interval. A new image
+// boots on trial: it is confirmed once healthy and rolled back after a
+// failed health check or AT_OTA_TRIAL_BOOTS boots without one.
+#ifndef AT_OTA_PUBLIC_KEY_PEM
+#define AT_OTA_PUBLIC_KEY_PEM ""
+#endif
+#ifndef AT_OTA_ALLOW_UNSIGNED
+#define AT_OTA_ALLOW_UNSIGNED 0
+#endif
+#ifndef AT_OTA_TRIAL_BOOTS
+#define AT_OTA_TRIAL_BOOTS 3
+#endif
+#ifndef AT_OTA_HEALTH_MS
+#define AT_OTA_HEALTH_MS 60000UL
+#endif
+const size_t kOtaMaxSignatureBytes = 72;  // DER ECDSA P-256
+const char* kOtaTrialPath = "/ota_trial.json";
+
+// Persisted in kOtaTrialPath across the switch.
+OtaTrial gOtaTrial = {};
+
+struct OtaSession;
+typedef bool (*OtaChunkWriter)(OtaSession& session, const uint8_t* data,
+                               size_t length);
+
+// Core1-owned. writeChunk is the only flash access on the receive path, so
+// the chunking can be driven against a fake partition off target.
+struct OtaSession {
+  bool active;
+  bool completed;
+  OtaChunkWriter writeChunk;
+  const esp_partition_t* target;
+  esp_ota_handle_t handle;
+  mbedtls_sha256_context sha;
+  uint8_t expectedHash[32];
+  uint8_t signature[kOtaMaxSignatureBytes];
+  size_t signatureLength;
+  uint32_t received;
+  uint32_t written;
+  uint16_t fill;
+  uint32_t chunks;
+  uint32_t lastChunkUs;
+  uint32_t maxChunkUs;
+  uint32_t startMs;
+  uint32_t durationMs;
+  uint32_t throughputBps;
+  int errorStatus;
+  const char* error;
+  uint8_t buffer[kOtaChunkBytes];
+};
+OtaSession gOtaSession = {};
+// Set by Core1 for the length of a transfer; the kernel then tracks its
+// jitter separately.
+std::atomic<bool> gOtaWriting(false);
+// Set by Core1 while it waits for a scan gap to write flash; the kernel then
+// wakes it on the next completed scan.
+std::atomic<bool> gScanGapWaiting(false);
+std::atomic<uint32_t> gScanCompleteSeq(0);
+uint32_t gJitterPrevStartUs = 0;  // kernel-owned; 0 after a gap in scanning
+
+bool isOutputMasked(uint16_t cardId);
+uint16_t scanOrderCardIdFromCursor(uint16_t cursor);
 bool connectWiFiWithPolicy();
 void initPortalServer();
 void handlePortalServerLoop();
@@ -460,53 +1607,142 @@ void handleHttpConfigPage();
 void handleHttpGetSettings();
 void handleHttpSaveSettingsWiFi();
 void handleHttpSaveSettingsRuntime();
+void handleHttpSaveSettingsMqtt();
+void handleHttpSaveSettingsExchange();
+void handleHttpSaveSettingsTrend();
+void writeTrendSettings(JsonObject out);
+bool parseTrendSettings(JsonObjectConst in, TrendSeriesConfig* out,
+                        String& reason);
+void initTrendStore();
+void writeTrendPage(TrendOpenPage& page);
+void flushTrendPages();
+void handleTrendLoop();
+void handleHttpGetTrend();
+uint32_t wallClockSeconds();
+void emitJournalEvent(const JournalRecord& record);
+void emitJournalFault(journalFault fault, uint16_t cardId, uint32_t detail);
+void initJournal();
+void recordJournalEvent(journalKind kind, uint8_t code, uint16_t cardId,
+                        uint32_t detail, uint32_t aux);
+bool flushJournal();
+void handleJournalLoop();
+void handleHttpGetJournal();
+uint32_t effectiveScanIntervalMs();
+void waitForScanGap();
+otaTrialAction initOtaTrial();
+void handleOtaLoop();
+void handleHttpOtaUpload();
+void handleHttpOtaDone();
+bool parseUInt32Arg(const char* name, uint32_t fallback, uint32_t& out);
+void writeExchangeSettings(JsonObject out, const ExchangeSettings& settings);
+void initTimeSync();
+void handleTimeSyncLoop();
+bool parseExchangeSettings(JsonObjectConst in, ExchangeSettings& out,
+                           String& reason);
 void handleHttpReconnectWiFi();
 void handleHttpReboot();
 void handleHttpGetActiveConfig();
 void handleHttpStagedSaveConfig();
 void handleHttpStagedValidateConfig();
 void handleHttpCommitConfig();
+void handleHttpShadowConfig();
+void handleHttpFastForward();
+void handleHttpGetFastForward();
+void stepFastForward();
+void cancelFastForward();
+void handleHttpGetCardTiming();
+void resetBreakpointHooks();
+void resetRewindRecorder();
+void handleHttpGetRewindFrame();
+void handleHttpDiagnostics();
+void handleHttpMetrics();
+uint16_t outputSlotForCard(uint16_t id);
+bool evalOperator(const LogicCard& target, logicOperator op,
+                  uint32_t threshold);
+bool isDigitalInputCard(uint16_t id);
+bool isAnalogInputCard(uint16_t id);
+bool isDigitalOutputCard(uint16_t id);
+bool isInputCard(uint16_t id);
+bool isSoftIOCard(uint16_t id);
+bool isScriptCard(uint16_t id);
+bool isPluginCard(uint16_t id);
+void initPluginCard(LogicCard& card);
+void processCardById(const KernelEvalContext& ctx, uint16_t cardId,
+                     uint32_t nowMs);
 void handleHttpRestoreConfig();
-void serializeCardsToArray(const LogicCard* sourceCards, JsonArray& array);
+void serializeCardsToArray(const LogicCard* sourceCards, JsonArray& array,
+                           const CardLabelTable* labels);
 void initializeCardArraySafeDefaults(LogicCard* cards);
 bool deserializeCardsFromArray(JsonArrayConst array, LogicCard* outCards);
 bool validateConfigCardsArray(JsonArrayConst array, String& reason);
+bool compileCardScripts(JsonArrayConst array, ScriptProgram* out,
+                        String& reason);
+uint16_t scriptInstructionsPerScan(const ScriptProgram* programs);
 bool writeJsonToPath(const char* path, JsonDocument& doc);
 bool readJsonFromPath(const char* path, JsonDocument& doc);
-bool saveCardsToPath(const char* path, const LogicCard* sourceCards);
+bool saveCardsToPath(const char* path, const LogicCard* sourceCards,
+                     const CardLabelTable* labels);
 bool loadCardsFromPath(const char* path, LogicCard* outCards);
-bool copyFileIfExists(const char* srcPath, const char* dstPath);
 void formatVersion(char* out, size_t outSize, uint32_t version);
 bool pauseKernelForConfigApply(uint32_t timeoutMs);
 void resumeKernelAfterConfigApply();
-void rotateHistoryVersions();
-bool applyCardsAsActiveConfig(const LogicCard* newCards);
+void initConfigHistory();
+bool loadConfigHistory(bool compactTornTail);
+bool appendConfigHistoryVersion(const LogicCard* cards,
+                                const CardLabelTable* labels, uint32_t number);
+bool materializeConfigHistoryVersion(uint8_t index, const char* path);
+int16_t findConfigHistoryVersion(uint32_t configId);
+void handleHttpGetConfigHistory();
+bool applyCardsAsActiveConfig(const LogicCard* newCards,
+                              const ScriptProgram* newScripts);
 bool extractConfigCardsFromRequest(JsonObjectConst root, JsonArrayConst& outCards,
                                    String& reason);
 void writeConfigErrorResponse(int statusCode, const char* code,
                               const String& message);
 bool loadPortalSettingsFromLittleFS();
 bool savePortalSettingsToLittleFS();
-
-enum kernelCommandType {
-  KernelCmd_SetRunMode,
-  KernelCmd_StepOnce,
-  KernelCmd_SetBreakpoint,
-  KernelCmd_SetTestMode,
-  KernelCmd_SetInputForce,
-  KernelCmd_SetOutputMask,
-  KernelCmd_SetOutputMaskGlobal
-};
+bool ensureV2MigrationCurrent();
+const char* recipeNameForSlot(int8_t slot);
+void saveActiveRecipeName(const char* name);
+void loadRecipesFromStorage();
+bool requestRecipeSwitch(const char* name);
+void handleHttpGetRecipes();
+void handleHttpSaveRecipe();
+void handleHttpDeleteRecipe();
+bool hashFileFnv1a(const char* path, uint32_t& outHash);
+void formatHash(char* out, size_t outSize, uint32_t hash);
 
 struct KernelCommand {
   kernelCommandType type;
-  uint8_t cardId;
+  uint16_t cardId;
   bool flag;
   uint32_t value;
   runMode mode;
   inputSourceMode inputMode;
+  BreakpointHook hook;
+  uint32_t recipeSeq;  // gRecipeSwitchSeq the switch was staged under
+  uint32_t enqueuedUs;  // stamped by enqueueKernelCommand
+  commandOrigin origin;  // stamped by enqueueKernelCommand
+  uint16_t client;
 };
 
+// Core1: where the commands being queued came from. Each entry point sets it
+// before it parses a request; HTTP resolves the peer at enqueue time.
+commandOrigin gCommandOrigin = Origin_Internal;
+uint16_t gCommandClient = 0;
+
+void setCommandOrigin(commandOrigin origin, uint16_t client) {
+  gCommandOrigin = origin;
+  gCommandClient = client;
+}
+
+uint16_t currentCommandClient() {
+  if (gCommandOrigin == Origin_Http) return gPortalServer.client().remoteIP()[3];
+  return gCommandClient;
+}
+
+bool enqueueKernelCommand(const KernelCommand& command);
+
 void serializeCardToJson(const LogicCard& card, JsonObject& json) {
   json["id"] = card.id;
   json["type"] = toString(card.type);
@@ -548,6 +1784,14 @@ void serializeCardToJson(const LogicCard& card, JsonObject& json) {
   json["resetB_Operator"] = toString(card.resetB_Operator);
   json["resetB_Threshold"] = card.resetB_Threshold;
   json["resetCombine"] = toString(card.resetCombine);
+  json["alarm"] = card.alarm;
+  json["journal"] = card.journal;
+  if (card.type == SoftIO) json["exchangePublish"] = card.exchangePublish;
+
+  if (card.type == AnalogInput) {
+    json["reportDeadbandMode"] = toString(card.reportDeadbandMode);
+    json["reportDeadband"] = card.reportDeadband;
+  }
 }
 
 void deserializeCardFromJson(JsonVariantConst jsonVariant, LogicCard& card) {
@@ -635,10 +1879,27 @@ void deserializeCardFromJson(JsonVariantConst jsonVariant, LogicCard& card) {
   bool resetCombineOk =
       tryParseCombineMode(rawResetCombine, parsedResetCombine);
   card.resetCombine = resetCombineOk ? parsedResetCombine : before.resetCombine;
+  card.alarm = json["alarm"] | card.alarm;
+  card.journal = json["journal"] | card.journal;
+  if (card.type == SoftIO) {
+    card.exchangePublish = json["exchangePublish"] | card.exchangePublish;
+  }
+
+  if (card.type == AnalogInput) {
+    const char* rawDeadbandMode = json["reportDeadbandMode"].as<const char*>();
+    deadbandMode parsedDeadbandMode = before.reportDeadbandMode;
+    bool deadbandModeOk =
+        tryParseDeadbandMode(rawDeadbandMode, parsedDeadbandMode);
+    card.reportDeadbandMode =
+        deadbandModeOk ? parsedDeadbandMode : before.reportDeadbandMode;
+    card.reportDeadband = json["reportDeadband"] | card.reportDeadband;
+  }
+  // Plugin runtime restarts with every loaded bank; a stored state is ignored.
+  if (isPluginCard(card.id)) initPluginCard(card);
 
 }
 
-void initializeCardSafeDefaults(LogicCard& card, uint8_t globalId) {
+void initializeCardSafeDefaults(LogicCard& card, uint16_t globalId) {
   card.id = globalId;
   card.invert = false;
   card.setting1 = 0;
@@ -666,6 +1927,11 @@ void initializeCardSafeDefaults(LogicCard& card, uint8_t globalId) {
   card.resetB_Threshold = 0;
   card.setCombine = Combine_None;
   card.resetCombine = Combine_None;
+  card.reportDeadbandMode = Deadband_None;
+  card.reportDeadband = 0;
+  card.alarm = false;
+  card.journal = false;
+  card.exchangePublish = false;
 
   if (globalId < DO_START) {
     card.type = DigitalInput;
@@ -708,36 +1974,117 @@ void initializeCardSafeDefaults(LogicCard& card, uint8_t globalId) {
     return;
   }
 
-  card.type = SoftIO;
-  card.index = globalId - SIO_START;
-  card.hwPin = SIO_Pins[card.index];
-  // SoftIO defaults follow DO defaults (virtual output).
-  card.setting1 = 1000;
-  card.setting2 = 1000;
-  card.setting3 = 1;
-  card.mode = Mode_DO_Normal;
-  card.state = State_DO_Idle;
+  if (globalId < SCRIPT_START) {
+    card.type = SoftIO;
+    card.index = globalId - SIO_START;
+    card.hwPin = kVirtualCardPin;
+    // SoftIO defaults follow DO defaults (virtual output).
+    card.setting1 = 1000;
+    card.setting2 = 1000;
+    card.setting3 = 1;
+    card.mode = Mode_DO_Normal;
+    card.state = State_DO_Idle;
+    return;
+  }
+
+  if (globalId < PLUGIN_START) {
+    card.type = Script;
+    card.index = globalId - SCRIPT_START;
+    card.hwPin = kVirtualCardPin;
+    // Script defaults: no program, output off. Set/reset clauses are unused.
+    card.mode = Mode_Script;
+    card.state = State_Script_Idle;
+    return;
+  }
+
+  card.type = Plugin;
+  card.index = globalId - PLUGIN_START;
+  card.hwPin = kVirtualCardPin;
+  // Plugin defaults: settings are the plugin's; set/reset clauses are unused.
+  card.mode = Mode_Plugin;
+  initPluginCard(card);
 }
 
 void initializeAllCardsSafeDefaults() {
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     initializeCardSafeDefaults(logicCards[i], i);
   }
 }
 
-bool saveLogicCardsToLittleFS() {
-  JsonDocument doc;
-  JsonArray array = doc.to<JsonArray>();
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
-    JsonObject obj = array.add<JsonObject>();
-    serializeCardToJson(logicCards[i], obj);
+void resetCardLabelTable(CardLabelTable& table) {
+  memset(&table, 0, sizeof(table));
+  table.poolUsed = 1;  // pool[0] is the shared empty string
+  table.hash = kFnv1aSeed;
+}
+
+bool internCardString(CardLabelTable& table, const char* value,
+                      uint16_t& outRef) {
+  outRef = 0;
+  if (value == nullptr || value[0] == '\0') return true;
+  uint16_t offset = 1;
+  while (offset < table.poolUsed) {
+    const char* existing = &table.pool[offset];
+    const size_t existingLength = strlen(existing);
+    if (strcmp(existing, value) == 0) {
+      outRef = offset;
+      return true;
+    }
+    offset = static_cast<uint16_t>(offset + existingLength + 1);
   }
+  const size_t length = strlen(value);
+  if (table.poolUsed + length + 1 > sizeof(table.pool)) return false;
+  memcpy(&table.pool[table.poolUsed], value, length + 1);
+  outRef = table.poolUsed;
+  table.poolUsed = static_cast<uint16_t>(table.poolUsed + length + 1);
+  return true;
+}
 
-  File file = LittleFS.open(kConfigPath, "w");
-  if (!file) return false;
-  size_t written = serializeJson(doc, file);
-  file.close();
-  return written > 0;
+const char* cardStringFromRef(const CardLabelTable& table, uint16_t ref) {
+  if (ref >= table.poolUsed) return "";
+  return &table.pool[ref];
+}
+
+bool buildCardLabelTable(JsonArrayConst array, CardLabelTable& out,
+                         String& reason) {
+  resetCardLabelTable(out);
+  for (JsonVariantConst item : array) {
+    const uint16_t id = item["id"] | kInvalidCardId;
+    if (id >= TOTAL_CARDS) continue;
+    if (!internCardString(out, item["label"] | "", out.labelRef[id]) ||
+        !internCardString(out, item["engineeringUnit"] | "",
+                          out.unitRef[id]) ||
+        (isScriptCard(id) &&
+         !internCardString(out, item["script"] | "",
+                           out.scriptRef[id - SCRIPT_START]))) {
+      reason = "label pool full (" + String(AT_LABEL_POOL_BYTES) + " bytes)";
+      return false;
+    }
+  }
+  out.hash = fnv1a32(out.hash, out.pool, out.poolUsed);
+  out.hash = fnv1a32(out.hash, out.labelRef, sizeof(out.labelRef));
+  out.hash = fnv1a32(out.hash, out.unitRef, sizeof(out.unitRef));
+  out.hash = fnv1a32(out.hash, out.scriptRef, sizeof(out.scriptRef));
+  return true;
+}
+
+void appendCardLabelFields(const CardLabelTable& table, uint16_t cardId,
+                           JsonObject& json) {
+  if (cardId >= TOTAL_CARDS) return;
+  json["label"] = cardStringFromRef(table, table.labelRef[cardId]);
+  if (table.unitRef[cardId] != 0) {
+    json["engineeringUnit"] = cardStringFromRef(table, table.unitRef[cardId]);
+  }
+}
+
+void appendCardScriptField(const CardLabelTable& table, uint16_t cardId,
+                           JsonObject& json) {
+  if (!isScriptCard(cardId)) return;
+  json["script"] =
+      cardStringFromRef(table, table.scriptRef[cardId - SCRIPT_START]);
+}
+
+bool saveLogicCardsToLittleFS() {
+  return saveCardsToPath(kConfigPath, logicCards, &gCardLabels);
 }
 
 bool loadLogicCardsFromLittleFS() {
@@ -755,25 +2102,527 @@ bool loadLogicCardsFromLittleFS() {
   String reason;
   if (!validateConfigCardsArray(array, reason)) return false;
 
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     JsonVariantConst item = array[i];
     if (!item.is<JsonObjectConst>()) return false;
     deserializeCardFromJson(item, logicCards[i]);
   }
+  if (!buildCardLabelTable(array, gCardLabels, reason)) {
+    resetCardLabelTable(gCardLabels);
+  }
+  // Boot only: the kernel is not running yet.
+  compileCardScripts(array, gScriptPrograms, reason);
   return true;
 }
 
-void printLogicCardsJsonToSerial(const char* label) {
-  JsonDocument doc;
-  JsonArray array = doc.to<JsonArray>();
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
-    JsonObject obj = array.add<JsonObject>();
-    serializeCardToJson(logicCards[i], obj);
+// ---------------------------------------------------------------------------
+// Config history store. Pack records and their compression are described in
+// config_history.h; blobs no version references are dropped by compaction.
+// Index (JSON): versions with per-card pack offsets, plus every blob as
+// [offset, hash, rawLength]. Load checks each indexed blob against the record
+// header at its offset, so an index that outlived a pack rewrite cannot map a
+// version onto the wrong records.
+// ---------------------------------------------------------------------------
+
+// Streams one card document from the pack; RAM use is the read buffer only.
+bool expandCardDocument(File& pack, const ConfigHistoryBlob& blob, Print& out) {
+  if (!pack.seek(blob.offset + kConfigHistoryRecordHeaderBytes)) return false;
+  const bool stored = (blob.storedLength == blob.rawLength);
+  uint8_t buffer[128];
+  size_t remaining = blob.storedLength;
+  size_t produced = 0;
+  while (remaining > 0) {
+    const size_t n =
+        pack.read(buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+    if (n == 0) return false;
+    remaining -= n;
+    for (size_t i = 0; i < n; ++i) {
+      const char* token = stored ? nullptr : configHistoryToken(buffer[i]);
+      if (token != nullptr) {
+        const size_t length = strlen(token);
+        out.write(reinterpret_cast<const uint8_t*>(token), length);
+        produced += length;
+      } else {
+        out.write(buffer[i]);
+        produced += 1;
+      }
+    }
   }
+  return produced == blob.rawLength;
+}
 
-  Serial.println(label);
-  serializeJsonPretty(doc, Serial);
-  Serial.println();
+// Same per-card bytes saveCardsToPath writes, so history restores are exact.
+size_t serializeHistoryCard(const LogicCard* cards, const CardLabelTable* labels,
+                            uint16_t id, char* out) {
+  JsonDocument cardDoc;
+  JsonObject obj = cardDoc.to<JsonObject>();
+  serializeCardToJson(cards[id], obj);
+  if (labels != nullptr) {
+    appendCardLabelFields(*labels, id, obj);
+    appendCardScriptField(*labels, id, obj);
+  }
+  if (measureJson(cardDoc) >= kConfigHistoryMaxCardBytes) return 0;
+  return serializeJson(cardDoc, out, kConfigHistoryMaxCardBytes);
+}
+
+// Print sink that checks a streamed card document against the expected bytes.
+class CardDocumentComparer : public Print {
+ public:
+  CardDocumentComparer(const char* expected, size_t length)
+      : expected_(expected), length_(length), position_(0), match_(true) {}
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override {
+    if (position_ + size > length_ ||
+        memcmp(expected_ + position_, buffer, size) != 0) {
+      match_ = false;
+    }
+    position_ += size;
+    return size;
+  }
+  bool matches() const { return match_ && position_ == length_; }
+
+ private:
+  const char* expected_;
+  size_t length_;
+  size_t position_;
+  bool match_;
+};
+
+// A hash hit is only a candidate: FNV-1a is not collision-free, so the stored
+// document is compared byte for byte before it is shared. Blobs at or past
+// firstNewOffset were appended for other cards of the same config; their
+// documents carry another id and can never be equal, so they are skipped
+// (and need not be readable yet through pack).
+int16_t findConfigHistoryBlob(File& pack, uint32_t hash, const char* raw,
+                              size_t rawLength, uint32_t firstNewOffset) {
+  for (uint16_t i = 0; i < gConfigHistory.blobCount; ++i) {
+    const ConfigHistoryBlob& blob = gConfigHistory.blobs[i];
+    if (blob.hash != hash || blob.rawLength != rawLength ||
+        blob.offset >= firstNewOffset) {
+      continue;
+    }
+    CardDocumentComparer comparer(raw, rawLength);
+    if (expandCardDocument(pack, blob, comparer) && comparer.matches()) {
+      return static_cast<int16_t>(i);
+    }
+  }
+  return -1;
+}
+
+int16_t findConfigHistoryBlobAt(uint32_t offset) {
+  for (uint16_t i = 0; i < gConfigHistory.blobCount; ++i) {
+    if (gConfigHistory.blobs[i].offset == offset) return static_cast<int16_t>(i);
+  }
+  return -1;
+}
+
+int16_t findConfigHistoryVersion(uint32_t configId) {
+  // Newest first: a restored config reappears under the same id.
+  for (int16_t i = gConfigHistory.versionCount - 1; i >= 0; --i) {
+    if (gConfigHistory.versions[i].configId == configId) return i;
+  }
+  return -1;
+}
+
+bool isConfigHistoryBlobReferenced(uint32_t offset) {
+  for (uint8_t v = 0; v < gConfigHistory.versionCount; ++v) {
+    const ConfigHistoryVersion& version = gConfigHistory.versions[v];
+    for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+      if (version.cardOffsets[id] == offset) return true;
+    }
+  }
+  return false;
+}
+
+bool saveConfigHistoryIndex() {
+  JsonDocument doc;
+  char hashText[9];
+  JsonArray versions = doc["versions"].to<JsonArray>();
+  for (uint8_t v = 0; v < gConfigHistory.versionCount; ++v) {
+    const ConfigHistoryVersion& version = gConfigHistory.versions[v];
+    JsonObject entry = versions.add<JsonObject>();
+    formatHash(hashText, sizeof(hashText), version.configId);
+    entry["configId"] = hashText;
+    formatHash(hashText, sizeof(hashText), version.parentId);
+    entry["parentId"] = hashText;
+    entry["number"] = version.number;
+    JsonArray offsets = entry["cards"].to<JsonArray>();
+    for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+      offsets.add(version.cardOffsets[id]);
+    }
+  }
+  JsonArray blobs = doc["blobs"].to<JsonArray>();
+  for (uint16_t b = 0; b < gConfigHistory.blobCount; ++b) {
+    const ConfigHistoryBlob& blob = gConfigHistory.blobs[b];
+    JsonArray record = blobs.add<JsonArray>();
+    record.add(blob.offset);
+    record.add(blob.hash);
+    record.add(blob.rawLength);
+  }
+  // Rename is atomic on LittleFS; a torn write never replaces the index.
+  if (!writeJsonToPath(kConfigHistoryIndexTempPath, doc)) return false;
+  return LittleFS.rename(kConfigHistoryIndexTempPath, kConfigHistoryIndexPath);
+}
+
+void evictOldestConfigHistoryVersion() {
+  if (gConfigHistory.versionCount == 0) return;
+  memmove(&gConfigHistory.versions[0], &gConfigHistory.versions[1],
+          sizeof(ConfigHistoryVersion) * (gConfigHistory.versionCount - 1));
+  gConfigHistory.versionCount -= 1;
+}
+
+// Rewrites the pack with referenced blobs only. Blobs keep their order, so
+// every new offset is at or below the old one and remapping in place never
+// aliases a blob that is still to be copied.
+bool compactConfigHistory() {
+  File src = LittleFS.open(kConfigHistoryPackPath, "r");
+  File dst = LittleFS.open(kConfigHistoryPackTempPath, "w");
+  if (!src || !dst) {
+    if (src) src.close();
+    if (dst) dst.close();
+    return false;
+  }
+  bool ok = true;
+  uint16_t kept = 0;
+  uint32_t offset = 0;
+  uint8_t buffer[128];
+  for (uint16_t b = 0; ok && b < gConfigHistory.blobCount; ++b) {
+    const ConfigHistoryBlob blob = gConfigHistory.blobs[b];
+    if (!isConfigHistoryBlobReferenced(blob.offset)) continue;
+    size_t remaining = kConfigHistoryRecordHeaderBytes + blob.storedLength;
+    ok = src.seek(blob.offset);
+    while (ok && remaining > 0) {
+      const size_t n =
+          src.read(buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+      ok = (n > 0) && (dst.write(buffer, n) == n);
+      remaining -= n;
+    }
+    if (!ok) break;
+    for (uint8_t v = 0; v < gConfigHistory.versionCount; ++v) {
+      uint32_t* offsets = gConfigHistory.versions[v].cardOffsets;
+      for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+        if (offsets[id] == blob.offset) offsets[id] = offset;
+      }
+    }
+    gConfigHistory.blobs[kept] = blob;
+    gConfigHistory.blobs[kept].offset = offset;
+    kept += 1;
+    offset += kConfigHistoryRecordHeaderBytes + blob.storedLength;
+  }
+  src.close();
+  dst.close();
+  if (!ok) {
+    // Offsets may be half remapped; the pack and index on flash are still
+    // the pre-compaction pair, so reload them (without another compaction).
+    LittleFS.remove(kConfigHistoryPackTempPath);
+    loadConfigHistory(false);
+    return false;
+  }
+  gConfigHistory.blobCount = kept;
+  gConfigHistory.packBytes = offset;
+  gConfigHistory.compactions += 1;
+  return LittleFS.rename(kConfigHistoryPackTempPath, kConfigHistoryPackPath) &&
+         saveConfigHistoryIndex();
+}
+
+// Keeps room for one more full version: evicts the oldest version at the
+// version limit, then compacts (evicting further) until the blob table can
+// take TOTAL_CARDS new entries.
+bool reserveConfigHistoryCapacity() {
+  if (gConfigHistory.versionCount >= AT_CONFIG_HISTORY_VERSIONS) {
+    evictOldestConfigHistoryVersion();
+  }
+  while (gConfigHistory.blobCount + TOTAL_CARDS > AT_CONFIG_HISTORY_BLOBS) {
+    const uint16_t before = gConfigHistory.blobCount;
+    if (!compactConfigHistory()) return false;
+    if (gConfigHistory.blobCount < before) continue;
+    if (gConfigHistory.versionCount <= 1) return false;
+    evictOldestConfigHistoryVersion();
+  }
+  return true;
+}
+
+uint32_t computeConfigHistoryId(const LogicCard* cards,
+                                const CardLabelTable* labels) {
+  static char raw[kConfigHistoryMaxCardBytes];
+  uint32_t configId = kFnv1aSeed;
+  for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+    const size_t length = serializeHistoryCard(cards, labels, id, raw);
+    const uint32_t hash = fnv1a32(kFnv1aSeed, raw, length);
+    configId = fnv1a32(configId, &hash, sizeof(hash));
+  }
+  return configId;
+}
+
+bool appendConfigHistoryVersion(const LogicCard* cards,
+                                const CardLabelTable* labels, uint32_t number) {
+  if (!gConfigHistory.ready || !reserveConfigHistoryCapacity()) return false;
+  File reader = LittleFS.open(kConfigHistoryPackPath, "r");
+  if (!reader) return false;
+  File pack = LittleFS.open(kConfigHistoryPackPath, "a");
+  if (!pack) {
+    reader.close();
+    return false;
+  }
+  const uint32_t firstNewOffset = gConfigHistory.packBytes;
+  // Core1-only scratch; kept off the portal task stack.
+  static char raw[kConfigHistoryMaxCardBytes];
+  static uint8_t packed[kConfigHistoryMaxCardBytes];
+  static ConfigHistoryVersion next;
+  uint32_t configId = kFnv1aSeed;
+  bool ok = true;
+  for (uint16_t id = 0; ok && id < TOTAL_CARDS; ++id) {
+    const size_t rawLength = serializeHistoryCard(cards, labels, id, raw);
+    if (rawLength == 0) {
+      ok = false;
+      break;
+    }
+    const uint32_t hash = fnv1a32(kFnv1aSeed, raw, rawLength);
+    configId = fnv1a32(configId, &hash, sizeof(hash));
+    int16_t blobIndex =
+        findConfigHistoryBlob(reader, hash, raw, rawLength, firstNewOffset);
+    if (blobIndex >= 0) {
+      gConfigHistory.reusedBlobs += 1;
+    } else {
+      size_t storedLength = compressCardDocument(raw, rawLength, packed);
+      const uint8_t* body = packed;
+      if (storedLength == 0) {
+        storedLength = rawLength;
+        body = reinterpret_cast<const uint8_t*>(raw);
+      }
+      ConfigHistoryBlob blob = {hash, gConfigHistory.packBytes,
+                                static_cast<uint16_t>(rawLength),
+                                static_cast<uint16_t>(storedLength)};
+      uint8_t header[kConfigHistoryRecordHeaderBytes];
+      memcpy(header, &blob.hash, 4);
+      memcpy(header + 4, &blob.rawLength, 2);
+      memcpy(header + 6, &blob.storedLength, 2);
+      ok = pack.write(header, sizeof(header)) == sizeof(header) &&
+           pack.write(body, storedLength) == storedLength;
+      if (!ok) break;
+      gConfigHistory.packBytes += kConfigHistoryRecordHeaderBytes + storedLength;
+      gConfigHistory.blobs[gConfigHistory.blobCount] = blob;
+      blobIndex = static_cast<int16_t>(gConfigHistory.blobCount);
+      gConfigHistory.blobCount += 1;
+      gConfigHistory.appendedBlobs += 1;
+    }
+    next.cardOffsets[id] = gConfigHistory.blobs[blobIndex].offset;
+  }
+  pack.close();
+  reader.close();
+  // A partial append leaves only unreferenced blobs for the next compaction.
+  if (!ok) return false;
+
+  next.configId = configId;
+  next.parentId = (gConfigHistory.versionCount > 0)
+                      ? gConfigHistory.versions[gConfigHistory.versionCount - 1].configId
+                      : 0;
+  next.number = number;
+  gConfigHistory.versions[gConfigHistory.versionCount] = next;
+  gConfigHistory.versionCount += 1;
+  return saveConfigHistoryIndex();
+}
+
+// Undoes the last append when the commit it belonged to failed later on, so
+// the history head always names a config that was actually applied. Blobs
+// only that version used are left to compaction.
+void dropConfigHistoryHead() {
+  if (gConfigHistory.versionCount == 0) return;
+  gConfigHistory.versionCount -= 1;
+  if (!saveConfigHistoryIndex()) {
+    gConsole.println("Config history: failed to drop unapplied head");
+  }
+}
+
+uint32_t headConfigId() {
+  return (gConfigHistory.versionCount > 0)
+             ? gConfigHistory.versions[gConfigHistory.versionCount - 1].configId
+             : 0;
+}
+
+// Writes a version as a plain config file, one card at a time.
+bool materializeConfigHistoryVersion(uint8_t index, const char* path) {
+  if (!gConfigHistory.ready || index >= gConfigHistory.versionCount) return false;
+  const ConfigHistoryVersion& version = gConfigHistory.versions[index];
+  File pack = LittleFS.open(kConfigHistoryPackPath, "r");
+  if (!pack) return false;
+  File out = LittleFS.open(path, "w");
+  if (!out) {
+    pack.close();
+    return false;
+  }
+  bool ok = out.write('[') == 1;
+  for (uint16_t id = 0; ok && id < TOTAL_CARDS; ++id) {
+    const int16_t blobIndex = findConfigHistoryBlobAt(version.cardOffsets[id]);
+    if (blobIndex < 0 || (id > 0 && out.write(',') != 1)) {
+      ok = false;
+      break;
+    }
+    ok = expandCardDocument(pack, gConfigHistory.blobs[blobIndex], out);
+  }
+  if (ok && out.write(']') != 1) ok = false;
+  pack.close();
+  out.close();
+  return ok;
+}
+
+// Rebuilds the blob table from record headers and loads the index. Versions
+// pointing at a missing blob, or at a blob whose header no longer matches the
+// indexed hash/length (index older than the pack), are dropped. A torn tail
+// record (torn append) is cut off by compacting; without compactTornTail the
+// store stays unavailable instead, which ends the compaction retry loop.
+bool loadConfigHistory(bool compactTornTail) {
+  memset(&gConfigHistory, 0, sizeof(gConfigHistory));
+  bool tornTail = false;
+  File pack = LittleFS.open(kConfigHistoryPackPath, "r");
+  if (pack) {
+    const uint32_t size = pack.size();
+    uint32_t offset = 0;
+    uint8_t header[kConfigHistoryRecordHeaderBytes];
+    while (offset + kConfigHistoryRecordHeaderBytes <= size &&
+           gConfigHistory.blobCount < AT_CONFIG_HISTORY_BLOBS) {
+      if (!pack.seek(offset) ||
+          pack.read(header, sizeof(header)) != sizeof(header)) {
+        break;
+      }
+      ConfigHistoryBlob blob = {};
+      memcpy(&blob.hash, header, 4);
+      memcpy(&blob.rawLength, header + 4, 2);
+      memcpy(&blob.storedLength, header + 6, 2);
+      blob.offset = offset;
+      const uint32_t end = offset + kConfigHistoryRecordHeaderBytes + blob.storedLength;
+      if (blob.storedLength > blob.rawLength ||
+          blob.rawLength >= kConfigHistoryMaxCardBytes || end > size) {
+        break;
+      }
+      gConfigHistory.blobs[gConfigHistory.blobCount++] = blob;
+      offset = end;
+    }
+    tornTail = (offset != size);
+    gConfigHistory.packBytes = offset;
+    pack.close();
+  } else {
+    File created = LittleFS.open(kConfigHistoryPackPath, "w");
+    if (!created) return false;
+    created.close();
+  }
+
+  JsonDocument doc;
+  if (readJsonFromPath(kConfigHistoryIndexPath, doc)) {
+    // Indexes written before blob records were added are trusted as-is.
+    JsonArrayConst indexedBlobs = doc["blobs"].as<JsonArrayConst>();
+    static bool verified[AT_CONFIG_HISTORY_BLOBS];
+    for (uint16_t b = 0; b < gConfigHistory.blobCount; ++b) {
+      verified[b] = indexedBlobs.isNull();
+    }
+    for (JsonArrayConst record : indexedBlobs) {
+      const int16_t b = findConfigHistoryBlobAt(record[0] | 0UL);
+      if (b < 0) continue;
+      const ConfigHistoryBlob& blob = gConfigHistory.blobs[b];
+      verified[b] = blob.hash == (record[1] | 0UL) &&
+                    blob.rawLength == (record[2] | 0UL);
+    }
+    for (JsonObjectConst entry : doc["versions"].as<JsonArrayConst>()) {
+      if (gConfigHistory.versionCount >= AT_CONFIG_HISTORY_VERSIONS) break;
+      JsonArrayConst offsets = entry["cards"].as<JsonArrayConst>();
+      if (offsets.size() != TOTAL_CARDS) continue;
+      ConfigHistoryVersion& version =
+          gConfigHistory.versions[gConfigHistory.versionCount];
+      bool complete = true;
+      uint16_t id = 0;
+      for (JsonVariantConst offset : offsets) {
+        version.cardOffsets[id] = offset.as<uint32_t>();
+        const int16_t b = findConfigHistoryBlobAt(version.cardOffsets[id]);
+        if (b < 0 || !verified[b]) complete = false;
+        ++id;
+      }
+      if (!complete) continue;
+      version.configId = strtoul(entry["configId"] | "0", nullptr, 16);
+      version.parentId = strtoul(entry["parentId"] | "0", nullptr, 16);
+      version.number = entry["number"] | 0UL;
+      gConfigHistory.versionCount += 1;
+    }
+  }
+  if (tornTail && !compactTornTail) return false;
+  gConfigHistory.ready = true;
+  if (tornTail) return compactConfigHistory();
+  return true;
+}
+
+// Moves the full-copy LKG/slot files of older firmware into the store,
+// oldest first, and deletes them with their V2 side files.
+void importLegacyConfigHistory() {
+  const char* const legacyPaths[] = {kSlot3ConfigPath, kSlot2ConfigPath,
+                                     kSlot1ConfigPath, kLkgConfigPath};
+  static LogicCard legacyCards[TOTAL_CARDS];
+  static CardLabelTable legacyLabels;
+  for (const char* path : legacyPaths) {
+    if (!LittleFS.exists(path)) continue;
+    JsonDocument doc;
+    if (readJsonFromPath(path, doc) && doc.is<JsonArrayConst>() &&
+        doc.as<JsonArrayConst>().size() == TOTAL_CARDS) {
+      JsonArrayConst array = doc.as<JsonArrayConst>();
+      String reason;
+      initializeCardArraySafeDefaults(legacyCards);
+      deserializeCardsFromArray(array, legacyCards);
+      if (!buildCardLabelTable(array, legacyLabels, reason)) {
+        resetCardLabelTable(legacyLabels);
+      }
+      const uint32_t number =
+          (gConfigHistory.versionCount > 0)
+              ? gConfigHistory.versions[gConfigHistory.versionCount - 1].number + 1
+              : 1;
+      if (!appendConfigHistoryVersion(legacyCards, &legacyLabels, number)) {
+        gConsole.printf("Config history: import of %s failed\n", path);
+        continue;  // keep the file for the next boot
+      }
+    }
+    LittleFS.remove(path);
+  }
+  for (const char* path : kLegacyHistoryV2Paths) {
+    if (LittleFS.exists(path)) LittleFS.remove(path);
+  }
+}
+
+// The active file is written after its history entry, so after a power
+// loss between the two the head may not match; record the active config
+// then. Otherwise the persisted version number is adopted.
+void initConfigHistory() {
+  if (!loadConfigHistory(true)) {
+    gConsole.println("Config history unavailable");
+    return;
+  }
+  importLegacyConfigHistory();
+  const uint32_t activeId = computeConfigHistoryId(logicCards, &gCardLabels);
+  const uint8_t count = gConfigHistory.versionCount;
+  const ConfigHistoryVersion* head =
+      (count > 0) ? &gConfigHistory.versions[count - 1] : nullptr;
+  if (head != nullptr && head->configId == activeId) {
+    gConfigVersionCounter = head->number;
+  } else {
+    gConfigVersionCounter = (head != nullptr) ? head->number + 1 : 1;
+    if (!appendConfigHistoryVersion(logicCards, &gCardLabels,
+                                    gConfigVersionCounter)) {
+      gConsole.println("Config history: failed to record active config");
+    }
+  }
+  formatVersion(gActiveVersion, sizeof(gActiveVersion), gConfigVersionCounter);
+  gConsole.printf("Config history: %u versions, %lu pack bytes\n",
+                gConfigHistory.versionCount,
+                static_cast<unsigned long>(gConfigHistory.packBytes));
+}
+
+void printLogicCardsJsonToSerial(const char* label) {
+  JsonDocument doc;
+  JsonArray array = doc.to<JsonArray>();
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
+    JsonObject obj = array.add<JsonObject>();
+    serializeCardToJson(logicCards[i], obj);
+  }
+
+  gConsole.println(label);
+  serializeJsonPretty(doc, Serial);
+  gConsole.println();
 }
 
 void copySharedRuntimeSnapshot(SharedRuntimeSnapshot& outSnapshot) {
@@ -782,9 +2631,16 @@ void copySharedRuntimeSnapshot(SharedRuntimeSnapshot& outSnapshot) {
   portEXIT_CRITICAL(&gSnapshotMux);
 }
 
+void readSharedSnapshotSeqs(uint32_t& seq, uint32_t& changeSeq) {
+  portENTER_CRITICAL(&gSnapshotMux);
+  seq = gSharedSnapshot.seq;
+  changeSeq = gSharedSnapshot.changeSeq;
+  portEXIT_CRITICAL(&gSnapshotMux);
+}
+
 void appendRuntimeSnapshotCard(JsonArray& cards,
                                const SharedRuntimeSnapshot& snapshot,
-                               uint8_t cardId) {
+                               uint16_t cardId) {
   const LogicCard& card = snapshot.cards[cardId];
   JsonObject node = cards.add<JsonObject>();
   node["id"] = card.id;
@@ -796,10 +2652,34 @@ void appendRuntimeSnapshotCard(JsonArray& cards,
   node["triggerFlag"] = card.triggerFlag;
   node["state"] = toString(card.state);
   node["mode"] = toString(card.mode);
-  node["currentValue"] = card.currentValue;
+  if (card.type == AnalogInput) {
+    // Published value honours the reporting deadband; kernelValue is what the
+    // conditions see.
+    const uint16_t slot = cardId - AI_START;
+    node["currentValue"] = snapshot.aiReportedValue[slot];
+    node["kernelValue"] = card.currentValue;
+    JsonObject reporting = node["reporting"].to<JsonObject>();
+    reporting["deadbandMode"] = toString(card.reportDeadbandMode);
+    reporting["deadband"] = card.reportDeadband;
+    reporting["published"] = snapshot.aiPublishedChanges[slot];
+    reporting["suppressed"] = snapshot.aiSuppressedChanges[slot];
+  } else {
+    node["currentValue"] = card.currentValue;
+  }
   node["startOnMs"] = card.startOnMs;
   node["startOffMs"] = card.startOffMs;
   node["repeatCounter"] = card.repeatCounter;
+  if (isPluginCard(cardId)) {
+    const CardPlugin& plugin = *kCardPlugins[cardId - PLUGIN_START];
+    const PluginRuntime& runtime = snapshot.plugins[cardId - PLUGIN_START];
+    JsonObject extension = node["plugin"].to<JsonObject>();
+    extension["name"] = plugin.name();
+    extension["budgetUs"] = plugin.budgetUs();
+    extension["lastUs"] = runtime.lastUs;
+    extension["maxUs"] = runtime.maxUs;
+    extension["overruns"] = runtime.overruns;
+    plugin.snapshotFields(card, extension["fields"].to<JsonObject>());
+  }
 
   JsonObject forced = node["maskForced"].to<JsonObject>();
   forced["inputSource"] = toString(snapshot.inputSource[cardId]);
@@ -818,7 +2698,7 @@ void appendRuntimeSnapshotCard(JsonArray& cards,
 }
 
 void serializeRuntimeSnapshot(JsonDocument& doc, uint32_t nowMs) {
-  SharedRuntimeSnapshot snapshot = {};
+  SharedRuntimeSnapshot& snapshot = gPortalSnapshot;
   copySharedRuntimeSnapshot(snapshot);
 
   doc["type"] = "runtime_snapshot";
@@ -829,19 +2709,186 @@ void serializeRuntimeSnapshot(JsonDocument& doc, uint32_t nowMs) {
       static_cast<double>(snapshot.lastCompleteScanUs) / 1000.0;
   doc["runMode"] = toString(snapshot.mode);
   doc["snapshotSeq"] = snapshot.seq;
+  doc["changeSeq"] = snapshot.changeSeq;
+
+  uint32_t aiPublished = 0;
+  uint32_t aiSuppressed = 0;
+  for (uint16_t slot = 0; slot < NUM_AI; ++slot) {
+    aiPublished += snapshot.aiPublishedChanges[slot];
+    aiSuppressed += snapshot.aiSuppressedChanges[slot];
+  }
+  JsonObject reporting = doc["reporting"].to<JsonObject>();
+  reporting["aiPublished"] = aiPublished;
+  reporting["aiSuppressed"] = aiSuppressed;
+  reporting["wsPublished"] = gWsSnapshotsPublished;
+  reporting["wsSuppressed"] = gWsSnapshotsSuppressed;
+  reporting["wsBytesSaved"] = gWsSnapshotBytesSaved;
 
   JsonObject testMode = doc["testMode"].to<JsonObject>();
   testMode["active"] = snapshot.testModeActive;
   testMode["outputMaskGlobal"] = snapshot.globalOutputMask;
   testMode["breakpointPaused"] = snapshot.breakpointPaused;
+  testMode["breakpointHookCount"] = snapshot.breakpointHookCount;
+  JsonObject rewind = testMode["rewind"].to<JsonObject>();
+  rewind["frames"] = snapshot.rewindFrames;
+  if (snapshot.rewindFrames > 0) {
+    rewind["oldestFrame"] = snapshot.rewindOldestFrame;
+    rewind["newestFrame"] = snapshot.rewindNewestFrame;
+  } else {
+    rewind["oldestFrame"] = nullptr;
+    rewind["newestFrame"] = nullptr;
+  }
+  rewind["frameCapacity"] = AT_REWIND_FRAMES;
+  rewind["entriesUsed"] = snapshot.rewindEntriesUsed;
+  rewind["entryCapacity"] = AT_REWIND_ENTRIES;
+  rewind["lastRecordUs"] = snapshot.rewindLastRecordUs;
+  rewind["maxRecordUs"] = snapshot.rewindMaxRecordUs;
+  rewind["overflows"] = snapshot.rewindOverflows;
+  if (snapshot.breakpointPaused && snapshot.breakpointHitCardId < TOTAL_CARDS) {
+    JsonObject hit = testMode["breakpointHit"].to<JsonObject>();
+    hit["cardId"] = snapshot.breakpointHitCardId;
+    if (snapshot.breakpointHitHook == kNoBreakpointHook) {
+      hit["hook"] = nullptr;
+    } else {
+      hit["hook"] = snapshot.breakpointHitHook;
+      hit["kind"] = toString(snapshot.breakpointHitKind);
+    }
+  }
   testMode["scanCursor"] = snapshot.scanCursor;
 
+  JsonObject alarms = doc["alarms"].to<JsonObject>();
+  alarms["sent"] = gAlarmLane.sent;
+  alarms["dropped"] = gAlarmLane.dropped.load(std::memory_order_relaxed);
+  alarms["lastLatencyUs"] = gAlarmLane.lastLatencyUs;
+  alarms["maxLatencyUs"] = gAlarmLane.maxLatencyUs;
+  alarms["latencyBudgetUs"] = AT_ALARM_LATENCY_BUDGET_US;
+  alarms["overBudget"] = gAlarmLane.overBudget;
+
+  JsonObject exchange = doc["exchange"].to<JsonObject>();
+  exchange["enabled"] = gExchangeSettings.enabled;
+  exchange["nodeId"] = gExchangeSettings.nodeId;
+  exchange["staleTransitions"] = snapshot.exchangeStaleTransitions;
+  JsonArray remotes = exchange["remotes"].to<JsonArray>();
+  for (uint16_t slot = 0; slot < NUM_REMOTE_SIO; ++slot) {
+    const RemoteSioBinding& binding = gExchangeSettings.remotes[slot];
+    if (!binding.bound) continue;
+    const LogicCard& image = snapshot.remoteCards[slot];
+    JsonObject remote = remotes.add<JsonObject>();
+    remote["cardId"] = image.id;
+    remote["node"] = binding.node;
+    remote["sio"] = binding.sioIndex;
+    remote["stale"] = (image.state == State_Remote_Stale);
+    remote["state"] = toString(image.state);
+    remote["logicalState"] = image.logicalState;
+    remote["physicalState"] = image.physicalState;
+    remote["currentValue"] = image.currentValue;
+    if (snapshot.remoteReceivedMs[slot] != 0) {
+      remote["ageMs"] = snapshot.tsMs - snapshot.remoteReceivedMs[slot];
+    } else {
+      remote["ageMs"] = nullptr;
+    }
+  }
+
+  JsonObject recipe = doc["recipe"].to<JsonObject>();
+  recipe["active"] = recipeNameForSlot(snapshot.activeRecipeSlot);
+  recipe["switchCount"] = snapshot.recipeSwitchCount;
+  recipe["lastStageUs"] = gLastRecipeStageUs;
+  recipe["lastSwapUs"] = snapshot.lastRecipeSwapUs;
+  recipe["lastSwitchLatencyUs"] = snapshot.lastRecipeSwitchLatencyUs;
+
+  JsonObject shadow = doc["shadow"].to<JsonObject>();
+  shadow["active"] = snapshot.shadowActive;
+  shadow["stopReason"] = snapshot.shadowStopReason;
+  shadow["scans"] = snapshot.shadowScans;
+  shadow["divergentScans"] = snapshot.shadowDivergentScans;
+  shadow["lastCostUs"] = snapshot.shadowLastCostUs;
+  shadow["maxCostUs"] = snapshot.shadowMaxCostUs;
+  if (snapshot.shadowActive) {
+    // Only DO/SIO/Script/Plugin cards whose staged result differs from
+    // the live one; divergences counts scans that differed since the shadow
+    // started.
+    JsonArray diff = shadow["diff"].to<JsonArray>();
+    for (uint16_t id = DO_START; id < TOTAL_CARDS; ++id) {
+      if (isAnalogInputCard(id)) continue;
+      const ShadowOutputImage& image = snapshot.shadowOutputs[id];
+      const LogicCard& live = snapshot.cards[id];
+      if (image.state == live.state && image.logicalState == live.logicalState &&
+          image.physicalState == live.physicalState) {
+        continue;
+      }
+      JsonObject entry = diff.add<JsonObject>();
+      entry["id"] = id;
+      entry["liveState"] = toString(live.state);
+      entry["livePhysicalState"] = live.physicalState;
+      entry["shadowState"] = toString(image.state);
+      entry["shadowPhysicalState"] = image.physicalState;
+      entry["divergences"] = image.divergences;
+    }
+  }
+
   JsonArray cards = doc["cards"].to<JsonArray>();
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     appendRuntimeSnapshotCard(cards, snapshot, scanOrderCardIdFromCursor(i));
   }
 }
 
+// Offline reconnect, stepped once per portal pass so the serial link and the
+// other offline loops keep running: MASTER for MASTER_WIFI_TIMEOUT_MS, then
+// USER for USER_WIFI_TIMEOUT_MS, then radio off until the next window. It
+// prints nothing, since the serial link owns the UART while offline.
+enum wifiRetryPhase {
+  WifiRetry_Idle,
+  WifiRetry_Master,
+  WifiRetry_SwitchToUser,
+  WifiRetry_User
+};
+struct WifiRetry {
+  wifiRetryPhase phase;
+  uint32_t phaseStartMs;
+};
+WifiRetry gWifiRetry = {};
+const uint32_t kOfflineWifiRetryMs = 30000;
+const uint32_t kWifiSettleMs = 50;
+
+void enterWifiRetryPhase(wifiRetryPhase phase, uint32_t nowMs) {
+  gWifiRetry.phase = phase;
+  gWifiRetry.phaseStartMs = nowMs;
+}
+
+// Returns true once connected; the caller then brings the portal up.
+bool stepOfflineWifiRetry(uint32_t nowMs) {
+  WifiRetry& retry = gWifiRetry;
+  const uint32_t elapsedMs = nowMs - retry.phaseStartMs;
+  switch (retry.phase) {
+    case WifiRetry_Idle:
+      if (elapsedMs < kOfflineWifiRetryMs) return false;
+      WiFi.mode(WIFI_STA);
+      WiFi.begin(kMasterSsid, kMasterPassword);
+      enterWifiRetryPhase(WifiRetry_Master, nowMs);
+      return false;
+    case WifiRetry_Master:
+      if (WiFi.status() == WL_CONNECTED) break;
+      if (elapsedMs < MASTER_WIFI_TIMEOUT_MS) return false;
+      WiFi.disconnect(true, true);
+      enterWifiRetryPhase(WifiRetry_SwitchToUser, nowMs);
+      return false;
+    case WifiRetry_SwitchToUser:
+      if (elapsedMs < kWifiSettleMs) return false;
+      WiFi.begin(gUserSsid, gUserPassword);
+      enterWifiRetryPhase(WifiRetry_User, nowMs);
+      return false;
+    case WifiRetry_User:
+      if (WiFi.status() == WL_CONNECTED) break;
+      if (elapsedMs < USER_WIFI_TIMEOUT_MS) return false;
+      WiFi.disconnect(true, true);
+      WiFi.mode(WIFI_OFF);
+      enterWifiRetryPhase(WifiRetry_Idle, nowMs);
+      return false;
+  }
+  enterWifiRetryPhase(WifiRetry_Idle, nowMs);
+  return true;
+}
+
 bool waitForWiFiConnected(uint32_t timeoutMs) {
   uint32_t startMs = millis();
   while ((millis() - startMs) < timeoutMs) {
@@ -858,8 +2905,8 @@ bool connectWiFiWithPolicy() {
 
   WiFi.begin(kMasterSsid, kMasterPassword);
   if (waitForWiFiConnected(MASTER_WIFI_TIMEOUT_MS)) {
-    Serial.print("WiFi connected via MASTER SSID. IP: ");
-    Serial.println(WiFi.localIP());
+    gConsole.print("WiFi connected via MASTER SSID. IP: ");
+    gConsole.println(WiFi.localIP());
     return true;
   }
 
@@ -868,14 +2915,15 @@ bool connectWiFiWithPolicy() {
 
   WiFi.begin(gUserSsid, gUserPassword);
   if (waitForWiFiConnected(USER_WIFI_TIMEOUT_MS)) {
-    Serial.print("WiFi connected via USER SSID. IP: ");
-    Serial.println(WiFi.localIP());
+    gConsole.print("WiFi connected via USER SSID. IP: ");
+    gConsole.println(WiFi.localIP());
     return true;
   }
 
   WiFi.disconnect(true, true);
   WiFi.mode(WIFI_OFF);
-  Serial.println("WiFi offline mode (master/user connect attempts failed)");
+  gConsole.println("WiFi offline mode (master/user connect attempts failed)");
+  enterWifiRetryPhase(WifiRetry_Idle, millis());
   return false;
 }
 
@@ -926,6 +2974,13 @@ void handleHttpGetSettings() {
   doc["scanIntervalMaxMs"] = kMaxScanIntervalMs;
   doc["wifiConnected"] = (WiFi.status() == WL_CONNECTED);
   doc["wifiIp"] = WiFi.localIP().toString();
+  doc["mqttHost"] = gMqttHost;
+  doc["mqttPort"] = gMqttPort;
+  doc["mqttTopicRoot"] = gMqttTopicRoot;
+  writeExchangeSettings(doc["exchange"].to<JsonObject>(),
+                        gStoredExchangeSettings);
+  doc["exchangeRestartRequired"] = gExchangeRestartRequired;
+  writeTrendSettings(doc["trend"].to<JsonObject>());
   doc["firmwareVersion"] = String(__DATE__) + " " + String(__TIME__);
 
   String body;
@@ -981,12 +3036,208 @@ void handleHttpSaveSettingsRuntime() {
   gPortalServer.send(200, "application/json", "{\"ok\":true}");
 }
 
+void handleHttpSaveSettingsMqtt() {
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, gPortalServer.arg("plain"));
+  if (error || !doc.is<JsonObject>()) {
+    gPortalServer.send(400, "application/json",
+                       "{\"ok\":false,\"error\":\"INVALID_REQUEST\"}");
+    return;
+  }
+  JsonObjectConst root = doc.as<JsonObjectConst>();
+  const char* host = root["mqttHost"] | "";
+  const uint32_t port = root["mqttPort"] | 1883UL;
+  const char* topicRoot = root["mqttTopicRoot"] | "";
+
+  if (strlen(host) > 64 || strlen(topicRoot) > 64 || port == 0 ||
+      port > 65535 || strpbrk(topicRoot, "+#") != nullptr) {
+    gPortalServer.send(400, "application/json",
+                       "{\"ok\":false,\"error\":\"VALIDATION_FAILED\"}");
+    return;
+  }
+
+  strncpy(gMqttHost, host, sizeof(gMqttHost) - 1);
+  gMqttHost[sizeof(gMqttHost) - 1] = '\0';
+  gMqttPort = static_cast<uint16_t>(port);
+  strncpy(gMqttTopicRoot, topicRoot, sizeof(gMqttTopicRoot) - 1);
+  gMqttTopicRoot[sizeof(gMqttTopicRoot) - 1] = '\0';
+  gMqttReconfigureRequested = true;
+
+  savePortalSettingsToLittleFS();
+  gPortalServer.send(200, "application/json", "{\"ok\":true}");
+}
+
+bool parseExchangeSettings(JsonObjectConst in, ExchangeSettings& out,
+                           String& reason) {
+  ExchangeSettings parsed = {};
+  parsed.enabled = in["enabled"] | false;
+  const uint32_t nodeId = in["nodeId"] | 1UL;
+  const char* group = in["group"] | "239.255.60.1";
+  const uint32_t port = in["port"] | static_cast<uint32_t>(AT_EXCHANGE_PORT);
+  const uint32_t timeMaster = in["timeMaster"] | 0UL;
+  IPAddress groupIp;
+  if (nodeId == 0 || nodeId > 254) {
+    reason = "nodeId out of range (1..254)";
+    return false;
+  }
+  if (strlen(group) >= sizeof(parsed.group) || !groupIp.fromString(group) ||
+      groupIp[0] < 224 || groupIp[0] > 239) {
+    reason = "group must be an IPv4 multicast address";
+    return false;
+  }
+  if (port == 0 || port > 65535) {
+    reason = "port out of range";
+    return false;
+  }
+  if (timeMaster > 254 || (timeMaster != 0 && port == 65535)) {
+    reason = "timeMaster out of range (0..254, needs port + 1)";
+    return false;
+  }
+  parsed.nodeId = static_cast<uint8_t>(nodeId);
+  strncpy(parsed.group, group, sizeof(parsed.group) - 1);
+  parsed.port = static_cast<uint16_t>(port);
+  parsed.timeMaster = static_cast<uint8_t>(timeMaster);
+
+  for (JsonObjectConst remote : in["remotes"].as<JsonArrayConst>()) {
+    const uint32_t slot = remote["slot"] | static_cast<uint32_t>(NUM_REMOTE_SIO);
+    const uint32_t node = remote["node"] | 0UL;
+    const uint32_t sio = remote["sio"] | 0xFFFFUL;
+    const uint32_t timeoutMs = remote["timeoutMs"] | kDefaultRemoteTimeoutMs;
+    if (slot >= NUM_REMOTE_SIO || parsed.remotes[slot].bound) {
+      reason = "remote slot out of range or duplicated";
+      return false;
+    }
+    if (node == 0 || node > 254 || node == nodeId || sio > 0xFFFE ||
+        timeoutMs == 0) {
+      reason = "invalid remote binding (slot=" + String(slot) + ")";
+      return false;
+    }
+    RemoteSioBinding& binding = parsed.remotes[slot];
+    binding.bound = true;
+    binding.node = static_cast<uint8_t>(node);
+    binding.sioIndex = static_cast<uint16_t>(sio);
+    binding.timeoutMs = timeoutMs;
+  }
+  out = parsed;
+  return true;
+}
+
+void writeExchangeSettings(JsonObject out, const ExchangeSettings& settings) {
+  out["enabled"] = settings.enabled;
+  out["nodeId"] = settings.nodeId;
+  out["group"] = settings.group;
+  out["port"] = settings.port;
+  out["timeMaster"] = settings.timeMaster;
+  JsonArray remotes = out["remotes"].to<JsonArray>();
+  for (uint16_t slot = 0; slot < NUM_REMOTE_SIO; ++slot) {
+    const RemoteSioBinding& binding = settings.remotes[slot];
+    if (!binding.bound) continue;
+    JsonObject remote = remotes.add<JsonObject>();
+    remote["slot"] = slot;
+    remote["cardId"] = REMOTE_START + slot;
+    remote["node"] = binding.node;
+    remote["sio"] = binding.sioIndex;
+    remote["timeoutMs"] = binding.timeoutMs;
+  }
+}
+
+// Exchange settings take effect on the next boot; bindings must not move
+// under a running kernel.
+void handleHttpSaveSettingsExchange() {
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, gPortalServer.arg("plain"));
+  if (error || !doc.is<JsonObject>()) {
+    gPortalServer.send(400, "application/json",
+                       "{\"ok\":false,\"error\":\"INVALID_REQUEST\"}");
+    return;
+  }
+  String reason;
+  ExchangeSettings parsed = {};
+  if (!parseExchangeSettings(doc.as<JsonObjectConst>(), parsed, reason)) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", reason);
+    return;
+  }
+  gStoredExchangeSettings = parsed;
+  gExchangeRestartRequired = true;
+  savePortalSettingsToLittleFS();
+  gPortalServer.send(200, "application/json",
+                     "{\"ok\":true,\"restartRequired\":true}");
+}
+
+bool parseTrendSettings(JsonObjectConst in, TrendSeriesConfig* out,
+                        String& reason) {
+  TrendSeriesConfig parsed[AT_TREND_MAX_SERIES] = {};
+  uint8_t count = 0;
+  for (JsonObjectConst series : in["series"].as<JsonArrayConst>()) {
+    const uint32_t cardId = series["cardId"] | static_cast<uint32_t>(kInvalidCardId);
+    const uint32_t periodS = series["periodS"] | 60UL;
+    if (count >= AT_TREND_MAX_SERIES) {
+      reason = "too many trend series (max " + String(AT_TREND_MAX_SERIES) + ")";
+      return false;
+    }
+    if (cardId >= TOTAL_CARDS || periodS == 0 || periodS > kTrendMaxPeriodS) {
+      reason = "invalid trend series (index=" + String(count) + ")";
+      return false;
+    }
+    for (uint8_t i = 0; i < count; ++i) {
+      if (parsed[i].cardId == cardId) {
+        reason = "card " + String(cardId) + " trended twice";
+        return false;
+      }
+    }
+    parsed[count].active = true;
+    parsed[count].cardId = static_cast<uint16_t>(cardId);
+    parsed[count].periodS = static_cast<uint16_t>(periodS);
+    count += 1;
+  }
+  memcpy(out, parsed, sizeof(parsed));
+  return true;
+}
+
+void writeTrendSettings(JsonObject out) {
+  JsonArray series = out["series"].to<JsonArray>();
+  for (uint8_t i = 0; i < AT_TREND_MAX_SERIES; ++i) {
+    const TrendSeriesConfig& config = gTrendStore.series[i];
+    if (!config.active) continue;
+    JsonObject entry = series.add<JsonObject>();
+    entry["cardId"] = config.cardId;
+    entry["periodS"] = config.periodS;
+  }
+}
+
+// Open pages are written out before the series change, so no page mixes
+// two configurations.
+void handleHttpSaveSettingsTrend() {
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, gPortalServer.arg("plain"));
+  if (error || !doc.is<JsonObject>()) {
+    gPortalServer.send(400, "application/json",
+                       "{\"ok\":false,\"error\":\"INVALID_REQUEST\"}");
+    return;
+  }
+  String reason;
+  TrendSeriesConfig parsed[AT_TREND_MAX_SERIES] = {};
+  if (!parseTrendSettings(doc.as<JsonObjectConst>(), parsed, reason)) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", reason);
+    return;
+  }
+  flushTrendPages();
+  for (uint8_t i = 0; i < AT_TREND_MAX_SERIES; ++i) {
+    gTrendStore.pages[i].nextDueS = 0;
+  }
+  memcpy(gTrendStore.series, parsed, sizeof(parsed));
+  savePortalSettingsToLittleFS();
+  gPortalServer.send(200, "application/json", "{\"ok\":true}");
+}
+
 void handleHttpReconnectWiFi() {
   gPortalReconnectRequested = true;
   gPortalServer.send(200, "application/json", "{\"ok\":true}");
 }
 
 void handleHttpReboot() {
+  flushJournal();
+  flushTrendPages();
   gPortalServer.send(200, "application/json", "{\"ok\":true}");
   gPortalServer.client().stop();
   delay(200);
@@ -1027,13 +3278,53 @@ void handleHttpGetActiveConfig() {
   doc["activeVersion"] = gActiveVersion;
   JsonObject config = doc["config"].to<JsonObject>();
   JsonArray cards = config["cards"].to<JsonArray>();
-  serializeCardsToArray(logicCards, cards);
+  serializeCardsToArray(logicCards, cards, &gCardLabels);
+  doc["error"] = nullptr;
+  String body;
+  serializeJson(doc, body);
+  gPortalServer.send(200, "application/json", body);
+}
+
+void handleHttpGetConfigLabels() {
+  char etag[16];
+  snprintf(etag, sizeof(etag), "\"%08lx\"",
+           static_cast<unsigned long>(gCardLabels.hash));
+  gPortalServer.sendHeader("ETag", etag);
+  gPortalServer.sendHeader("Cache-Control", "no-cache");
+  if (gPortalServer.header("If-None-Match") == etag) {
+    gPortalServer.send(304, "application/json", "");
+    return;
+  }
+
+  JsonDocument doc;
+  doc["ok"] = true;
+  doc["activeVersion"] = gActiveVersion;
+  JsonArray cards = doc["cards"].to<JsonArray>();
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
+    if (gCardLabels.labelRef[i] == 0 && gCardLabels.unitRef[i] == 0) continue;
+    JsonObject node = cards.add<JsonObject>();
+    node["id"] = i;
+    appendCardLabelFields(gCardLabels, i, node);
+  }
   doc["error"] = nullptr;
   String body;
   serializeJson(doc, body);
   gPortalServer.send(200, "application/json", body);
 }
 
+void handleHttpGetV2Config() {
+  // Lazily refreshes the cached V2 export if the active config was committed
+  // since the last migration.
+  ensureV2MigrationCurrent();
+  File file = LittleFS.open(kV2MigrationPaths[0].v2Path, "r");
+  if (!file) {
+    writeConfigErrorResponse(404, "NOT_FOUND", "no V2 config available");
+    return;
+  }
+  gPortalServer.streamFile(file, "application/json");
+  file.close();
+}
+
 void handleHttpStagedSaveConfig() {
   JsonDocument request;
   DeserializationError parseError =
@@ -1105,49 +3396,675 @@ void handleHttpStagedValidateConfig() {
   gPortalServer.send(200, "application/json", body);
 }
 
-bool rotateHistoryFiles() {
-  if (!copyFileIfExists(kSlot2ConfigPath, kSlot3ConfigPath)) return false;
-  if (!copyFileIfExists(kSlot1ConfigPath, kSlot2ConfigPath)) return false;
-  if (!copyFileIfExists(kLkgConfigPath, kSlot1ConfigPath)) return false;
-  if (!copyFileIfExists(kConfigPath, kLkgConfigPath)) return false;
-  rotateHistoryVersions();
-  return true;
-}
-
+// Starts or stops shadow evaluation of /config_staged.json against the live
+// input image. The staged cards are loaded only while the shadow is stopped.
+void handleHttpShadowConfig() {
+  JsonDocument request;
+  DeserializationError parseError =
+      deserializeJson(request, gPortalServer.arg("plain"));
+  if (parseError || !request["enabled"].is<bool>()) {
+    writeConfigErrorResponse(400, "INVALID_REQUEST", "enabled must be boolean");
+    return;
+  }
+  const bool enabled = request["enabled"].as<bool>();
+
+  if (enabled) {
+    if (gShadowActive || gShadowEnableQueued) {
+      writeConfigErrorResponse(409, "BUSY", "shadow already running");
+      return;
+    }
+    JsonDocument staged;
+    if (!readJsonFromPath(kStagedConfigPath, staged) ||
+        !staged.is<JsonObjectConst>()) {
+      writeConfigErrorResponse(404, "NOT_FOUND", "no staged config available");
+      return;
+    }
+    JsonArrayConst cards;
+    String reason;
+    if (!extractConfigCardsFromRequest(staged.as<JsonObjectConst>(), cards,
+                                       reason)) {
+      writeConfigErrorResponse(400, "VALIDATION_FAILED", reason);
+      return;
+    }
+    if (!deserializeCardsFromArray(cards, gShadow.cards) ||
+        !compileCardScripts(cards, gShadow.scripts, reason)) {
+      writeConfigErrorResponse(400, "VALIDATION_FAILED", "failed to parse cards");
+      return;
+    }
+  }
+
+  KernelCommand command = {};
+  command.type = KernelCmd_SetShadowEnabled;
+  command.flag = enabled;
+  if (enabled) gShadowEnableQueued = true;
+  if (!enqueueKernelCommand(command)) {
+    if (enabled) gShadowEnableQueued = false;
+    writeConfigErrorResponse(503, "BUSY", "kernel command queue full");
+    return;
+  }
+  gPortalServer.send(200, "application/json", "{\"ok\":true,\"error\":null}");
+}
+
+// Private card image for a virtual-time run; Core1-only and never visible to
+// the kernel, so the live scan and hardware are unaffected.
+struct VirtualRun {
+  LogicCard cards[TOTAL_CARDS];
+  bool prevSetCondition[TOTAL_CARDS];
+  bool prevDISample[TOTAL_CARDS];
+  bool prevDIPrimed[TOTAL_CARDS];
+  bool setResult[TOTAL_CARDS];
+  bool resetResult[TOTAL_CARDS];
+  bool resetOverride[TOTAL_CARDS];
+  bool inputDI[NUM_DI];
+  uint32_t inputAI[NUM_AI];
+  uint32_t pulses[TOTAL_CARDS];
+  uint32_t onTimeMs[TOTAL_CARDS];
+};
+// Shared by the fast-forward and timing endpoints; both run on Core1 only.
+VirtualRun gVirtualRun;
+
+struct VirtualInputStep {
+  uint32_t atMs;
+  uint16_t cardId;
+  uint32_t value;
+};
+
+bool isVirtualOutputCard(uint16_t id) {
+  return isDigitalOutputCard(id) || isSoftIOCard(id);
+}
+
+bool parseVirtualInputScript(JsonArrayConst script, VirtualInputStep* outSteps,
+                             uint16_t& outCount, String& reason) {
+  outCount = 0;
+  uint32_t previousAtMs = 0;
+  for (JsonVariantConst entry : script) {
+    if (outCount >= kVirtualScriptCapacity) {
+      reason = "too many input steps";
+      return false;
+    }
+    const uint32_t atMs = entry["atMs"] | 0UL;
+    const uint16_t cardId = entry["cardId"] | kInvalidCardId;
+    if (atMs < previousAtMs) {
+      reason = "input steps must be sorted by atMs";
+      return false;
+    }
+    VirtualInputStep& step = outSteps[outCount];
+    step.atMs = atMs;
+    step.cardId = cardId;
+    if (isDigitalInputCard(cardId) && entry["value"].is<bool>()) {
+      step.value = entry["value"].as<bool>() ? 1 : 0;
+    } else if (isAnalogInputCard(cardId) && entry["value"].is<uint32_t>()) {
+      step.value = entry["value"].as<uint32_t>();
+    } else {
+      reason = "input step needs a DI (bool) or AI (number) card";
+      return false;
+    }
+    previousAtMs = atMs;
+    outCount += 1;
+  }
+  return true;
+}
+
+void applyVirtualInputStep(VirtualRun& run, const VirtualInputStep& step) {
+  if (isDigitalInputCard(step.cardId)) {
+    run.inputDI[step.cardId - DI_START] = (step.value != 0);
+  } else {
+    run.inputAI[step.cardId - AI_START] = step.value;
+  }
+}
+
+// Fast-forward job state. The POST handler seeds gVirtualRun from one
+// published snapshot and returns; stepFastForward() then advances at most
+// AT_VIRTUAL_EVALS_PER_PASS card evaluations per portal pass, so HTTP/WS
+// service never stalls on a long run. The job owns gVirtualRun while running.
+struct VirtualTimelineEvent {
+  uint32_t tMs;
+  uint16_t id;
+  cardState state;
+  bool physicalState;
+};
+
+struct FastForwardJob {
+  bool running;
+  bool done;
+  bool cancelled;
+  uint32_t durationMs;
+  uint32_t stepMs;
+  uint32_t baseMs;
+  uint32_t steps;
+  uint32_t totalSteps;
+  uint16_t scriptCount;
+  uint16_t scriptCursor;
+  uint16_t timelineCount;
+  uint32_t droppedEvents;
+  uint32_t startUs;
+  uint32_t wallUs;
+  uint32_t busyUs;
+  uint32_t passes;
+  VirtualInputStep script[kVirtualScriptCapacity];
+  VirtualTimelineEvent timeline[kVirtualTimelineCapacity];
+};
+FastForwardJob gFastForward = {};
+
+// Runs a copy of the current card image in virtual time, stepping nowMs by
+// stepMs. Inputs start from the forced values (or the input image of the
+// same published scan) and follow the optional script; outputs are never
+// driven. Answers 202 at once; GET returns progress and then the DO/SIO
+// transitions as a timeline plus per-output totals.
+void handleHttpFastForward() {
+  if (gFastForward.running) {
+    writeConfigErrorResponse(409, "BUSY", "fast-forward already running");
+    return;
+  }
+  JsonDocument request;
+  DeserializationError parseError =
+      deserializeJson(request, gPortalServer.arg("plain"));
+  if (parseError || !request.is<JsonObjectConst>()) {
+    writeConfigErrorResponse(400, "INVALID_REQUEST", "invalid json");
+    return;
+  }
+  // One copy under gSnapshotMux: cards, edge history and the input image all
+  // come from the same published scan.
+  SharedRuntimeSnapshot& snapshot = gPortalSnapshot;
+  copySharedRuntimeSnapshot(snapshot);
+  if (!snapshot.testModeActive) {
+    writeConfigErrorResponse(409, "FORBIDDEN_IN_MODE", "test mode required");
+    return;
+  }
+
+  // Steps run at elapsed 0, stepMs, ... up to durationMs inclusive.
+  const uint32_t durationMs = request["durationMs"] | 0UL;
+  const uint32_t stepMs = request["stepMs"] | gScanIntervalMs;
+  if (durationMs == 0 || stepMs == 0 ||
+      (durationMs / stepMs) >= kVirtualMaxSteps) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED",
+                             "durationMs/stepMs out of range");
+    return;
+  }
+  FastForwardJob& job = gFastForward;
+  String reason;
+  if (!parseVirtualInputScript(request["inputs"].as<JsonArrayConst>(),
+                               job.script, job.scriptCount, reason)) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", reason);
+    return;
+  }
+  job.durationMs = durationMs;
+  job.stepMs = stepMs;
+  job.totalSteps = durationMs / stepMs + 1;
+  job.steps = 0;
+  job.scriptCursor = 0;
+  job.timelineCount = 0;
+  job.droppedEvents = 0;
+  job.busyUs = 0;
+  job.passes = 0;
+  job.wallUs = 0;
+  job.done = false;
+  job.cancelled = false;
+  // Virtual clock continues from the snapshot time so timers already running
+  // in the copied image stay consistent; tMs/atMs are offsets from the start.
+  job.baseMs = snapshot.tsMs;
+
+  VirtualRun& run = gVirtualRun;
+  memset(&run, 0, sizeof(run));
+  memcpy(run.cards, snapshot.cards, sizeof(run.cards));
+  // Edge history comes from the same published scan as the cards, so a set
+  // condition that is already true does not read as a rising edge at step 0.
+  memcpy(run.prevSetCondition, snapshot.prevSetCondition,
+         sizeof(run.prevSetCondition));
+  memcpy(run.prevDISample, snapshot.prevDISample, sizeof(run.prevDISample));
+  memcpy(run.prevDIPrimed, snapshot.prevDIPrimed, sizeof(run.prevDIPrimed));
+  for (uint16_t i = 0; i < NUM_DI; ++i) {
+    const inputSourceMode source = snapshot.inputSource[DI_START + i];
+    const bool forced =
+        source == InputSource_ForcedHigh || source == InputSource_ForcedLow;
+    run.inputDI[i] =
+        forced ? (source == InputSource_ForcedHigh) : snapshot.inputImageDI[i];
+  }
+  for (uint16_t i = 0; i < NUM_AI; ++i) {
+    const uint16_t id = AI_START + i;
+    run.inputAI[i] = (snapshot.inputSource[id] == InputSource_ForcedValue)
+                         ? snapshot.forcedAIValue[id]
+                         : snapshot.inputImageAI[i];
+  }
+  job.startUs = micros();
+  job.running = true;
+
+  JsonDocument response;
+  response["ok"] = true;
+  response["state"] = "running";
+  response["totalSteps"] = job.totalSteps;
+  response["error"] = nullptr;
+  String body;
+  serializeJson(response, body);
+  gPortalServer.send(202, "application/json", body);
+}
+
+// Portal-loop slice of the running fast-forward job.
+void stepFastForward() {
+  FastForwardJob& job = gFastForward;
+  if (!job.running) return;
+  VirtualRun& run = gVirtualRun;
+  const KernelEvalContext ctx = {run.cards,         run.prevSetCondition,
+                                 run.prevDISample,  run.prevDIPrimed,
+                                 run.setResult,     run.resetResult,
+                                 run.resetOverride, run.inputDI,
+                                 run.inputAI,       false,
+                                 gScriptPrograms};
+  const uint32_t passStartUs = micros();
+  uint32_t budget = AT_VIRTUAL_EVALS_PER_PASS / TOTAL_CARDS;
+  if (budget == 0) budget = 1;
+  for (; budget > 0 && job.steps < job.totalSteps; --budget) {
+    const uint32_t elapsedMs = job.steps * job.stepMs;
+    const uint32_t nowMs = job.baseMs + elapsedMs;
+    while (job.scriptCursor < job.scriptCount &&
+           job.script[job.scriptCursor].atMs <= elapsedMs) {
+      applyVirtualInputStep(run, job.script[job.scriptCursor]);
+      job.scriptCursor += 1;
+    }
+    for (uint16_t cursor = 0; cursor < TOTAL_CARDS; ++cursor) {
+      const uint16_t id = scanOrderCardIdFromCursor(cursor);
+      if (!isVirtualOutputCard(id)) {
+        processCardById(ctx, id, nowMs);
+        continue;
+      }
+      const cardState previousState = run.cards[id].state;
+      const bool previousPhysical = run.cards[id].physicalState;
+      processCardById(ctx, id, nowMs);
+      const LogicCard& card = run.cards[id];
+      if (previousPhysical) run.onTimeMs[id] += job.stepMs;
+      if (!previousPhysical && card.physicalState) run.pulses[id] += 1;
+      if (previousState == card.state && previousPhysical == card.physicalState) {
+        continue;
+      }
+      if (job.timelineCount >= kVirtualTimelineCapacity) {
+        job.droppedEvents += 1;
+        continue;
+      }
+      VirtualTimelineEvent& event = job.timeline[job.timelineCount];
+      event.tMs = elapsedMs;
+      event.id = id;
+      event.state = card.state;
+      event.physicalState = card.physicalState;
+      job.timelineCount += 1;
+    }
+    job.steps += 1;
+  }
+  job.busyUs += micros() - passStartUs;
+  job.passes += 1;
+  if (job.steps < job.totalSteps) return;
+  job.wallUs = micros() - job.startUs;
+  job.running = false;
+  job.done = true;
+}
+
+// A commit swaps the script programs the virtual run evaluates.
+void cancelFastForward() {
+  if (!gFastForward.running) return;
+  gFastForward.running = false;
+  gFastForward.cancelled = true;
+}
+
+void handleHttpGetFastForward() {
+  const FastForwardJob& job = gFastForward;
+  if (!job.running && !job.done && !job.cancelled) {
+    writeConfigErrorResponse(404, "NOT_FOUND", "no fast-forward run");
+    return;
+  }
+  JsonDocument response;
+  response["ok"] = true;
+  response["state"] =
+      job.running ? "running" : (job.cancelled ? "cancelled" : "done");
+  response["durationMs"] = job.durationMs;
+  response["stepMs"] = job.stepMs;
+  response["steps"] = job.steps;
+  response["totalSteps"] = job.totalSteps;
+  response["passes"] = job.passes;
+  response["busyUs"] = job.busyUs;
+  if (job.done) {
+    response["wallUs"] = job.wallUs;
+    response["droppedEvents"] = job.droppedEvents;
+    JsonArray timeline = response["timeline"].to<JsonArray>();
+    for (uint16_t i = 0; i < job.timelineCount; ++i) {
+      const VirtualTimelineEvent& entry = job.timeline[i];
+      JsonObject event = timeline.add<JsonObject>();
+      event["tMs"] = entry.tMs;
+      event["id"] = entry.id;
+      event["state"] = toString(entry.state);
+      event["physicalState"] = entry.physicalState;
+    }
+    const VirtualRun& run = gVirtualRun;
+    JsonArray outputs = response["outputs"].to<JsonArray>();
+    for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+      if (!isVirtualOutputCard(id)) continue;
+      JsonObject output = outputs.add<JsonObject>();
+      output["id"] = id;
+      output["pulses"] = run.pulses[id];
+      output["onTimeMs"] = run.onTimeMs[id];
+      output["finalState"] = toString(run.cards[id].state);
+    }
+  }
+  response["error"] = nullptr;
+  String body;
+  serializeJson(response, body);
+  gPortalServer.send(200, "application/json", body);
+}
+
+// The legacy slot names map onto history depth: LKG is the parent of the
+// active version, SLOT1..3 the three before it.
+const char* const kHistoryDepthSources[] = {"LKG", "SLOT1", "SLOT2", "SLOT3"};
+const char* const kHistoryDepthKeys[] = {"lkgVersion", "slot1Version",
+                                         "slot2Version", "slot3Version"};
+
 void writeHistoryHead(JsonObject& head) {
-  head["lkgVersion"] = gLkgVersion;
-  head["slot1Version"] = gSlot1Version;
-  head["slot2Version"] = gSlot2Version;
-  head["slot3Version"] = gSlot3Version;
+  const uint8_t count = gConfigHistory.versionCount;
+  char text[16];
+  for (uint8_t depth = 1; depth <= 4; ++depth) {
+    text[0] = '\0';
+    if (count > depth) {
+      formatVersion(text, sizeof(text),
+                    gConfigHistory.versions[count - 1 - depth].number);
+    }
+    head[kHistoryDepthKeys[depth - 1]] = text;
+  }
+  if (count > 0) {
+    formatHash(text, sizeof(text), gConfigHistory.versions[count - 1].configId);
+    head["configId"] = text;
+  } else {
+    head["configId"] = nullptr;
+  }
+  head["versions"] = count;
 }
 
-bool commitCards(JsonArrayConst cards, String& reason) {
-  LogicCard nextCards[TOTAL_CARDS];
+// Journals one record for the commit: Journal_Commit, or Journal_Restore
+// with its source code for a restore.
+bool commitCards(JsonArrayConst cards, journalKind kind, uint8_t code,
+                 String& reason) {
+  // Core1-only staging buffer; kept off the portal task stack.
+  static LogicCard nextCards[TOTAL_CARDS];
+  static CardLabelTable nextLabels;
+  static ScriptProgram nextScripts[kScriptSlots];
   if (!deserializeCardsFromArray(cards, nextCards)) {
     reason = "failed to parse cards";
     return false;
   }
-
-  if (!rotateHistoryFiles()) {
-    reason = "failed to rotate history slots";
+  if (!buildCardLabelTable(cards, nextLabels, reason)) return false;
+  if (!compileCardScripts(cards, nextScripts, reason)) return false;
+
+  // History first, so a power loss before the active file is written is
+  // caught at boot (initConfigHistory); a failure below rolls it back.
+  const uint32_t persistStartUs = micros();
+  if (!appendConfigHistoryVersion(nextCards, &nextLabels,
+                                  gConfigVersionCounter + 1)) {
+    reason = "failed to record config history";
     return false;
   }
 
-  if (!saveCardsToPath(kConfigPath, nextCards)) {
+  if (!saveCardsToPath(kConfigPath, nextCards, &nextLabels)) {
+    dropConfigHistoryHead();
     reason = "failed to persist active config";
     return false;
   }
+  gConfigHistory.lastCommitUs = micros() - persistStartUs;
+  if (gConfigHistory.lastCommitUs > gConfigHistory.maxCommitUs) {
+    gConfigHistory.maxCommitUs = gConfigHistory.lastCommitUs;
+  }
 
-  if (!applyCardsAsActiveConfig(nextCards)) {
+  if (!applyCardsAsActiveConfig(nextCards, nextScripts)) {
+    dropConfigHistoryHead();
     reason = "failed to apply active config to runtime";
     return false;
   }
+  memcpy(&gCardLabels, &nextLabels, sizeof(gCardLabels));
+  saveActiveRecipeName(nullptr);
 
   gConfigVersionCounter += 1;
   formatVersion(gActiveVersion, sizeof(gActiveVersion), gConfigVersionCounter);
+  recordJournalEvent(kind, code, kInvalidCardId, headConfigId(),
+                     gConfigVersionCounter);
+  flushJournal();
+  return true;
+}
+
+bool isValidRecipeName(const char* name) {
+  if (name == nullptr) return false;
+  const size_t length = strlen(name);
+  if (length == 0 || length > kMaxRecipeNameLength) return false;
+  for (size_t i = 0; i < length; ++i) {
+    const unsigned char ch = static_cast<unsigned char>(name[i]);
+    if (!std::isalnum(ch) && ch != '_' && ch != '-') return false;
+  }
+  return true;
+}
+
+int8_t findRecipeSlotByName(const char* name) {
+  if (name == nullptr) return kNoRecipe;
+  for (uint8_t i = 0; i < AT_RECIPE_CAPACITY; ++i) {
+    if (gRecipes[i].loaded && strcmp(gRecipes[i].name, name) == 0) {
+      return static_cast<int8_t>(i);
+    }
+  }
+  return kNoRecipe;
+}
+
+const char* recipeNameForSlot(int8_t slot) {
+  if (slot < 0 || slot >= AT_RECIPE_CAPACITY || !gRecipes[slot].loaded) {
+    return nullptr;
+  }
+  return gRecipes[slot].name;
+}
+
+void formatRecipePath(char* out, size_t outSize, uint8_t slot) {
+  snprintf(out, outSize, "/recipe_%u.json", static_cast<unsigned>(slot));
+}
+
+bool saveRecipeIndex() {
+  JsonDocument doc;
+  JsonArray recipes = doc["recipes"].to<JsonArray>();
+  for (uint8_t i = 0; i < AT_RECIPE_CAPACITY; ++i) {
+    if (!gRecipes[i].loaded) continue;
+    JsonObject entry = recipes.add<JsonObject>();
+    entry["slot"] = i;
+    entry["name"] = gRecipes[i].name;
+  }
+  return writeJsonToPath(kRecipeIndexPath, doc);
+}
+
+void saveActiveRecipeName(const char* name) {
+  if (name == nullptr) {
+    LittleFS.remove(kActiveRecipePath);
+    return;
+  }
+  JsonDocument doc;
+  doc["name"] = name;
+  writeJsonToPath(kActiveRecipePath, doc);
+}
+
+// Recipes are validated and deserialized once at save/boot, so a switch only
+// has to copy a ready card image and flip the kernel's bank pointer.
+void loadRecipesFromStorage() {
+  JsonDocument index;
+  if (!readJsonFromPath(kRecipeIndexPath, index)) return;
+  for (JsonVariantConst entry : index["recipes"].as<JsonArrayConst>()) {
+    const uint8_t slot = entry["slot"] | static_cast<uint8_t>(255);
+    const char* name = entry["name"] | "";
+    if (slot >= AT_RECIPE_CAPACITY || !isValidRecipeName(name)) continue;
+
+    char path[24];
+    formatRecipePath(path, sizeof(path), slot);
+    JsonDocument doc;
+    if (!readJsonFromPath(path, doc) || !doc.is<JsonArrayConst>()) continue;
+    String reason;
+    if (!validateConfigCardsArray(doc.as<JsonArrayConst>(), reason)) {
+      gConsole.printf("Recipe %s rejected: %s\n", name, reason.c_str());
+      continue;
+    }
+    RecipeSlot& recipe = gRecipes[slot];
+    if (!deserializeCardsFromArray(doc.as<JsonArrayConst>(), recipe.cards)) {
+      continue;
+    }
+    strncpy(recipe.name, name, sizeof(recipe.name) - 1);
+    recipe.name[sizeof(recipe.name) - 1] = '\0';
+    hashFileFnv1a(path, recipe.cardsHash);
+    recipe.loaded = true;
+  }
+
+  JsonDocument active;
+  if (!readJsonFromPath(kActiveRecipePath, active)) return;
+  const int8_t slot = findRecipeSlotByName(active["name"] | "");
+  if (slot == kNoRecipe) return;
+  // Kernel task is not running yet, so the active bank can be written directly.
+  memcpy(logicCards, gRecipes[slot].cards, sizeof(gRecipes[slot].cards));
+  gActiveRecipeSlot = slot;
+  gConsole.printf("Active recipe: %s\n", gRecipes[slot].name);
+}
+
+bool requestRecipeSwitch(const char* name) {
+  const int8_t slot = findRecipeSlotByName(name);
+  if (slot == kNoRecipe) return false;
+  if (gRecipeSwitchPending) return false;
+
+  // Only the standby bank is written here. Bumping the sequence first retires
+  // any switch still queued from before a commit, so the kernel cannot flip
+  // onto the bank until the command below carries the new value.
+  const uint32_t seq = gRecipeSwitchSeq + 1;
+  gRecipeSwitchSeq = seq;
+  const uint32_t stageStartUs = micros();
+  LogicCard* standby =
+      (logicCards == gCardBank[0]) ? gCardBank[1] : gCardBank[0];
+  memcpy(standby, gRecipes[slot].cards, sizeof(gRecipes[slot].cards));
+  gStagedRecipeSlot = slot;
+  gRecipeSwitchRequestedUs = micros();
+  gLastRecipeStageUs = gRecipeSwitchRequestedUs - stageStartUs;
+  gRecipeSwitchPending = true;
+
+  KernelCommand command = {};
+  command.type = KernelCmd_SwitchRecipe;
+  command.value = static_cast<uint32_t>(slot);
+  command.recipeSeq = seq;
+  if (!enqueueKernelCommand(command)) {
+    gRecipeSwitchPending = false;
+    return false;
+  }
+  saveActiveRecipeName(gRecipes[slot].name);
   return true;
 }
 
+void handleHttpGetRecipes() {
+  JsonDocument doc;
+  doc["ok"] = true;
+  doc["capacity"] = AT_RECIPE_CAPACITY;
+  doc["active"] = recipeNameForSlot(gActiveRecipeSlot);
+  JsonArray recipes = doc["recipes"].to<JsonArray>();
+  for (uint8_t i = 0; i < AT_RECIPE_CAPACITY; ++i) {
+    if (!gRecipes[i].loaded) continue;
+    JsonObject entry = recipes.add<JsonObject>();
+    entry["name"] = gRecipes[i].name;
+    char hashText[9];
+    formatHash(hashText, sizeof(hashText), gRecipes[i].cardsHash);
+    entry["hash"] = hashText;
+  }
+  doc["error"] = nullptr;
+  String body;
+  serializeJson(doc, body);
+  gPortalServer.send(200, "application/json", body);
+}
+
+void handleHttpSaveRecipe() {
+  JsonDocument request;
+  DeserializationError parseError =
+      deserializeJson(request, gPortalServer.arg("plain"));
+  if (parseError || !request.is<JsonObjectConst>()) {
+    writeConfigErrorResponse(400, "INVALID_REQUEST", "invalid json");
+    return;
+  }
+  JsonObjectConst root = request.as<JsonObjectConst>();
+  const char* name = root["name"] | "";
+  if (!isValidRecipeName(name)) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", "invalid recipe name");
+    return;
+  }
+  JsonArrayConst cards;
+  String reason;
+  if (!extractConfigCardsFromRequest(root, cards, reason)) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", reason);
+    return;
+  }
+
+  int8_t slot = findRecipeSlotByName(name);
+  if (slot == kNoRecipe) {
+    for (uint8_t i = 0; i < AT_RECIPE_CAPACITY; ++i) {
+      if (!gRecipes[i].loaded) {
+        slot = static_cast<int8_t>(i);
+        break;
+      }
+    }
+  }
+  if (slot == kNoRecipe) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", "recipe capacity reached");
+    return;
+  }
+
+  static LogicCard compiled[TOTAL_CARDS];
+  if (!deserializeCardsFromArray(cards, compiled)) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", "failed to parse cards");
+    return;
+  }
+  char path[24];
+  formatRecipePath(path, sizeof(path), static_cast<uint8_t>(slot));
+  if (!saveCardsToPath(path, compiled, nullptr)) {
+    writeConfigErrorResponse(500, "COMMIT_FAILED", "failed to persist recipe");
+    return;
+  }
+
+  RecipeSlot& recipe = gRecipes[slot];
+  memcpy(recipe.cards, compiled, sizeof(recipe.cards));
+  strncpy(recipe.name, name, sizeof(recipe.name) - 1);
+  recipe.name[sizeof(recipe.name) - 1] = '\0';
+  hashFileFnv1a(path, recipe.cardsHash);
+  recipe.loaded = true;
+  if (!saveRecipeIndex()) {
+    writeConfigErrorResponse(500, "COMMIT_FAILED", "failed to persist recipe index");
+    return;
+  }
+
+  JsonDocument response;
+  response["ok"] = true;
+  response["name"] = recipe.name;
+  // Saving over the running recipe only updates its image; it takes effect on
+  // the next switch_recipe.
+  response["active"] = (slot == gActiveRecipeSlot);
+  response["error"] = nullptr;
+  String body;
+  serializeJson(response, body);
+  gPortalServer.send(200, "application/json", body);
+}
+
+void handleHttpDeleteRecipe() {
+  JsonDocument request;
+  DeserializationError parseError =
+      deserializeJson(request, gPortalServer.arg("plain"));
+  if (parseError || !request.is<JsonObjectConst>()) {
+    writeConfigErrorResponse(400, "INVALID_REQUEST", "invalid json");
+    return;
+  }
+  const int8_t slot = findRecipeSlotByName(request["name"] | "");
+  if (slot == kNoRecipe) {
+    writeConfigErrorResponse(404, "NOT_FOUND", "recipe not found");
+    return;
+  }
+  if (slot == gActiveRecipeSlot || gRecipeSwitchPending) {
+    writeConfigErrorResponse(409, "BUSY", "recipe is active or switching");
+    return;
+  }
+  char path[24];
+  formatRecipePath(path, sizeof(path), static_cast<uint8_t>(slot));
+  LittleFS.remove(path);
+  gRecipes[slot].loaded = false;
+  gRecipes[slot].name[0] = '\0';
+  saveRecipeIndex();
+  gPortalServer.send(200, "application/json", "{\"ok\":true,\"error\":null}");
+}
+
 void handleHttpCommitConfig() {
   JsonDocument sourceDoc;
   JsonArrayConst cards;
@@ -1180,7 +4097,7 @@ void handleHttpCommitConfig() {
     }
   }
 
-  if (!commitCards(cards, reason)) {
+  if (!commitCards(cards, Journal_Commit, 0, reason)) {
     writeConfigErrorResponse(500, "COMMIT_FAILED", reason);
     return;
   }
@@ -1207,23 +4124,42 @@ void handleHttpRestoreConfig() {
   }
 
   const char* source = request["source"] | "";
+  const char* configId = request["configId"] | "";
   const char* restorePath = nullptr;
-  if (strcmp(source, "LKG") == 0) restorePath = kLkgConfigPath;
-  if (strcmp(source, "SLOT1") == 0) restorePath = kSlot1ConfigPath;
-  if (strcmp(source, "SLOT2") == 0) restorePath = kSlot2ConfigPath;
-  if (strcmp(source, "SLOT3") == 0) restorePath = kSlot3ConfigPath;
+  int16_t historyIndex = -1;
+  bool historySource = false;
+  uint8_t journalSource = 5;  // see journalRestoreSource()
+  for (uint8_t depth = 1; depth <= 4; ++depth) {
+    if (strcmp(source, kHistoryDepthSources[depth - 1]) != 0) continue;
+    historySource = true;
+    historyIndex = static_cast<int16_t>(gConfigHistory.versionCount) - 1 - depth;
+    journalSource = depth - 1;
+  }
+  if (strcmp(source, "CONFIG_ID") == 0 && strlen(configId) == 8) {
+    historySource = true;
+    historyIndex = findConfigHistoryVersion(strtoul(configId, nullptr, 16));
+    journalSource = 4;
+  }
+  if (historySource) restorePath = kConfigHistoryRestorePath;
   if (strcmp(source, "FACTORY") == 0) restorePath = kFactoryConfigPath;
   if (restorePath == nullptr) {
     writeConfigErrorResponse(400, "VALIDATION_FAILED", "invalid restore source");
     return;
   }
-  if (!LittleFS.exists(restorePath)) {
+  if ((historySource && historyIndex < 0) ||
+      (!historySource && !LittleFS.exists(restorePath))) {
     writeConfigErrorResponse(404, "NOT_FOUND", "restore source not found");
     return;
   }
 
   JsonDocument doc;
-  if (!readJsonFromPath(restorePath, doc) || !doc.is<JsonArrayConst>()) {
+  const bool loaded =
+      (!historySource ||
+       materializeConfigHistoryVersion(static_cast<uint8_t>(historyIndex),
+                                       restorePath)) &&
+      readJsonFromPath(restorePath, doc);
+  if (historySource) LittleFS.remove(restorePath);
+  if (!loaded || !doc.is<JsonArrayConst>()) {
     writeConfigErrorResponse(500, "RESTORE_FAILED", "failed to load restore source");
     return;
   }
@@ -1233,7 +4169,7 @@ void handleHttpRestoreConfig() {
     writeConfigErrorResponse(500, "RESTORE_FAILED", reason);
     return;
   }
-  if (!commitCards(cards, reason)) {
+  if (!commitCards(cards, Journal_Restore, journalSource, reason)) {
     writeConfigErrorResponse(500, "RESTORE_FAILED", reason);
     return;
   }
@@ -1241,6 +4177,7 @@ void handleHttpRestoreConfig() {
   JsonDocument response;
   response["ok"] = true;
   response["restoredFrom"] = source;
+  if (strcmp(source, "CONFIG_ID") == 0) response["configId"] = configId;
   response["activeVersion"] = gActiveVersion;
   response["requiresRestart"] = false;
   response["error"] = nullptr;
@@ -1249,45 +4186,123 @@ void handleHttpRestoreConfig() {
   gPortalServer.send(200, "application/json", body);
 }
 
+void handleHttpGetConfigHistory() {
+  JsonDocument response;
+  response["ok"] = true;
+  response["activeVersion"] = gActiveVersion;
+  char hashText[9];
+  JsonArray versions = response["versions"].to<JsonArray>();
+  // Newest first, like the restore depth names.
+  for (int16_t i = gConfigHistory.versionCount - 1; i >= 0; --i) {
+    const ConfigHistoryVersion& version = gConfigHistory.versions[i];
+    JsonObject entry = versions.add<JsonObject>();
+    formatHash(hashText, sizeof(hashText), version.configId);
+    entry["configId"] = hashText;
+    if (version.parentId != 0) {
+      formatHash(hashText, sizeof(hashText), version.parentId);
+      entry["parentId"] = hashText;
+    } else {
+      entry["parentId"] = nullptr;
+    }
+    char versionText[16];
+    formatVersion(versionText, sizeof(versionText), version.number);
+    entry["version"] = versionText;
+    if (i > 0) {
+      const ConfigHistoryVersion& parent = gConfigHistory.versions[i - 1];
+      uint16_t changed = 0;
+      for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+        if (version.cardOffsets[id] != parent.cardOffsets[id]) changed += 1;
+      }
+      entry["changedCards"] = changed;
+    } else {
+      entry["changedCards"] = nullptr;
+    }
+  }
+  JsonObject storage = response["storage"].to<JsonObject>();
+  storage["ready"] = gConfigHistory.ready;
+  storage["packBytes"] = gConfigHistory.packBytes;
+  storage["blobs"] = gConfigHistory.blobCount;
+  storage["blobCapacity"] = AT_CONFIG_HISTORY_BLOBS;
+  storage["versionCapacity"] = AT_CONFIG_HISTORY_VERSIONS;
+  storage["appendedBlobs"] = gConfigHistory.appendedBlobs;
+  storage["reusedBlobs"] = gConfigHistory.reusedBlobs;
+  storage["compactions"] = gConfigHistory.compactions;
+  storage["lastCommitUs"] = gConfigHistory.lastCommitUs;
+  storage["maxCommitUs"] = gConfigHistory.maxCommitUs;
+  response["error"] = nullptr;
+  String body;
+  serializeJson(response, body);
+  gPortalServer.send(200, "application/json", body);
+}
+
 void initPortalServer() {
   if (gPortalServerInitialized) return;
   gPortalServer.on("/", HTTP_GET, handleHttpRoot);
   gPortalServer.on("/config", HTTP_GET, handleHttpConfigPage);
   gPortalServer.on("/settings", HTTP_GET, handleHttpSettingsPage);
   gPortalServer.on("/api/snapshot", HTTP_GET, handleHttpSnapshot);
+  gPortalServer.on("/api/diagnostics", HTTP_GET, handleHttpDiagnostics);
+  gPortalServer.on("/metrics", HTTP_GET, handleHttpMetrics);
   gPortalServer.on("/api/command", HTTP_POST, handleHttpCommand);
   gPortalServer.on("/api/config/active", HTTP_GET, handleHttpGetActiveConfig);
+  gPortalServer.on("/api/config/labels", HTTP_GET, handleHttpGetConfigLabels);
+  gPortalServer.on("/api/config/v2", HTTP_GET, handleHttpGetV2Config);
   gPortalServer.on("/api/config/staged/save", HTTP_POST,
                    handleHttpStagedSaveConfig);
   gPortalServer.on("/api/config/staged/validate", HTTP_POST,
                    handleHttpStagedValidateConfig);
+  gPortalServer.on("/api/config/staged/shadow", HTTP_POST,
+                   handleHttpShadowConfig);
   gPortalServer.on("/api/config/commit", HTTP_POST, handleHttpCommitConfig);
+  gPortalServer.on("/api/test/fast_forward", HTTP_POST, handleHttpFastForward);
+  gPortalServer.on("/api/test/fast_forward", HTTP_GET,
+                   handleHttpGetFastForward);
+  gPortalServer.on(UriBraces("/api/cards/{}/timing"), HTTP_GET,
+                   handleHttpGetCardTiming);
+  gPortalServer.on("/api/test/rewind/frame", HTTP_GET,
+                   handleHttpGetRewindFrame);
   gPortalServer.on("/api/config/restore", HTTP_POST, handleHttpRestoreConfig);
+  gPortalServer.on("/api/config/history", HTTP_GET, handleHttpGetConfigHistory);
+  gPortalServer.on("/api/recipes", HTTP_GET, handleHttpGetRecipes);
+  gPortalServer.on("/api/recipes/save", HTTP_POST, handleHttpSaveRecipe);
+  gPortalServer.on("/api/recipes/delete", HTTP_POST, handleHttpDeleteRecipe);
   gPortalServer.on("/api/settings", HTTP_GET, handleHttpGetSettings);
   gPortalServer.on("/api/settings/wifi", HTTP_POST, handleHttpSaveSettingsWiFi);
   gPortalServer.on("/api/settings/runtime", HTTP_POST,
                    handleHttpSaveSettingsRuntime);
+  gPortalServer.on("/api/settings/mqtt", HTTP_POST, handleHttpSaveSettingsMqtt);
+  gPortalServer.on("/api/settings/exchange", HTTP_POST,
+                   handleHttpSaveSettingsExchange);
+  gPortalServer.on("/api/settings/trend", HTTP_POST, handleHttpSaveSettingsTrend);
+  gPortalServer.on("/api/trend", HTTP_GET, handleHttpGetTrend);
+  gPortalServer.on("/api/journal", HTTP_GET, handleHttpGetJournal);
+  gPortalServer.on("/api/ota", HTTP_POST, handleHttpOtaDone, handleHttpOtaUpload);
   gPortalServer.on("/api/settings/reconnect", HTTP_POST, handleHttpReconnectWiFi);
   gPortalServer.on("/api/settings/reboot", HTTP_POST, handleHttpReboot);
   gPortalServer.on("/favicon.ico", HTTP_GET,
                    []() { gPortalServer.send(204, "text/plain", ""); });
+  const char* collectedHeaders[] = {"If-None-Match"};
+  gPortalServer.collectHeaders(collectedHeaders, 1);
   gPortalServer.begin();
   gPortalServerInitialized = true;
-  Serial.println("Portal HTTP server started on :80");
+  gConsole.println("Portal HTTP server started on :80");
 }
 
-void handlePortalServerLoop() { gPortalServer.handleClient(); }
+void handlePortalServerLoop() {
+  setCommandOrigin(Origin_Http, 0);
+  gPortalServer.handleClient();
+}
 
 void handleWebSocketEvent(uint8_t clientNum, WStype_t type, uint8_t* payload,
                           size_t length) {
   if (type == WStype_CONNECTED) {
     IPAddress ip = gWsServer.remoteIP(clientNum);
-    Serial.printf("WS client connected #%u from %u.%u.%u.%u\n", clientNum, ip[0],
+    gConsole.printf("WS client connected #%u from %u.%u.%u.%u\n", clientNum, ip[0],
                   ip[1], ip[2], ip[3]);
     return;
   }
   if (type == WStype_DISCONNECTED) {
-    Serial.printf("WS client disconnected #%u\n", clientNum);
+    gConsole.printf("WS client disconnected #%u\n", clientNum);
     return;
   }
   if (type != WStype_TEXT) return;
@@ -1312,6 +4327,7 @@ void handleWebSocketEvent(uint8_t clientNum, WStype_t type, uint8_t* payload,
   }
 
   const char* requestId = root["requestId"] | "";
+  setCommandOrigin(Origin_WebSocket, clientNum);
   bool ok = applyCommand(root);
 
   JsonDocument result;
@@ -1325,42 +4341,2941 @@ void handleWebSocketEvent(uint8_t clientNum, WStype_t type, uint8_t* payload,
   } else {
     result["error"] = nullptr;
   }
-  String body;
-  serializeJson(result, body);
-  gWsServer.sendTXT(clientNum, body);
+  String body;
+  serializeJson(result, body);
+  gWsServer.sendTXT(clientNum, body);
+}
+
+void initWebSocketServer() {
+  if (gWsServerInitialized) return;
+  gWsServer.begin();
+  gWsServer.onEvent(handleWebSocketEvent);
+  gWsServerInitialized = true;
+  gConsole.println("WebSocket server started on :81");
+}
+
+void handleWebSocketLoop() { gWsServer.loop(); }
+
+void publishRuntimeSnapshotWebSocket() {
+  static uint32_t lastPublishMs = 0;
+  static uint32_t lastSeq = 0;
+  static uint32_t lastChangeSeq = 0;
+  static uint32_t lastPayloadBytes = 0;
+
+  uint32_t seq = 0;
+  uint32_t changeSeq = 0;
+  readSharedSnapshotSeqs(seq, changeSeq);
+  uint32_t nowMs = millis();
+
+  // Scans that produced nothing publishable (e.g. AI noise inside its
+  // deadband) no longer trigger a frame; count them as saved bandwidth.
+  bool hasUpdate = (changeSeq != lastChangeSeq);
+  if (!hasUpdate && seq != lastSeq) {
+    gWsSnapshotsSuppressed += 1;
+    gWsSnapshotBytesSaved += lastPayloadBytes;
+    lastSeq = seq;
+  }
+  bool dueHeartbeat = (nowMs - lastPublishMs) >= 1000;
+  if (!hasUpdate && !dueHeartbeat) return;
+  if ((nowMs - lastPublishMs) < 200 && hasUpdate) return;
+
+  const uint32_t buildStartUs = micros();
+  JsonDocument doc;
+  serializeRuntimeSnapshot(doc, nowMs);
+  String payload;
+  serializeJson(doc, payload);
+  gWsSnapshotLastBuildUs = micros() - buildStartUs;
+  if (gWsSnapshotLastBuildUs > gWsSnapshotMaxBuildUs) {
+    gWsSnapshotMaxBuildUs = gWsSnapshotLastBuildUs;
+  }
+  gWsSnapshotLastBytes = payload.length();
+  gWsServer.broadcastTXT(payload);
+  gWsSnapshotsPublished += 1;
+  gWsFramesSent += 1;
+  gWsBytesSent += payload.length();
+
+  lastPublishMs = nowMs;
+  lastSeq = seq;
+  lastChangeSeq = changeSeq;
+  lastPayloadBytes = payload.length();
+}
+
+// ---------------------------------------------------------------------------
+// Modbus TCP server (Core1). Register map, all addresses zero-based:
+//   Coils            [cardId]           logicalState (read-only)
+//   Discrete inputs  [cardId]           physicalState
+//   Input registers  [cardId * 8 + n]   0 state, 1 repeatCounter (saturated),
+//                                       2-3 currentValue, 4-5 startOnMs,
+//                                       6-7 startOffMs (32-bit values hi word
+//                                       first)
+//   Holding regs     [cardId * 4 + n]   0 inputSource, 1-2 forcedAIValue,
+//                                       3 outputMaskLocal
+//                    [TOTAL_CARDS * 4]  global output mask
+// Reads are encoded straight from gSharedSnapshot under gSnapshotMux, so every
+// response reflects one published revision. Writes become kernel commands.
+// Modbus has no authentication and the map includes writable forces and
+// masks, so the server is opt-in per build.
+// ---------------------------------------------------------------------------
+#ifndef AT_ENABLE_MODBUS_TCP
+#define AT_ENABLE_MODBUS_TCP 0
+#endif
+#ifndef AT_MODBUS_PORT
+#define AT_MODBUS_PORT 502
+#endif
+#ifndef AT_MODBUS_MAX_CLIENTS
+#define AT_MODBUS_MAX_CLIENTS 2
+#endif
+
+const uint16_t kModbusHoldingGlobalMask = TOTAL_CARDS * kModbusHoldingRegsPerCard;
+// A write is applied all or nothing, so it may not need more commands than the
+// kernel queue holds; with the default depth that is eight whole cards.
+const uint16_t kModbusMaxWriteCommands = AT_KERNEL_QUEUE_DEPTH;
+
+struct ModbusSession {
+  WiFiClient client;
+  uint8_t rx[kModbusMaxFrame];
+  uint16_t rxLen;
+};
+
+struct ModbusCounters {
+  uint32_t requests;
+  uint32_t exceptions;
+  uint32_t writes;
+  uint32_t lastServiceUs;
+  uint32_t maxServiceUs;
+};
+
+WiFiServer gModbusServer(AT_MODBUS_PORT);
+ModbusSession gModbusSessions[AT_MODBUS_MAX_CLIENTS];
+ModbusCounters gModbusCounters = {};
+bool gModbusServerInitialized = false;
+
+void initModbusServer() {
+  if (gModbusServerInitialized) return;
+  gModbusServer.begin();
+  gModbusServer.setNoDelay(true);
+  gModbusServerInitialized = true;
+  gConsole.print("Modbus TCP server started on :");
+  gConsole.println(AT_MODBUS_PORT);
+}
+
+uint16_t modbusInputRegister(const SharedRuntimeSnapshot& snapshot,
+                             uint16_t address) {
+  const LogicCard& card = snapshot.cards[address / kModbusInputRegsPerCard];
+  switch (address % kModbusInputRegsPerCard) {
+    case 0:
+      return static_cast<uint16_t>(card.state);
+    case 1:
+      return (card.repeatCounter > 0xFFFF)
+                 ? 0xFFFF
+                 : static_cast<uint16_t>(card.repeatCounter);
+    case 2:
+      return static_cast<uint16_t>(card.currentValue >> 16);
+    case 3:
+      return static_cast<uint16_t>(card.currentValue & 0xFFFF);
+    case 4:
+      return static_cast<uint16_t>(card.startOnMs >> 16);
+    case 5:
+      return static_cast<uint16_t>(card.startOnMs & 0xFFFF);
+    case 6:
+      return static_cast<uint16_t>(card.startOffMs >> 16);
+    default:
+      return static_cast<uint16_t>(card.startOffMs & 0xFFFF);
+  }
+}
+
+uint16_t modbusHoldingRegister(const SharedRuntimeSnapshot& snapshot,
+                               uint16_t address) {
+  if (address == kModbusHoldingGlobalMask) {
+    return snapshot.globalOutputMask ? 1 : 0;
+  }
+  const uint16_t cardId = address / kModbusHoldingRegsPerCard;
+  switch (address % kModbusHoldingRegsPerCard) {
+    case 0:
+      return static_cast<uint16_t>(snapshot.inputSource[cardId]);
+    case 1:
+      return static_cast<uint16_t>(snapshot.forcedAIValue[cardId] >> 16);
+    case 2:
+      return static_cast<uint16_t>(snapshot.forcedAIValue[cardId] & 0xFFFF);
+    default:
+      return snapshot.outputMaskLocal[cardId] ? 1 : 0;
+  }
+}
+
+// Encodes a validated read range straight from the published snapshot.
+void encodeModbusRead(uint8_t function, uint16_t start, uint16_t quantity,
+                      uint8_t* data) {
+  portENTER_CRITICAL(&gSnapshotMux);
+  const SharedRuntimeSnapshot& snapshot = gSharedSnapshot;
+  if (function == 0x01 || function == 0x02) {
+    for (uint16_t i = 0; i < quantity; ++i) {
+      const LogicCard& card = snapshot.cards[start + i];
+      const bool bit =
+          (function == 0x01) ? card.logicalState : card.physicalState;
+      if (bit) data[i / 8] |= static_cast<uint8_t>(1U << (i % 8));
+    }
+  } else {
+    for (uint16_t i = 0; i < quantity; ++i) {
+      const uint16_t value =
+          (function == 0x04) ? modbusInputRegister(snapshot, start + i)
+                             : modbusHoldingRegister(snapshot, start + i);
+      writeBe16(data + i * 2, value);
+    }
+  }
+  portEXIT_CRITICAL(&gSnapshotMux);
+}
+
+// Turns a holding-register write into kernel commands. Registers of one card
+// not covered by the write keep their published values. The whole range is
+// validated and the queue space checked before anything is enqueued, so an
+// exception response always means nothing was applied. A write that could
+// never fit the queue is a bad value, not a busy device.
+uint8_t applyModbusHoldingWrite(uint16_t start, uint16_t quantity,
+                                const uint8_t* values) {
+  if (static_cast<uint32_t>(start) + quantity > kModbusHoldingGlobalMask + 1U) {
+    return kModbusExIllegalAddress;
+  }
+  if (modbusHoldingWriteCommands(start, quantity, kModbusHoldingGlobalMask) >
+      kModbusMaxWriteCommands) {
+    return kModbusExIllegalValue;
+  }
+  static KernelCommand commands[kModbusMaxWriteCommands];
+  uint16_t commandCount = 0;
+  uint16_t address = start;
+  const uint16_t end = start + quantity;
+  while (address < end) {
+    KernelCommand command = {};
+    if (address == kModbusHoldingGlobalMask) {
+      const uint16_t value = readBe16(values + (address - start) * 2);
+      if (value > 1) return kModbusExIllegalValue;
+      command.type = KernelCmd_SetOutputMaskGlobal;
+      command.flag = (value != 0);
+      commands[commandCount++] = command;
+      address += 1;
+      continue;
+    }
+
+    const uint16_t cardId = address / kModbusHoldingRegsPerCard;
+    const uint16_t base = cardId * kModbusHoldingRegsPerCard;
+    uint16_t regs[kModbusHoldingRegsPerCard];
+    bool written[kModbusHoldingRegsPerCard] = {};
+    portENTER_CRITICAL(&gSnapshotMux);
+    for (uint16_t n = 0; n < kModbusHoldingRegsPerCard; ++n) {
+      regs[n] = modbusHoldingRegister(gSharedSnapshot, base + n);
+    }
+    portEXIT_CRITICAL(&gSnapshotMux);
+    for (; address < end && address < base + kModbusHoldingRegsPerCard;
+         ++address) {
+      regs[address - base] = readBe16(values + (address - start) * 2);
+      written[address - base] = true;
+    }
+
+    if (written[0] || written[1] || written[2]) {
+      if (!isInputCard(cardId)) return kModbusExIllegalAddress;
+      // Writing only the value words of an AI card forces that value.
+      if (!written[0] && isAnalogInputCard(cardId)) {
+        regs[0] = InputSource_ForcedValue;
+      }
+      const bool analog = isAnalogInputCard(cardId);
+      if (regs[0] >= InputSource_Stimulus ||
+          (analog && (regs[0] == InputSource_ForcedHigh ||
+                      regs[0] == InputSource_ForcedLow)) ||
+          (!analog && regs[0] == InputSource_ForcedValue)) {
+        return kModbusExIllegalValue;
+      }
+      command.type = KernelCmd_SetInputForce;
+      command.cardId = cardId;
+      command.inputMode = static_cast<inputSourceMode>(regs[0]);
+      command.value = (static_cast<uint32_t>(regs[1]) << 16) | regs[2];
+      commands[commandCount++] = command;
+    }
+    if (written[3]) {
+      if (!isDigitalOutputCard(cardId)) return kModbusExIllegalAddress;
+      if (regs[3] > 1) return kModbusExIllegalValue;
+      command = {};
+      command.type = KernelCmd_SetOutputMask;
+      command.cardId = cardId;
+      command.flag = (regs[3] != 0);
+      commands[commandCount++] = command;
+    }
+  }
+  // All producers run on Core1 and the kernel only drains, so the space seen
+  // here cannot shrink before the loop below.
+  if (gKernelCommandQueue == nullptr ||
+      uxQueueSpacesAvailable(gKernelCommandQueue) < commandCount) {
+    return kModbusExDeviceBusy;
+  }
+  for (uint16_t i = 0; i < commandCount; ++i) {
+    if (!enqueueKernelCommand(commands[i])) return kModbusExDeviceFailure;
+  }
+  gModbusCounters.writes += 1;
+  return 0;
+}
+
+// Register map behind serviceModbusAdu (modbus_tcp.h).
+struct ModbusCardMap {
+  uint32_t addressCount(uint8_t function) const {
+    if (function == 0x01 || function == 0x02) return TOTAL_CARDS;
+    return (function == 0x04) ? TOTAL_CARDS * kModbusInputRegsPerCard
+                              : kModbusHoldingGlobalMask + 1U;
+  }
+  void read(uint8_t function, uint16_t start, uint16_t quantity,
+            uint8_t* data) {
+    encodeModbusRead(function, start, quantity, data);
+  }
+  uint8_t writeHolding(uint16_t start, uint16_t quantity,
+                       const uint8_t* values) {
+    return applyModbusHoldingWrite(start, quantity, values);
+  }
+};
+
+// Handles one complete ADU in session.rx and writes the response.
+void serviceModbusFrame(ModbusSession& session, uint16_t frameLen) {
+  static uint8_t tx[kModbusMaxFrame];
+  ModbusCardMap map;
+  setCommandOrigin(Origin_Modbus, session.client.remoteIP()[3]);
+  const uint16_t txLen = serviceModbusAdu(map, session.rx, frameLen, tx);
+  if ((tx[7] & 0x80) != 0) gModbusCounters.exceptions += 1;
+  session.client.write(tx, txLen);
+  gModbusCounters.requests += 1;
+}
+
+void handleModbusLoop() {
+  if (!gModbusServerInitialized) return;
+  WiFiClient incoming = gModbusServer.accept();
+  if (incoming) {
+    bool placed = false;
+    for (uint8_t i = 0; i < AT_MODBUS_MAX_CLIENTS && !placed; ++i) {
+      if (gModbusSessions[i].client.connected()) continue;
+      gModbusSessions[i].client = incoming;
+      gModbusSessions[i].client.setNoDelay(true);
+      gModbusSessions[i].rxLen = 0;
+      placed = true;
+    }
+    if (!placed) incoming.stop();
+  }
+
+  for (uint8_t i = 0; i < AT_MODBUS_MAX_CLIENTS; ++i) {
+    ModbusSession& session = gModbusSessions[i];
+    if (!session.client.connected()) continue;
+    int available = session.client.available();
+    while (available > 0) {
+      const int room = kModbusMaxFrame - session.rxLen;
+      const int chunk = session.client.read(session.rx + session.rxLen,
+                                            (available < room) ? available : room);
+      if (chunk <= 0) break;
+      session.rxLen += chunk;
+      available -= chunk;
+
+      while (session.rxLen > 0) {
+        const int frameLen = modbusFrameLength(session.rx, session.rxLen);
+        if (frameLen < 0) {
+          // Not Modbus TCP; drop the connection rather than resync.
+          session.client.stop();
+          session.rxLen = 0;
+          break;
+        }
+        if (frameLen == 0) break;
+        const uint32_t startUs = micros();
+        serviceModbusFrame(session, frameLen);
+        const uint32_t elapsedUs = micros() - startUs;
+        gModbusCounters.lastServiceUs = elapsedUs;
+        if (elapsedUs > gModbusCounters.maxServiceUs) {
+          gModbusCounters.maxServiceUs = elapsedUs;
+        }
+        memmove(session.rx, session.rx + frameLen, session.rxLen - frameLen);
+        session.rxLen -= frameLen;
+      }
+      if (!session.client.connected()) break;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// MQTT publisher (Core1, optional). Enabled when a broker host is configured.
+// Topics below <root> (default "advancedtimer/<chip id>"):
+//   <root>/delta       cards changed since the last message, one per revision
+//   <root>/keyframe    every card, every AT_MQTT_KEYFRAME_MS and on connect
+//   <root>/status      retained "online"/"offline" (last will)
+//   <root>/cmd         command envelopes fed to applyCommand
+//   <root>/cmd/result  command results
+// Card entries are compact arrays [id, state, logicalState, physicalState,
+// value]; state is the numeric cardState and AI values honour the reporting
+// deadband. Messages are built in one fixed buffer and split when full, so
+// outbound memory is bounded by AT_MQTT_BUFFER_BYTES.
+// ---------------------------------------------------------------------------
+#ifndef AT_ENABLE_MQTT
+#define AT_ENABLE_MQTT 1
+#endif
+#ifndef AT_MQTT_BUFFER_BYTES
+#define AT_MQTT_BUFFER_BYTES 1024
+#endif
+#ifndef AT_MQTT_KEYFRAME_MS
+#define AT_MQTT_KEYFRAME_MS 30000UL
+#endif
+// A connect attempt blocks the portal task for at most kMqttConnectTimeoutMs
+// (TCP) plus kMqttSocketTimeoutS (CONNACK); failures back off from
+// kMqttRetryMs to kMqttRetryMaxMs so an unreachable broker costs little.
+const uint32_t kMqttRetryMs = 5000;
+const uint32_t kMqttRetryMaxMs = 120000;
+const int32_t kMqttConnectTimeoutMs = 300;
+const uint16_t kMqttSocketTimeoutS = 1;
+const size_t kMqttEntryMaxBytes = 40;
+const size_t kMqttTopicBytes = 96;
+// Fits a result echoing a requestId of about 70 characters; longer ones get
+// the fixed oversize result (mqtt_result.h).
+const size_t kMqttResultBytes = 160;
+
+struct MqttCardImage {
+  uint8_t state;
+  bool logicalState;
+  bool physicalState;
+  uint32_t value;
+};
+
+struct MqttPublisher {
+  char buffer[AT_MQTT_BUFFER_BYTES];
+  size_t length;
+  uint16_t entries;
+  const char* topicSuffix;
+  uint32_t seq;
+  uint32_t tsMs;
+  MqttCardImage last[TOTAL_CARDS];
+  // Entries of the message being built; copied into last only once the
+  // broker accepted it, so a failed publish is resent on the next pass.
+  MqttCardImage staged[TOTAL_CARDS];
+  uint16_t stagedIds[TOTAL_CARDS];
+  bool batchFailed;
+  bool primed;
+  uint32_t lastChangeSeq;
+  uint32_t lastKeyframeMs;
+  uint32_t lastConnectAttemptMs;
+  uint32_t retryMs;
+  uint32_t messages;
+  uint64_t bytes;
+  uint32_t failures;
+  uint32_t commands;
+  uint32_t oversizeResults;
+  uint32_t connects;
+};
+
+WiFiClient gMqttNet;
+PubSubClient gMqtt(gMqttNet);
+MqttPublisher gMqttPublisher = {};
+
+const char* mqttTopicRoot() {
+  static char defaultRoot[40] = {};
+  if (gMqttTopicRoot[0] != '\0') return gMqttTopicRoot;
+  if (defaultRoot[0] == '\0') {
+    snprintf(defaultRoot, sizeof(defaultRoot), "advancedtimer/%012llx",
+             static_cast<unsigned long long>(ESP.getEfuseMac()));
+  }
+  return defaultRoot;
+}
+
+void mqttTopic(char* out, const char* suffix) {
+  snprintf(out, kMqttTopicBytes, "%s/%s", mqttTopicRoot(), suffix);
+}
+
+void handleMqttMessage(char* topic, uint8_t* payload, unsigned int length) {
+  char cmdTopic[kMqttTopicBytes];
+  mqttTopic(cmdTopic, "cmd");
+  if (strcmp(topic, cmdTopic) != 0) return;
+  setCommandOrigin(Origin_Mqtt, 0);
+
+  // Parse and format before publishing: the client reuses its buffer for
+  // the reply.
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(
+      doc, reinterpret_cast<const char*>(payload), length);
+  char body[kMqttResultBytes];
+  size_t bodyLength = 0;
+  bool ok = false;
+  if (error || !doc.is<JsonObject>()) {
+    bodyLength = formatCommandResult(body, sizeof(body), nullptr,
+                                     "INVALID_REQUEST");
+  } else {
+    JsonObjectConst root = doc.as<JsonObjectConst>();
+    ok = applyCommand(root);
+    bodyLength = formatCommandResult(body, sizeof(body),
+                                     root["requestId"] | "",
+                                     ok ? nullptr : "COMMAND_REJECTED");
+  }
+  if (bodyLength == 0) {
+    bodyLength = formatOversizeCommandResult(body, sizeof(body), ok);
+    gMqttPublisher.oversizeResults += 1;
+  }
+  gMqttPublisher.commands += 1;
+
+  char resultTopic[kMqttTopicBytes];
+  mqttTopic(resultTopic, "cmd/result");
+  if (!gMqtt.publish(resultTopic, reinterpret_cast<const uint8_t*>(body),
+                     bodyLength, false)) {
+    gMqttPublisher.failures += 1;
+  }
+}
+
+void beginMqttMessage(MqttPublisher& pub) {
+  pub.entries = 0;
+  pub.length = snprintf(pub.buffer, sizeof(pub.buffer),
+                        "{\"seq\":%lu,\"tsMs\":%lu,\"cards\":[",
+                        static_cast<unsigned long>(pub.seq),
+                        static_cast<unsigned long>(pub.tsMs));
+}
+
+void flushMqttMessage(MqttPublisher& pub) {
+  pub.length += snprintf(pub.buffer + pub.length,
+                         sizeof(pub.buffer) - pub.length, "]}");
+  char topic[kMqttTopicBytes];
+  mqttTopic(topic, pub.topicSuffix);
+  if (gMqtt.publish(topic, reinterpret_cast<const uint8_t*>(pub.buffer),
+                    pub.length, false)) {
+    pub.messages += 1;
+    pub.bytes += pub.length;
+    for (uint16_t i = 0; i < pub.entries; ++i) {
+      pub.last[pub.stagedIds[i]] = pub.staged[pub.stagedIds[i]];
+    }
+  } else {
+    pub.failures += 1;
+    pub.batchFailed = true;
+  }
+}
+
+void appendMqttCard(MqttPublisher& pub, uint16_t id,
+                    const MqttCardImage& image) {
+  if (pub.length + kMqttEntryMaxBytes + 2 > sizeof(pub.buffer)) {
+    flushMqttMessage(pub);
+    beginMqttMessage(pub);
+  }
+  pub.length += snprintf(pub.buffer + pub.length,
+                         sizeof(pub.buffer) - pub.length, "%s[%u,%u,%u,%u,%lu]",
+                         (pub.entries > 0) ? "," : "", id, image.state,
+                         image.logicalState ? 1U : 0U,
+                         image.physicalState ? 1U : 0U,
+                         static_cast<unsigned long>(image.value));
+  pub.staged[id] = image;
+  pub.stagedIds[pub.entries] = id;
+  pub.entries += 1;
+}
+
+MqttCardImage mqttCardImage(const SharedRuntimeSnapshot& snapshot,
+                            uint16_t id) {
+  const LogicCard& card = snapshot.cards[id];
+  MqttCardImage image = {};
+  image.state = static_cast<uint8_t>(card.state);
+  image.logicalState = card.logicalState;
+  image.physicalState = card.physicalState;
+  image.value = isAnalogInputCard(id)
+                    ? snapshot.aiReportedValue[id - AI_START]
+                    : card.currentValue;
+  return image;
+}
+
+bool connectMqtt() {
+  char clientId[40];
+  snprintf(clientId, sizeof(clientId), "advancedtimer-%012llx",
+           static_cast<unsigned long long>(ESP.getEfuseMac()));
+  char statusTopic[kMqttTopicBytes];
+  mqttTopic(statusTopic, "status");
+  // Open the TCP socket with a bounded timeout; PubSubClient then reuses the
+  // connected client instead of its own unbounded connect.
+  IPAddress brokerIp;
+  if (!brokerIp.fromString(gMqttHost) &&
+      WiFi.hostByName(gMqttHost, brokerIp) != 1) {
+    return false;
+  }
+  if (!gMqttNet.connect(brokerIp, gMqttPort, kMqttConnectTimeoutMs)) {
+    return false;
+  }
+  gMqtt.setServer(brokerIp, gMqttPort);
+  gMqtt.setSocketTimeout(kMqttSocketTimeoutS);
+  gMqtt.setBufferSize(AT_MQTT_BUFFER_BYTES + kMqttTopicBytes + 8);
+  gMqtt.setCallback(handleMqttMessage);
+  if (!gMqtt.connect(clientId, statusTopic, 0, true, "offline")) {
+    gMqttNet.stop();
+    return false;
+  }
+  gMqtt.publish(statusTopic, "online", true);
+  char cmdTopic[kMqttTopicBytes];
+  mqttTopic(cmdTopic, "cmd");
+  gMqtt.subscribe(cmdTopic);
+  gMqttPublisher.primed = false;  // resend a keyframe on every (re)connect
+  gMqttPublisher.connects += 1;
+  return true;
+}
+
+// Publishes at most one batch per loop: a keyframe when due, otherwise a
+// delta when the published changeSeq moved.
+void publishMqttUpdates(uint32_t nowMs) {
+  MqttPublisher& pub = gMqttPublisher;
+  uint32_t seq = 0;
+  uint32_t changeSeq = 0;
+  readSharedSnapshotSeqs(seq, changeSeq);
+  const bool keyframe =
+      !pub.primed || (nowMs - pub.lastKeyframeMs) >= AT_MQTT_KEYFRAME_MS;
+  if (!keyframe && changeSeq == pub.lastChangeSeq) return;
+
+  SharedRuntimeSnapshot& snapshot = gPortalSnapshot;
+  copySharedRuntimeSnapshot(snapshot);
+  pub.topicSuffix = keyframe ? "keyframe" : "delta";
+  pub.seq = snapshot.changeSeq;
+  pub.tsMs = snapshot.tsMs;
+  pub.batchFailed = false;
+  beginMqttMessage(pub);
+  for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+    const MqttCardImage image = mqttCardImage(snapshot, id);
+    const MqttCardImage& last = pub.last[id];
+    if (keyframe || image.state != last.state ||
+        image.logicalState != last.logicalState ||
+        image.physicalState != last.physicalState ||
+        image.value != last.value) {
+      appendMqttCard(pub, id, image);
+    }
+  }
+  flushMqttMessage(pub);
+  // A failed message leaves its cards unsent in last; retry next pass.
+  if (pub.batchFailed) return;
+  pub.lastChangeSeq = snapshot.changeSeq;
+  if (keyframe) {
+    pub.lastKeyframeMs = nowMs;
+    pub.primed = true;
+  }
+}
+
+void handleMqttLoop() {
+  if (gMqttReconfigureRequested) {
+    gMqttReconfigureRequested = false;
+    if (gMqtt.connected()) gMqtt.disconnect();
+    gMqttPublisher.lastConnectAttemptMs = 0;
+    gMqttPublisher.retryMs = kMqttRetryMs;
+  }
+  if (gMqttHost[0] == '\0') return;
+  const uint32_t nowMs = millis();
+  if (!gMqtt.connected()) {
+    MqttPublisher& pub = gMqttPublisher;
+    if (pub.retryMs == 0) pub.retryMs = kMqttRetryMs;
+    if (pub.lastConnectAttemptMs != 0 &&
+        (nowMs - pub.lastConnectAttemptMs) < pub.retryMs) {
+      return;
+    }
+    const bool connected = connectMqtt();
+    // Stamped after the attempt so its own blocking time is not counted as
+    // part of the wait.
+    pub.lastConnectAttemptMs = millis();
+    if (!connected) {
+      pub.retryMs = (pub.retryMs >= kMqttRetryMaxMs / 2) ? kMqttRetryMaxMs
+                                                         : pub.retryMs * 2;
+      return;
+    }
+    pub.retryMs = kMqttRetryMs;
+  }
+  gMqtt.loop();
+  publishMqttUpdates(nowMs);
+}
+
+// ---------------------------------------------------------------------------
+// Serial link (Core1, offline only). COBS-framed binary protocol on Serial,
+// active while WiFi is down. Each frame is 0x00 COBS(type, body, crc16) 0x00,
+// with CRC-16/CCITT-FALSE over type+body, little-endian. The leading
+// delimiter lets a host discard any text printed between frames.
+//   Device -> host
+//     0x01 revision    u32 changeSeq, u32 tsMs, u8 runMode, u8 flags
+//                      (bit0 test mode, bit1 global mask, bit2 paused),
+//                      u8 keyframe, then cards: u16 id, u8 state,
+//                      u8 bits (logical, physical, trigger), u32 value
+//     0x02 event       u32 seq, u32 ageUs, u16 cardId, u8 state, u8 bits
+//                      (logical, physical, resetOverride)
+//     0x03 diagnostics u32 scans, u32 overruns, u32 lastScanUs,
+//                      u32 maxLatenessMs, u32 commands, u32 heapMinFree,
+//                      u32 framesDropped
+//     0x04 result      u16 tag, u8 ok
+//     0x05 hello       u8 protocol version, u16 totalCards
+//   Host -> device
+//     0x81 command     u16 tag, JSON command envelope (same as WebSocket)
+//     0x82 hello       no body; answered with 0x05
+// Writes never wait: a frame that does not fit the UART TX buffer is dropped
+// and counted.
+// ---------------------------------------------------------------------------
+#ifndef AT_ENABLE_SERIAL_LINK
+#define AT_ENABLE_SERIAL_LINK 1
+#endif
+#ifndef AT_SERIAL_LINK_BAUD
+#define AT_SERIAL_LINK_BAUD 921600UL
+#endif
+#ifndef AT_SERIAL_LINK_RX_BUFFER
+#define AT_SERIAL_LINK_RX_BUFFER 1024
+#endif
+#ifndef AT_SERIAL_LINK_TX_BUFFER
+#define AT_SERIAL_LINK_TX_BUFFER 4096
+#endif
+const uint32_t kSerialConsoleBaud = 115200;
+const uint8_t kSerialLinkVersion = 1;
+const uint16_t kSerialLinkMaxPayload = 384;
+const uint16_t kSerialLinkCardsPerFrame = 32;
+const uint32_t kSerialLinkKeyframeMs = 5000;
+const uint32_t kSerialLinkDiagnosticsMs = 1000;
+const uint32_t kSerialLinkMinRevisionMs = 50;
+
+enum serialFrameType : uint8_t {
+  SerialFrame_Revision = 0x01,
+  SerialFrame_Event = 0x02,
+  SerialFrame_Diagnostics = 0x03,
+  SerialFrame_Result = 0x04,
+  SerialFrame_Hello = 0x05,
+  SerialFrame_Command = 0x81,
+  SerialFrame_HelloRequest = 0x82
+};
+
+struct SerialLinkCardImage {
+  uint8_t state;
+  uint8_t bits;
+  uint32_t value;
+};
+
+struct SerialLink {
+  bool active;
+  uint8_t rx[kSerialLinkMaxPayload + 8];
+  SerialFrameReader reader;
+  SerialLinkCardImage last[TOTAL_CARDS];
+  bool primed;
+  uint32_t lastChangeSeq;
+  uint32_t lastRevisionMs;
+  uint32_t lastKeyframeMs;
+  uint32_t lastDiagnosticsMs;
+  uint32_t framesSent;
+  uint32_t framesDropped;
+  uint32_t framesRejected;
+};
+SerialLink gSerialLink = {};
+
+bool sendSerialFrame(uint8_t type, const uint8_t* body, size_t length) {
+  static uint8_t raw[kSerialLinkMaxPayload + 3];
+  static uint8_t encoded[serialFrameBytes(kSerialLinkMaxPayload)];
+  if (length > kSerialLinkMaxPayload) return false;
+  const size_t encodedLength = encodeSerialFrame(type, body, length, raw, encoded);
+  if (Serial.availableForWrite() < static_cast<int>(encodedLength)) {
+    gSerialLink.framesDropped += 1;
+    return false;
+  }
+  Serial.write(encoded, encodedLength);
+  gSerialLink.framesSent += 1;
+  return true;
+}
+
+void putLe16(uint8_t* p, uint16_t value) {
+  p[0] = static_cast<uint8_t>(value & 0xFF);
+  p[1] = static_cast<uint8_t>(value >> 8);
+}
+
+void putLe32(uint8_t* p, uint32_t value) {
+  for (uint8_t i = 0; i < 4; ++i) p[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+void sendSerialHello() {
+  uint8_t body[3];
+  body[0] = kSerialLinkVersion;
+  putLe16(body + 1, TOTAL_CARDS);
+  sendSerialFrame(SerialFrame_Hello, body, sizeof(body));
+}
+
+// frame is type + body, CRC already checked.
+void handleSerialFrame(const uint8_t* frame, size_t length) {
+  const uint8_t type = frame[0];
+  const uint8_t* body = frame + 1;
+  const size_t bodyLength = length - 1;
+  if (type == SerialFrame_HelloRequest) {
+    sendSerialHello();
+    return;
+  }
+  if (type != SerialFrame_Command || bodyLength < 2) {
+    gSerialLink.framesRejected += 1;
+    return;
+  }
+  setCommandOrigin(Origin_Serial, 0);
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(
+      doc, reinterpret_cast<const char*>(body + 2), bodyLength - 2);
+  const bool ok = !error && doc.is<JsonObject>() &&
+                  applyCommand(doc.as<JsonObjectConst>());
+  uint8_t result[3];
+  memcpy(result, body, 2);
+  result[2] = ok ? 1 : 0;
+  sendSerialFrame(SerialFrame_Result, result, sizeof(result));
+}
+
+void receiveSerialFrames() {
+  int available = Serial.available();
+  while (available-- > 0) {
+    const int value = Serial.read();
+    if (value < 0) break;
+    static uint8_t frame[sizeof(SerialLink::rx)];
+    size_t length = 0;
+    switch (feedSerialFrameByte(gSerialLink.reader, static_cast<uint8_t>(value),
+                                frame, length)) {
+      case SerialRead_Frame:
+        handleSerialFrame(frame, length);
+        break;
+      case SerialRead_Rejected:
+        gSerialLink.framesRejected += 1;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void sendSerialRevision(uint32_t nowMs) {
+  uint32_t seq = 0;
+  uint32_t changeSeq = 0;
+  readSharedSnapshotSeqs(seq, changeSeq);
+  const bool keyframe = !gSerialLink.primed ||
+                        (nowMs - gSerialLink.lastKeyframeMs) >= kSerialLinkKeyframeMs;
+  if (!keyframe && changeSeq == gSerialLink.lastChangeSeq) return;
+  if (!keyframe && (nowMs - gSerialLink.lastRevisionMs) < kSerialLinkMinRevisionMs) {
+    return;
+  }
+
+  SharedRuntimeSnapshot& snapshot = gPortalSnapshot;
+  copySharedRuntimeSnapshot(snapshot);
+  static uint8_t body[kSerialLinkMaxPayload];
+  putLe32(body, snapshot.changeSeq);
+  putLe32(body + 4, snapshot.tsMs);
+  body[8] = static_cast<uint8_t>(snapshot.mode);
+  body[9] = static_cast<uint8_t>((snapshot.testModeActive ? 0x01 : 0) |
+                                 (snapshot.globalOutputMask ? 0x02 : 0) |
+                                 (snapshot.breakpointPaused ? 0x04 : 0));
+  body[10] = keyframe ? 1 : 0;
+  const size_t headerLength = 11;
+  size_t length = headerLength;
+  uint16_t cardsInFrame = 0;
+  // Cards in the frame being built; they reach last only once the frame fit
+  // the TX buffer, so a dropped frame is resent on the next pass.
+  uint16_t frameIds[kSerialLinkCardsPerFrame];
+  SerialLinkCardImage frameImages[kSerialLinkCardsPerFrame];
+  bool allSent = true;
+  uint16_t frames = 0;
+  auto flushFrame = [&]() {
+    frames += 1;
+    if (sendSerialFrame(SerialFrame_Revision, body, length)) {
+      for (uint16_t i = 0; i < cardsInFrame; ++i) {
+        gSerialLink.last[frameIds[i]] = frameImages[i];
+      }
+    } else {
+      allSent = false;
+    }
+    length = headerLength;
+    cardsInFrame = 0;
+  };
+  for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+    const LogicCard& card = snapshot.cards[id];
+    SerialLinkCardImage image = {};
+    image.state = static_cast<uint8_t>(card.state);
+    image.bits = static_cast<uint8_t>((card.logicalState ? 0x01 : 0) |
+                                      (card.physicalState ? 0x02 : 0) |
+                                      (card.triggerFlag ? 0x04 : 0));
+    image.value = isAnalogInputCard(id) ? snapshot.aiReportedValue[id - AI_START]
+                                        : card.currentValue;
+    const SerialLinkCardImage& last = gSerialLink.last[id];
+    if (!keyframe && image.state == last.state && image.bits == last.bits &&
+        image.value == last.value) {
+      continue;
+    }
+    putLe16(body + length, id);
+    body[length + 2] = image.state;
+    body[length + 3] = image.bits;
+    putLe32(body + length + 4, image.value);
+    length += 8;
+    frameIds[cardsInFrame] = id;
+    frameImages[cardsInFrame] = image;
+    if (++cardsInFrame == kSerialLinkCardsPerFrame) flushFrame();
+  }
+  // An unchanged revision still goes out as one header-only frame.
+  if (cardsInFrame > 0 || frames == 0) flushFrame();
+  if (!allSent) return;
+  gSerialLink.lastChangeSeq = snapshot.changeSeq;
+  gSerialLink.lastRevisionMs = nowMs;
+  if (keyframe) {
+    gSerialLink.lastKeyframeMs = nowMs;
+    gSerialLink.primed = true;
+  }
+}
+
+// Alarm lane events go out as event records while the WS publisher is idle.
+void sendSerialEvents() {
+  uint32_t tail = gAlarmLane.tail.load(std::memory_order_relaxed);
+  const uint32_t head = gAlarmLane.head.load(std::memory_order_acquire);
+  while (tail != head) {
+    const AlarmEvent event =
+        gAlarmLane.events[tail & (AT_ALARM_QUEUE_DEPTH - 1)];
+    tail += 1;
+    gAlarmLane.tail.store(tail, std::memory_order_release);
+    uint8_t body[12];
+    putLe32(body, event.seq);
+    putLe32(body + 4, micros() - event.enqueuedUs);
+    putLe16(body + 8, event.cardId);
+    body[10] = static_cast<uint8_t>(event.state);
+    body[11] = static_cast<uint8_t>((event.logicalState ? 0x01 : 0) |
+                                    (event.physicalState ? 0x02 : 0) |
+                                    (event.resetOverride ? 0x04 : 0));
+    sendSerialFrame(SerialFrame_Event, body, sizeof(body));
+  }
+}
+
+void sendSerialDiagnostics(uint32_t nowMs) {
+  if ((nowMs - gSerialLink.lastDiagnosticsMs) < kSerialLinkDiagnosticsMs) return;
+  gSerialLink.lastDiagnosticsMs = nowMs;
+  KernelMetrics metrics;
+  uint32_t lastScanUs = 0;
+  portENTER_CRITICAL(&gSnapshotMux);
+  metrics = gSharedKernelMetrics;
+  lastScanUs = gSharedSnapshot.lastCompleteScanUs;
+  portEXIT_CRITICAL(&gSnapshotMux);
+  uint8_t body[28];
+  putLe32(body, metrics.scans);
+  putLe32(body + 4, metrics.overruns);
+  putLe32(body + 8, lastScanUs);
+  putLe32(body + 12, metrics.maxLatenessMs);
+  putLe32(body + 16, metrics.commands);
+  putLe32(body + 20, ESP.getMinFreeHeap());
+  putLe32(body + 24, gSerialLink.framesDropped);
+  sendSerialFrame(SerialFrame_Diagnostics, body, sizeof(body));
+}
+
+void startSerialLink() {
+  gConsole.println("Serial link: switching to COBS binary frames");
+  Serial.flush();
+  // Library and IDF logs write to the same UART, bypassing gConsole.
+  esp_log_level_set("*", ESP_LOG_NONE);
+  gConsole.muted = true;
+  Serial.updateBaudRate(AT_SERIAL_LINK_BAUD);
+  gSerialLink.active = true;
+  gSerialLink.reader = {gSerialLink.rx, sizeof(gSerialLink.rx), 0, false};
+  gSerialLink.primed = false;
+  sendSerialHello();
+}
+
+void stopSerialLink() {
+  if (!gSerialLink.active) return;
+  Serial.flush();
+  Serial.updateBaudRate(kSerialConsoleBaud);
+  gSerialLink.active = false;
+  gConsole.muted = false;
+  esp_log_level_set("*", static_cast<esp_log_level_t>(CONFIG_LOG_DEFAULT_LEVEL));
+}
+
+void handleSerialLink() {
+  if (!gSerialLink.active) startSerialLink();
+  const uint32_t nowMs = millis();
+  receiveSerialFrames();
+  sendSerialEvents();
+  sendSerialRevision(nowMs);
+  sendSerialDiagnostics(nowMs);
+}
+
+// ---------------------------------------------------------------------------
+// SoftIO exchange (Core1). Frame layout in softio_exchange.h. One frame per
+// published scan revision; the kernel never touches the socket.
+// ---------------------------------------------------------------------------
+
+WiFiUDP gExchangeUdp;
+bool gExchangeInitialized = false;
+uint32_t gExchangeLastTxVersion = 0;
+uint32_t gExchangeFramesSent = 0;
+uint32_t gExchangeFramesReceived = 0;
+uint32_t gExchangeFramesRejected = 0;
+
+void initExchange() {
+  if (gExchangeInitialized || !gExchangeSettings.enabled) return;
+  IPAddress group;
+  if (!group.fromString(gExchangeSettings.group) ||
+      !gExchangeUdp.beginMulticast(group, gExchangeSettings.port)) {
+    gConsole.println("SoftIO exchange: multicast join failed");
+    return;
+  }
+  gExchangeInitialized = true;
+  gConsole.printf("SoftIO exchange: node %u on %s:%u\n", gExchangeSettings.nodeId,
+                gExchangeSettings.group, gExchangeSettings.port);
+  initTimeSync();
+}
+
+void receiveExchangeFrames() {
+  static uint8_t frame[kExchangeHeaderBytes +
+                       AT_EXCHANGE_MAX_PUBLISH * kExchangeEntryBytes];
+  for (int size = gExchangeUdp.parsePacket(); size > 0;
+       size = gExchangeUdp.parsePacket()) {
+    const int length = gExchangeUdp.read(frame, sizeof(frame));
+    ExchangeFrameHeader header = {};
+    if (length <= 0 ||
+        !parseExchangeFrame(frame, static_cast<size_t>(length), header)) {
+      gExchangeFramesRejected += 1;
+      continue;
+    }
+    if (header.node == gExchangeSettings.nodeId) continue;  // own loopback
+    const uint32_t nowMs = millis();
+    gExchangeFramesReceived += 1;
+
+    for (uint16_t slot = 0; slot < NUM_REMOTE_SIO; ++slot) {
+      const RemoteSioBinding& binding = gExchangeSettings.remotes[slot];
+      if (!binding.bound || binding.node != header.node) continue;
+      RemoteSioSlot& target = gRemoteSlots[slot];
+      if (!acceptExchangeFrame(target, header.scanSeq, nowMs,
+                               binding.timeoutMs)) {
+        continue;
+      }
+      ExchangeEntry entry = {};
+      if (findExchangeEntry(frame, header.count, binding.sioIndex, entry)) {
+        writeRemoteSlot(target, entry, header.scanSeq, nowMs);
+      }
+    }
+  }
+}
+
+void sendExchangeFrame() {
+  static uint8_t frame[kExchangeHeaderBytes +
+                       AT_EXCHANGE_MAX_PUBLISH * kExchangeEntryBytes];
+  static ExchangeEntry entries[AT_EXCHANGE_MAX_PUBLISH];
+  const ExchangeTxImage& tx = gExchangeTx;
+  const uint32_t before = tx.version.load(std::memory_order_acquire);
+  if (before == gExchangeLastTxVersion || (before & 1U)) return;
+  const uint16_t count = tx.count;
+  const uint32_t scanSeq = tx.scanSeq;
+  memcpy(entries, tx.entries, sizeof(ExchangeEntry) * count);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (tx.version.load(std::memory_order_relaxed) != before) return;  // retry
+  gExchangeLastTxVersion = before;
+
+  const size_t length = encodeExchangeFrame(gExchangeSettings.nodeId, scanSeq,
+                                            entries, count, frame);
+  gExchangeUdp.beginMulticastPacket();
+  gExchangeUdp.write(frame, length);
+  if (gExchangeUdp.endPacket()) gExchangeFramesSent += 1;
+}
+
+void handleExchangeLoop() {
+  if (!gExchangeInitialized) return;
+  receiveExchangeFrames();
+  sendExchangeFrame();
+  handleTimeSyncLoop();
+}
+
+// ---------------------------------------------------------------------------
+// Time sync wire format (little-endian), multicast on exchange port + 1:
+//   "ATTS", u8 version, u8 type, u8 fromNode, u8 toNode, u32 seq,
+//   i64 t1 (client send), i64 t2 (master receive), i64 t3 (master send)
+// The master answers each request unicast. With t4 taken on receipt:
+//   offset = ((t2 - t1) + (t3 - t4)) / 2,  delay = (t4 - t1) - (t3 - t2)
+// The estimator itself (window, drift) lives in time_sync.h.
+// ---------------------------------------------------------------------------
+const uint8_t kTimeSyncVersion = 1;
+const uint8_t kTimeSyncRequest = 1;
+const uint8_t kTimeSyncResponse = 2;
+const size_t kTimeSyncFrameBytes = 36;
+
+// Core1-owned.
+struct TimeSyncState {
+  uint32_t seq;
+  bool pending;
+  int64_t pendingT1;
+  uint32_t lastTickMs;
+  TimeSyncEstimator<AT_TIMESYNC_WINDOW> estimator;
+  uint32_t lastSyncMs;
+  uint32_t requests;
+  uint32_t responses;
+  uint32_t lost;
+  uint32_t rejected;
+  uint32_t served;
+};
+
+WiFiUDP gTimeSyncUdp;
+bool gTimeSyncInitialized = false;
+TimeSyncState gTimeSync = {};
+
+bool isTimeMaster() {
+  return gExchangeSettings.timeMaster == gExchangeSettings.nodeId;
+}
+
+void publishTimeSyncModel(int64_t offsetUs, int64_t refLocalUs,
+                          int32_t driftPpb) {
+  TimeSyncModel& model = gTimeSyncModel;
+  const uint32_t version = model.version.load(std::memory_order_relaxed);
+  model.version.store(version + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  model.valid = true;
+  model.offsetUs = offsetUs;
+  model.refLocalUs = refLocalUs;
+  model.driftPpb = driftPpb;
+  model.updatedMs = millis();
+  model.version.store(version + 2, std::memory_order_release);
+}
+
+void initTimeSync() {
+  if (gTimeSyncInitialized || gExchangeSettings.timeMaster == 0) return;
+  IPAddress group;
+  if (!group.fromString(gExchangeSettings.group) ||
+      !gTimeSyncUdp.beginMulticast(group, gExchangeSettings.port + 1)) {
+    gConsole.println("Time sync: multicast join failed");
+    return;
+  }
+  gTimeSyncInitialized = true;
+  gConsole.printf("Time sync: %s, master node %u\n",
+                isTimeMaster() ? "master" : "client",
+                gExchangeSettings.timeMaster);
+}
+
+void encodeTimeSyncFrame(uint8_t* frame, uint8_t type, uint8_t toNode,
+                         uint32_t seq, int64_t t1, int64_t t2, int64_t t3) {
+  memcpy(frame, "ATTS", 4);
+  frame[4] = kTimeSyncVersion;
+  frame[5] = type;
+  frame[6] = gExchangeSettings.nodeId;
+  frame[7] = toNode;
+  memcpy(frame + 8, &seq, sizeof(seq));
+  memcpy(frame + 12, &t1, sizeof(t1));
+  memcpy(frame + 20, &t2, sizeof(t2));
+  memcpy(frame + 28, &t3, sizeof(t3));
+}
+
+void serveTimeSyncRequest(const uint8_t* request, int64_t t2) {
+  uint32_t seq = 0;
+  int64_t t1 = 0;
+  memcpy(&seq, request + 8, sizeof(seq));
+  memcpy(&t1, request + 12, sizeof(t1));
+  uint8_t frame[kTimeSyncFrameBytes];
+  gTimeSyncUdp.beginPacket(gTimeSyncUdp.remoteIP(), gTimeSyncUdp.remotePort());
+  encodeTimeSyncFrame(frame, kTimeSyncResponse, request[6], seq, t1, t2,
+                      esp_timer_get_time());
+  gTimeSyncUdp.write(frame, sizeof(frame));
+  if (gTimeSyncUdp.endPacket()) gTimeSync.served += 1;
+}
+
+void acceptTimeSyncResponse(const uint8_t* response, int64_t t4) {
+  TimeSyncState& sync = gTimeSync;
+  uint32_t seq = 0;
+  int64_t t1 = 0, t2 = 0, t3 = 0;
+  memcpy(&seq, response + 8, sizeof(seq));
+  memcpy(&t1, response + 12, sizeof(t1));
+  memcpy(&t2, response + 20, sizeof(t2));
+  memcpy(&t3, response + 28, sizeof(t3));
+  if (!sync.pending || seq != sync.seq || t1 != sync.pendingT1) {
+    sync.rejected += 1;
+    return;
+  }
+  sync.pending = false;
+  if (!addTimeSyncSample(sync.estimator, t1, t2, t3, t4,
+                         AT_TIMESYNC_MAX_DELAY_US,
+                         static_cast<int64_t>(kTimeSyncDriftSpanMs) * 1000)) {
+    sync.rejected += 1;
+    return;
+  }
+  sync.responses += 1;
+  sync.lastSyncMs = millis();
+  publishTimeSyncModel(sync.estimator.best.offsetUs, sync.estimator.best.localUs,
+                       sync.estimator.driftPpb);
+}
+
+void handleTimeSyncLoop() {
+  if (!gTimeSyncInitialized) return;
+  TimeSyncState& sync = gTimeSync;
+  const bool master = isTimeMaster();
+  uint8_t frame[kTimeSyncFrameBytes];
+  for (int size = gTimeSyncUdp.parsePacket(); size > 0;
+       size = gTimeSyncUdp.parsePacket()) {
+    const int64_t rxUs = esp_timer_get_time();
+    const int length = gTimeSyncUdp.read(frame, sizeof(frame));
+    if (size != static_cast<int>(kTimeSyncFrameBytes) ||
+        length != static_cast<int>(kTimeSyncFrameBytes) ||
+        memcmp(frame, "ATTS", 4) != 0 || frame[4] != kTimeSyncVersion) {
+      sync.rejected += 1;
+      continue;
+    }
+    if (frame[7] != gExchangeSettings.nodeId) continue;  // other pairs
+    if (master && frame[5] == kTimeSyncRequest) {
+      serveTimeSyncRequest(frame, rxUs);
+    } else if (!master && frame[5] == kTimeSyncResponse &&
+               frame[6] == gExchangeSettings.timeMaster) {
+      acceptTimeSyncResponse(frame, rxUs);
+    } else {
+      sync.rejected += 1;
+    }
+  }
+
+  const uint32_t nowMs = millis();
+  if ((nowMs - sync.lastTickMs) < AT_TIMESYNC_INTERVAL_MS) return;
+  sync.lastTickMs = nowMs;
+  if (master) {
+    // The master's own clock is the epoch; refresh so holdover never lapses.
+    publishTimeSyncModel(0, 0, 0);
+    return;
+  }
+  if (sync.pending) sync.lost += 1;
+  sync.seq += 1;
+  sync.pending = true;
+  gTimeSyncUdp.beginMulticastPacket();
+  sync.pendingT1 = esp_timer_get_time();
+  encodeTimeSyncFrame(frame, kTimeSyncRequest, gExchangeSettings.timeMaster,
+                      sync.seq, sync.pendingT1, 0, 0);
+  gTimeSyncUdp.write(frame, sizeof(frame));
+  if (gTimeSyncUdp.endPacket()) sync.requests += 1;
+}
+
+void serializeRuntimeDiagnostics(JsonDocument& doc, uint32_t nowMs) {
+  // Core1-only scratch copy, like the runtime snapshot.
+  static CardStatistics stats;
+  portENTER_CRITICAL(&gSnapshotMux);
+  memcpy(&stats, &gSharedStatistics, sizeof(stats));
+  portEXIT_CRITICAL(&gSnapshotMux);
+
+  doc["type"] = "runtime_diagnostics";
+  doc["schemaVersion"] = 1;
+  doc["tsMs"] = stats.started ? stats.lastMs : nowMs;
+  doc["bucketMs"] = AT_STATS_BUCKET_MS;
+  const uint32_t fullWindowMs = AT_STATS_BUCKETS * AT_STATS_BUCKET_MS;
+  // Span actually covered by the buckets: earlier full buckets plus the
+  // elapsed part of the current one, limited by uptime of the statistics.
+  uint32_t windowMs = (AT_STATS_BUCKETS - 1) * AT_STATS_BUCKET_MS +
+                      (stats.lastMs % AT_STATS_BUCKET_MS);
+  const uint32_t elapsedMs = stats.lastMs - stats.startMs;
+  if (windowMs > elapsedMs) windowMs = elapsedMs;
+  if (windowMs > fullWindowMs) windowMs = fullWindowMs;
+  doc["windowMs"] = windowMs;
+  const double windowHours = static_cast<double>(windowMs) / 3600000.0;
+  const double windowMinutes = static_cast<double>(windowMs) / 60000.0;
+
+  // Scan and snapshot cost against the built card count, for sizing profiles.
+  uint32_t lastScanUs = 0;
+  portENTER_CRITICAL(&gSnapshotMux);
+  lastScanUs = gSharedSnapshot.lastCompleteScanUs;
+  portEXIT_CRITICAL(&gSnapshotMux);
+  JsonObject capacity = doc["capacity"].to<JsonObject>();
+  capacity["totalCards"] = TOTAL_CARDS;
+  capacity["cardBytes"] = sizeof(LogicCard);
+  capacity["lastScanUs"] = lastScanUs;
+  capacity["scanUsPerCard"] =
+      static_cast<double>(lastScanUs) / static_cast<double>(TOTAL_CARDS);
+  capacity["snapshotBuildUs"] = gWsSnapshotLastBuildUs;
+  capacity["snapshotMaxBuildUs"] = gWsSnapshotMaxBuildUs;
+  capacity["snapshotBytes"] = gWsSnapshotLastBytes;
+
+  JsonObject migration = doc["v2Migration"].to<JsonObject>();
+  migration["lastUs"] = gV2MigrationLastUs;
+  migration["cards"] = gV2MigrationLastCards;
+  migration["usPerCard"] =
+      (gV2MigrationLastCards == 0)
+          ? 0.0
+          : static_cast<double>(gV2MigrationLastUs) / gV2MigrationLastCards;
+  migration["cacheHits"] = gV2MigrationCacheHits;
+
+  JsonObject modbus = doc["modbus"].to<JsonObject>();
+  modbus["enabled"] = gModbusServerInitialized;
+  modbus["requests"] = gModbusCounters.requests;
+  modbus["exceptions"] = gModbusCounters.exceptions;
+  modbus["writes"] = gModbusCounters.writes;
+  modbus["lastServiceUs"] = gModbusCounters.lastServiceUs;
+  modbus["maxServiceUs"] = gModbusCounters.maxServiceUs;
+
+  JsonObject exchange = doc["exchange"].to<JsonObject>();
+  exchange["enabled"] = gExchangeInitialized;
+  exchange["framesSent"] = gExchangeFramesSent;
+  exchange["framesReceived"] = gExchangeFramesReceived;
+  exchange["framesRejected"] = gExchangeFramesRejected;
+
+  KernelMetrics metrics;
+  portENTER_CRITICAL(&gSnapshotMux);
+  metrics = gSharedKernelMetrics;
+  portEXIT_CRITICAL(&gSnapshotMux);
+  JsonObject timeSync = doc["timeSync"].to<JsonObject>();
+  timeSync["enabled"] = gTimeSyncInitialized;
+  timeSync["role"] = !gTimeSyncInitialized ? "off"
+                     : isTimeMaster()      ? "master"
+                                           : "client";
+  timeSync["masterNode"] = gExchangeSettings.timeMaster;
+  timeSync["requests"] = gTimeSync.requests;
+  timeSync["responses"] = gTimeSync.responses;
+  timeSync["lost"] = gTimeSync.lost;
+  timeSync["rejected"] = gTimeSync.rejected;
+  timeSync["served"] = gTimeSync.served;
+  if (gTimeSync.lastSyncMs != 0) {
+    timeSync["offsetUs"] = gTimeSync.estimator.best.offsetUs;
+    timeSync["pathDelayUs"] = gTimeSync.estimator.best.delayUs;
+    timeSync["driftPpm"] =
+        static_cast<double>(gTimeSync.estimator.driftPpb) / 1000.0;
+    timeSync["syncAgeMs"] = nowMs - gTimeSync.lastSyncMs;
+  }
+  JsonObject alignment = timeSync["alignment"].to<JsonObject>();
+  alignment["active"] = metrics.alignActive;
+  alignment["lastErrorUs"] = metrics.alignLastErrorUs;
+  alignment["meanAbsErrorUs"] = metrics.alignMeanAbsErrorUs;
+  alignment["maxAbsErrorUs"] = metrics.alignMaxAbsErrorUs;
+  alignment["samples"] = metrics.alignSamples;
+  alignment["slews"] = metrics.alignSlews;
+
+  JsonObject trend = doc["trend"].to<JsonObject>();
+  trend["enabled"] = (gTrendStore.partition != nullptr);
+  trend["pageSlots"] = gTrendStore.pageSlots;
+  trend["nextSlot"] = gTrendStore.nextSlot;
+  trend["samples"] = gTrendStore.samples;
+  trend["pagesWritten"] = gTrendStore.pagesWritten;
+  trend["sectorErases"] = gTrendStore.sectorErases;
+  trend["writeFailures"] = gTrendStore.writeFailures;
+  trend["lastWriteUs"] = gTrendStore.lastWriteUs;
+  trend["maxWriteUs"] = gTrendStore.maxWriteUs;
+  trend["clockSynced"] = (time(nullptr) > static_cast<time_t>(kWallClockValidEpochS));
+
+  const JournalStore& journal = gJournalStore;
+  JsonObject journalOut = doc["journal"].to<JsonObject>();
+  journalOut["enabled"] = journal.ready;
+  journalOut["segments"] = journal.segmentCount;
+  journalOut["firstSeq"] =
+      journal.segmentCount > 0 ? journal.segments[0].firstSeq : journal.nextSeq;
+  journalOut["nextSeq"] = journal.nextSeq;
+  journalOut["pending"] = journal.pending;
+  journalOut["appended"] = journal.appended;
+  journalOut["dropped"] = gJournalLane.dropped.load(std::memory_order_relaxed);
+  journalOut["overflowed"] = journal.overflowed;
+  journalOut["flushes"] = journal.flushes;
+  journalOut["evictions"] = journal.evictions;
+  journalOut["writeFailures"] = journal.writeFailures;
+  journalOut["lastFlushUs"] = journal.lastFlushUs;
+  journalOut["maxFlushUs"] = journal.maxFlushUs;
+  journalOut["queries"] = journal.queries;
+  journalOut["lastQueryUs"] = journal.lastQueryUs;
+  journalOut["maxQueryUs"] = journal.maxQueryUs;
+
+  const OtaSession& session = gOtaSession;
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  JsonObject ota = doc["ota"].to<JsonObject>();
+  ota["running"] = (running != nullptr) ? running->label : "";
+  ota["trial"] = toString(gOtaTrial.state);
+  ota["trialBoots"] = gOtaTrial.boots;
+  ota["trialReason"] = gOtaTrial.reason;
+  ota["receiving"] = session.active;
+  ota["bytes"] = session.received;
+  ota["chunks"] = session.chunks;
+  ota["maxChunkUs"] = session.maxChunkUs;
+  ota["throughputBps"] = session.throughputBps;
+  ota["scanJitterMaxUs"] = metrics.otaJitterMaxUs;
+  ota["idleScanJitterMaxUs"] = metrics.jitterMaxUs;
+  ota["lastError"] = session.error;
+
+  JsonObject scripts = doc["scripts"].to<JsonObject>();
+  scripts["cards"] = NUM_SCRIPT;
+  scripts["instructionsPerScan"] = scriptInstructionsPerScan(gScriptPrograms);
+  scripts["budget"] = AT_SCRIPT_SCAN_BUDGET;
+  scripts["lastScanUs"] = metrics.scriptLastUs;
+  scripts["maxScanUs"] = metrics.scriptMaxUs;
+
+  static PluginRuntime pluginRuntime[kPluginSlots];
+  portENTER_CRITICAL(&gSnapshotMux);
+  memcpy(pluginRuntime, gSharedSnapshot.plugins, sizeof(pluginRuntime));
+  portEXIT_CRITICAL(&gSnapshotMux);
+  JsonObject plugins = doc["plugins"].to<JsonObject>();
+  plugins["cards"] = NUM_PLUGIN;
+  plugins["overrunLimit"] = AT_PLUGIN_OVERRUN_LIMIT;
+  JsonArray registered = plugins["registered"].to<JsonArray>();
+  for (uint16_t slot = 0; slot < NUM_PLUGIN; ++slot) {
+    const CardPlugin& plugin = *kCardPlugins[slot];
+    const PluginRuntime& runtime = pluginRuntime[slot];
+    JsonObject entry = registered.add<JsonObject>();
+    entry["id"] = PLUGIN_START + slot;
+    entry["name"] = plugin.name();
+    entry["budgetUs"] = plugin.budgetUs();
+    entry["lastUs"] = runtime.lastUs;
+    entry["maxUs"] = runtime.maxUs;
+    entry["overruns"] = runtime.overruns;
+    entry["faults"] = runtime.faults;
+    plugin.describe(entry["describe"].to<JsonObject>());
+  }
+
+  JsonObject mqtt = doc["mqtt"].to<JsonObject>();
+  mqtt["enabled"] = (gMqttHost[0] != '\0');
+  mqtt["connected"] = gMqtt.connected();
+  mqtt["connects"] = gMqttPublisher.connects;
+  mqtt["retryMs"] = gMqttPublisher.retryMs;
+  mqtt["messages"] = gMqttPublisher.messages;
+  mqtt["bytes"] = gMqttPublisher.bytes;
+  mqtt["failures"] = gMqttPublisher.failures;
+  mqtt["commands"] = gMqttPublisher.commands;
+  mqtt["oversizeResults"] = gMqttPublisher.oversizeResults;
+
+  JsonArray cards = doc["cards"].to<JsonArray>();
+  for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+    JsonObject card = cards.add<JsonObject>();
+    card["id"] = id;
+    if (isDigitalInputCard(id)) {
+      const DigitalInputStats& di = stats.di[id - DI_START];
+      uint32_t edges = 0;
+      for (uint8_t b = 0; b < AT_STATS_BUCKETS; ++b) edges += di.edgeBuckets[b];
+      card["edgesInWindow"] = edges;
+      card["edgesPerMinute"] =
+          (windowMinutes > 0.0) ? edges / windowMinutes : 0.0;
+    } else if (isAnalogInputCard(id)) {
+      const AnalogInputStats& ai = stats.ai[id - AI_START];
+      uint32_t minValue = UINT32_MAX;
+      uint32_t maxValue = 0;
+      uint64_t sum = 0;
+      uint32_t count = 0;
+      for (uint8_t b = 0; b < AT_STATS_BUCKETS; ++b) {
+        if (ai.count[b] == 0) continue;
+        if (ai.min[b] < minValue) minValue = ai.min[b];
+        if (ai.max[b] > maxValue) maxValue = ai.max[b];
+        sum += ai.sum[b];
+        count += ai.count[b];
+      }
+      card["samples"] = count;
+      if (count == 0) {
+        card["min"] = nullptr;
+        card["max"] = nullptr;
+        card["mean"] = nullptr;
+      } else {
+        card["min"] = minValue;
+        card["max"] = maxValue;
+        card["mean"] = static_cast<double>(sum) / count;
+      }
+    } else if (isScriptCard(id)) {
+      card["instructions"] = gScriptPrograms[id - SCRIPT_START].length;
+    } else if (isPluginCard(id)) {
+      card["plugin"] = kCardPlugins[id - PLUGIN_START]->name();
+    } else {
+      const OutputCardStats& out = stats.outputs[outputSlotForCard(id)];
+      uint32_t cycles = 0;
+      for (uint8_t b = 0; b < AT_STATS_BUCKETS; ++b) {
+        cycles += out.cycleBuckets[b];
+      }
+      card["onTimeMs"] = out.onMs;
+      card["onHours"] = static_cast<double>(out.onMs) / 3600000.0;
+      card["cycles"] = out.cycles;
+      card["cyclesInWindow"] = cycles;
+      card["cyclesPerHour"] = (windowHours > 0.0) ? cycles / windowHours : 0.0;
+    }
+  }
+}
+
+void handleHttpDiagnostics() {
+  JsonDocument doc;
+  serializeRuntimeDiagnostics(doc, millis());
+  String body;
+  serializeJson(doc, body);
+  gPortalServer.send(200, "application/json", body);
+}
+
+// Fixed-size line buffer for /metrics, flushed to the client as chunks so the
+// response never builds up in heap.
+struct MetricsStream {
+  char buffer[1024];
+  size_t length;
+};
+
+void flushMetrics(MetricsStream& out) {
+  if (out.length == 0) return;
+  gPortalServer.sendContent(out.buffer, out.length);
+  out.length = 0;
+}
+
+void writeMetric(MetricsStream& out, const char* format, ...) {
+  if (out.length + 192 > sizeof(out.buffer)) flushMetrics(out);
+  va_list args;
+  va_start(args, format);
+  const size_t room = sizeof(out.buffer) - out.length;
+  const int written = vsnprintf(out.buffer + out.length, room, format, args);
+  va_end(args);
+  if (written > 0) {
+    out.length += (static_cast<size_t>(written) < room) ? written : room - 1;
+  }
+}
+
+void writeMetricHeader(MetricsStream& out, const char* name, const char* type,
+                       const char* help) {
+  writeMetric(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Prometheus text exposition, rendered from the kernel's preaggregated
+// counters; per-card values are read one card at a time under the mux.
+void handleHttpMetrics() {
+  KernelMetrics metrics;
+  uint32_t scanIntervalMs = 0;
+  portENTER_CRITICAL(&gSnapshotMux);
+  metrics = gSharedKernelMetrics;
+  portEXIT_CRITICAL(&gSnapshotMux);
+  scanIntervalMs = gScanIntervalMs;
+
+  gPortalServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  gPortalServer.send(200, "text/plain; version=0.0.4", "");
+  static MetricsStream out;
+  out.length = 0;
+
+  writeMetricHeader(out, "advancedtimer_scan_duration_seconds", "histogram",
+                    "Duration of completed full scans.");
+  uint32_t cumulative = 0;
+  for (uint8_t b = 0; b < kScanHistogramBuckets; ++b) {
+    cumulative += metrics.scanBuckets[b];
+    if (b + 1 < kScanHistogramBuckets) {
+      const uint32_t boundUs = kScanHistogramBoundsUs[b];
+      writeMetric(out,
+                  "advancedtimer_scan_duration_seconds_bucket{le=\"%lu.%06lu\"} "
+                  "%lu\n",
+                  static_cast<unsigned long>(boundUs / 1000000),
+                  static_cast<unsigned long>(boundUs % 1000000),
+                  static_cast<unsigned long>(cumulative));
+    } else {
+      writeMetric(out,
+                  "advancedtimer_scan_duration_seconds_bucket{le=\"+Inf\"} %lu\n",
+                  static_cast<unsigned long>(cumulative));
+    }
+  }
+  writeMetric(out, "advancedtimer_scan_duration_seconds_sum %.6f\n",
+              static_cast<double>(metrics.scanSumUs) / 1000000.0);
+  writeMetric(out, "advancedtimer_scan_duration_seconds_count %lu\n",
+              static_cast<unsigned long>(metrics.scans));
+
+  writeMetricHeader(out, "advancedtimer_scan_interval_seconds", "gauge",
+                    "Configured scan interval.");
+  writeMetric(out, "advancedtimer_scan_interval_seconds %.3f\n",
+              static_cast<double>(scanIntervalMs) / 1000.0);
+  writeMetricHeader(out, "advancedtimer_scan_overruns_total", "counter",
+                    "Full scans that took longer than the scan interval.");
+  writeMetric(out, "advancedtimer_scan_overruns_total %lu\n",
+              static_cast<unsigned long>(metrics.overruns));
+  writeMetricHeader(out, "advancedtimer_scan_late_starts_total", "counter",
+                    "Scans that started after their scheduled tick.");
+  writeMetric(out, "advancedtimer_scan_late_starts_total %lu\n",
+              static_cast<unsigned long>(metrics.lateScans));
+  writeMetricHeader(out, "advancedtimer_scan_lateness_seconds_total", "counter",
+                    "Accumulated scan start lateness.");
+  writeMetric(out, "advancedtimer_scan_lateness_seconds_total %.3f\n",
+              static_cast<double>(metrics.latenessSumMs) / 1000.0);
+  writeMetricHeader(out, "advancedtimer_scan_lateness_max_seconds", "gauge",
+                    "Largest scan start lateness since boot.");
+  writeMetric(out, "advancedtimer_scan_lateness_max_seconds %.3f\n",
+              static_cast<double>(metrics.maxLatenessMs) / 1000.0);
+
+  writeMetricHeader(out, "advancedtimer_scan_alignment_error_seconds", "gauge",
+                    "Last scan release phase against the time-sync epoch.");
+  writeMetric(out, "advancedtimer_scan_alignment_error_seconds %.6f\n",
+              static_cast<double>(metrics.alignLastErrorUs) / 1000000.0);
+  writeMetricHeader(out, "advancedtimer_scan_alignment_mean_abs_error_seconds",
+                    "gauge", "Moving average of the absolute alignment error.");
+  writeMetric(out, "advancedtimer_scan_alignment_mean_abs_error_seconds %.6f\n",
+              static_cast<double>(metrics.alignMeanAbsErrorUs) / 1000000.0);
+  writeMetricHeader(out, "advancedtimer_time_sync_offset_seconds", "gauge",
+                    "Estimated master clock minus local clock.");
+  writeMetric(out, "advancedtimer_time_sync_offset_seconds %.6f\n",
+              static_cast<double>(gTimeSync.estimator.best.offsetUs) / 1000000.0);
+
+  writeMetricHeader(out, "advancedtimer_command_queue_depth", "gauge",
+                    "Kernel commands waiting in the queue.");
+  writeMetric(out, "advancedtimer_command_queue_depth %lu\n",
+              static_cast<unsigned long>(
+                  (gKernelCommandQueue != nullptr)
+                      ? uxQueueMessagesWaiting(gKernelCommandQueue)
+                      : 0));
+  writeMetricHeader(out, "advancedtimer_commands_total", "counter",
+                    "Kernel commands applied.");
+  writeMetric(out, "advancedtimer_commands_total %lu\n",
+              static_cast<unsigned long>(metrics.commands));
+  writeMetricHeader(out, "advancedtimer_commands_rejected_total", "counter",
+                    "Kernel commands rejected by the kernel.");
+  writeMetric(out, "advancedtimer_commands_rejected_total %lu\n",
+              static_cast<unsigned long>(metrics.commandsRejected));
+  writeMetricHeader(out, "advancedtimer_command_latency_seconds", "summary",
+                    "Time from enqueue to kernel apply.");
+  writeMetric(out, "advancedtimer_command_latency_seconds_sum %.6f\n",
+              static_cast<double>(metrics.commandLatencySumUs) / 1000000.0);
+  writeMetric(out, "advancedtimer_command_latency_seconds_count %lu\n",
+              static_cast<unsigned long>(metrics.commands));
+  writeMetricHeader(out, "advancedtimer_command_latency_max_seconds", "gauge",
+                    "Largest enqueue-to-apply latency since boot.");
+  writeMetric(out, "advancedtimer_command_latency_max_seconds %.6f\n",
+              static_cast<double>(metrics.commandLatencyMaxUs) / 1000000.0);
+
+  writeMetricHeader(out, "advancedtimer_ws_clients", "gauge",
+                    "Connected WebSocket clients.");
+  writeMetric(out, "advancedtimer_ws_clients %u\n",
+              static_cast<unsigned>(gWsServer.connectedClients()));
+  writeMetricHeader(out, "advancedtimer_ws_frames_total", "counter",
+                    "WebSocket frames broadcast.");
+  writeMetric(out, "advancedtimer_ws_frames_total %lu\n",
+              static_cast<unsigned long>(gWsFramesSent));
+  writeMetricHeader(out, "advancedtimer_ws_bytes_total", "counter",
+                    "WebSocket payload bytes broadcast.");
+  writeMetric(out, "advancedtimer_ws_bytes_total %llu\n",
+              static_cast<unsigned long long>(gWsBytesSent));
+
+  writeMetricHeader(out, "advancedtimer_heap_free_bytes", "gauge",
+                    "Current free heap.");
+  writeMetric(out, "advancedtimer_heap_free_bytes %lu\n",
+              static_cast<unsigned long>(ESP.getFreeHeap()));
+  writeMetricHeader(out, "advancedtimer_heap_min_free_bytes", "gauge",
+                    "Lowest free heap since boot.");
+  writeMetric(out, "advancedtimer_heap_min_free_bytes %lu\n",
+              static_cast<unsigned long>(ESP.getMinFreeHeap()));
+  writeMetricHeader(out, "advancedtimer_task_stack_free_bytes", "gauge",
+                    "Stack high-water mark per task.");
+  writeMetric(out, "advancedtimer_task_stack_free_bytes{task=\"core0_engine\"} %lu\n",
+              static_cast<unsigned long>(
+                  uxTaskGetStackHighWaterMark(gCore0TaskHandle)));
+  writeMetric(out, "advancedtimer_task_stack_free_bytes{task=\"core1_portal\"} %lu\n",
+              static_cast<unsigned long>(
+                  uxTaskGetStackHighWaterMark(gCore1TaskHandle)));
+
+  writeMetricHeader(out, "advancedtimer_card_evaluations_total", "counter",
+                    "Kernel evaluations per card.");
+  for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+    portENTER_CRITICAL(&gSnapshotMux);
+    const uint32_t evaluations = gSharedSnapshot.evalCounter[id];
+    const logicCardType type = gSharedSnapshot.cards[id].type;
+    portEXIT_CRITICAL(&gSnapshotMux);
+    writeMetric(out,
+                "advancedtimer_card_evaluations_total{card=\"%u\",type=\"%s\"} "
+                "%lu\n",
+                id, toString(type), static_cast<unsigned long>(evaluations));
+  }
+  writeMetricHeader(out, "advancedtimer_output_cycles_total", "counter",
+                    "OFF to ON transitions per DO/SIO card.");
+  for (uint16_t id = DO_START; id < SCRIPT_START; ++id) {
+    if (isAnalogInputCard(id)) continue;
+    portENTER_CRITICAL(&gSnapshotMux);
+    const uint32_t cycles = gSharedStatistics.outputs[outputSlotForCard(id)].cycles;
+    portEXIT_CRITICAL(&gSnapshotMux);
+    writeMetric(out, "advancedtimer_output_cycles_total{card=\"%u\"} %lu\n", id,
+                static_cast<unsigned long>(cycles));
+  }
+  writeMetricHeader(out, "advancedtimer_plugin_eval_max_us", "gauge",
+                    "Slowest evaluation per plugin card since config apply.");
+  for (uint16_t slot = 0; slot < NUM_PLUGIN; ++slot) {
+    portENTER_CRITICAL(&gSnapshotMux);
+    const uint32_t maxUs = gSharedSnapshot.plugins[slot].maxUs;
+    portEXIT_CRITICAL(&gSnapshotMux);
+    writeMetric(out,
+                "advancedtimer_plugin_eval_max_us"
+                "{card=\"%u\",plugin=\"%s\"} %lu\n",
+                PLUGIN_START + slot, kCardPlugins[slot]->name(),
+                static_cast<unsigned long>(maxUs));
+  }
+  writeMetricHeader(out, "advancedtimer_plugin_overruns_total", "counter",
+                    "Over-budget evaluations per plugin card.");
+  for (uint16_t slot = 0; slot < NUM_PLUGIN; ++slot) {
+    portENTER_CRITICAL(&gSnapshotMux);
+    const uint32_t overruns = gSharedSnapshot.plugins[slot].overruns;
+    portEXIT_CRITICAL(&gSnapshotMux);
+    writeMetric(out,
+                "advancedtimer_plugin_overruns_total"
+                "{card=\"%u\",plugin=\"%s\"} %lu\n",
+                PLUGIN_START + slot, kCardPlugins[slot]->name(),
+                static_cast<unsigned long>(overruns));
+  }
+
+  flushMetrics(out);
+  gPortalServer.sendContent("", 0);
+}
+
+// ---------------------------------------------------------------------------
+// Trend page (little-endian), 512 bytes:
+//   u16 magic, u8 version, u8 reserved, u32 seq, u16 cardId, u16 count,
+//   u32 t0, u32 v0, u32 tLast, u16 bits, u16 crc16 (page with crc = 0xFFFF)
+// followed by one bit stream (MSB first). Each sample after the first adds
+//   time  delta-of-delta: '0' | '10'+7 | '110'+9 | '1110'+12 | '1111'+32 bits
+//   value XOR previous:   '0' | '10'+bits of the previous window
+//                         | '11'+5 leading zeros+5 (length-1)+bits
+// Times are Unix seconds once SNTP has synced. Before that they continue
+// from the newest stored page, so an offline reboot never runs backwards.
+// ---------------------------------------------------------------------------
+const uint16_t kTrendMagic = 0x54A7;
+const uint8_t kTrendVersion = 1;
+const uint16_t kTrendMaxSampleBits = 4 + 32 + 2 + 5 + 5 + 32;
+
+struct TrendPageHeader {
+  uint32_t seq;
+  uint16_t cardId;
+  uint16_t count;
+  uint32_t t0;
+  uint32_t v0;
+  uint32_t tLast;
+  uint16_t bits;
+};
+
+struct TrendBitReader {
+  const uint8_t* data;
+  uint16_t bits;
+  uint16_t pos;
+};
+
+// Downsampling buckets of one range query; Core1 scratch.
+struct TrendQuery {
+  uint16_t cardId;
+  uint32_t from;
+  uint32_t to;
+  uint16_t points;
+  uint32_t pages;
+  uint32_t corruptPages;
+  uint32_t min[AT_TREND_MAX_POINTS];
+  uint32_t max[AT_TREND_MAX_POINTS];
+  uint64_t sum[AT_TREND_MAX_POINTS];
+  uint32_t count[AT_TREND_MAX_POINTS];
+};
+
+uint32_t wallClockSeconds() {
+  WallClock& clock = gWallClock;
+  if (!clock.sntpStarted && WiFi.status() == WL_CONNECTED) {
+    configTime(0, 0, "pool.ntp.org");
+    clock.sntpStarted = true;
+  }
+  const time_t wall = time(nullptr);
+  uint32_t nowS = (wall > static_cast<time_t>(kWallClockValidEpochS))
+                      ? static_cast<uint32_t>(wall)
+                      : clock.bootBaseS + millis() / 1000;
+  if (nowS < clock.lastS) nowS = clock.lastS;
+  clock.lastS = nowS;
+  return nowS;
+}
+
+void trendPutBits(TrendOpenPage& page, uint32_t value, uint8_t width) {
+  for (int8_t bit = static_cast<int8_t>(width) - 1; bit >= 0; --bit) {
+    const uint16_t pos = page.bits++;
+    uint8_t& byte = page.payload[pos >> 3];
+    if ((pos & 7) == 0) byte = 0;
+    if ((value >> bit) & 1U) byte |= static_cast<uint8_t>(0x80 >> (pos & 7));
+  }
+}
+
+bool trendGetBits(TrendBitReader& reader, uint8_t width, uint32_t& out) {
+  if (static_cast<uint32_t>(reader.pos) + width > reader.bits) return false;
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < width; ++i, ++reader.pos) {
+    value = (value << 1) |
+            ((reader.data[reader.pos >> 3] >> (7 - (reader.pos & 7))) & 1U);
+  }
+  out = value;
+  return true;
+}
+
+void startTrendPage(TrendOpenPage& page, uint16_t cardId, uint32_t t,
+                    uint32_t value) {
+  page.cardId = cardId;
+  page.count = 1;
+  page.t0 = t;
+  page.v0 = value;
+  page.tLast = t;
+  page.prevDelta = 0;
+  page.prevValue = value;
+  page.prevLeading = 0xFF;
+  page.prevTrailing = 0;
+  page.bits = 0;
+}
+
+void encodeTrendSample(TrendOpenPage& page, uint32_t t, uint32_t value) {
+  const int32_t delta = static_cast<int32_t>(t - page.tLast);
+  const int32_t dod = delta - page.prevDelta;
+  if (dod == 0) {
+    trendPutBits(page, 0, 1);
+  } else if (dod >= -63 && dod <= 64) {
+    trendPutBits(page, 0x2, 2);
+    trendPutBits(page, static_cast<uint32_t>(dod + 63), 7);
+  } else if (dod >= -255 && dod <= 256) {
+    trendPutBits(page, 0x6, 3);
+    trendPutBits(page, static_cast<uint32_t>(dod + 255), 9);
+  } else if (dod >= -2047 && dod <= 2048) {
+    trendPutBits(page, 0xE, 4);
+    trendPutBits(page, static_cast<uint32_t>(dod + 2047), 12);
+  } else {
+    trendPutBits(page, 0xF, 4);
+    trendPutBits(page, static_cast<uint32_t>(dod), 32);
+  }
+  page.prevDelta = delta;
+  page.tLast = t;
+
+  const uint32_t diff = value ^ page.prevValue;
+  if (diff == 0) {
+    trendPutBits(page, 0, 1);
+  } else {
+    const uint8_t leading = static_cast<uint8_t>(__builtin_clz(diff));
+    const uint8_t trailing = static_cast<uint8_t>(__builtin_ctz(diff));
+    if (page.prevLeading != 0xFF && leading >= page.prevLeading &&
+        trailing >= page.prevTrailing) {
+      trendPutBits(page, 0x2, 2);
+      trendPutBits(page, diff >> page.prevTrailing,
+                   32 - page.prevLeading - page.prevTrailing);
+    } else {
+      const uint8_t length = 32 - leading - trailing;
+      trendPutBits(page, 0x3, 2);
+      trendPutBits(page, leading, 5);
+      trendPutBits(page, length - 1, 5);
+      trendPutBits(page, diff >> trailing, length);
+      page.prevLeading = leading;
+      page.prevTrailing = trailing;
+    }
+  }
+  page.prevValue = value;
+  page.count += 1;
+}
+
+bool readTrendHeader(uint32_t slot, TrendPageHeader& header) {
+  uint8_t raw[kTrendHeaderBytes];
+  if (esp_partition_read(gTrendStore.partition, slot * kTrendPageBytes, raw,
+                         sizeof(raw)) != ESP_OK) {
+    return false;
+  }
+  uint16_t magic = 0;
+  memcpy(&magic, raw, 2);
+  if (magic != kTrendMagic || raw[2] != kTrendVersion) return false;
+  memcpy(&header.seq, raw + 4, 4);
+  memcpy(&header.cardId, raw + 8, 2);
+  memcpy(&header.count, raw + 10, 2);
+  memcpy(&header.t0, raw + 12, 4);
+  memcpy(&header.v0, raw + 16, 4);
+  memcpy(&header.tLast, raw + 20, 4);
+  memcpy(&header.bits, raw + 24, 2);
+  return header.count > 0 && header.bits <= kTrendPayloadBytes * 8;
+}
+
+// Writes and resets the page. The sector ahead of the ring is erased when
+// its first page comes up. Flash writes stall both cores, so pages are only
+// written when full, at AT_TREND_FLUSH_S age, on reconfiguration, or before
+// a planned restart, and each write starts in a scan gap.
+void writeTrendPage(TrendOpenPage& page) {
+  TrendStore& store = gTrendStore;
+  if (page.count == 0 || store.partition == nullptr) return;
+  static uint8_t buffer[kTrendPageBytes];
+  memset(buffer, 0xFF, sizeof(buffer));
+  buffer[0] = static_cast<uint8_t>(kTrendMagic & 0xFF);
+  buffer[1] = static_cast<uint8_t>(kTrendMagic >> 8);
+  buffer[2] = kTrendVersion;
+  memcpy(buffer + 4, &store.nextSeq, 4);
+  memcpy(buffer + 8, &page.cardId, 2);
+  memcpy(buffer + 10, &page.count, 2);
+  memcpy(buffer + 12, &page.t0, 4);
+  memcpy(buffer + 16, &page.v0, 4);
+  memcpy(buffer + 20, &page.tLast, 4);
+  memcpy(buffer + 24, &page.bits, 2);
+  memcpy(buffer + kTrendHeaderBytes, page.payload, (page.bits + 7) / 8);
+  const uint16_t crc = crc16Ccitt(buffer, sizeof(buffer));
+  memcpy(buffer + 26, &crc, 2);
+
+  const uint32_t offset = store.nextSlot * kTrendPageBytes;
+  waitForScanGap();
+  const uint32_t startUs = micros();
+  bool ok = true;
+  if ((offset % kTrendSectorBytes) == 0) {
+    ok = esp_partition_erase_range(store.partition, offset, kTrendSectorBytes) ==
+         ESP_OK;
+    if (ok) store.sectorErases += 1;
+  }
+  ok = ok && esp_partition_write(store.partition, offset, buffer,
+                                 sizeof(buffer)) == ESP_OK;
+  store.lastWriteUs = micros() - startUs;
+  if (store.lastWriteUs > store.maxWriteUs) store.maxWriteUs = store.lastWriteUs;
+  if (ok) {
+    store.pagesWritten += 1;
+  } else {
+    store.writeFailures += 1;
+  }
+  store.nextSlot = (store.nextSlot + 1) % store.pageSlots;
+  store.nextSeq += 1;
+  page.count = 0;
+}
+
+void flushTrendPages() {
+  for (uint8_t i = 0; i < AT_TREND_MAX_SERIES; ++i) {
+    writeTrendPage(gTrendStore.pages[i]);
+  }
+}
+
+void appendTrendSample(TrendOpenPage& page, uint16_t cardId, uint32_t t,
+                       uint32_t value) {
+  if (page.count > 0 &&
+      static_cast<size_t>(page.bits) + kTrendMaxSampleBits > kTrendPayloadBytes * 8) {
+    writeTrendPage(page);
+  }
+  if (page.count == 0) {
+    startTrendPage(page, cardId, t, value);
+  } else {
+    encodeTrendSample(page, t, value);
+  }
+}
+
+bool isTrendSlotErased(uint32_t slot) {
+  uint8_t buffer[64];
+  for (uint32_t at = 0; at < kTrendPageBytes; at += sizeof(buffer)) {
+    if (esp_partition_read(gTrendStore.partition, slot * kTrendPageBytes + at,
+                           buffer, sizeof(buffer)) != ESP_OK) {
+      return false;
+    }
+    for (uint8_t b : buffer) {
+      if (b != 0xFF) return false;
+    }
+  }
+  return true;
+}
+
+// Finds the newest page to continue the ring after it, and the newest
+// timestamp as the clock base until SNTP syncs.
+void initTrendStore() {
+  TrendStore& store = gTrendStore;
+  store.partition = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA,
+      static_cast<esp_partition_subtype_t>(kTrendPartitionSubtype), "trend");
+  if (store.partition == nullptr) {
+    gConsole.println("Trend store: no \"trend\" partition");
+    return;
+  }
+  const uint32_t pagesPerSector = kTrendSectorBytes / kTrendPageBytes;
+  store.pageSlots = (store.partition->size / kTrendSectorBytes) * pagesPerSector;
+  bool found = false;
+  uint32_t newestSeq = 0;
+  uint32_t newestSlot = 0;
+  for (uint32_t slot = 0; slot < store.pageSlots; ++slot) {
+    TrendPageHeader header = {};
+    if (!readTrendHeader(slot, header)) continue;
+    if (!found || static_cast<int32_t>(header.seq - newestSeq) > 0) {
+      found = true;
+      newestSeq = header.seq;
+      newestSlot = slot;
+    }
+    if (header.tLast >= gWallClock.bootBaseS) gWallClock.bootBaseS = header.tLast + 1;
+  }
+  store.nextSeq = found ? newestSeq + 1 : 1;
+  store.nextSlot = found ? (newestSlot + 1) % store.pageSlots : 0;
+  // A torn write leaves a dirty slot; skip to the next sector boundary.
+  if ((store.nextSlot % pagesPerSector) != 0 && !isTrendSlotErased(store.nextSlot)) {
+    store.nextSlot = ((store.nextSlot / pagesPerSector + 1) * pagesPerSector) %
+                     store.pageSlots;
+  }
+  gConsole.printf("Trend store: %lu pages, next %lu\n",
+                static_cast<unsigned long>(store.pageSlots),
+                static_cast<unsigned long>(store.nextSlot));
+}
+
+// Core1, online and offline: samples due series from the shared snapshot.
+void handleTrendLoop() {
+  TrendStore& store = gTrendStore;
+  if (store.partition == nullptr) return;
+  const uint32_t nowS = wallClockSeconds();
+  for (uint8_t i = 0; i < AT_TREND_MAX_SERIES; ++i) {
+    const TrendSeriesConfig& series = store.series[i];
+    TrendOpenPage& page = store.pages[i];
+    if (!series.active) continue;
+#if AT_TREND_FLUSH_S > 0
+    if (page.count > 0 && (nowS - page.t0) >= AT_TREND_FLUSH_S) {
+      writeTrendPage(page);
+    }
+#endif
+    if (nowS < page.nextDueS) continue;
+    page.nextDueS = nowS - (nowS % series.periodS) + series.periodS;
+    portENTER_CRITICAL(&gSnapshotMux);
+    const uint32_t value = gSharedSnapshot.cards[series.cardId].currentValue;
+    portEXIT_CRITICAL(&gSnapshotMux);
+    appendTrendSample(page, series.cardId, nowS, value);
+    store.samples += 1;
+  }
+}
+
+void addTrendPoint(TrendQuery& query, uint32_t t, uint32_t value) {
+  if (t < query.from || t > query.to) return;
+  const uint32_t bucket = static_cast<uint32_t>(
+      static_cast<uint64_t>(t - query.from) * query.points /
+      (static_cast<uint64_t>(query.to - query.from) + 1));
+  if (query.count[bucket] == 0 || value < query.min[bucket]) query.min[bucket] = value;
+  if (query.count[bucket] == 0 || value > query.max[bucket]) query.max[bucket] = value;
+  query.sum[bucket] += value;
+  query.count[bucket] += 1;
+}
+
+bool accumulateTrendPage(TrendQuery& query, const TrendPageHeader& header,
+                         const uint8_t* payload) {
+  TrendBitReader reader = {payload, header.bits, 0};
+  uint32_t t = header.t0;
+  uint32_t value = header.v0;
+  int32_t delta = 0;
+  uint8_t leading = 0xFF;
+  uint8_t trailing = 0;
+  addTrendPoint(query, t, value);
+  for (uint16_t i = 1; i < header.count; ++i) {
+    uint32_t bit = 0;
+    uint32_t raw = 0;
+    int32_t dod = 0;
+    if (!trendGetBits(reader, 1, bit)) return false;
+    if (bit != 0) {
+      uint8_t prefix = 1;
+      while (prefix < 4) {
+        if (!trendGetBits(reader, 1, bit)) return false;
+        if (bit == 0) break;
+        prefix += 1;
+      }
+      static const uint8_t kWidths[] = {7, 9, 12, 32};
+      static const int32_t kBias[] = {63, 255, 2047, 0};
+      if (!trendGetBits(reader, kWidths[prefix - 1], raw)) return false;
+      dod = static_cast<int32_t>(raw) - kBias[prefix - 1];
+    }
+    delta += dod;
+    t += static_cast<uint32_t>(delta);
+
+    if (!trendGetBits(reader, 1, bit)) return false;
+    if (bit != 0) {
+      if (!trendGetBits(reader, 1, bit)) return false;
+      if (bit != 0) {
+        uint32_t lead = 0;
+        uint32_t length = 0;
+        if (!trendGetBits(reader, 5, lead) || !trendGetBits(reader, 5, length)) {
+          return false;
+        }
+        leading = static_cast<uint8_t>(lead);
+        trailing = static_cast<uint8_t>(32 - lead - (length + 1));
+      } else if (leading == 0xFF) {
+        return false;
+      }
+      if (!trendGetBits(reader, 32 - leading - trailing, raw)) return false;
+      value ^= raw << trailing;
+    }
+    addTrendPoint(query, t, value);
+  }
+  return true;
+}
+
+// GET /api/trend?cardId=N[&from=S][&to=S][&points=N]: min/max/avg per
+// bucket over [from, to] (default the last 24 h), streamed with the
+// /metrics chunk writer so a month of data never builds up in heap.
+void handleHttpGetTrend() {
+  TrendStore& store = gTrendStore;
+  if (store.partition == nullptr) {
+    writeConfigErrorResponse(503, "UNAVAILABLE", "no trend partition");
+    return;
+  }
+  const uint32_t cardId = gPortalServer.hasArg("cardId")
+                              ? strtoul(gPortalServer.arg("cardId").c_str(), nullptr, 10)
+                              : TOTAL_CARDS;
+  const uint32_t nowS = wallClockSeconds();
+  const uint32_t to = gPortalServer.hasArg("to")
+                          ? strtoul(gPortalServer.arg("to").c_str(), nullptr, 10)
+                          : nowS;
+  const uint32_t from =
+      gPortalServer.hasArg("from")
+          ? strtoul(gPortalServer.arg("from").c_str(), nullptr, 10)
+          : (to > 86400 ? to - 86400 : 0);
+  uint32_t points = gPortalServer.hasArg("points")
+                        ? strtoul(gPortalServer.arg("points").c_str(), nullptr, 10)
+                        : AT_TREND_MAX_POINTS;
+  if (points == 0 || points > AT_TREND_MAX_POINTS) points = AT_TREND_MAX_POINTS;
+  if (cardId >= TOTAL_CARDS || from >= to) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", "invalid trend query");
+    return;
+  }
+  if (points > to - from + 1) points = to - from + 1;
+
+  static TrendQuery query;
+  memset(&query, 0, sizeof(query));
+  query.cardId = static_cast<uint16_t>(cardId);
+  query.from = from;
+  query.to = to;
+  query.points = static_cast<uint16_t>(points);
+  static uint8_t page[kTrendPageBytes];
+  for (uint32_t slot = 0; slot < store.pageSlots; ++slot) {
+    TrendPageHeader header = {};
+    if (!readTrendHeader(slot, header) || header.cardId != cardId ||
+        header.tLast < from || header.t0 > to) {
+      continue;
+    }
+    bool ok = esp_partition_read(store.partition, slot * kTrendPageBytes, page,
+                                 sizeof(page)) == ESP_OK;
+    uint16_t crc = 0;
+    memcpy(&crc, page + 26, 2);
+    page[26] = 0xFF;
+    page[27] = 0xFF;
+    ok = ok && crc == crc16Ccitt(page, sizeof(page)) &&
+         accumulateTrendPage(query, header, page + kTrendHeaderBytes);
+    if (ok) {
+      query.pages += 1;
+    } else {
+      query.corruptPages += 1;
+    }
+  }
+  // Samples not yet on flash.
+  for (uint8_t i = 0; i < AT_TREND_MAX_SERIES; ++i) {
+    const TrendOpenPage& open = store.pages[i];
+    if (open.count == 0 || open.cardId != cardId) continue;
+    const TrendPageHeader header = {0,       open.cardId, open.count, open.t0,
+                                    open.v0, open.tLast,  open.bits};
+    accumulateTrendPage(query, header, open.payload);
+  }
+
+  gPortalServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  gPortalServer.send(200, "application/json", "");
+  static MetricsStream out;
+  out.length = 0;
+  const uint64_t spanS = static_cast<uint64_t>(to - from) + 1;
+  writeMetric(out,
+              "{\"ok\":true,\"cardId\":%lu,\"from\":%lu,\"to\":%lu,"
+              "\"bucketS\":%.1f,\"pages\":%lu,\"corruptPages\":%lu,\"points\":[",
+              static_cast<unsigned long>(cardId), static_cast<unsigned long>(from),
+              static_cast<unsigned long>(to),
+              static_cast<double>(spanS) / query.points,
+              static_cast<unsigned long>(query.pages),
+              static_cast<unsigned long>(query.corruptPages));
+  bool first = true;
+  for (uint16_t b = 0; b < query.points; ++b) {
+    if (query.count[b] == 0) continue;
+    const uint32_t bucketStart =
+        from + static_cast<uint32_t>(spanS * b / query.points);
+    writeMetric(out, "%s[%lu,%lu,%lu,%.2f,%lu]", first ? "" : ",",
+                static_cast<unsigned long>(bucketStart),
+                static_cast<unsigned long>(query.min[b]),
+                static_cast<unsigned long>(query.max[b]),
+                static_cast<double>(query.sum[b]) / query.count[b],
+                static_cast<unsigned long>(query.count[b]));
+    first = false;
+  }
+  writeMetric(out, "],\"error\":null}");
+  flushMetrics(out);
+  gPortalServer.sendContent("", 0);
+}
+
+void journalSegmentPath(char* out, size_t outSize, uint32_t number) {
+  snprintf(out, outSize, "%s/%08lu.seg", kJournalDir,
+           static_cast<unsigned long>(number));
+}
+
+// Core1: stamps seq and time and queues the record for the next flush. Time
+// is clamped so it never decreases along seq, which keeps it searchable.
+void appendJournalRecord(JournalRecord record, uint32_t timeS) {
+  JournalStore& store = gJournalStore;
+  if (!store.ready) return;
+  if (store.pending >= AT_JOURNAL_BATCH_RECORDS && !flushJournal()) {
+    store.overflowed += 1;
+    return;
+  }
+  if (timeS < store.lastTimeS) timeS = store.lastTimeS;
+  record.seq = store.nextSeq++;
+  record.timeS = timeS;
+  store.lastTimeS = timeS;
+  if (store.pending == 0) store.pendingSinceMs = millis();
+  store.batch[store.pending++] = record;
+  store.appended += 1;
+}
+
+// Core1 events. Commits and restores carry the origin of the request.
+void recordJournalEvent(journalKind kind, uint8_t code, uint16_t cardId,
+                        uint32_t detail, uint32_t aux) {
+  JournalRecord record = {};
+  record.kind = static_cast<uint8_t>(kind);
+  record.code = code;
+  record.cardId = cardId;
+  if (kind == Journal_Commit || kind == Journal_Restore) {
+    record.origin = static_cast<uint8_t>(gCommandOrigin);
+    record.client = currentCommandClient();
+  }
+  record.detail = detail;
+  record.aux = aux;
+  appendJournalRecord(record, wallClockSeconds());
+}
+
+// Starts a segment after the newest one; a full journal deletes its oldest.
+void openJournalSegment() {
+  JournalStore& store = gJournalStore;
+  if (store.segmentCount == AT_JOURNAL_SEGMENTS) {
+    char path[32];
+    journalSegmentPath(path, sizeof(path), store.segments[0].number);
+    LittleFS.remove(path);
+    memmove(&store.segments[0], &store.segments[1],
+            (AT_JOURNAL_SEGMENTS - 1) * sizeof(JournalSegment));
+    store.segmentCount -= 1;
+    store.evictions += 1;
+  }
+  const uint32_t number =
+      (store.segmentCount > 0) ? store.segments[store.segmentCount - 1].number + 1 : 1;
+  JournalSegment& segment = store.segments[store.segmentCount++];
+  memset(&segment, 0, sizeof(segment));
+  segment.number = number;
+}
+
+// Core1: writes the batch with one append per segment touched. A failed
+// write keeps the rest of the batch for a fresh segment and evicts the
+// oldest one, since the journal shares LittleFS with the config.
+bool flushJournal() {
+  JournalStore& store = gJournalStore;
+  if (!store.ready || store.pending == 0) return true;
+  const uint32_t startUs = micros();
+  uint16_t done = 0;
+  bool ok = true;
+  while (done < store.pending) {
+    if (store.sealed || store.segmentCount == 0 ||
+        store.segments[store.segmentCount - 1].count >= AT_JOURNAL_SEGMENT_RECORDS) {
+      openJournalSegment();
+      store.sealed = false;
+    }
+    JournalSegment& segment = store.segments[store.segmentCount - 1];
+    uint16_t n = store.pending - done;
+    if (n > AT_JOURNAL_SEGMENT_RECORDS - segment.count) {
+      n = AT_JOURNAL_SEGMENT_RECORDS - segment.count;
+    }
+    char path[32];
+    journalSegmentPath(path, sizeof(path), segment.number);
+    File file = LittleFS.open(path, "a");
+    const size_t bytes = n * sizeof(JournalRecord);
+    ok = file && file.write(reinterpret_cast<const uint8_t*>(&store.batch[done]),
+                            bytes) == bytes;
+    if (file) file.close();
+    if (!ok) break;
+    if (segment.count == 0) segment.firstSeq = store.batch[done].seq;
+    markJournalRecords(segment.marks, segment.count, &store.batch[done], n);
+    segment.count += n;
+    segment.lastTimeS = store.batch[done + n - 1].timeS;
+    done += n;
+  }
+  memmove(store.batch, store.batch + done,
+          (store.pending - done) * sizeof(JournalRecord));
+  store.pending -= done;
+  store.pendingSinceMs = millis();
+  if (!ok) {
+    store.writeFailures += 1;
+    if (store.segments[store.segmentCount - 1].count == 0) {
+      char path[32];
+      journalSegmentPath(path, sizeof(path),
+                         store.segments[store.segmentCount - 1].number);
+      LittleFS.remove(path);
+      store.segmentCount -= 1;
+    }
+    store.sealed = true;
+    if (store.segmentCount > 1) {
+      char path[32];
+      journalSegmentPath(path, sizeof(path), store.segments[0].number);
+      LittleFS.remove(path);
+      memmove(&store.segments[0], &store.segments[1],
+              (store.segmentCount - 1) * sizeof(JournalSegment));
+      store.segmentCount -= 1;
+      store.evictions += 1;
+    }
+    if (store.pending < AT_JOURNAL_BATCH_RECORDS) {
+      recordJournalEvent(Journal_Fault, Fault_StorageWrite, kInvalidCardId,
+                         store.pending, 0);
+    }
+    return false;
+  }
+  store.flushes += 1;
+  store.lastFlushUs = micros() - startUs;
+  if (store.lastFlushUs > store.maxFlushUs) store.maxFlushUs = store.lastFlushUs;
+  return true;
+}
+
+// Core1: moves kernel events into the batch. They carry uptime, so their
+// time is back-dated from the moment they are drained.
+void drainJournalLane() {
+  JournalStore& store = gJournalStore;
+  const uint32_t nowMs = millis();
+  const uint32_t nowS = wallClockSeconds();
+  uint32_t tail = gJournalLane.tail.load(std::memory_order_relaxed);
+  const uint32_t head = gJournalLane.head.load(std::memory_order_acquire);
+  while (tail != head) {
+    const JournalEvent event =
+        gJournalLane.events[tail & (AT_JOURNAL_QUEUE_DEPTH - 1)];
+    tail += 1;
+    gJournalLane.tail.store(tail, std::memory_order_release);
+    const uint32_t ageS = (nowMs - event.atMs) / 1000;
+    appendJournalRecord(event.record, (ageS < nowS) ? nowS - ageS : 0);
+  }
+  const uint32_t dropped = gJournalLane.dropped.load(std::memory_order_relaxed);
+  if (dropped != store.reportedDrops) {
+    recordJournalEvent(Journal_Fault, Fault_JournalDropped, kInvalidCardId,
+                       dropped - store.reportedDrops, 0);
+    store.reportedDrops = dropped;
+  }
+}
+
+// Core1, online and offline. A full batch flushes on append; a partial one
+// once its oldest record has waited AT_JOURNAL_FLUSH_MS.
+void handleJournalLoop() {
+  JournalStore& store = gJournalStore;
+  if (!store.ready) return;
+  drainJournalLane();
+  if (store.pending > 0 &&
+      (millis() - store.pendingSinceMs) >= AT_JOURNAL_FLUSH_MS) {
+    flushJournal();
+  }
+}
+
+bool readJournalRecord(File& file, uint32_t index, JournalRecord& record) {
+  return file.seek(index * sizeof(JournalRecord)) &&
+         file.read(reinterpret_cast<uint8_t*>(&record), sizeof(record)) ==
+             sizeof(record);
+}
+
+// Rebuilds the sparse index from the segment files, one read per stride,
+// and continues seq and the wall clock after the newest record. Segments
+// beyond AT_JOURNAL_SEGMENTS (a smaller build) are deleted.
+void initJournal() {
+  JournalStore& store = gJournalStore;
+  if (!LittleFS.exists(kJournalDir) && !LittleFS.mkdir(kJournalDir)) {
+    gConsole.println("Journal: cannot create /journal");
+    return;
+  }
+  uint32_t numbers[AT_JOURNAL_SEGMENTS];
+  uint8_t found = 0;
+  uint32_t stale[8];
+  uint8_t staleCount = 0;
+  File dir = LittleFS.open(kJournalDir);
+  for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile()) {
+    const char* name = entry.name();
+    const char* base = strrchr(name, '/');
+    base = (base != nullptr) ? base + 1 : name;
+    char* end = nullptr;
+    uint32_t number = strtoul(base, &end, 10);
+    entry.close();
+    if (end == base || strcmp(end, ".seg") != 0) continue;
+    if (found < AT_JOURNAL_SEGMENTS) {
+      numbers[found++] = number;
+    } else if (number > numbers[0]) {
+      const uint32_t oldest = numbers[0];
+      numbers[0] = number;
+      number = oldest;
+      if (staleCount < 8) stale[staleCount++] = number;
+    } else if (staleCount < 8) {
+      stale[staleCount++] = number;
+    }
+    // Ascending, so numbers[0] is always the oldest kept.
+    for (uint8_t i = 1; i < found; ++i) {
+      for (uint8_t j = i; j > 0 && numbers[j - 1] > numbers[j]; --j) {
+        const uint32_t swap = numbers[j];
+        numbers[j] = numbers[j - 1];
+        numbers[j - 1] = swap;
+      }
+    }
+  }
+  dir.close();
+  char path[32];
+  for (uint8_t i = 0; i < staleCount; ++i) {
+    journalSegmentPath(path, sizeof(path), stale[i]);
+    LittleFS.remove(path);
+  }
+
+  for (uint8_t i = 0; i < found; ++i) {
+    journalSegmentPath(path, sizeof(path), numbers[i]);
+    File file = LittleFS.open(path, "r");
+    if (!file) continue;
+    size_t count = file.size() / sizeof(JournalRecord);
+    if (count > AT_JOURNAL_SEGMENT_RECORDS) count = AT_JOURNAL_SEGMENT_RECORDS;
+    JournalSegment& segment = store.segments[store.segmentCount];
+    memset(&segment, 0, sizeof(segment));
+    segment.number = numbers[i];
+    segment.count = static_cast<uint16_t>(count);
+    JournalRecord record = {};
+    bool ok = count > 0 && readJournalRecord(file, 0, record);
+    segment.firstSeq = record.seq;
+    for (uint32_t index = 0; ok && index < count; index += kJournalIndexStride) {
+      ok = readJournalRecord(file, index, record);
+      segment.marks[index / kJournalIndexStride] = record.timeS;
+    }
+    ok = ok && readJournalRecord(file, count - 1, record);
+    segment.lastTimeS = record.timeS;
+    file.close();
+    if (!ok) {
+      LittleFS.remove(path);
+      continue;
+    }
+    store.segmentCount += 1;
+  }
+  if (store.segmentCount > 0) {
+    const JournalSegment& newest = store.segments[store.segmentCount - 1];
+    store.nextSeq = newest.firstSeq + newest.count;
+    store.lastTimeS = newest.lastTimeS;
+    if (newest.lastTimeS >= gWallClock.bootBaseS) {
+      gWallClock.bootBaseS = newest.lastTimeS + 1;
+    }
+  } else {
+    store.nextSeq = 1;
+  }
+  store.ready = true;
+  gConsole.printf("Journal: %u segments, next seq %lu\n", store.segmentCount,
+                static_cast<unsigned long>(store.nextSeq));
+}
+
+// Sequential reader over the segments and then the unflushed batch. Flash is
+// read one index stride at a time.
+struct JournalCursor {
+  uint8_t segment;  // == segmentCount: reading the batch
+  uint16_t index;
+  File file;
+  uint16_t bufferStart;
+  uint16_t bufferCount;
+  JournalRecord buffer[kJournalIndexStride];
+};
+
+bool nextJournalRecord(JournalCursor& cursor, JournalRecord& record) {
+  const JournalStore& store = gJournalStore;
+  while (cursor.segment < store.segmentCount) {
+    const JournalSegment& segment = store.segments[cursor.segment];
+    if (cursor.index >= segment.count) {
+      if (cursor.file) cursor.file.close();
+      cursor.file = File();
+      cursor.segment += 1;
+      cursor.index = 0;
+      cursor.bufferCount = 0;
+      continue;
+    }
+    if (cursor.bufferCount == 0 || cursor.index < cursor.bufferStart ||
+        cursor.index >= cursor.bufferStart + cursor.bufferCount) {
+      if (!cursor.file) {
+        char path[32];
+        journalSegmentPath(path, sizeof(path), segment.number);
+        cursor.file = LittleFS.open(path, "r");
+      }
+      uint16_t n = segment.count - cursor.index;
+      if (n > kJournalIndexStride) n = kJournalIndexStride;
+      const size_t bytes = n * sizeof(JournalRecord);
+      if (!cursor.file ||
+          !cursor.file.seek(cursor.index * sizeof(JournalRecord)) ||
+          cursor.file.read(reinterpret_cast<uint8_t*>(cursor.buffer), bytes) !=
+              bytes) {
+        cursor.index = segment.count;
+        continue;
+      }
+      cursor.bufferStart = cursor.index;
+      cursor.bufferCount = n;
+    }
+    record = cursor.buffer[cursor.index - cursor.bufferStart];
+    cursor.index += 1;
+    return true;
+  }
+  if (cursor.index >= store.pending) return false;
+  record = store.batch[cursor.index++];
+  return true;
+}
+
+// Binary search over the segment index; seq is contiguous inside a segment.
+void seekJournalBySeq(JournalCursor& cursor, uint32_t fromSeq) {
+  const JournalStore& store = gJournalStore;
+  const uint8_t lo =
+      findJournalSegmentBySeq(store.segments, store.segmentCount, fromSeq);
+  cursor.segment = lo;
+  const uint32_t firstSeq = (lo < store.segmentCount) ? store.segments[lo].firstSeq
+                            : (store.pending > 0)     ? store.batch[0].seq
+                                                      : fromSeq;
+  cursor.index = (fromSeq > firstSeq) ? fromSeq - firstSeq : 0;
+}
+
+// Binary search over segments by their last time, then over the segment's
+// marks; at most one stride is scanned before the first match.
+void seekJournalByTime(JournalCursor& cursor, uint32_t from) {
+  const JournalStore& store = gJournalStore;
+  cursor.segment =
+      findJournalSegmentByTime(store.segments, store.segmentCount, from);
+  cursor.index = (cursor.segment < store.segmentCount)
+                     ? findJournalIndexByTime(store.segments[cursor.segment], from)
+                     : 0;
+}
+
+// Restore sources: history depth 0..3, then CONFIG_ID and FACTORY.
+const char* journalRestoreSource(uint8_t code) {
+  if (code < 4) return kHistoryDepthSources[code];
+  return (code == 4) ? "CONFIG_ID" : "FACTORY";
+}
+
+void writeJournalRecord(MetricsStream& out, const JournalRecord& record,
+                        bool first) {
+  writeMetric(out, "%s{\"seq\":%lu,\"t\":%lu,\"kind\":\"%s\"", first ? "" : ",",
+              static_cast<unsigned long>(record.seq),
+              static_cast<unsigned long>(record.timeS),
+              toString(static_cast<journalKind>(record.kind)));
+  if (record.cardId != kInvalidCardId) {
+    writeMetric(out, ",\"cardId\":%u", record.cardId);
+  }
+  char hash[9];
+  switch (record.kind) {
+    case Journal_Boot:
+      formatHash(hash, sizeof(hash), record.detail);
+      writeMetric(out, ",\"resetReason\":%u,\"configId\":\"%s\"", record.code, hash);
+      break;
+    case Journal_Transition:
+      writeMetric(out,
+                  ",\"state\":\"%s\",\"from\":\"%s\",\"logicalState\":%s,"
+                  "\"physicalState\":%s,\"resetOverride\":%s",
+                  toString(static_cast<cardState>(record.code)),
+                  toString(static_cast<cardState>(record.aux)),
+                  (record.detail & 0x01) ? "true" : "false",
+                  (record.detail & 0x02) ? "true" : "false",
+                  (record.detail & 0x04) ? "true" : "false");
+      break;
+    case Journal_Command:
+      writeMetric(out,
+                  ",\"command\":\"%s\",\"origin\":\"%s\",\"client\":%u,"
+                  "\"applied\":%s,\"value\":%lu,\"flag\":%s",
+                  toString(static_cast<kernelCommandType>(record.code)),
+                  toString(static_cast<commandOrigin>(record.origin)),
+                  record.client, record.result ? "true" : "false",
+                  static_cast<unsigned long>(record.detail),
+                  record.aux ? "true" : "false");
+      break;
+    case Journal_Restore:
+      writeMetric(out, ",\"source\":\"%s\"", journalRestoreSource(record.code));
+      // fall through
+    case Journal_Commit:
+      formatHash(hash, sizeof(hash), record.detail);
+      writeMetric(out,
+                  ",\"configId\":\"%s\",\"version\":%lu,\"origin\":\"%s\","
+                  "\"client\":%u",
+                  hash, static_cast<unsigned long>(record.aux),
+                  toString(static_cast<commandOrigin>(record.origin)),
+                  record.client);
+      break;
+    case Journal_Fault:
+      writeMetric(out, ",\"fault\":\"%s\",\"detail\":%lu",
+                  toString(static_cast<journalFault>(record.code)),
+                  static_cast<unsigned long>(record.detail));
+      break;
+    case Journal_Firmware:
+      writeMetric(out, ",\"trial\":\"%s\",\"bytes\":%lu,\"boots\":%lu",
+                  toString(static_cast<otaTrialState>(record.code)),
+                  static_cast<unsigned long>(record.detail),
+                  static_cast<unsigned long>(record.aux));
+      break;
+    default:
+      break;
+  }
+  writeMetric(out, "}");
+}
+
+// GET /api/journal?[fromSeq=N | from=S][&to=S][&kind=Journal_*][&cardId=N]
+// [&limit=N]: records in seq order, streamed like /api/trend. When "more"
+// is set, nextSeq continues the same query.
+void handleHttpGetJournal() {
+  JournalStore& store = gJournalStore;
+  if (!store.ready) {
+    writeConfigErrorResponse(503, "UNAVAILABLE", "journal not mounted");
+    return;
+  }
+  const uint32_t startUs = micros();
+  uint32_t fromSeq = 0;
+  uint32_t from = 0;
+  uint32_t to = UINT32_MAX;
+  uint32_t cardId = kInvalidCardId;
+  uint32_t limit = kJournalDefaultResults;
+  journalKind kind = Journal_Boot;
+  const bool kindFilter = gPortalServer.hasArg("kind");
+  if (!parseUInt32Arg("fromSeq", 0, fromSeq) || !parseUInt32Arg("from", 0, from) ||
+      !parseUInt32Arg("to", UINT32_MAX, to) ||
+      !parseUInt32Arg("cardId", kInvalidCardId, cardId) ||
+      !parseUInt32Arg("limit", kJournalDefaultResults, limit) ||
+      (kindFilter && !tryParseJournalKind(gPortalServer.arg("kind").c_str(), kind)) ||
+      from > to) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED", "invalid journal query");
+    return;
+  }
+  if (limit == 0 || limit > AT_JOURNAL_MAX_RESULTS) limit = AT_JOURNAL_MAX_RESULTS;
+  drainJournalLane();
+
+  static JournalCursor cursor;
+  cursor.file = File();
+  cursor.bufferCount = 0;
+  if (gPortalServer.hasArg("fromSeq")) {
+    seekJournalBySeq(cursor, fromSeq);
+  } else {
+    seekJournalByTime(cursor, from);
+  }
+  const uint32_t firstSeq = (store.segmentCount > 0) ? store.segments[0].firstSeq
+                            : (store.pending > 0)    ? store.batch[0].seq
+                                                     : store.nextSeq;
+
+  gPortalServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  gPortalServer.send(200, "application/json", "");
+  static MetricsStream out;
+  out.length = 0;
+  writeMetric(out, "{\"ok\":true,\"firstSeq\":%lu,\"records\":[",
+              static_cast<unsigned long>(firstSeq));
+  uint32_t emitted = 0;
+  uint32_t nextSeq = store.nextSeq;
+  bool more = false;
+  JournalRecord record = {};
+  while (nextJournalRecord(cursor, record)) {
+    if (record.seq < fromSeq || record.timeS < from) continue;
+    if (record.timeS > to) break;
+    if (emitted == limit) {
+      more = true;
+      nextSeq = record.seq;
+      break;
+    }
+    if ((kindFilter && record.kind != kind) ||
+        (cardId != kInvalidCardId && record.cardId != cardId)) {
+      continue;
+    }
+    writeJournalRecord(out, record, emitted == 0);
+    emitted += 1;
+  }
+  if (cursor.file) cursor.file.close();
+  cursor.file = File();
+  store.queries += 1;
+  store.lastQueryUs = micros() - startUs;
+  if (store.lastQueryUs > store.maxQueryUs) store.maxQueryUs = store.lastQueryUs;
+  writeMetric(out, "],\"nextSeq\":%lu,\"more\":%s,\"queryUs\":%lu,\"error\":null}",
+              static_cast<unsigned long>(nextSeq), more ? "true" : "false",
+              static_cast<unsigned long>(store.lastQueryUs));
+  flushMetrics(out);
+  gPortalServer.sendContent("", 0);
+}
+
+// Core1: broadcasts every queued alarm event. Latency runs from the scan that
+// saw the transition to the moment the frame is handed to the socket layer;
+// the budget is only counted (overBudget), never enforced.
+void publishAlarmEvents() {
+  uint32_t tail = gAlarmLane.tail.load(std::memory_order_relaxed);
+  const uint32_t head = gAlarmLane.head.load(std::memory_order_acquire);
+  while (tail != head) {
+    const AlarmEvent event =
+        gAlarmLane.events[tail & (AT_ALARM_QUEUE_DEPTH - 1)];
+    tail += 1;
+    gAlarmLane.tail.store(tail, std::memory_order_release);
+
+    const uint32_t latencyUs = micros() - event.enqueuedUs;
+    JsonDocument doc;
+    doc["type"] = "alarm";
+    doc["seq"] = event.seq;
+    doc["cardId"] = event.cardId;
+    doc["state"] = toString(event.state);
+    doc["logicalState"] = event.logicalState;
+    doc["physicalState"] = event.physicalState;
+    doc["resetOverride"] = event.resetOverride;
+    doc["latencyUs"] = latencyUs;
+    char payload[192];
+    const size_t length = serializeJson(doc, payload, sizeof(payload));
+    gWsServer.broadcastTXT(payload, length);
+    gWsFramesSent += 1;
+    gWsBytesSent += length;
+
+    gAlarmLane.sent += 1;
+    gAlarmLane.lastLatencyUs = latencyUs;
+    if (latencyUs > gAlarmLane.maxLatencyUs) gAlarmLane.maxLatencyUs = latencyUs;
+    if (latencyUs > AT_ALARM_LATENCY_BUDGET_US) gAlarmLane.overBudget += 1;
+  }
+}
+
+// Separate, low-rate document so maintenance counters never weigh on the
+// runtime snapshot stream.
+void publishDiagnosticsWebSocket() {
+  static uint32_t lastPublishMs = 0;
+  const uint32_t nowMs = millis();
+  if ((nowMs - lastPublishMs) < kDiagnosticsPublishMs) return;
+  lastPublishMs = nowMs;
+
+  JsonDocument doc;
+  serializeRuntimeDiagnostics(doc, nowMs);
+  String payload;
+  serializeJson(doc, payload);
+  gWsServer.broadcastTXT(payload);
+  gWsFramesSent += 1;
+  gWsBytesSent += payload.length();
+}
+
+bool loadOtaTrial(OtaTrial& trial) {
+  JsonDocument doc;
+  if (!readJsonFromPath(kOtaTrialPath, doc)) return false;
+  if (!tryParseOtaTrialState(doc["state"] | "", trial.state)) return false;
+  snprintf(trial.previous, sizeof(trial.previous), "%s", doc["previous"] | "");
+  snprintf(trial.target, sizeof(trial.target), "%s", doc["target"] | "");
+  snprintf(trial.sha256, sizeof(trial.sha256), "%s", doc["sha256"] | "");
+  snprintf(trial.reason, sizeof(trial.reason), "%s", doc["reason"] | "");
+  trial.bytes = doc["bytes"] | 0;
+  trial.boots = doc["boots"] | 0;
+  return true;
+}
+
+bool saveOtaTrial(const OtaTrial& trial) {
+  JsonDocument doc;
+  doc["state"] = toString(trial.state);
+  doc["previous"] = trial.previous;
+  doc["target"] = trial.target;
+  doc["sha256"] = trial.sha256;
+  doc["bytes"] = trial.bytes;
+  doc["boots"] = trial.boots;
+  doc["reason"] = trial.reason;
+  return writeJsonToPath(kOtaTrialPath, doc);
+}
+
+// Keeps a freshly switched image pending-verify in the bootloader until the
+// trial confirms it, so a crash before the file-based trial runs still rolls
+// back when the framework's bootloader has rollback enabled.
+extern "C" bool verifyRollbackLater() { return true; }
+
+void journalOtaTrial() {
+  const OtaTrial& trial = gOtaTrial;
+  recordJournalEvent(Journal_Firmware, static_cast<uint8_t>(trial.state),
+                     kInvalidCardId, trial.bytes, trial.boots);
+}
+
+// Marking the image invalid keeps the bootloader from selecting it again;
+// that call only returns when no rollback is possible, so the boot partition
+// is switched by hand as a fallback.
+void applyOtaTrialAction(otaTrialAction action) {
+  OtaTrial& trial = gOtaTrial;
+  if (action == OtaAction_None) return;
+  if (action == OtaAction_Confirm) esp_ota_mark_app_valid_cancel_rollback();
+  saveOtaTrial(trial);
+  journalOtaTrial();
+  if (action != OtaAction_RollBack) return;
+  gConsole.printf("OTA: rolling back to %s (%s)\n", trial.previous, trial.reason);
+  flushJournal();
+  flushTrendPages();
+  delay(100);
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+  const esp_partition_t* previous = esp_partition_find_first(
+      ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, trial.previous);
+  if (previous == nullptr || esp_ota_set_boot_partition(previous) != ESP_OK) {
+    gConsole.println("OTA: rollback target missing; keeping this image");
+    return;
+  }
+  ESP.restart();
+}
+
+// Boot half of the trial. Runs right after LittleFS mounts, before anything
+// else in setup can crash, so every boot of the image on trial is counted.
+// The journal is not up yet; setup records the outcome once it is.
+otaTrialAction initOtaTrial() {
+  if (!loadOtaTrial(gOtaTrial)) return OtaAction_None;
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  const bool runningTarget =
+      running != nullptr && strcmp(running->label, gOtaTrial.target) == 0;
+  const otaTrialAction action =
+      stepOtaTrial(gOtaTrial, OtaEvent_Boot, runningTarget, AT_OTA_TRIAL_BOOTS);
+  applyOtaTrialAction(action);
+  return action;
+}
+
+// Core1: the image on trial is healthy once the kernel is still scanning
+// after AT_OTA_HEALTH_MS, and unhealthy if it has stopped for as long again.
+void handleOtaLoop() {
+  if (gOtaTrial.state != OtaTrial_Testing) return;
+  static uint32_t lastCheckMs = 0;
+  static uint32_t lastScans = 0;
+  static uint32_t lastProgressMs = 0;
+  const uint32_t nowMs = millis();
+  if (nowMs < AT_OTA_HEALTH_MS || (nowMs - lastCheckMs) < 1000) return;
+  lastCheckMs = nowMs;
+  portENTER_CRITICAL(&gSnapshotMux);
+  const uint32_t scans = gSharedKernelMetrics.scans;
+  portEXIT_CRITICAL(&gSnapshotMux);
+  if (scans != lastScans) {
+    lastScans = scans;
+    lastProgressMs = nowMs;
+    if (scans > 0) {
+      applyOtaTrialAction(
+          stepOtaTrial(gOtaTrial, OtaEvent_Healthy, true, AT_OTA_TRIAL_BOOTS));
+    }
+    return;
+  }
+  if ((nowMs - lastProgressMs) >= AT_OTA_HEALTH_MS) {
+    applyOtaTrialAction(
+        stepOtaTrial(gOtaTrial, OtaEvent_Unhealthy, true, AT_OTA_TRIAL_BOOTS));
+  }
+}
+
+bool parseHexBytes(const String& text, uint8_t* out, size_t maxBytes,
+                   size_t& length) {
+  length = text.length() / 2;
+  if ((text.length() % 2) != 0 || length > maxBytes) return false;
+  for (size_t i = 0; i < length; ++i) {
+    char pair[3] = {text[i * 2], text[i * 2 + 1], '\0'};
+    char* end = nullptr;
+    out[i] = static_cast<uint8_t>(strtoul(pair, &end, 16));
+    if (end != pair + 2) return false;
+  }
+  return true;
+}
+
+bool verifyOtaSignature(const uint8_t* hash, const uint8_t* signature,
+                        size_t signatureLength) {
+  static const char kPublicKey[] = AT_OTA_PUBLIC_KEY_PEM;
+  if (kPublicKey[0] == '\0') return AT_OTA_ALLOW_UNSIGNED != 0;
+  mbedtls_pk_context key;
+  mbedtls_pk_init(&key);
+  const bool ok =
+      mbedtls_pk_parse_public_key(&key,
+                                  reinterpret_cast<const unsigned char*>(kPublicKey),
+                                  sizeof(kPublicKey)) == 0 &&
+      mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, hash, 32, signature,
+                        signatureLength) == 0;
+  mbedtls_pk_free(&key);
+  return ok;
+}
+
+// Waits for the next completed scan, or two intervals when the kernel is not
+// scanning, so a flash erase or write starts in the idle gap after it.
+void waitForScanGap() {
+  const uint32_t seq = gScanCompleteSeq.load(std::memory_order_acquire);
+  const uint32_t waitStartMs = millis();
+  const uint32_t timeoutMs = 2 * effectiveScanIntervalMs() + 2;
+  gScanGapWaiting.store(true, std::memory_order_relaxed);
+  while (gScanCompleteSeq.load(std::memory_order_acquire) == seq &&
+         (millis() - waitStartMs) < timeoutMs) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1));
+  }
+  gScanGapWaiting.store(false, std::memory_order_relaxed);
 }
 
-void initWebSocketServer() {
-  if (gWsServerInitialized) return;
-  gWsServer.begin();
-  gWsServer.onEvent(handleWebSocketEvent);
-  gWsServerInitialized = true;
-  Serial.println("WebSocket server started on :81");
+// Core1 is inside the request for the whole transfer, so alarms and the
+// exchange are serviced here.
+bool writeOtaFlashChunk(OtaSession& session, const uint8_t* data, size_t length) {
+  publishAlarmEvents();
+  handleExchangeLoop();
+  waitForScanGap();
+  const uint32_t startUs = micros();
+  const bool ok = esp_ota_write(session.handle, data, length) == ESP_OK;
+  session.lastChunkUs = micros() - startUs;
+  if (session.lastChunkUs > session.maxChunkUs) session.maxChunkUs = session.lastChunkUs;
+  session.chunks += 1;
+  return ok;
 }
 
-void handleWebSocketLoop() { gWsServer.loop(); }
+void failOtaSession(int status, const char* reason) {
+  OtaSession& session = gOtaSession;
+  if (session.active) {
+    esp_ota_abort(session.handle);
+    mbedtls_sha256_free(&session.sha);
+    recordJournalEvent(Journal_Fault, Fault_OtaRejected, kInvalidCardId,
+                       session.received, 0);
+  }
+  session.active = false;
+  session.errorStatus = status;
+  session.error = reason;
+  gOtaWriting.store(false, std::memory_order_relaxed);
+}
 
-void publishRuntimeSnapshotWebSocket() {
-  static uint32_t lastPublishMs = 0;
-  static uint32_t lastSeq = 0;
+void beginOtaSession() {
+  OtaSession& session = gOtaSession;
+  memset(&session, 0, offsetof(OtaSession, buffer));
+  size_t hashLength = 0;
+  if (!parseHexBytes(gPortalServer.arg("sha256"), session.expectedHash,
+                     sizeof(session.expectedHash), hashLength) ||
+      hashLength != sizeof(session.expectedHash)) {
+    failOtaSession(400, "sha256 required");
+    return;
+  }
+  if (!parseHexBytes(gPortalServer.arg("signature"), session.signature,
+                     sizeof(session.signature), session.signatureLength)) {
+    failOtaSession(400, "invalid signature encoding");
+    return;
+  }
+  if (sizeof(AT_OTA_PUBLIC_KEY_PEM) <= 1 && !AT_OTA_ALLOW_UNSIGNED) {
+    failOtaSession(503, "no signing key configured");
+    return;
+  }
+  if (gOtaTrial.state == OtaTrial_Testing) {
+    failOtaSession(409, "running image not confirmed yet");
+    return;
+  }
+  session.target = esp_ota_get_next_update_partition(nullptr);
+  if (session.target == nullptr ||
+      esp_ota_begin(session.target, OTA_WITH_SEQUENTIAL_WRITES,
+                    &session.handle) != ESP_OK) {
+    failOtaSession(500, "no update partition");
+    return;
+  }
+  mbedtls_sha256_init(&session.sha);
+  mbedtls_sha256_starts(&session.sha, 0);
+  session.writeChunk = writeOtaFlashChunk;
+  session.startMs = millis();
+  session.active = true;
+  gOtaWriting.store(true, std::memory_order_relaxed);
+}
 
-  SharedRuntimeSnapshot snapshot = {};
-  copySharedRuntimeSnapshot(snapshot);
-  uint32_t nowMs = millis();
+void finishOtaSession() {
+  OtaSession& session = gOtaSession;
+  uint8_t hash[32];
+  if (!otaFlushBytes(session)) {
+    failOtaSession(500, "flash write failed");
+    return;
+  }
+  mbedtls_sha256_finish(&session.sha, hash);
+  if (memcmp(hash, session.expectedHash, sizeof(hash)) != 0) {
+    failOtaSession(400, "sha256 mismatch");
+    return;
+  }
+  if (!verifyOtaSignature(hash, session.signature, session.signatureLength)) {
+    failOtaSession(403, "signature rejected");
+    return;
+  }
+  mbedtls_sha256_free(&session.sha);
+  // esp_ota_end releases the handle even when the image fails validation.
+  session.active = false;
+  gOtaWriting.store(false, std::memory_order_relaxed);
+  if (esp_ota_end(session.handle) != ESP_OK ||
+      esp_ota_set_boot_partition(session.target) != ESP_OK) {
+    failOtaSession(400, "image rejected by bootloader check");
+    recordJournalEvent(Journal_Fault, Fault_OtaRejected, kInvalidCardId,
+                       session.received, 0);
+    return;
+  }
+  session.durationMs = millis() - session.startMs;
+  session.throughputBps = static_cast<uint32_t>(
+      static_cast<uint64_t>(session.received) * 1000 /
+      (session.durationMs > 0 ? session.durationMs : 1));
+
+  OtaTrial& trial = gOtaTrial;
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  trial.state = OtaTrial_Pending;
+  snprintf(trial.previous, sizeof(trial.previous), "%s",
+           running != nullptr ? running->label : "");
+  snprintf(trial.target, sizeof(trial.target), "%s", session.target->label);
+  for (size_t i = 0; i < sizeof(hash); ++i) {
+    snprintf(trial.sha256 + i * 2, 3, "%02x", hash[i]);
+  }
+  trial.bytes = session.received;
+  trial.boots = 0;
+  trial.reason[0] = '\0';
+  applyOtaTrialAction(OtaAction_Save);
+  session.completed = true;
+}
 
-  bool hasUpdate = (snapshot.seq != lastSeq);
-  bool dueHeartbeat = (nowMs - lastPublishMs) >= 1000;
-  if (!hasUpdate && !dueHeartbeat) return;
-  if ((nowMs - lastPublishMs) < 200 && hasUpdate) return;
+// POST /api/ota?sha256=<64 hex>[&signature=<DER hex>], body = app image as
+// application/octet-stream. The body is hashed and written as it arrives;
+// the boot partition only changes once hash and signature check out.
+void handleHttpOtaUpload() {
+  OtaSession& session = gOtaSession;
+  HTTPRaw& raw = gPortalServer.raw();
+  if (raw.status == RAW_START) {
+    beginOtaSession();
+    return;
+  }
+  if (!session.active) return;
+  if (raw.status == RAW_WRITE) {
+    mbedtls_sha256_update(&session.sha, raw.buf, raw.currentSize);
+    if (!otaAcceptBytes(session, raw.buf, raw.currentSize)) {
+      failOtaSession(500, "flash write failed");
+    }
+  } else if (raw.status == RAW_END) {
+    finishOtaSession();
+  } else {
+    failOtaSession(400, "upload aborted");
+  }
+}
 
+void handleHttpOtaDone() {
+  OtaSession& session = gOtaSession;
+  if (session.active) failOtaSession(400, "empty body");
+  if (!session.completed) {
+    writeConfigErrorResponse(session.errorStatus != 0 ? session.errorStatus : 400,
+                             "OTA_FAILED",
+                             session.error != nullptr ? session.error : "no image");
+    return;
+  }
+  KernelMetrics metrics;
+  portENTER_CRITICAL(&gSnapshotMux);
+  metrics = gSharedKernelMetrics;
+  portEXIT_CRITICAL(&gSnapshotMux);
   JsonDocument doc;
-  serializeRuntimeSnapshot(doc, nowMs);
-  String payload;
-  serializeJson(doc, payload);
-  gWsServer.broadcastTXT(payload);
-
-  lastPublishMs = nowMs;
-  lastSeq = snapshot.seq;
+  doc["ok"] = true;
+  doc["bytes"] = session.received;
+  doc["chunks"] = session.chunks;
+  doc["durationMs"] = session.durationMs;
+  doc["throughputBps"] = session.throughputBps;
+  doc["maxChunkUs"] = session.maxChunkUs;
+  doc["scanJitterMaxUs"] = metrics.otaJitterMaxUs;
+  doc["idleScanJitterMaxUs"] = metrics.jitterMaxUs;
+  doc["target"] = session.target->label;
+  doc["sha256"] = gOtaTrial.sha256;
+  doc["restarting"] = true;
+  doc["error"] = nullptr;
+  String body;
+  serializeJson(doc, body);
+  gPortalServer.send(200, "application/json", body);
+  flushJournal();
+  flushTrendPages();
+  gPortalServer.client().stop();
+  delay(200);
+  ESP.restart();
 }
 
 void configureHardwarePinsSafeState() {
@@ -1376,9 +7291,9 @@ void configureHardwarePinsSafeState() {
 void bootstrapCardsFromStorage() {
   // Keep factory baseline aligned with current firmware defaults.
   {
-    LogicCard factoryCards[TOTAL_CARDS];
+    static LogicCard factoryCards[TOTAL_CARDS];
     initializeCardArraySafeDefaults(factoryCards);
-    saveCardsToPath(kFactoryConfigPath, factoryCards);
+    saveCardsToPath(kFactoryConfigPath, factoryCards, nullptr);
   }
 
   initializeAllCardsSafeDefaults();
@@ -1386,35 +7301,43 @@ void bootstrapCardsFromStorage() {
     strncpy(gActiveVersion, "v1", sizeof(gActiveVersion) - 1);
     gActiveVersion[sizeof(gActiveVersion) - 1] = '\0';
     gConfigVersionCounter = 1;
-    Serial.println("Loaded config from /config.json");
+    gConsole.println("Loaded config from /config.json");
     return;
   }
 
   initializeAllCardsSafeDefaults();
+  resetCardLabelTable(gCardLabels);
+  memset(gScriptPrograms, 0, sizeof(gScriptPrograms));
   if (saveLogicCardsToLittleFS()) {
     strncpy(gActiveVersion, "v1", sizeof(gActiveVersion) - 1);
     gActiveVersion[sizeof(gActiveVersion) - 1] = '\0';
     gConfigVersionCounter = 1;
-    Serial.println("Saved default config to /config.json");
+    gConsole.println("Saved default config to /config.json");
   } else {
-    Serial.println("Failed to save default JSON to /config.json");
+    gConsole.println("Failed to save default JSON to /config.json");
   }
 }
 
-LogicCard* getCardById(uint8_t id) {
+LogicCard* getCardById(uint16_t id) {
   if (id >= TOTAL_CARDS) return nullptr;
   return &logicCards[id];
 }
 
-bool isDigitalInputCard(uint8_t id) { return id < DO_START; }
+bool isDigitalInputCard(uint16_t id) { return id < DO_START; }
+
+bool isDigitalOutputCard(uint16_t id) { return id >= DO_START && id < AI_START; }
 
-bool isDigitalOutputCard(uint8_t id) { return id >= DO_START && id < AI_START; }
+bool isAnalogInputCard(uint16_t id) { return id >= AI_START && id < SIO_START; }
 
-bool isAnalogInputCard(uint8_t id) { return id >= AI_START && id < SIO_START; }
+bool isSoftIOCard(uint16_t id) { return id >= SIO_START && id < SCRIPT_START; }
+bool isScriptCard(uint16_t id) { return id >= SCRIPT_START && id < PLUGIN_START; }
+bool isPluginCard(uint16_t id) { return id >= PLUGIN_START && id < TOTAL_CARDS; }
 
-bool isSoftIOCard(uint8_t id) { return id >= SIO_START && id < TOTAL_CARDS; }
+uint16_t inputSlotForCard(uint16_t id) {
+  return (id < DO_START) ? id : static_cast<uint16_t>(NUM_DI + (id - AI_START));
+}
 
-bool isInputCard(uint8_t id) {
+bool isInputCard(uint16_t id) {
   return isDigitalInputCard(id) || isAnalogInputCard(id);
 }
 
@@ -1431,15 +7354,31 @@ void initializeRuntimeControlState() {
   gBreakpointPaused = false;
   gTestModeActive = false;
   gGlobalOutputMask = false;
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  gExchangeSettings = {};
+  gExchangeSettings.nodeId = 1;
+  strncpy(gExchangeSettings.group, "239.255.60.1",
+          sizeof(gExchangeSettings.group) - 1);
+  gExchangeSettings.port = AT_EXCHANGE_PORT;
+  gStoredExchangeSettings = gExchangeSettings;
+  resetBreakpointHooks();
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     gCardBreakpoint[i] = false;
     gCardOutputMask[i] = false;
     gCardInputSource[i] = InputSource_Real;
     gCardForcedAIValue[i] = 0;
   }
+  for (uint16_t slot = 0; slot < NUM_REMOTE_SIO; ++slot) {
+    LogicCard& image = gRemoteCards[slot];
+    image = {};
+    image.id = REMOTE_START + slot;
+    image.type = SoftIO;
+    image.index = slot;
+    image.hwPin = kVirtualCardPin;
+    image.state = State_Remote_Stale;
+  }
 }
 
-bool isOutputMasked(uint8_t cardId) {
+bool isOutputMasked(uint16_t cardId) {
   if (!isDigitalOutputCard(cardId)) return false;
   return gGlobalOutputMask || gCardOutputMask[cardId];
 }
@@ -1452,15 +7391,20 @@ bool setRunModeCommand(runMode mode) {
   return true;
 }
 
-void serializeCardsToArray(const LogicCard* sourceCards, JsonArray& array) {
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+void serializeCardsToArray(const LogicCard* sourceCards, JsonArray& array,
+                           const CardLabelTable* labels) {
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     JsonObject obj = array.add<JsonObject>();
     serializeCardToJson(sourceCards[i], obj);
+    if (labels != nullptr) {
+      appendCardLabelFields(*labels, i, obj);
+      appendCardScriptField(*labels, i, obj);
+    }
   }
 }
 
 void initializeCardArraySafeDefaults(LogicCard* cards) {
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     initializeCardSafeDefaults(cards[i], i);
   }
 }
@@ -1468,7 +7412,7 @@ void initializeCardArraySafeDefaults(LogicCard* cards) {
 bool deserializeCardsFromArray(JsonArrayConst array, LogicCard* outCards) {
   if (array.size() != TOTAL_CARDS) return false;
   initializeCardArraySafeDefaults(outCards);
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     JsonVariantConst item = array[i];
     if (!item.is<JsonObjectConst>()) return false;
     deserializeCardFromJson(item, outCards[i]);
@@ -1476,6 +7420,48 @@ bool deserializeCardsFromArray(JsonArrayConst array, LogicCard* outCards) {
   return true;
 }
 
+bool isRemoteCardId(uint16_t id) {
+  return id >= REMOTE_START && id < REMOTE_START + NUM_REMOTE_SIO;
+}
+
+bool isReferenceCardId(uint16_t id) {
+  return id < TOTAL_CARDS || isRemoteCardId(id);
+}
+
+bool compileCardScript(const char* source, ScriptProgram& out,
+                       String& reason) {
+  const char* error = nullptr;
+  size_t offset = 0;
+  if (compileScriptSource(source, isReferenceCardId, out, error, offset)) {
+    return true;
+  }
+  reason = String(error) + " at offset " + String(static_cast<uint32_t>(offset));
+  return false;
+}
+
+// Compiles every script card of a (validated) cards array; other slots get
+// empty programs.
+bool compileCardScripts(JsonArrayConst array, ScriptProgram* out,
+                        String& reason) {
+  memset(out, 0, sizeof(ScriptProgram) * kScriptSlots);
+  for (JsonVariantConst item : array) {
+    const uint16_t id = item["id"] | kInvalidCardId;
+    if (!isScriptCard(id)) continue;
+    if (!compileCardScript(item["script"] | "", out[id - SCRIPT_START],
+                           reason)) {
+      reason = "script error (id=" + String(id) + "): " + reason;
+      return false;
+    }
+  }
+  return true;
+}
+
+uint16_t scriptInstructionsPerScan(const ScriptProgram* programs) {
+  uint16_t total = 0;
+  for (uint16_t i = 0; i < NUM_SCRIPT; ++i) total += programs[i].length;
+  return total;
+}
+
 bool validateConfigCardsArray(JsonArrayConst array, String& reason) {
   if (array.size() != TOTAL_CARDS) {
     reason = "cards size mismatch";
@@ -1498,6 +7484,8 @@ bool validateConfigCardsArray(JsonArrayConst array, String& reason) {
              strcmp(mode, "Mode_DO_Immediate") == 0 ||
              strcmp(mode, "Mode_DO_Gated") == 0;
     }
+    if (type == Script) return strcmp(mode, "Mode_Script") == 0;
+    if (type == Plugin) return strcmp(mode, "Mode_Plugin") == 0;
     return false;
   };
   auto isAlwaysOp = [](const char* op) -> bool {
@@ -1538,6 +7526,9 @@ bool validateConfigCardsArray(JsonArrayConst array, String& reason) {
       return isStateOp(op) || isTriggerOp(op) || isNumericOp(op) ||
              isProcessOp(op);
     }
+    if (targetType == Script || targetType == Plugin) {
+      return isStateOp(op) || isTriggerOp(op) || isNumericOp(op);
+    }
     return false;
   };
   auto isNonNegativeNumber = [](JsonVariantConst v) -> bool {
@@ -1557,17 +7548,21 @@ bool validateConfigCardsArray(JsonArrayConst array, String& reason) {
     return true;
   };
 
-  bool seenId[TOTAL_CARDS] = {};
-  logicCardType typeById[TOTAL_CARDS] = {};
-  bool typeKnown[TOTAL_CARDS] = {};
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  // Core1-only scratch tables; kept off the portal task stack.
+  static bool seenId[TOTAL_CARDS];
+  static logicCardType typeById[TOTAL_CARDS];
+  static bool typeKnown[TOTAL_CARDS];
+  memset(seenId, 0, sizeof(seenId));
+  memset(typeById, 0, sizeof(typeById));
+  memset(typeKnown, 0, sizeof(typeKnown));
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     JsonVariantConst item = array[i];
     if (!item.is<JsonObjectConst>()) {
       reason = "cards[] item is not object";
       return false;
     }
     JsonObjectConst card = item.as<JsonObjectConst>();
-    uint8_t id = card["id"] | 255;
+    uint16_t id = card["id"] | kInvalidCardId;
     if (id >= TOTAL_CARDS) {
       reason = "card id out of range";
       return false;
@@ -1580,20 +7575,21 @@ bool validateConfigCardsArray(JsonArrayConst array, String& reason) {
     typeById[id] = cardTypeFromString(card["type"] | "DigitalInput");
     typeKnown[id] = true;
 
-    uint8_t setAId = card["setA_ID"] | 255;
-    uint8_t setBId = card["setB_ID"] | 255;
-    uint8_t resetAId = card["resetA_ID"] | 255;
-    uint8_t resetBId = card["resetB_ID"] | 255;
-    if (setAId >= TOTAL_CARDS || setBId >= TOTAL_CARDS ||
-        resetAId >= TOTAL_CARDS || resetBId >= TOTAL_CARDS) {
+    uint16_t setAId = card["setA_ID"] | kInvalidCardId;
+    uint16_t setBId = card["setB_ID"] | kInvalidCardId;
+    uint16_t resetAId = card["resetA_ID"] | kInvalidCardId;
+    uint16_t resetBId = card["resetB_ID"] | kInvalidCardId;
+    if (!isReferenceCardId(setAId) || !isReferenceCardId(setBId) ||
+        !isReferenceCardId(resetAId) || !isReferenceCardId(resetBId)) {
       reason = "set/reset reference id out of range";
       return false;
     }
   }
 
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  uint16_t exchangePublishCount = 0;
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     JsonObjectConst card = array[i].as<JsonObjectConst>();
-    uint8_t id = card["id"] | 255;
+    uint16_t id = card["id"] | kInvalidCardId;
     if (id >= TOTAL_CARDS || !typeKnown[id]) {
       reason = "card id/type map error";
       return false;
@@ -1622,6 +7618,30 @@ bool validateConfigCardsArray(JsonArrayConst array, String& reason) {
     if (!ensureNonNegativeField(card, "resetB_Threshold", "resetB_Threshold"))
       return false;
 
+    JsonVariantConst label = card["label"];
+    if (!label.isNull() && (!label.is<const char*>() ||
+                            strlen(label.as<const char*>()) >
+                                kMaxCardLabelLength)) {
+      reason = "label must be a string of at most " +
+               String(static_cast<uint32_t>(kMaxCardLabelLength)) +
+               " chars (id=" + String(id) + ")";
+      return false;
+    }
+    JsonVariantConst unit = card["engineeringUnit"];
+    if (!unit.isNull()) {
+      if (typeById[id] != AnalogInput) {
+        reason = "engineeringUnit is only valid for AnalogInput cards";
+        return false;
+      }
+      if (!unit.is<const char*>() ||
+          strlen(unit.as<const char*>()) > kMaxEngineeringUnitLength) {
+        reason = "engineeringUnit must be a string of at most " +
+                 String(static_cast<uint32_t>(kMaxEngineeringUnitLength)) +
+                 " chars (id=" + String(id) + ")";
+        return false;
+      }
+    }
+
     if (typeById[id] == AnalogInput) {
       const double alpha = card["setting3"] | 0.0;
       if (alpha < 0.0 || alpha > 1.0) {
@@ -1630,24 +7650,123 @@ bool validateConfigCardsArray(JsonArrayConst array, String& reason) {
       }
     }
 
-    uint8_t setAId = card["setA_ID"] | 255;
-    uint8_t setBId = card["setB_ID"] | 255;
-    uint8_t resetAId = card["resetA_ID"] | 255;
-    uint8_t resetBId = card["resetB_ID"] | 255;
+    if (!card["exchangePublish"].isNull() && typeById[id] != SoftIO) {
+      reason = "exchangePublish is only valid for SoftIO cards";
+      return false;
+    }
+    if ((card["exchangePublish"] | false) &&
+        ++exchangePublishCount > AT_EXCHANGE_MAX_PUBLISH) {
+      reason = "too many exchangePublish cards (max " +
+               String(AT_EXCHANGE_MAX_PUBLISH) + ")";
+      return false;
+    }
+
+    if (!card["alarm"].isNull() && !card["alarm"].is<bool>()) {
+      reason = "alarm must be boolean (id=" + String(id) + ")";
+      return false;
+    }
+    if (!card["journal"].isNull() && !card["journal"].is<bool>()) {
+      reason = "journal must be boolean (id=" + String(id) + ")";
+      return false;
+    }
+
+    JsonVariantConst script = card["script"];
+    if (!script.isNull()) {
+      if (!isScriptCard(id)) {
+        reason = "script is only valid for Script cards";
+        return false;
+      }
+      if (!script.is<const char*>() ||
+          strlen(script.as<const char*>()) > kMaxScriptSourceLength) {
+        reason = "script must be a string of at most " +
+                 String(static_cast<uint32_t>(kMaxScriptSourceLength)) +
+                 " chars (id=" + String(id) + ")";
+        return false;
+      }
+    }
+
+    // Script ids are bound to compiled program slots and plugin ids to
+    // registered plugins, so both families are fixed by id.
+    if ((typeById[id] == Script) != isScriptCard(id)) {
+      reason = "Script type is only valid for script cards (id=" +
+               String(id) + ")";
+      return false;
+    }
+    if ((typeById[id] == Plugin) != isPluginCard(id)) {
+      reason = "Plugin type is only valid for registered plugin cards (id=" +
+               String(id) + ")";
+      return false;
+    }
+    if (isPluginCard(id)) {
+      const CardPlugin& plugin = *kCardPlugins[id - PLUGIN_START];
+      String pluginReason;
+      if (!plugin.validate(card, pluginReason)) {
+        reason = "plugin error (id=" + String(id) + ", " + plugin.name() +
+                 "): " + pluginReason;
+        return false;
+      }
+    }
+
+    JsonVariantConst deadbandModeField = card["reportDeadbandMode"];
+    if (!deadbandModeField.isNull() || !card["reportDeadband"].isNull()) {
+      if (typeById[id] != AnalogInput) {
+        reason = "reportDeadband is only valid for AnalogInput cards";
+        return false;
+      }
+      deadbandMode parsedDeadbandMode = Deadband_None;
+      if (!deadbandModeField.isNull() &&
+          !tryParseDeadbandMode(deadbandModeField.as<const char*>(),
+                                parsedDeadbandMode)) {
+        reason = "invalid reportDeadbandMode (id=" + String(id) + ")";
+        return false;
+      }
+      if (!ensureNonNegativeField(card, "reportDeadband", "reportDeadband"))
+        return false;
+      if (parsedDeadbandMode == Deadband_Percent &&
+          (card["reportDeadband"] | 0UL) > 10000UL) {
+        reason = "percent reportDeadband out of range (0..10000)";
+        return false;
+      }
+    }
+
+    uint16_t setAId = card["setA_ID"] | kInvalidCardId;
+    uint16_t setBId = card["setB_ID"] | kInvalidCardId;
+    uint16_t resetAId = card["resetA_ID"] | kInvalidCardId;
+    uint16_t resetBId = card["resetB_ID"] | kInvalidCardId;
     const char* setAOp = card["setA_Operator"] | "";
     const char* setBOp = card["setB_Operator"] | "";
     const char* resetAOp = card["resetA_Operator"] | "";
     const char* resetBOp = card["resetB_Operator"] | "";
 
-    if (!isOperatorAllowedForTarget(typeById[setAId], setAOp) ||
-        !isOperatorAllowedForTarget(typeById[setBId], setBOp) ||
-        !isOperatorAllowedForTarget(typeById[resetAId], resetAOp) ||
-        !isOperatorAllowedForTarget(typeById[resetBId], resetBOp)) {
+    // Remote slots behave like SoftIO targets.
+    auto targetType = [&](uint16_t refId) -> logicCardType {
+      return isRemoteCardId(refId) ? SoftIO : typeById[refId];
+    };
+    if (!isOperatorAllowedForTarget(targetType(setAId), setAOp) ||
+        !isOperatorAllowedForTarget(targetType(setBId), setBOp) ||
+        !isOperatorAllowedForTarget(targetType(resetAId), resetAOp) ||
+        !isOperatorAllowedForTarget(targetType(resetBId), resetBOp)) {
       reason = "operator not valid for referenced card type";
       return false;
     }
   }
 
+  // Straight-line programs cost exactly their length, so the per-scan script
+  // budget is enforced here rather than in the kernel.
+  static ScriptProgram scratchScripts[kScriptSlots];
+  if (!compileCardScripts(array, scratchScripts, reason)) return false;
+  const uint16_t scriptInstructions = scriptInstructionsPerScan(scratchScripts);
+  if (scriptInstructions > AT_SCRIPT_SCAN_BUDGET) {
+    reason = "script cards need " + String(scriptInstructions) +
+             " instructions per scan (budget " + String(AT_SCRIPT_SCAN_BUDGET) +
+             ")";
+    return false;
+  }
+
+  // Interned pool capacity is only known after dedupe, so build it here too.
+  static CardLabelTable scratchLabels;
+  if (!buildCardLabelTable(array, scratchLabels, reason)) return false;
+
   reason = "";
   return true;
 }
@@ -1660,89 +7779,568 @@ bool writeJsonToPath(const char* path, JsonDocument& doc) {
   return written > 0;
 }
 
-bool readJsonFromPath(const char* path, JsonDocument& doc) {
-  File file = LittleFS.open(path, "r");
-  if (!file) return false;
-  DeserializationError error = deserializeJson(doc, file);
-  file.close();
-  return !error;
+bool readJsonFromPath(const char* path, JsonDocument& doc) {
+  File file = LittleFS.open(path, "r");
+  if (!file) return false;
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+  return !error;
+}
+
+bool loadPortalSettingsFromLittleFS() {
+  if (!LittleFS.exists(kPortalSettingsPath)) return false;
+  JsonDocument doc;
+  if (!readJsonFromPath(kPortalSettingsPath, doc)) return false;
+  if (!doc.is<JsonObjectConst>()) return false;
+  JsonObjectConst root = doc.as<JsonObjectConst>();
+
+  const char* userSsid = root["userSsid"] | "";
+  const char* userPassword = root["userPassword"] | "";
+  const uint32_t scanIntervalMs =
+      root["scanIntervalMs"] | static_cast<uint32_t>(kDefaultScanIntervalMs);
+
+  if (strlen(userSsid) > 0 && strlen(userSsid) <= 32) {
+    strncpy(gUserSsid, userSsid, sizeof(gUserSsid) - 1);
+    gUserSsid[sizeof(gUserSsid) - 1] = '\0';
+  }
+  if (strlen(userPassword) <= 64) {
+    strncpy(gUserPassword, userPassword, sizeof(gUserPassword) - 1);
+    gUserPassword[sizeof(gUserPassword) - 1] = '\0';
+  }
+  if (scanIntervalMs >= kMinScanIntervalMs &&
+      scanIntervalMs <= kMaxScanIntervalMs) {
+    gScanIntervalMs = scanIntervalMs;
+  }
+
+  const char* mqttHost = root["mqttHost"] | "";
+  const uint32_t mqttPort = root["mqttPort"] | 1883UL;
+  const char* mqttTopicRoot = root["mqttTopicRoot"] | "";
+  if (strlen(mqttHost) <= 64) {
+    strncpy(gMqttHost, mqttHost, sizeof(gMqttHost) - 1);
+    gMqttHost[sizeof(gMqttHost) - 1] = '\0';
+  }
+  if (mqttPort > 0 && mqttPort <= 65535) {
+    gMqttPort = static_cast<uint16_t>(mqttPort);
+  }
+  if (strlen(mqttTopicRoot) <= 64 && strpbrk(mqttTopicRoot, "+#") == nullptr) {
+    strncpy(gMqttTopicRoot, mqttTopicRoot, sizeof(gMqttTopicRoot) - 1);
+    gMqttTopicRoot[sizeof(gMqttTopicRoot) - 1] = '\0';
+  }
+
+  JsonObjectConst exchange = root["exchange"].as<JsonObjectConst>();
+  String exchangeReason;
+  if (!exchange.isNull() &&
+      parseExchangeSettings(exchange, gExchangeSettings, exchangeReason)) {
+    gStoredExchangeSettings = gExchangeSettings;
+  }
+
+  JsonObjectConst trend = root["trend"].as<JsonObjectConst>();
+  String trendReason;
+  if (!trend.isNull()) {
+    parseTrendSettings(trend, gTrendStore.series, trendReason);
+  }
+  return true;
+}
+
+bool savePortalSettingsToLittleFS() {
+  JsonDocument doc;
+  doc["userSsid"] = gUserSsid;
+  doc["userPassword"] = gUserPassword;
+  doc["scanIntervalMs"] = gScanIntervalMs;
+  doc["mqttHost"] = gMqttHost;
+  doc["mqttPort"] = gMqttPort;
+  doc["mqttTopicRoot"] = gMqttTopicRoot;
+  writeExchangeSettings(doc["exchange"].to<JsonObject>(),
+                        gStoredExchangeSettings);
+  writeTrendSettings(doc["trend"].to<JsonObject>());
+  return writeJsonToPath(kPortalSettingsPath, doc);
+}
+
+bool saveCardsToPath(const char* path, const LogicCard* sourceCards,
+                     const CardLabelTable* labels) {
+  // Stream one card at a time so heap use does not grow with TOTAL_CARDS.
+  File file = LittleFS.open(path, "w");
+  if (!file) return false;
+  bool ok = file.write('[') == 1;
+  JsonDocument cardDoc;
+  for (uint16_t i = 0; ok && i < TOTAL_CARDS; ++i) {
+    if (i > 0 && file.write(',') != 1) ok = false;
+    cardDoc.clear();
+    JsonObject obj = cardDoc.to<JsonObject>();
+    serializeCardToJson(sourceCards[i], obj);
+    if (labels != nullptr) {
+      appendCardLabelFields(*labels, i, obj);
+      appendCardScriptField(*labels, i, obj);
+    }
+    if (serializeJson(cardDoc, file) == 0) ok = false;
+  }
+  if (ok && file.write(']') != 1) ok = false;
+  file.close();
+  return ok;
+}
+
+bool loadCardsFromPath(const char* path, LogicCard* outCards) {
+  JsonDocument doc;
+  if (!readJsonFromPath(path, doc)) return false;
+  if (!doc.is<JsonArrayConst>()) return false;
+  return deserializeCardsFromArray(doc.as<JsonArrayConst>(), outCards);
+}
+
+void formatVersion(char* out, size_t outSize, uint32_t version) {
+  snprintf(out, outSize, "v%lu", static_cast<unsigned long>(version));
+}
+
+// Byte sink that forwards to a file while hashing everything written, so a
+// migrated document gets its content hash without being re-read.
+class HashingFileWriter : public Print {
+ public:
+  explicit HashingFileWriter(File& file) : file_(file), hash_(kFnv1aSeed) {}
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override {
+    hash_ = fnv1a32(hash_, buffer, size);
+    return file_.write(buffer, size);
+  }
+  uint32_t hash() const { return hash_; }
+
+ private:
+  File& file_;
+  uint32_t hash_;
+};
+
+bool hashFileFnv1a(const char* path, uint32_t& outHash) {
+  File file = LittleFS.open(path, "r");
+  if (!file) return false;
+  uint32_t hash = kFnv1aSeed;
+  uint8_t buffer[256];
+  while (true) {
+    size_t n = file.read(buffer, sizeof(buffer));
+    if (n == 0) break;
+    hash = fnv1a32(hash, buffer, n);
+  }
+  file.close();
+  outHash = hash;
+  return true;
+}
+
+void formatHash(char* out, size_t outSize, uint32_t hash) {
+  snprintf(out, outSize, "%08lx", static_cast<unsigned long>(hash));
+}
+
+// nullptr for a type with no V2 mapping; the migration fails on it rather
+// than exporting the card as some other family.
+const char* toV2CardType(logicCardType type) {
+  switch (type) {
+    case DigitalInput:
+      return "DI";
+    case DigitalOutput:
+      return "DO";
+    case AnalogInput:
+      return "AI";
+    case SoftIO:
+      return "SIO";
+    case Script:
+      return "SCRIPT";
+    case Plugin:
+      return "PLUGIN";
+  }
+  return nullptr;
+}
+
+const char* toV2DeadbandMode(deadbandMode mode) {
+  if (mode == Deadband_Absolute) return "ABSOLUTE";
+  if (mode == Deadband_Percent) return "PERCENT";
+  return "NONE";
+}
+
+const char* toV2TimerMode(cardMode mode) {
+  if (mode == Mode_DO_Immediate) return "Immediate";
+  if (mode == Mode_DO_Gated) return "Gated";
+  return "Normal";
+}
+
+const char* toV2EdgeMode(cardMode mode) {
+  if (mode == Mode_DI_Falling) return "FALLING";
+  if (mode == Mode_DI_Change) return "CHANGE";
+  return "RISING";
+}
+
+// Legacy operators are rewritten into V2 typed clauses. Operators with no
+// direct V2 equivalent use explicit, behavior-preserving rules:
+// - Op_AlwaysTrue/False compare the unsigned currentValue against 0.
+// - Op_Stopped (Idle or Finished) is the DO/SIO mission latch being clear.
+void writeV2Clause(JsonObject clause, uint16_t sourceId, logicOperator op,
+                   uint32_t threshold) {
+  JsonObject source = clause["source"].to<JsonObject>();
+  source["cardId"] = sourceId;
+  const char* field = "currentValue";
+  const char* type = "NUMBER";
+  const char* v2Op = "EQ";
+  uint32_t v2Threshold = threshold;
+  const char* stateValue = nullptr;
+  switch (op) {
+    case Op_AlwaysTrue:
+      v2Op = "GTE";
+      v2Threshold = 0;
+      break;
+    case Op_AlwaysFalse:
+      v2Op = "LT";
+      v2Threshold = 0;
+      break;
+    case Op_LogicalTrue:
+    case Op_LogicalFalse:
+      field = "logicalState";
+      type = "BOOL";
+      v2Threshold = (op == Op_LogicalTrue) ? 1 : 0;
+      break;
+    case Op_PhysicalOn:
+    case Op_PhysicalOff:
+      field = "physicalState";
+      type = "BOOL";
+      v2Threshold = (op == Op_PhysicalOn) ? 1 : 0;
+      break;
+    case Op_Triggered:
+    case Op_TriggerCleared:
+      field = "triggerFlag";
+      type = "BOOL";
+      v2Threshold = (op == Op_Triggered) ? 1 : 0;
+      break;
+    case Op_GT:
+      v2Op = "GT";
+      break;
+    case Op_LT:
+      v2Op = "LT";
+      break;
+    case Op_NEQ:
+      v2Op = "NEQ";
+      break;
+    case Op_GTE:
+      v2Op = "GTE";
+      break;
+    case Op_LTE:
+      v2Op = "LTE";
+      break;
+    case Op_Running:
+      field = "missionState";
+      type = "STATE";
+      stateValue = "ACTIVE";
+      break;
+    case Op_Finished:
+      field = "missionState";
+      type = "STATE";
+      stateValue = "FINISHED";
+      break;
+    case Op_Stopped:
+      field = "logicalState";
+      type = "BOOL";
+      v2Threshold = 0;
+      break;
+    case Op_EQ:
+    default:
+      break;
+  }
+  source["field"] = field;
+  source["type"] = type;
+  clause["operator"] = v2Op;
+  if (stateValue != nullptr) {
+    clause["threshold"] = stateValue;
+  } else {
+    clause["threshold"] = v2Threshold;
+  }
+}
+
+void writeV2ConditionBlock(JsonObject block, uint16_t aId, logicOperator aOp,
+                           uint32_t aTh, uint16_t bId, logicOperator bOp,
+                           uint32_t bTh, combineMode combine) {
+  writeV2Clause(block["clauseA"].to<JsonObject>(), aId, aOp, aTh);
+  if (combine == Combine_AND || combine == Combine_OR) {
+    writeV2Clause(block["clauseB"].to<JsonObject>(), bId, bOp, bTh);
+    block["combiner"] = (combine == Combine_AND) ? "AND" : "OR";
+  } else {
+    block["combiner"] = "NONE";
+  }
 }
 
-bool loadPortalSettingsFromLittleFS() {
-  if (!LittleFS.exists(kPortalSettingsPath)) return false;
-  JsonDocument doc;
-  if (!readJsonFromPath(kPortalSettingsPath, doc)) return false;
-  if (!doc.is<JsonObjectConst>()) return false;
-  JsonObjectConst root = doc.as<JsonObjectConst>();
-
-  const char* userSsid = root["userSsid"] | "";
-  const char* userPassword = root["userPassword"] | "";
-  const uint32_t scanIntervalMs =
-      root["scanIntervalMs"] | static_cast<uint32_t>(kDefaultScanIntervalMs);
+bool migrateLegacyCardToV2(JsonObjectConst legacy, JsonObject out,
+                           String& reason) {
+  const uint16_t id = legacy["id"] | static_cast<uint16_t>(0);
+  logicCardType legacyType = DigitalInput;
+  if (!legacy["type"].isNull() &&
+      !tryParseLogicCardType(legacy["type"] | "", legacyType)) {
+    reason = "unknown card type (id=" + String(id) + ")";
+    return false;
+  }
+  LogicCard card = {};
+  initializeCardSafeDefaults(card, (id < TOTAL_CARDS) ? id : 0);
+  deserializeCardFromJson(legacy, card);
+  const char* cardType = toV2CardType(card.type);
+  if (cardType == nullptr) {
+    reason = "card type has no V2 mapping (id=" + String(id) + ")";
+    return false;
+  }
 
-  if (strlen(userSsid) > 0 && strlen(userSsid) <= 32) {
-    strncpy(gUserSsid, userSsid, sizeof(gUserSsid) - 1);
-    gUserSsid[sizeof(gUserSsid) - 1] = '\0';
+  out["cardId"] = card.id;
+  out["cardType"] = cardType;
+  out["enabled"] = true;
+  const char* label = legacy["label"] | "";
+  if (label[0] != '\0') {
+    out["label"] = label;
+  } else {
+    out["label"] = String(cardType) + String(card.index);
   }
-  if (strlen(userPassword) <= 64) {
-    strncpy(gUserPassword, userPassword, sizeof(gUserPassword) - 1);
-    gUserPassword[sizeof(gUserPassword) - 1] = '\0';
+  out["faultPolicy"] = "WARN";
+  out["alarm"] = card.alarm;
+  out["journal"] = card.journal;
+  if (card.type == SoftIO) out["exchangePublish"] = card.exchangePublish;
+
+  JsonObject config = out["config"].to<JsonObject>();
+  if (card.type == Script) {
+    config["script"] = legacy["script"] | "";
+    return true;
   }
-  if (scanIntervalMs >= kMinScanIntervalMs &&
-      scanIntervalMs <= kMaxScanIntervalMs) {
-    gScanIntervalMs = scanIntervalMs;
+  if (card.type == Plugin) {
+    config["plugin"] = isPluginCard(card.id)
+                           ? kCardPlugins[card.id - PLUGIN_START]->name()
+                           : "";
+    config["setting1"] = card.setting1;
+    config["setting2"] = card.setting2;
+    config["setting3"] = card.setting3;
+    return true;
+  }
+  if (card.type == AnalogInput) {
+    config["channel"] = card.index;
+    config["engineeringUnit"] = legacy["engineeringUnit"] | "";
+    JsonObject inputRange = config["inputRange"].to<JsonObject>();
+    inputRange["min"] = card.setting1;
+    inputRange["max"] = card.setting2;
+    JsonObject clampRange = config["clampRange"].to<JsonObject>();
+    clampRange["min"] = card.setting1;
+    clampRange["max"] = card.setting2;
+    JsonObject outputRange = config["outputRange"].to<JsonObject>();
+    outputRange["min"] = card.startOnMs;
+    outputRange["max"] = card.startOffMs;
+    // Legacy alpha is milliunits (0..1000); V2 uses centiunits (0..100).
+    config["emaAlpha"] = (card.setting3 + 5) / 10;
+    config["reportDeadbandMode"] = toV2DeadbandMode(card.reportDeadbandMode);
+    config["reportDeadband"] = card.reportDeadband;
+    return true;
   }
-  return true;
-}
 
-bool savePortalSettingsToLittleFS() {
-  JsonDocument doc;
-  doc["userSsid"] = gUserSsid;
-  doc["userPassword"] = gUserPassword;
-  doc["scanIntervalMs"] = gScanIntervalMs;
-  return writeJsonToPath(kPortalSettingsPath, doc);
+  JsonObject set = config["set"].to<JsonObject>();
+  writeV2ConditionBlock(set, card.setA_ID, card.setA_Operator,
+                        card.setA_Threshold, card.setB_ID, card.setB_Operator,
+                        card.setB_Threshold, card.setCombine);
+  JsonObject reset = config["reset"].to<JsonObject>();
+  writeV2ConditionBlock(reset, card.resetA_ID, card.resetA_Operator,
+                        card.resetA_Threshold, card.resetB_ID,
+                        card.resetB_Operator, card.resetB_Threshold,
+                        card.resetCombine);
+
+  if (card.type == DigitalInput) {
+    config["channel"] = card.index;
+    config["invert"] = card.invert;
+    config["debounceTime"] = card.setting1;
+    config["edgeMode"] = toV2EdgeMode(card.mode);
+    config["counterVisible"] = true;
+    return true;
+  }
+
+  if (card.type == DigitalOutput) config["channel"] = card.index;
+  config["mode"] = toV2TimerMode(card.mode);
+  config["delayBeforeON"] = card.setting1;
+  config["onDuration"] = card.setting2;
+  config["repeatCount"] = card.setting3;
+  if (card.type == SoftIO) {
+    JsonArray roles =
+        config["writePolicy"].to<JsonObject>()["allowedRoles"].to<JsonArray>();
+    roles.add("OPERATOR");
+    roles.add("ENGINEER");
+    roles.add("ADMIN");
+  }
+  return true;
 }
 
-bool saveCardsToPath(const char* path, const LogicCard* sourceCards) {
-  JsonDocument doc;
-  JsonArray cards = doc.to<JsonArray>();
-  serializeCardsToArray(sourceCards, cards);
-  return writeJsonToPath(path, doc);
+// Writes every top-level V2 field except cards[], left open for streaming.
+bool writeV2DocumentHeader(Print& out, uint32_t sourceHash) {
+  char hashText[9];
+  formatHash(hashText, sizeof(hashText), sourceHash);
+  JsonDocument header;
+  header["schemaVersion"] = kV2SchemaVersion;
+  header["configId"] = String("legacy-") + hashText;
+  // Legacy files carry no timestamp; use the epoch so output stays
+  // deterministic for a given source.
+  header["createdAt"] = "1970-01-01T00:00:00Z";
+  JsonObject scan = header["scan"].to<JsonObject>();
+  scan["intervalMs"] = gScanIntervalMs;
+  scan["jitterBudgetUs"] = 500;
+  scan["overrunBudgetUs"] = 1000;
+  header["bindings"].to<JsonArray>();
+  JsonObject wifi = header["wifi"].to<JsonObject>();
+  JsonObject master = wifi["master"].to<JsonObject>();
+  master["ssid"] = kMasterSsid;
+  master["password"] = kMasterPassword;
+  master["timeoutSec"] = MASTER_WIFI_TIMEOUT_MS / 1000;
+  master["editable"] = false;
+  JsonObject user = wifi["user"].to<JsonObject>();
+  user["ssid"] = gUserSsid;
+  user["password"] = gUserPassword;
+  user["timeoutSec"] = USER_WIFI_TIMEOUT_MS / 1000;
+  wifi["retryBackoffSec"] = 30;
+  wifi["staOnly"] = true;
+
+  String text;
+  serializeJson(header, text);
+  if (text.length() < 2) return false;
+  // Drop the closing brace and open the cards array.
+  const size_t prefixLength = text.length() - 1;
+  if (out.write(reinterpret_cast<const uint8_t*>(text.c_str()),
+                prefixLength) != prefixLength) {
+    return false;
+  }
+  return out.print(",\"cards\":[") > 0;
 }
 
-bool loadCardsFromPath(const char* path, LogicCard* outCards) {
-  JsonDocument doc;
-  if (!readJsonFromPath(path, doc)) return false;
-  if (!doc.is<JsonArrayConst>()) return false;
-  return deserializeCardsFromArray(doc.as<JsonArrayConst>(), outCards);
+bool isLegacyConfigFile(const char* path) {
+  File file = LittleFS.open(path, "r");
+  if (!file) return false;
+  int c = file.read();
+  while (c == ' ' || c == '\t' || c == '\r' || c == '\n') c = file.read();
+  file.close();
+  // PoC configs are a bare card array; V2 documents are objects.
+  return c == '[';
 }
 
-bool copyFileIfExists(const char* srcPath, const char* dstPath) {
-  if (!LittleFS.exists(srcPath)) return true;
+// Streams one legacy card array into a V2 document, holding one card in RAM at
+// a time. Output goes to a temp file that replaces dstPath only on success.
+bool migrateLegacyConfigFile(const char* srcPath, const char* dstPath,
+                             uint32_t sourceHash, uint32_t& outResultHash,
+                             uint16_t& outCardCount, String& reason) {
+  outCardCount = 0;
   File src = LittleFS.open(srcPath, "r");
-  if (!src) return false;
-  File dst = LittleFS.open(dstPath, "w");
+  if (!src) {
+    reason = "cannot open source";
+    return false;
+  }
+  if (!src.find("[")) {
+    src.close();
+    reason = "source is not a card array";
+    return false;
+  }
+  File dst = LittleFS.open(kV2MigrationTempPath, "w");
   if (!dst) {
     src.close();
+    reason = "cannot open temp output";
     return false;
   }
-  uint8_t buffer[256];
-  while (true) {
-    size_t n = src.read(buffer, sizeof(buffer));
-    if (n == 0) break;
-    if (dst.write(buffer, n) != n) {
-      src.close();
-      dst.close();
-      return false;
+
+  HashingFileWriter writer(dst);
+  bool ok = writeV2DocumentHeader(writer, sourceHash);
+  JsonDocument legacyCard;
+  JsonDocument v2Card;
+  bool more = (src.peek() != ']');
+  while (ok && more) {
+    legacyCard.clear();
+    DeserializationError error = deserializeJson(legacyCard, src);
+    if (error || !legacyCard.is<JsonObjectConst>()) {
+      reason = "malformed card at index " + String(outCardCount);
+      ok = false;
+      break;
+    }
+    v2Card.clear();
+    if (!migrateLegacyCardToV2(legacyCard.as<JsonObjectConst>(),
+                               v2Card.to<JsonObject>(), reason)) {
+      ok = false;
+      break;
     }
+    if (outCardCount > 0 && writer.print(',') != 1) ok = false;
+    if (ok && serializeJson(v2Card, writer) == 0) ok = false;
+    outCardCount += 1;
+    more = src.findUntil(",", "]");
   }
+  if (ok && writer.print("]}") != 2) ok = false;
   src.close();
   dst.close();
+
+  if (!ok) {
+    if (reason.length() == 0) reason = "write failed";
+    LittleFS.remove(kV2MigrationTempPath);
+    return false;
+  }
+  LittleFS.remove(dstPath);
+  if (!LittleFS.rename(kV2MigrationTempPath, dstPath)) {
+    reason = "failed to publish migrated file";
+    return false;
+  }
+  outResultHash = writer.hash();
   return true;
 }
 
-void formatVersion(char* out, size_t outSize, uint32_t version) {
-  snprintf(out, outSize, "v%lu", static_cast<unsigned long>(version));
+// Migrates the legacy active config to its V2 side file. The manifest caches
+// sourceHash -> resultHash, so an unchanged source is never migrated twice.
+// History versions live in the config history pack and are not exported;
+// the side files of the old full-copy slots are deleted on import.
+bool ensureV2MigrationCurrent() {
+  JsonDocument manifest;
+  if (!readJsonFromPath(kV2MigrationManifestPath, manifest) ||
+      !manifest.is<JsonObject>()) {
+    manifest.clear();
+    manifest.to<JsonObject>();
+  }
+  JsonObject entries = manifest["entries"].is<JsonObject>()
+                           ? manifest["entries"].as<JsonObject>()
+                           : manifest["entries"].to<JsonObject>();
+
+  bool manifestDirty = false;
+  bool allOk = true;
+  for (const LegacyV2PathPair& pair : kV2MigrationPaths) {
+    if (!LittleFS.exists(pair.legacyPath)) continue;
+    if (!isLegacyConfigFile(pair.legacyPath)) continue;
+    uint32_t sourceHash = 0;
+    if (!hashFileFnv1a(pair.legacyPath, sourceHash)) {
+      allOk = false;
+      continue;
+    }
+    char sourceHashText[9];
+    formatHash(sourceHashText, sizeof(sourceHashText), sourceHash);
+
+    JsonObject entry = entries[pair.legacyPath].as<JsonObject>();
+    const char* cachedSourceHash = entry["sourceHash"] | "";
+    if (strcmp(cachedSourceHash, sourceHashText) == 0 &&
+        LittleFS.exists(pair.v2Path)) {
+      gV2MigrationCacheHits += 1;
+      continue;
+    }
+
+    const uint32_t startUs = micros();
+    uint32_t resultHash = 0;
+    uint16_t cardCount = 0;
+    String reason;
+    if (!migrateLegacyConfigFile(pair.legacyPath, pair.v2Path, sourceHash,
+                                 resultHash, cardCount, reason)) {
+      gConsole.printf("V2 migration failed for %s: %s\n", pair.legacyPath,
+                    reason.c_str());
+      allOk = false;
+      continue;
+    }
+    gV2MigrationLastUs = micros() - startUs;
+    gV2MigrationLastCards = cardCount;
+    char resultHashText[9];
+    formatHash(resultHashText, sizeof(resultHashText), resultHash);
+    entry = entries[pair.legacyPath].to<JsonObject>();
+    entry["target"] = pair.v2Path;
+    entry["sourceHash"] = sourceHashText;
+    entry["resultHash"] = resultHashText;
+    entry["cards"] = cardCount;
+    manifestDirty = true;
+    gConsole.printf("V2 migration %s -> %s (%u cards, %lu us)\n",
+                  pair.legacyPath, pair.v2Path, cardCount,
+                  static_cast<unsigned long>(gV2MigrationLastUs));
+  }
+
+  if (manifestDirty) {
+    manifest["schemaVersion"] = kV2SchemaVersion;
+    if (!writeJsonToPath(kV2MigrationManifestPath, manifest)) allOk = false;
+  }
+  return allOk;
 }
 
 bool pauseKernelForConfigApply(uint32_t timeoutMs) {
@@ -1756,26 +8354,26 @@ bool pauseKernelForConfigApply(uint32_t timeoutMs) {
 
 void resumeKernelAfterConfigApply() { gKernelPauseRequested = false; }
 
-void rotateHistoryVersions() {
-  strncpy(gSlot3Version, gSlot2Version, sizeof(gSlot3Version) - 1);
-  gSlot3Version[sizeof(gSlot3Version) - 1] = '\0';
-  strncpy(gSlot2Version, gSlot1Version, sizeof(gSlot2Version) - 1);
-  gSlot2Version[sizeof(gSlot2Version) - 1] = '\0';
-  strncpy(gSlot1Version, gLkgVersion, sizeof(gSlot1Version) - 1);
-  gSlot1Version[sizeof(gSlot1Version) - 1] = '\0';
-  strncpy(gLkgVersion, gActiveVersion, sizeof(gLkgVersion) - 1);
-  gLkgVersion[sizeof(gLkgVersion) - 1] = '\0';
-}
-
-bool applyCardsAsActiveConfig(const LogicCard* newCards) {
+bool applyCardsAsActiveConfig(const LogicCard* newCards,
+                              const ScriptProgram* newScripts) {
   if (!pauseKernelForConfigApply(1000)) {
     resumeKernelAfterConfigApply();
     return false;
   }
-  memcpy(logicCards, newCards, sizeof(logicCards));
+  memcpy(logicCards, newCards, sizeof(LogicCard) * TOTAL_CARDS);
+  memcpy(gScriptPrograms, newScripts, sizeof(gScriptPrograms));
+  memset(gPluginRuntime, 0, sizeof(gPluginRuntime));
+  cancelFastForward();
+  // A committed config supersedes any running or pending recipe.
+  gActiveRecipeSlot = kNoRecipe;
+  gPendingRecipeSlot = kNoRecipe;
+  gRecipeSwitchSeq = gRecipeSwitchSeq + 1;
+  gRecipeSwitchPending = false;
   memset(gPrevSetCondition, 0, sizeof(gPrevSetCondition));
   memset(gPrevDISample, 0, sizeof(gPrevDISample));
   memset(gPrevDIPrimed, 0, sizeof(gPrevDIPrimed));
+  resetRewindRecorder();
+  markPublishDirty();
   updateSharedRuntimeSnapshot(millis(), false);
   resumeKernelAfterConfigApply();
   return true;
@@ -1817,17 +8415,342 @@ bool requestStepCommand() {
   return true;
 }
 
-bool setBreakpointCommand(uint8_t cardId, bool enabled) {
+uint32_t readWatchField(const LogicCard& card, watchField field) {
+  switch (field) {
+    case Field_LogicalState:
+      return card.logicalState ? 1 : 0;
+    case Field_PhysicalState:
+      return card.physicalState ? 1 : 0;
+    case Field_TriggerFlag:
+      return card.triggerFlag ? 1 : 0;
+    case Field_CurrentValue:
+      return card.currentValue;
+    case Field_State:
+      return static_cast<uint32_t>(card.state);
+    case Field_RepeatCounter:
+      return card.repeatCounter;
+    default:
+      return 0;
+  }
+}
+
+// Primed with the card's current value so a hook never fires on arming.
+void primeBreakpointHook(BreakpointHook& hook, const LogicCard& card) {
+  switch (hook.kind) {
+    case Hook_Condition:
+      hook.lastValue = evalOperator(card, hook.op, hook.operand) ? 1 : 0;
+      break;
+    case Hook_EnterState:
+      hook.lastValue = static_cast<uint32_t>(card.state);
+      break;
+    case Hook_Watch:
+      hook.lastValue = readWatchField(card, hook.field);
+      break;
+  }
+}
+
+// Condition hooks fire when the condition becomes true, enter-state hooks
+// when the card transitions into the state, watch hooks on any change.
+bool evalBreakpointHook(BreakpointHook& hook, const LogicCard& card) {
+  uint32_t value = 0;
+  bool hit = false;
+  switch (hook.kind) {
+    case Hook_Condition:
+      value = evalOperator(card, hook.op, hook.operand) ? 1 : 0;
+      hit = (value != 0) && (hook.lastValue == 0);
+      break;
+    case Hook_EnterState:
+      value = static_cast<uint32_t>(card.state);
+      hit = (value == hook.operand) && (hook.lastValue != hook.operand);
+      break;
+    case Hook_Watch:
+      value = readWatchField(card, hook.field);
+      hit = (value != hook.lastValue);
+      break;
+  }
+  hook.lastValue = value;
+  return hit;
+}
+
+// Only reached for cards with a plain breakpoint or at least one hook.
+bool checkCardBreakpoints(uint16_t cardId) {
+  bool hit = gCardBreakpoint[cardId];
+  int8_t hitHook = kNoBreakpointHook;
+  for (uint8_t i = gCardHookHead[cardId]; i != kNoBreakpointHookSlot;
+       i = gBreakpointHooks[i].next) {
+    if (evalBreakpointHook(gBreakpointHooks[i], logicCards[cardId]) &&
+        hitHook == kNoBreakpointHook) {
+      hitHook = static_cast<int8_t>(i);
+      hit = true;
+    }
+  }
+  if (hit) {
+    gBreakpointHitCardId = cardId;
+    gBreakpointHitHook = hitHook;
+  }
+  return hit;
+}
+
+bool addBreakpointHookCommand(uint16_t cardId, const BreakpointHook& spec) {
+  if (cardId >= TOTAL_CARDS) return false;
+  for (uint8_t i = 0; i < kMaxBreakpointHooks; ++i) {
+    BreakpointHook& hook = gBreakpointHooks[i];
+    if (hook.cardId != kInvalidCardId) continue;
+    hook = spec;
+    hook.cardId = cardId;
+    primeBreakpointHook(hook, logicCards[cardId]);
+    hook.next = gCardHookHead[cardId];
+    gCardHookHead[cardId] = i;
+    gBreakpointHookCount += 1;
+    return true;
+  }
+  return false;
+}
+
+bool clearBreakpointHooksCommand(uint16_t cardId) {
+  if (cardId >= TOTAL_CARDS) return false;
+  uint8_t i = gCardHookHead[cardId];
+  while (i != kNoBreakpointHookSlot) {
+    const uint8_t next = gBreakpointHooks[i].next;
+    gBreakpointHooks[i].cardId = kInvalidCardId;
+    gBreakpointHookCount -= 1;
+    i = next;
+  }
+  gCardHookHead[cardId] = kNoBreakpointHookSlot;
+  return true;
+}
+
+void resetBreakpointHooks() {
+  for (uint8_t i = 0; i < kMaxBreakpointHooks; ++i) {
+    gBreakpointHooks[i].cardId = kInvalidCardId;
+  }
+  memset(gCardHookHead, kNoBreakpointHookSlot, sizeof(gCardHookHead));
+  gBreakpointHookCount = 0;
+  gBreakpointHitCardId = kInvalidCardId;
+  gBreakpointHitHook = kNoBreakpointHook;
+}
+
+bool setBreakpointCommand(uint16_t cardId, bool enabled) {
   if (cardId >= TOTAL_CARDS) return false;
   gCardBreakpoint[cardId] = enabled;
   if (!enabled) gBreakpointPaused = false;
   return true;
 }
 
+CardHotState captureHotState(uint16_t id) {
+  const LogicCard& card = logicCards[id];
+  CardHotState hot = {};
+  hot.currentValue = card.currentValue;
+  hot.startOnMs = card.startOnMs;
+  hot.startOffMs = card.startOffMs;
+  hot.repeatCounter = card.repeatCounter;
+  hot.state = card.state;
+  if (card.logicalState) hot.flags |= kHotLogical;
+  if (card.physicalState) hot.flags |= kHotPhysical;
+  if (card.triggerFlag) hot.flags |= kHotTrigger;
+  if (gPrevSetCondition[id]) hot.flags |= kHotPrevSet;
+  if (gPrevDISample[id]) hot.flags |= kHotPrevDISample;
+  if (gPrevDIPrimed[id]) hot.flags |= kHotPrevDIPrimed;
+  return hot;
+}
+
+void restoreHotState(uint16_t id, const CardHotState& hot) {
+  LogicCard& card = logicCards[id];
+  card.currentValue = hot.currentValue;
+  card.startOnMs = hot.startOnMs;
+  card.startOffMs = hot.startOffMs;
+  card.repeatCounter = hot.repeatCounter;
+  card.state = hot.state;
+  card.logicalState = (hot.flags & kHotLogical) != 0;
+  card.physicalState = (hot.flags & kHotPhysical) != 0;
+  card.triggerFlag = (hot.flags & kHotTrigger) != 0;
+  gPrevSetCondition[id] = (hot.flags & kHotPrevSet) != 0;
+  gPrevDISample[id] = (hot.flags & kHotPrevDISample) != 0;
+  gPrevDIPrimed[id] = (hot.flags & kHotPrevDIPrimed) != 0;
+}
+
+bool hotStateEquals(const CardHotState& a, const CardHotState& b) {
+  return a.currentValue == b.currentValue && a.startOnMs == b.startOnMs &&
+         a.startOffMs == b.startOffMs && a.repeatCounter == b.repeatCounter &&
+         a.state == b.state && a.flags == b.flags;
+}
+
+// Drops all frames and re-baselines on the current image. Called whenever
+// the card program changes underneath the recorder.
+void resetRewindRecorder() {
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
+    gRewind.latest[i] = captureHotState(i);
+  }
+  gRewind.frameHead = 0;
+  gRewind.frameCount = 0;
+  gRewind.entryHead = 0;
+  gRewind.entryCount = 0;
+}
+
+void evictOldestRewindFrame() {
+  const RewindFrame& oldest = gRewind.frames[gRewind.frameHead];
+  gRewind.entryHead = static_cast<uint16_t>(
+      (gRewind.entryHead + oldest.entryCount) % AT_REWIND_ENTRIES);
+  gRewind.entryCount -= oldest.entryCount;
+  gRewind.frameHead =
+      static_cast<uint16_t>((gRewind.frameHead + 1) % AT_REWIND_FRAMES);
+  gRewind.frameCount -= 1;
+}
+
+const RewindFrame& rewindFrameAt(uint16_t offset) {
+  return gRewind.frames[(gRewind.frameHead + offset) % AT_REWIND_FRAMES];
+}
+
+// Records one frame after every kernel advance in test mode. Cost is one
+// compare per card plus one undo entry per changed card.
+void recordRewindFrame(uint32_t nowMs) {
+  const uint32_t startUs = micros();
+  if (gRewind.frameCount >= AT_REWIND_FRAMES) evictOldestRewindFrame();
+
+  const uint16_t firstEntry = static_cast<uint16_t>(
+      (gRewind.entryHead + gRewind.entryCount) % AT_REWIND_ENTRIES);
+  uint16_t newCount = 0;
+  bool overflow = false;
+  for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+    const CardHotState current = captureHotState(id);
+    if (hotStateEquals(current, gRewind.latest[id])) continue;
+    while (!overflow &&
+           (gRewind.entryCount + newCount) >= AT_REWIND_ENTRIES) {
+      if (gRewind.frameCount == 0) {
+        overflow = true;
+        break;
+      }
+      evictOldestRewindFrame();
+    }
+    if (!overflow) {
+      RewindUndoEntry& entry =
+          gRewind.entries[(firstEntry + newCount) % AT_REWIND_ENTRIES];
+      entry.cardId = id;
+      entry.before = gRewind.latest[id];
+      newCount += 1;
+    }
+    gRewind.latest[id] = current;
+  }
+
+  if (overflow) {
+    // One frame changed more cards than the ring holds; the undo chain is
+    // broken, so restart from the current image.
+    gRewind.overflows += 1;
+    resetRewindRecorder();
+  } else {
+    RewindFrame& frame =
+        gRewind.frames[(gRewind.frameHead + gRewind.frameCount) %
+                       AT_REWIND_FRAMES];
+    frame.frame = gRewind.nextFrame;
+    frame.tsMs = nowMs;
+    frame.scanCursor = gScanCursor;
+    frame.firstEntry = firstEntry;
+    frame.entryCount = newCount;
+    gRewind.frameCount += 1;
+    gRewind.entryCount += newCount;
+  }
+  gRewind.nextFrame += 1;
+
+  const uint32_t costUs = micros() - startUs;
+  gRewind.lastRecordUs = costUs;
+  if (costUs > gRewind.maxRecordUs) gRewind.maxRecordUs = costUs;
+}
+
+// Rebuilds the image of a retained frame into gRewindScratch. Returns the
+// ring offset of that frame, or -1 when it is no longer retained.
+int32_t rebuildRewindFrame(uint32_t target) {
+  if (gRewind.frameCount == 0) return -1;
+  const uint32_t oldest = rewindFrameAt(0).frame;
+  const uint32_t newest = rewindFrameAt(gRewind.frameCount - 1).frame;
+  if (target < oldest || target > newest) return -1;
+
+  memcpy(gRewindScratch.cards, gRewind.latest, sizeof(gRewindScratch.cards));
+  int32_t offset = gRewind.frameCount - 1;
+  for (; offset >= 0; --offset) {
+    const RewindFrame& frame = rewindFrameAt(static_cast<uint16_t>(offset));
+    if (frame.frame == target) break;
+    for (uint16_t i = 0; i < frame.entryCount; ++i) {
+      const RewindUndoEntry& entry =
+          gRewind.entries[(frame.firstEntry + i) % AT_REWIND_ENTRIES];
+      gRewindScratch.cards[entry.cardId] = entry.before;
+    }
+  }
+  const RewindFrame& frame = rewindFrameAt(static_cast<uint16_t>(offset));
+  gRewindScratch.frame = frame.frame;
+  gRewindScratch.tsMs = frame.tsMs;
+  gRewindScratch.scanCursor = frame.scanCursor;
+  return offset;
+}
+
+bool inspectRewindFrameCommand(uint32_t target) {
+  const bool ok = rebuildRewindFrame(target) >= 0;
+  if (ok) {
+    portENTER_CRITICAL(&gSnapshotMux);
+    memcpy(&gRewindInspect, &gRewindScratch, sizeof(gRewindInspect));
+    portEXIT_CRITICAL(&gSnapshotMux);
+  }
+  gRewindInspectState = ok ? RewindInspect_Ready : RewindInspect_Unavailable;
+  return ok;
+}
+
+// DI debounce and DO/SIO phase timers hold absolute millis() stamps; every
+// other family keeps configuration or values in those fields.
+void shiftHotStateTimers(uint16_t id, CardHotState& hot, uint32_t shiftMs) {
+  if (isDigitalInputCard(id)) {
+    hot.startOnMs += shiftMs;
+  } else if (isDigitalOutputCard(id) || isSoftIOCard(id)) {
+    hot.startOnMs += shiftMs;
+    hot.startOffMs += shiftMs;
+  }
+}
+
+// Restores a retained frame as the live state and discards newer frames.
+// Outputs are masked and the kernel is left in RUN_STEP at that frame's cursor.
+// Timer stamps are rebased so the frame's tsMs maps to now: a card 300 ms into
+// an on-delay at that frame resumes 300 ms into it instead of jumping ahead
+// by the wall time spent rewinding.
+bool rewindToFrameCommand(uint32_t target) {
+  if (!gTestModeActive) return false;
+  const int32_t offset = rebuildRewindFrame(target);
+  if (offset < 0) return false;
+
+  while (gRewind.frameCount > static_cast<uint16_t>(offset + 1)) {
+    const RewindFrame& newest = rewindFrameAt(gRewind.frameCount - 1);
+    gRewind.entryCount -= newest.entryCount;
+    gRewind.frameCount -= 1;
+  }
+  // Shift the retained frames with the live image so older frames stay
+  // rewindable on one consistent timeline.
+  const uint32_t shiftMs = millis() - gRewindScratch.tsMs;
+  for (uint16_t id = 0; id < TOTAL_CARDS; ++id) {
+    shiftHotStateTimers(id, gRewindScratch.cards[id], shiftMs);
+    restoreHotState(id, gRewindScratch.cards[id]);
+  }
+  for (uint16_t f = 0; f < gRewind.frameCount; ++f) {
+    RewindFrame& frame =
+        gRewind.frames[(gRewind.frameHead + f) % AT_REWIND_FRAMES];
+    frame.tsMs += shiftMs;
+    for (uint16_t i = 0; i < frame.entryCount; ++i) {
+      RewindUndoEntry& entry =
+          gRewind.entries[(frame.firstEntry + i) % AT_REWIND_ENTRIES];
+      shiftHotStateTimers(entry.cardId, entry.before, shiftMs);
+    }
+  }
+  memcpy(gRewind.latest, gRewindScratch.cards, sizeof(gRewind.latest));
+  gRewind.nextFrame = target + 1;
+  gScanCursor = gRewindScratch.scanCursor;
+  gGlobalOutputMask = true;
+  gRunMode = RUN_STEP;
+  gStepRequested = false;
+  gBreakpointPaused = false;
+  return true;
+}
+
 bool setTestModeCommand(bool active) {
   gTestModeActive = active;
+  resetRewindRecorder();
   if (!active) {
-    for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+    for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
       gCardInputSource[i] = InputSource_Real;
       gCardOutputMask[i] = false;
       gCardForcedAIValue[i] = 0;
@@ -1837,7 +8760,7 @@ bool setTestModeCommand(bool active) {
   return true;
 }
 
-bool setOutputMaskCommand(uint8_t cardId, bool masked) {
+bool setOutputMaskCommand(uint16_t cardId, bool masked) {
   if (cardId >= TOTAL_CARDS) return false;
   if (!isDigitalOutputCard(cardId)) return false;
   gCardOutputMask[cardId] = masked;
@@ -1849,7 +8772,25 @@ bool setGlobalOutputMaskCommand(bool masked) {
   return true;
 }
 
-bool setInputForceCommand(uint8_t cardId, inputSourceMode mode,
+bool setInputStimulusCommand(uint16_t cardId) {
+  if (!gStimulusUploadPending) return false;
+  const StimulusUpload& upload = gStimulusUpload;
+  bool accepted = false;
+  if (upload.cardId == cardId && isInputCard(cardId)) {
+    StimulusChannel& channel = gStimulus[inputSlotForCard(cardId)];
+    channel.spec = upload.spec;
+    memcpy(channel.trace, upload.trace,
+           sizeof(StimulusTracePoint) * upload.spec.traceLength);
+    channel.elapsedMs = 0;
+    channel.traceCursor = 0;
+    gCardInputSource[cardId] = InputSource_Stimulus;
+    accepted = true;
+  }
+  gStimulusUploadPending = false;
+  return accepted;
+}
+
+bool setInputForceCommand(uint16_t cardId, inputSourceMode mode,
                           uint32_t forcedValue) {
   if (cardId >= TOTAL_CARDS) return false;
   if (!isInputCard(cardId)) return false;
@@ -1870,7 +8811,92 @@ bool setInputForceCommand(uint8_t cardId, inputSourceMode mode,
 
 bool enqueueKernelCommand(const KernelCommand& command) {
   if (gKernelCommandQueue == nullptr) return false;
-  return xQueueSend(gKernelCommandQueue, &command, 0) == pdTRUE;
+  KernelCommand stamped = command;
+  stamped.enqueuedUs = micros();
+  stamped.origin = gCommandOrigin;
+  stamped.client = currentCommandClient();
+  return xQueueSend(gKernelCommandQueue, &stamped, 0) == pdTRUE;
+}
+
+bool switchRecipeCommand(uint32_t slot, uint32_t seq) {
+  // Queued before a commit or a later request: the bank it staged is gone.
+  if (!gRecipeSwitchPending || seq != gRecipeSwitchSeq) return false;
+  if (slot >= AT_RECIPE_CAPACITY ||
+      static_cast<int8_t>(slot) != gStagedRecipeSlot) {
+    gRecipeSwitchPending = false;
+    return false;
+  }
+  gPendingRecipeSlot = static_cast<int8_t>(slot);
+  return true;
+}
+
+// Recipe carryover rule: physical inputs keep their runtime (debounce state,
+// edge counters, AI filter value) since the plant did not change; outputs and
+// SoftIO start Idle under the new program and re-evaluate on the next scan,
+// with set edges detected against the new program only.
+void carryInputRuntime(const LogicCard& from, LogicCard& to) {
+  to.currentValue = from.currentValue;
+  if (to.type != DigitalInput) return;
+  to.logicalState = from.logicalState;
+  to.physicalState = from.physicalState;
+  to.triggerFlag = from.triggerFlag;
+  to.startOnMs = from.startOnMs;
+  to.startOffMs = from.startOffMs;
+  to.repeatCounter = from.repeatCounter;
+  to.state = from.state;
+}
+
+// Runs only at a scan boundary. Cost is a bank pointer flip plus the physical
+// input carryover, independent of virtual card count.
+void applyPendingRecipeSwitch() {
+  const uint32_t startUs = micros();
+  markPublishDirty();
+  LogicCard* previous = logicCards;
+  LogicCard* next = (previous == gCardBank[0]) ? gCardBank[1] : gCardBank[0];
+  for (uint16_t i = DI_START; i < DO_START; ++i) {
+    carryInputRuntime(previous[i], next[i]);
+  }
+  for (uint16_t i = AI_START; i < SIO_START; ++i) {
+    carryInputRuntime(previous[i], next[i]);
+  }
+  memset(gPrevSetCondition, 0, sizeof(gPrevSetCondition));
+  logicCards = next;
+  resetRewindRecorder();
+  gActiveRecipeSlot = gPendingRecipeSlot;
+  gPendingRecipeSlot = kNoRecipe;
+  gRecipeSwitchCount += 1;
+  const uint32_t endUs = micros();
+  gLastRecipeSwapUs = endUs - startUs;
+  gLastRecipeSwitchLatencyUs = endUs - gRecipeSwitchRequestedUs;
+  gRecipeSwitchPending = false;
+}
+
+void resetShadowRuntime() {
+  memset(gShadow.prevSetCondition, 0, sizeof(gShadow.prevSetCondition));
+  memset(gShadow.prevDISample, 0, sizeof(gShadow.prevDISample));
+  memset(gShadow.prevDIPrimed, 0, sizeof(gShadow.prevDIPrimed));
+  memset(gShadow.setResult, 0, sizeof(gShadow.setResult));
+  memset(gShadow.resetResult, 0, sizeof(gShadow.resetResult));
+  memset(gShadow.resetOverride, 0, sizeof(gShadow.resetOverride));
+  memset(gShadow.divergences, 0, sizeof(gShadow.divergences));
+  gShadow.scans = 0;
+  gShadow.divergentScans = 0;
+  gShadow.lastCostUs = 0;
+  gShadow.maxCostUs = 0;
+  gShadow.overrunStreak = 0;
+}
+
+bool setShadowEnabledCommand(bool enabled) {
+  if (enabled) {
+    resetShadowRuntime();
+    gShadowStopReason = nullptr;
+    gShadowActive = true;
+    gShadowEnableQueued = false;
+    return true;
+  }
+  if (gShadowActive) gShadowStopReason = "stopped";
+  gShadowActive = false;
+  return true;
 }
 
 bool applyKernelCommand(const KernelCommand& command) {
@@ -1890,6 +8916,20 @@ bool applyKernelCommand(const KernelCommand& command) {
       return setOutputMaskCommand(command.cardId, command.flag);
     case KernelCmd_SetOutputMaskGlobal:
       return setGlobalOutputMaskCommand(command.flag);
+    case KernelCmd_SwitchRecipe:
+      return switchRecipeCommand(command.value, command.recipeSeq);
+    case KernelCmd_SetShadowEnabled:
+      return setShadowEnabledCommand(command.flag);
+    case KernelCmd_SetInputStimulus:
+      return setInputStimulusCommand(command.cardId);
+    case KernelCmd_AddBreakpointHook:
+      return addBreakpointHookCommand(command.cardId, command.hook);
+    case KernelCmd_ClearBreakpointHooks:
+      return clearBreakpointHooksCommand(command.cardId);
+    case KernelCmd_InspectRewindFrame:
+      return inspectRewindFrameCommand(command.value);
+    case KernelCmd_RewindToFrame:
+      return rewindToFrameCommand(command.value);
     default:
       return false;
   }
@@ -1899,21 +8939,138 @@ void processKernelCommandQueue() {
   if (gKernelCommandQueue == nullptr) return;
   KernelCommand command = {};
   while (xQueueReceive(gKernelCommandQueue, &command, 0) == pdTRUE) {
-    applyKernelCommand(command);
+    const bool ok = applyKernelCommand(command);
+    if (ok) markPublishDirty();
+    const uint32_t latencyUs = micros() - command.enqueuedUs;
+    JournalRecord record = {};
+    record.kind = Journal_Command;
+    record.code = static_cast<uint8_t>(command.type);
+    record.cardId = command.cardId;
+    record.origin = static_cast<uint8_t>(command.origin);
+    record.result = ok ? 1 : 0;
+    record.client = command.client;
+    record.detail = command.value;
+    record.aux = command.flag ? 1 : 0;
+    emitJournalEvent(record);
+    gKernelMetrics.commands += 1;
+    if (!ok) gKernelMetrics.commandsRejected += 1;
+    gKernelMetrics.commandLatencySumUs += latencyUs;
+    if (latencyUs > gKernelMetrics.commandLatencyMaxUs) {
+      gKernelMetrics.commandLatencyMaxUs = latencyUs;
+    }
+  }
+}
+
+// True when a new AI value differs enough from the last reported one to be
+// published. Absolute deadbands share the centiunits of currentValue; percent
+// deadbands are in centi-percent of the card's output span.
+bool exceedsReportDeadband(const LogicCard& card, uint32_t reported,
+                           uint32_t value) {
+  const uint64_t delta =
+      (value > reported) ? (value - reported) : (reported - value);
+  switch (card.reportDeadbandMode) {
+    case Deadband_Absolute:
+      return delta > card.reportDeadband;
+    case Deadband_Percent: {
+      const uint64_t span = (card.startOffMs > card.startOnMs)
+                                ? (card.startOffMs - card.startOnMs)
+                                : (card.startOnMs - card.startOffMs);
+      if (span == 0) return delta != 0;
+      return delta * 10000ULL > static_cast<uint64_t>(card.reportDeadband) * span;
+    }
+    case Deadband_None:
+    default:
+      return delta != 0;
+  }
+}
+
+// Once per scan: moves each AI reported value only past its deadband. The
+// kernel keeps using the unfiltered currentValue for conditions.
+bool updateAIReporting() {
+  bool changed = false;
+  for (uint16_t id = AI_START; id < SIO_START; ++id) {
+    const uint16_t slot = id - AI_START;
+    const uint32_t value = logicCards[id].currentValue;
+    if (!gAIReportPrimed[slot]) {
+      gAIReportedValue[slot] = value;
+      gAIReportPrimed[slot] = true;
+      changed = true;
+      continue;
+    }
+    if (value == gAIReportedValue[slot]) continue;
+    if (exceedsReportDeadband(logicCards[id], gAIReportedValue[slot], value)) {
+      gAIReportedValue[slot] = value;
+      gAIPublishedChanges[slot] += 1;
+      changed = true;
+    } else {
+      gAISuppressedChanges[slot] += 1;
+    }
   }
+  return changed;
+}
+
+// Card, input, and runtime changes arrive through gPublishDirty; the few
+// kernel scalars are compared against the last publish. Caller holds
+// gSnapshotMux.
+bool hasPublishableChange() {
+  if (gPublishDirty.exchange(false, std::memory_order_relaxed)) return true;
+  return gSharedSnapshot.mode != gRunMode ||
+         gSharedSnapshot.testModeActive != gTestModeActive ||
+         gSharedSnapshot.globalOutputMask != gGlobalOutputMask ||
+         gSharedSnapshot.breakpointPaused != gBreakpointPaused ||
+         gSharedSnapshot.scanCursor != gScanCursor;
 }
 
 void updateSharedRuntimeSnapshot(uint32_t nowMs, bool incrementSeq) {
+  const bool aiChanged = incrementSeq && updateAIReporting();
   portENTER_CRITICAL(&gSnapshotMux);
+  const bool changed = hasPublishableChange() || aiChanged;
   if (incrementSeq) gSharedSnapshot.seq += 1;
+  if (changed) gSharedSnapshot.changeSeq += 1;
   gSharedSnapshot.tsMs = nowMs;
   gSharedSnapshot.lastCompleteScanUs = gLastCompleteScanUs;
+  gSharedKernelMetrics = gKernelMetrics;
   gSharedSnapshot.mode = gRunMode;
   gSharedSnapshot.testModeActive = gTestModeActive;
   gSharedSnapshot.globalOutputMask = gGlobalOutputMask;
   gSharedSnapshot.breakpointPaused = gBreakpointPaused;
+  gSharedSnapshot.breakpointHitCardId = gBreakpointHitCardId;
+  gSharedSnapshot.breakpointHitHook = gBreakpointHitHook;
+  if (gBreakpointHitHook != kNoBreakpointHook) {
+    gSharedSnapshot.breakpointHitKind = gBreakpointHooks[gBreakpointHitHook].kind;
+  }
+  gSharedSnapshot.breakpointHookCount = gBreakpointHookCount;
+  gSharedSnapshot.rewindFrames = gRewind.frameCount;
+  if (gRewind.frameCount > 0) {
+    gSharedSnapshot.rewindOldestFrame = rewindFrameAt(0).frame;
+    gSharedSnapshot.rewindNewestFrame =
+        rewindFrameAt(gRewind.frameCount - 1).frame;
+  }
+  gSharedSnapshot.rewindEntriesUsed = gRewind.entryCount;
+  gSharedSnapshot.rewindLastRecordUs = gRewind.lastRecordUs;
+  gSharedSnapshot.rewindMaxRecordUs = gRewind.maxRecordUs;
+  gSharedSnapshot.rewindOverflows = gRewind.overflows;
   gSharedSnapshot.scanCursor = gScanCursor;
-  memcpy(gSharedSnapshot.cards, logicCards, sizeof(logicCards));
+  gSharedSnapshot.activeRecipeSlot = gActiveRecipeSlot;
+  gSharedSnapshot.recipeSwitchCount = gRecipeSwitchCount;
+  gSharedSnapshot.lastRecipeSwapUs = gLastRecipeSwapUs;
+  gSharedSnapshot.lastRecipeSwitchLatencyUs = gLastRecipeSwitchLatencyUs;
+  gSharedSnapshot.shadowActive = gShadowActive;
+  gSharedSnapshot.shadowStopReason = gShadowStopReason;
+  gSharedSnapshot.shadowScans = gShadow.scans;
+  gSharedSnapshot.shadowDivergentScans = gShadow.divergentScans;
+  gSharedSnapshot.shadowLastCostUs = gShadow.lastCostUs;
+  gSharedSnapshot.shadowMaxCostUs = gShadow.maxCostUs;
+  if (gShadowActive) {
+    for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
+      ShadowOutputImage& image = gSharedSnapshot.shadowOutputs[i];
+      image.state = gShadow.cards[i].state;
+      image.logicalState = gShadow.cards[i].logicalState;
+      image.physicalState = gShadow.cards[i].physicalState;
+      image.divergences = gShadow.divergences[i];
+    }
+  }
+  memcpy(gSharedSnapshot.cards, logicCards, sizeof(gSharedSnapshot.cards));
   memcpy(gSharedSnapshot.inputSource, gCardInputSource, sizeof(gCardInputSource));
   memcpy(gSharedSnapshot.forcedAIValue, gCardForcedAIValue,
          sizeof(gCardForcedAIValue));
@@ -1925,19 +9082,40 @@ void updateSharedRuntimeSnapshot(uint32_t nowMs, bool incrementSeq) {
   memcpy(gSharedSnapshot.resetResult, gCardResetResult, sizeof(gCardResetResult));
   memcpy(gSharedSnapshot.resetOverride, gCardResetOverride,
          sizeof(gCardResetOverride));
+  memcpy(gSharedSnapshot.prevSetCondition, gPrevSetCondition,
+         sizeof(gPrevSetCondition));
+  memcpy(gSharedSnapshot.prevDISample, gPrevDISample, sizeof(gPrevDISample));
+  memcpy(gSharedSnapshot.prevDIPrimed, gPrevDIPrimed, sizeof(gPrevDIPrimed));
+  memcpy(gSharedSnapshot.inputImageDI, gInputImageDI, sizeof(gInputImageDI));
+  memcpy(gSharedSnapshot.inputImageAI, gInputImageAI, sizeof(gInputImageAI));
   memcpy(gSharedSnapshot.evalCounter, gCardEvalCounter, sizeof(gCardEvalCounter));
+  memcpy(gSharedSnapshot.aiReportedValue, gAIReportedValue,
+         sizeof(gAIReportedValue));
+  memcpy(gSharedSnapshot.aiPublishedChanges, gAIPublishedChanges,
+         sizeof(gAIPublishedChanges));
+  memcpy(gSharedSnapshot.aiSuppressedChanges, gAISuppressedChanges,
+         sizeof(gAISuppressedChanges));
+  memcpy(gSharedSnapshot.remoteCards, gRemoteCards, sizeof(gRemoteCards));
+  memcpy(gSharedSnapshot.remoteReceivedMs, gRemoteReceivedMs,
+         sizeof(gRemoteReceivedMs));
+  gSharedSnapshot.exchangeStaleTransitions = gExchangeStaleTransitions;
+  memcpy(gSharedSnapshot.plugins, gPluginRuntime, sizeof(gPluginRuntime));
   portEXIT_CRITICAL(&gSnapshotMux);
 }
 
-uint8_t scanOrderCardIdFromCursor(uint16_t cursor) {
+uint16_t scanOrderCardIdFromCursor(uint16_t cursor) {
   uint16_t pos = (TOTAL_CARDS == 0) ? 0 : (cursor % TOTAL_CARDS);
-  if (pos < NUM_DI) return static_cast<uint8_t>(DI_START + pos);
+  if (pos < NUM_DI) return static_cast<uint16_t>(DI_START + pos);
   pos -= NUM_DI;
-  if (pos < NUM_AI) return static_cast<uint8_t>(AI_START + pos);
+  if (pos < NUM_AI) return static_cast<uint16_t>(AI_START + pos);
   pos -= NUM_AI;
-  if (pos < NUM_SIO) return static_cast<uint8_t>(SIO_START + pos);
+  if (pos < NUM_SIO) return static_cast<uint16_t>(SIO_START + pos);
   pos -= NUM_SIO;
-  return static_cast<uint8_t>(DO_START + pos);
+  if (pos < NUM_SCRIPT) return static_cast<uint16_t>(SCRIPT_START + pos);
+  pos -= NUM_SCRIPT;
+  if (pos < NUM_PLUGIN) return static_cast<uint16_t>(PLUGIN_START + pos);
+  pos -= NUM_PLUGIN;
+  return static_cast<uint16_t>(DO_START + pos);
 }
 
 bool isDoRunningState(cardState state) {
@@ -1986,14 +9164,43 @@ bool evalOperator(const LogicCard& target, logicOperator op,
   }
 }
 
-bool evalCondition(uint8_t aId, logicOperator aOp, uint32_t aTh, uint8_t bId,
+KernelEvalContext liveEvalContext() {
+  KernelEvalContext ctx = {logicCards,       gPrevSetCondition,
+                           gPrevDISample,    gPrevDIPrimed,
+                           gCardSetResult,   gCardResetResult,
+                           gCardResetOverride, nullptr,
+                           nullptr,          true,
+                           gScriptPrograms};
+  return ctx;
+}
+
+KernelEvalContext shadowEvalContext() {
+  KernelEvalContext ctx = {gShadow.cards,         gShadow.prevSetCondition,
+                           gShadow.prevDISample,  gShadow.prevDIPrimed,
+                           gShadow.setResult,     gShadow.resetResult,
+                           gShadow.resetOverride, gInputImageDI,
+                           gInputImageAI,         false,
+                           gShadow.scripts};
+  return ctx;
+}
+
+// Local ids resolve in the context's bank; remote ids in the shared remote
+// SoftIO image.
+const LogicCard* conditionTarget(const KernelEvalContext& ctx, uint16_t id) {
+  if (id < TOTAL_CARDS) return &ctx.cards[id];
+  if (isRemoteCardId(id)) return &gRemoteCards[id - REMOTE_START];
+  return nullptr;
+}
+
+bool evalCondition(const KernelEvalContext& ctx, uint16_t aId,
+                   logicOperator aOp, uint32_t aTh, uint16_t bId,
                    logicOperator bOp, uint32_t bTh, combineMode combine) {
-  const LogicCard* aCard = getCardById(aId);
-  bool aResult = (aCard != nullptr) ? evalOperator(*aCard, aOp, aTh) : false;
+  const LogicCard* a = conditionTarget(ctx, aId);
+  bool aResult = (a != nullptr) ? evalOperator(*a, aOp, aTh) : false;
   if (combine == Combine_None) return aResult;
 
-  const LogicCard* bCard = getCardById(bId);
-  bool bResult = (bCard != nullptr) ? evalOperator(*bCard, bOp, bTh) : false;
+  const LogicCard* b = conditionTarget(ctx, bId);
+  bool bResult = (b != nullptr) ? evalOperator(*b, bOp, bTh) : false;
 
   if (combine == Combine_AND) return aResult && bResult;
   if (combine == Combine_OR) return aResult || bResult;
@@ -2009,34 +9216,98 @@ void resetDIRuntime(LogicCard& card) {
   card.repeatCounter = 0;
 }
 
-void processDICard(LogicCard& card, uint32_t nowMs) {
-  bool sample = false;
-  inputSourceMode sourceMode = InputSource_Real;
-  if (card.id < TOTAL_CARDS) {
-    sourceMode = gCardInputSource[card.id];
+uint32_t effectiveScanIntervalMs() {
+  return (gRunMode == RUN_SLOW) ? SLOW_SCAN_INTERVAL_MS : gScanIntervalMs;
+}
+
+uint32_t stimulusTraceValue(StimulusChannel& channel, uint32_t t) {
+  const StimulusSpec& spec = channel.spec;
+  if (spec.loop && spec.periodMs > 0) t %= spec.periodMs;
+  // Time only moves forward except on a loop wrap, so the cursor is amortized
+  // O(1) per scan.
+  if (t < channel.trace[channel.traceCursor].atMs) channel.traceCursor = 0;
+  while ((channel.traceCursor + 1) < spec.traceLength &&
+         channel.trace[channel.traceCursor + 1].atMs <= t) {
+    channel.traceCursor += 1;
+  }
+  if (t < channel.trace[channel.traceCursor].atMs) return spec.low;
+  return channel.trace[channel.traceCursor].value;
+}
+
+uint32_t stimulusValueAt(StimulusChannel& channel, uint32_t t) {
+  const StimulusSpec& spec = channel.spec;
+  if (spec.waveform == Stimulus_Trace) return stimulusTraceValue(channel, t);
+
+  const uint32_t phase = t % spec.periodMs;
+  const int64_t span =
+      static_cast<int64_t>(spec.high) - static_cast<int64_t>(spec.low);
+  switch (spec.waveform) {
+    case Stimulus_Square:
+      return (phase < (spec.periodMs / 2)) ? spec.high : spec.low;
+    case Stimulus_Pulse:
+      return (phase < spec.widthMs) ? spec.high : spec.low;
+    case Stimulus_Ramp:
+      return static_cast<uint32_t>(static_cast<int64_t>(spec.low) +
+                                   (span * phase) / spec.periodMs);
+    case Stimulus_Sine: {
+      const float angle = (6.2831853f * phase) / spec.periodMs;
+      const float unit = 0.5f + 0.5f * sinf(angle);
+      return static_cast<uint32_t>(static_cast<float>(spec.low) +
+                                   unit * static_cast<float>(span));
+    }
+    default:
+      return spec.low;
   }
+}
+
+// Stimulus time advances by one scan interval per sample rather than by the
+// wall clock, so a waveform replays identically regardless of scan jitter.
+uint32_t sampleStimulus(uint16_t cardId) {
+  StimulusChannel& channel = gStimulus[inputSlotForCard(cardId)];
+  const uint32_t value = stimulusValueAt(channel, channel.elapsedMs);
+  channel.elapsedMs += effectiveScanIntervalMs();
+  return value;
+}
 
+bool sampleDigitalInput(const KernelEvalContext& ctx, const LogicCard& card) {
+  const uint16_t imageIndex = static_cast<uint16_t>(card.id - DI_START);
+  if (ctx.inputImageDI != nullptr) return ctx.inputImageDI[imageIndex];
+
+  bool sample = false;
+  const inputSourceMode sourceMode = gCardInputSource[card.id];
   if (sourceMode == InputSource_ForcedHigh) {
     sample = true;
   } else if (sourceMode == InputSource_ForcedLow) {
     sample = false;
-  } else if (card.hwPin != 255) {
+  } else if (sourceMode == InputSource_Stimulus) {
+    sample = (sampleStimulus(card.id) != 0);
+  } else if (card.hwPin != kVirtualCardPin) {
     sample = (digitalRead(card.hwPin) == HIGH);
   }
+  gInputImageDI[imageIndex] = sample;
+  return sample;
+}
+
+void processDICard(const KernelEvalContext& ctx, LogicCard& card,
+                   uint32_t nowMs) {
+  bool sample = false;
+  if (isDigitalInputCard(card.id)) {
+    sample = sampleDigitalInput(ctx, card);
+  }
   if (card.invert) sample = !sample;
   card.physicalState = sample;
 
   const bool setCondition = evalCondition(
-      card.setA_ID, card.setA_Operator, card.setA_Threshold, card.setB_ID,
+      ctx, card.setA_ID, card.setA_Operator, card.setA_Threshold, card.setB_ID,
       card.setB_Operator, card.setB_Threshold, card.setCombine);
-  const bool resetCondition =
-      evalCondition(card.resetA_ID, card.resetA_Operator, card.resetA_Threshold,
-                    card.resetB_ID, card.resetB_Operator, card.resetB_Threshold,
-                    card.resetCombine);
+  const bool resetCondition = evalCondition(
+      ctx, card.resetA_ID, card.resetA_Operator, card.resetA_Threshold,
+      card.resetB_ID, card.resetB_Operator, card.resetB_Threshold,
+      card.resetCombine);
   if (card.id < TOTAL_CARDS) {
-    gCardSetResult[card.id] = setCondition;
-    gCardResetResult[card.id] = resetCondition;
-    gCardResetOverride[card.id] = setCondition && resetCondition;
+    ctx.setResult[card.id] = setCondition;
+    ctx.resetResult[card.id] = resetCondition;
+    ctx.resetOverride[card.id] = setCondition && resetCondition;
   }
 
   if (resetCondition) {
@@ -2053,11 +9324,11 @@ void processDICard(LogicCard& card, uint32_t nowMs) {
 
   bool previousSample = sample;
   if (card.id < TOTAL_CARDS) {
-    if (gPrevDIPrimed[card.id]) {
-      previousSample = gPrevDISample[card.id];
+    if (ctx.prevDIPrimed[card.id]) {
+      previousSample = ctx.prevDISample[card.id];
     }
-    gPrevDISample[card.id] = sample;
-    gPrevDIPrimed[card.id] = true;
+    ctx.prevDISample[card.id] = sample;
+    ctx.prevDIPrimed[card.id] = true;
   }
 
   const bool risingEdge = (!previousSample && sample);
@@ -2104,22 +9375,31 @@ uint32_t clampUInt32(uint32_t value, uint32_t lo, uint32_t hi) {
   return value;
 }
 
-void processAICard(LogicCard& card) {
+uint32_t sampleAnalogInput(const KernelEvalContext& ctx, const LogicCard& card) {
+  const uint16_t imageIndex = static_cast<uint16_t>(card.id - AI_START);
+  if (ctx.inputImageAI != nullptr) return ctx.inputImageAI[imageIndex];
+
+  uint32_t raw = 0;
+  if (gCardInputSource[card.id] == InputSource_ForcedValue) {
+    raw = gCardForcedAIValue[card.id];
+  } else if (gCardInputSource[card.id] == InputSource_Stimulus) {
+    raw = sampleStimulus(card.id);
+  } else if (card.hwPin != kVirtualCardPin) {
+    raw = static_cast<uint32_t>(analogRead(card.hwPin));
+  }
+  gInputImageAI[imageIndex] = raw;
+  return raw;
+}
+
+void processAICard(const KernelEvalContext& ctx, LogicCard& card) {
   if (card.id < TOTAL_CARDS) {
-    gCardSetResult[card.id] = false;
-    gCardResetResult[card.id] = false;
-    gCardResetOverride[card.id] = false;
+    ctx.setResult[card.id] = false;
+    ctx.resetResult[card.id] = false;
+    ctx.resetOverride[card.id] = false;
   }
   uint32_t raw = 0;
-  inputSourceMode sourceMode = InputSource_Real;
-  if (card.id < TOTAL_CARDS) {
-    sourceMode = gCardInputSource[card.id];
-  }
-
-  if (sourceMode == InputSource_ForcedValue) {
-    raw = gCardForcedAIValue[card.id];
-  } else if (card.hwPin != 255) {
-    raw = static_cast<uint32_t>(analogRead(card.hwPin));
+  if (isAnalogInputCard(card.id)) {
+    raw = sampleAnalogInput(ctx, card);
   }
 
   const uint32_t inMin =
@@ -2164,30 +9444,32 @@ void forceDOIdle(LogicCard& card, bool clearCounter = false) {
 void driveDOHardware(const LogicCard& card, bool driveHardware, bool level,
                      bool masked) {
   if (!driveHardware) return;
-  if (card.hwPin == 255) return;
+  if (card.hwPin == kVirtualCardPin) return;
   if (masked) return;
   digitalWrite(card.hwPin, level ? HIGH : LOW);
 }
 
-void processDOCard(LogicCard& card, uint32_t nowMs, bool driveHardware) {
+void processDOCard(const KernelEvalContext& ctx, LogicCard& card,
+                   uint32_t nowMs, bool driveHardware) {
+  driveHardware = driveHardware && ctx.driveOutputs;
   const bool previousPhysical = card.physicalState;
   const bool setCondition = evalCondition(
-      card.setA_ID, card.setA_Operator, card.setA_Threshold, card.setB_ID,
+      ctx, card.setA_ID, card.setA_Operator, card.setA_Threshold, card.setB_ID,
       card.setB_Operator, card.setB_Threshold, card.setCombine);
-  const bool resetCondition =
-      evalCondition(card.resetA_ID, card.resetA_Operator, card.resetA_Threshold,
-                    card.resetB_ID, card.resetB_Operator, card.resetB_Threshold,
-                    card.resetCombine);
+  const bool resetCondition = evalCondition(
+      ctx, card.resetA_ID, card.resetA_Operator, card.resetA_Threshold,
+      card.resetB_ID, card.resetB_Operator, card.resetB_Threshold,
+      card.resetCombine);
   if (card.id < TOTAL_CARDS) {
-    gCardSetResult[card.id] = setCondition;
-    gCardResetResult[card.id] = resetCondition;
-    gCardResetOverride[card.id] = setCondition && resetCondition;
+    ctx.setResult[card.id] = setCondition;
+    ctx.resetResult[card.id] = resetCondition;
+    ctx.resetOverride[card.id] = setCondition && resetCondition;
   }
 
   bool prevSet = false;
   if (card.id < TOTAL_CARDS) {
-    prevSet = gPrevSetCondition[card.id];
-    gPrevSetCondition[card.id] = setCondition;
+    prevSet = ctx.prevSetCondition[card.id];
+    ctx.prevSetCondition[card.id] = setCondition;
   }
   const bool setRisingEdge = setCondition && !prevSet;
 
@@ -2279,73 +9561,662 @@ void processDOCard(LogicCard& card, uint32_t nowMs, bool driveHardware) {
   driveDOHardware(card, driveHardware, effectiveOutput, isOutputMasked(card.id));
 }
 
-void processSIOCard(LogicCard& card, uint32_t nowMs) {
-  processDOCard(card, nowMs, false);
+void processSIOCard(const KernelEvalContext& ctx, LogicCard& card,
+                    uint32_t nowMs) {
+  processDOCard(ctx, card, nowMs, false);
+}
+
+int32_t saturateScriptValue(uint32_t value) {
+  return (value > INT32_MAX) ? INT32_MAX : static_cast<int32_t>(value);
+}
+
+int32_t readScriptField(const LogicCard& card, uint8_t field) {
+  switch (field) {
+    case ScriptField_State:
+      return card.logicalState ? 1 : 0;
+    case ScriptField_Phys:
+      return card.physicalState ? 1 : 0;
+    case ScriptField_Trig:
+      return card.triggerFlag ? 1 : 0;
+    case ScriptField_Value:
+      return saturateScriptValue(card.currentValue);
+    case ScriptField_Count:
+      return saturateScriptValue(card.repeatCounter);
+    default:
+      return 0;
+  }
+}
+
+// Loads resolve like set/reset references in the context's bank; stores
+// only reach this card.
+void runScriptProgram(const KernelEvalContext& ctx,
+                      const ScriptProgram& program, LogicCard& card) {
+  runScriptInstructions(
+      program,
+      [&ctx](uint8_t field, uint16_t id) -> int32_t {
+        const LogicCard* target = conditionTarget(ctx, id);
+        return (target != nullptr) ? readScriptField(*target, field) : 0;
+      },
+      [&card](uint8_t field, int32_t value) {
+        if (field == ScriptField_State) {
+          card.logicalState = (value != 0);
+        } else {
+          card.currentValue = (value < 0) ? 0 : static_cast<uint32_t>(value);
+        }
+      });
+}
+
+// Script cards have no pin: physicalState follows the logical output and
+// triggerFlag pulses for one scan when it turns on.
+void processScriptCard(const KernelEvalContext& ctx, LogicCard& card,
+                       uint16_t cardId) {
+  const bool previous = card.logicalState;
+  runScriptProgram(ctx, ctx.scripts[cardId - SCRIPT_START], card);
+  card.physicalState = card.logicalState;
+  card.triggerFlag = card.logicalState && !previous;
+  card.state = card.logicalState ? State_Script_Active : State_Script_Idle;
+}
+
+// Reference plugin: two-threshold comparator on another card's value.
+// setting1 = source card id, setting2 = turn on at value >=, setting3 = turn
+// off at value <=. currentValue mirrors the source value.
+class HysteresisPlugin : public CardPlugin {
+ public:
+  explicit HysteresisPlugin(const char* name) : CardPlugin(name, 20) {}
+
+  void init(LogicCard& card) const override { card.currentValue = 0; }
+
+  void evaluate(const KernelEvalContext& ctx, LogicCard& card,
+                uint32_t nowMs) const override {
+    (void)nowMs;
+    const LogicCard* source =
+        conditionTarget(ctx, static_cast<uint16_t>(card.setting1));
+    if (source == nullptr) return;
+    card.currentValue = source->currentValue;
+    if (card.currentValue >= card.setting2) {
+      card.logicalState = true;
+    } else if (card.currentValue <= card.setting3) {
+      card.logicalState = false;
+    }
+  }
+
+  void describe(JsonObject out) const override {
+    out["kind"] = "HysteresisPlugin";
+    out["setting1"] = "source card id";
+    out["setting2"] = "on at value >=";
+    out["setting3"] = "off at value <=";
+  }
+
+  void snapshotFields(const LogicCard& card, JsonObject out) const override {
+    out["source"] = card.setting1;
+    out["inBand"] =
+        card.currentValue > card.setting3 && card.currentValue < card.setting2;
+  }
+
+  bool validate(JsonObjectConst card, String& reason) const override {
+    const uint32_t source = card["setting1"] | 0UL;
+    if (source > 0xFFFFUL ||
+        !isReferenceCardId(static_cast<uint16_t>(source))) {
+      reason = "setting1 must be a card id";
+      return false;
+    }
+    if ((card["setting3"] | 0UL) > (card["setting2"] | 0UL)) {
+      reason = "setting3 (off) must not exceed setting2 (on)";
+      return false;
+    }
+    return true;
+  }
+};
+
+// Out-of-tree plugin classes come in through a header named by the build,
+// e.g. -DAT_CARD_PLUGIN_HEADER='"plugins/modbus_rtu.h"'.
+#ifdef AT_CARD_PLUGIN_HEADER
+#include AT_CARD_PLUGIN_HEADER
+#endif
+
+#define DEFINE_CARD_PLUGIN(instance, type) \
+  const type gPlugin_##instance(#instance);
+#define REGISTER_CARD_PLUGIN(instance, type) &gPlugin_##instance,
+AT_CARD_PLUGINS(DEFINE_CARD_PLUGIN)
+const CardPlugin* const kCardPlugins[kPluginSlots] = {
+    AT_CARD_PLUGINS(REGISTER_CARD_PLUGIN)};
+#undef DEFINE_CARD_PLUGIN
+#undef REGISTER_CARD_PLUGIN
+
+void initPluginCard(LogicCard& card) {
+  card.logicalState = false;
+  card.physicalState = false;
+  card.triggerFlag = false;
+  card.state = State_Plugin_Idle;
+  kCardPlugins[card.id - PLUGIN_START]->init(card);
+}
+
+// Like scripts, plugin cards have no pin: physicalState follows the logical
+// output and triggerFlag pulses when it turns on. Live evaluations are timed
+// against the plugin's declared budget. An overrun is journaled when a streak
+// starts; AT_PLUGIN_OVERRUN_LIMIT in a row fault the card, which then holds
+// its outputs off and is skipped until its bank is loaded again.
+void processPluginCard(const KernelEvalContext& ctx, LogicCard& card,
+                       uint16_t cardId, uint32_t nowMs) {
+  if (card.state == State_Plugin_Faulted) {
+    card.logicalState = false;
+    card.physicalState = false;
+    card.triggerFlag = false;
+    return;
+  }
+  const uint16_t slot = cardId - PLUGIN_START;
+  const CardPlugin& plugin = *kCardPlugins[slot];
+  const bool previous = card.logicalState;
+  const uint32_t startUs = micros();
+  plugin.evaluate(ctx, card, nowMs);
+  const uint32_t costUs = micros() - startUs;
+  card.physicalState = card.logicalState;
+  card.triggerFlag = card.logicalState && !previous;
+  card.state = card.logicalState ? State_Plugin_Active : State_Plugin_Idle;
+  if (!ctx.driveOutputs) return;
+
+  PluginRuntime& runtime = gPluginRuntime[slot];
+  runtime.lastUs = costUs;
+  if (costUs > runtime.maxUs) {
+    runtime.maxUs = costUs;
+    markPublishDirty();
+  }
+  if (costUs <= plugin.budgetUs()) {
+    runtime.overrunStreak = 0;
+    return;
+  }
+  runtime.overruns += 1;
+  markPublishDirty();
+  if (runtime.overrunStreak == 0) {
+    emitJournalFault(Fault_PluginOverrun, cardId, costUs);
+  }
+  if (++runtime.overrunStreak < AT_PLUGIN_OVERRUN_LIMIT) return;
+  runtime.overrunStreak = 0;
+  runtime.faults += 1;
+  card.logicalState = false;
+  card.physicalState = false;
+  card.triggerFlag = false;
+  card.state = State_Plugin_Faulted;
+  emitJournalFault(Fault_PluginFaulted, cardId, costUs);
 }
 
-void processCardById(uint8_t cardId, uint32_t nowMs) {
+void processCardById(const KernelEvalContext& ctx, uint16_t cardId,
+                     uint32_t nowMs) {
   if (cardId >= TOTAL_CARDS) return;
   if (isDigitalInputCard(cardId)) {
-    processDICard(logicCards[cardId], nowMs);
+    processDICard(ctx, ctx.cards[cardId], nowMs);
     return;
   }
   if (isAnalogInputCard(cardId)) {
-    processAICard(logicCards[cardId]);
+    processAICard(ctx, ctx.cards[cardId]);
     return;
   }
   if (isSoftIOCard(cardId)) {
-    processSIOCard(logicCards[cardId], nowMs);
+    processSIOCard(ctx, ctx.cards[cardId], nowMs);
+    return;
+  }
+  if (isScriptCard(cardId)) {
+    const uint32_t startUs = micros();
+    processScriptCard(ctx, ctx.cards[cardId], cardId);
+    if (ctx.driveOutputs) gScriptScanUs += micros() - startUs;
+    return;
+  }
+  if (isPluginCard(cardId)) {
+    processPluginCard(ctx, ctx.cards[cardId], cardId, nowMs);
     return;
   }
   if (isDigitalOutputCard(cardId)) {
-    processDOCard(logicCards[cardId], nowMs, true);
+    processDOCard(ctx, ctx.cards[cardId], nowMs, true);
+  }
+}
+
+// Kernel: queues a journal record for Core1 without waking it; the journal
+// is write-behind. Never blocks; a full lane drops the record and counts it.
+void emitJournalEvent(const JournalRecord& record) {
+  const uint32_t head = gJournalLane.head.load(std::memory_order_relaxed);
+  const uint32_t tail = gJournalLane.tail.load(std::memory_order_acquire);
+  if ((head - tail) >= AT_JOURNAL_QUEUE_DEPTH) {
+    gJournalLane.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  JournalEvent& event = gJournalLane.events[head & (AT_JOURNAL_QUEUE_DEPTH - 1)];
+  event.atMs = millis();
+  event.record = record;
+  gJournalLane.head.store(head + 1, std::memory_order_release);
+}
+
+void emitJournalFault(journalFault fault, uint16_t cardId, uint32_t detail) {
+  JournalRecord record = {};
+  record.kind = Journal_Fault;
+  record.code = static_cast<uint8_t>(fault);
+  record.cardId = cardId;
+  record.detail = detail;
+  emitJournalEvent(record);
+}
+
+void emitJournalTransition(uint16_t cardId, cardState prevState) {
+  const LogicCard& card = logicCards[cardId];
+  JournalRecord record = {};
+  record.kind = Journal_Transition;
+  record.code = static_cast<uint8_t>(card.state);
+  record.cardId = cardId;
+  record.detail = (card.logicalState ? 0x01U : 0) |
+                  (card.physicalState ? 0x02U : 0) |
+                  (gCardResetOverride[cardId] ? 0x04U : 0);
+  record.aux = static_cast<uint32_t>(prevState);
+  emitJournalEvent(record);
+}
+
+// Kernel: queues an alarm event and wakes the portal task. Never blocks; a
+// full lane drops the event and counts it.
+void emitAlarmEvent(uint16_t cardId) {
+  const uint32_t head = gAlarmLane.head.load(std::memory_order_relaxed);
+  const uint32_t tail = gAlarmLane.tail.load(std::memory_order_acquire);
+  if ((head - tail) >= AT_ALARM_QUEUE_DEPTH) {
+    gAlarmLane.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  const LogicCard& card = logicCards[cardId];
+  AlarmEvent& event = gAlarmLane.events[head & (AT_ALARM_QUEUE_DEPTH - 1)];
+  event.seq = gAlarmLane.nextSeq++;
+  event.enqueuedUs = micros();
+  event.cardId = cardId;
+  event.state = card.state;
+  event.logicalState = card.logicalState;
+  event.physicalState = card.physicalState;
+  event.resetOverride = gCardResetOverride[cardId];
+  gAlarmLane.head.store(head + 1, std::memory_order_release);
+  if (gCore1TaskHandle != nullptr) xTaskNotifyGive(gCore1TaskHandle);
+}
+
+// Once per scan, before the first card: refreshes the read-only remote SIO
+// images. A slot with no fresh frame inside its timeout goes to
+// State_Remote_Stale with both states false.
+void sampleRemoteInputs(uint32_t nowMs) {
+  for (uint16_t slot = 0; slot < NUM_REMOTE_SIO; ++slot) {
+    const RemoteSioBinding& binding = gExchangeSettings.remotes[slot];
+    LogicCard& image = gRemoteCards[slot];
+    ExchangeEntry entry = {};
+    uint32_t receivedMs = gRemoteReceivedMs[slot];
+    const bool received =
+        binding.bound && readRemoteSlot(gRemoteSlots[slot], entry, receivedMs);
+    if (received) {
+      gRemoteReceivedMs[slot] = receivedMs;
+      markPublishDirty();
+    }
+    const bool fresh =
+        binding.bound &&
+        remoteSlotFresh(gRemoteReceivedMs[slot], nowMs, binding.timeoutMs);
+    if (fresh && received) {
+      image.state = static_cast<cardState>(entry.state);
+      image.logicalState = (entry.bits & 0x01) != 0;
+      image.physicalState = (entry.bits & 0x02) != 0;
+      image.currentValue = entry.value;
+    } else if (!fresh) {
+      if (image.state != State_Remote_Stale) {
+        gExchangeStaleTransitions += 1;
+        markPublishDirty();
+        if (binding.bound) {
+          emitJournalFault(Fault_RemoteStale, REMOTE_START + slot,
+                           nowMs - gRemoteReceivedMs[slot]);
+        }
+      }
+      image.state = State_Remote_Stale;
+      image.logicalState = false;
+      image.physicalState = false;
+      image.currentValue = 0;
+    }
+  }
+}
+
+// After the last card of a scan: publishes flagged local SIO cards into the
+// seqlocked TX image that Core1 turns into one multicast frame.
+void publishExchangeImage() {
+  if (!gExchangeSettings.enabled) return;
+  ExchangeTxImage& tx = gExchangeTx;
+  const uint32_t version = tx.version.load(std::memory_order_relaxed);
+  tx.version.store(version + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  uint16_t count = 0;
+  for (uint16_t id = SIO_START; id < SCRIPT_START; ++id) {
+    const LogicCard& card = logicCards[id];
+    if (!card.exchangePublish || count >= AT_EXCHANGE_MAX_PUBLISH) continue;
+    ExchangeEntry& entry = tx.entries[count++];
+    entry.sioIndex = id - SIO_START;
+    entry.state = static_cast<uint8_t>(card.state);
+    entry.bits = static_cast<uint8_t>((card.logicalState ? 0x01 : 0) |
+                                      (card.physicalState ? 0x02 : 0));
+    entry.value = card.currentValue;
   }
+  tx.count = count;
+  tx.scanSeq += 1;
+  tx.version.store(version + 2, std::memory_order_release);
 }
 
 void processOneScanOrderedCard(uint32_t nowMs, bool honorBreakpoints) {
-  uint8_t cardId = scanOrderCardIdFromCursor(gScanCursor);
-  processCardById(cardId, nowMs);
+  if (gScanCursor == 0) sampleRemoteInputs(nowMs);
+  uint16_t cardId = scanOrderCardIdFromCursor(gScanCursor);
+  const LogicCard& card = logicCards[cardId];
+  const cardState prevState = card.state;
+  // Raw AI values publish through updateAIReporting's deadband instead.
+  const bool tracked = !isAnalogInputCard(cardId);
+  const CardHotState prevHot = tracked ? captureHotState(cardId) : CardHotState{};
+  const bool prevSet = gCardSetResult[cardId];
+  const bool prevReset = gCardResetResult[cardId];
+  if (card.alarm) {
+    const bool prevLogical = card.logicalState;
+    const bool prevPhysical = card.physicalState;
+    const bool prevOverride = gCardResetOverride[cardId];
+    processCardById(liveEvalContext(), cardId, nowMs);
+    if (card.state != prevState || card.logicalState != prevLogical ||
+        card.physicalState != prevPhysical ||
+        gCardResetOverride[cardId] != prevOverride) {
+      emitAlarmEvent(cardId);
+    }
+  } else {
+    processCardById(liveEvalContext(), cardId, nowMs);
+  }
+  if (card.journal && card.state != prevState) {
+    emitJournalTransition(cardId, prevState);
+  }
+  if (tracked && (!hotStateEquals(prevHot, captureHotState(cardId)) ||
+                  gCardSetResult[cardId] != prevSet ||
+                  gCardResetResult[cardId] != prevReset)) {
+    markPublishDirty();
+  }
   gCardEvalCounter[cardId] += 1;
 
   gScanCursor = static_cast<uint16_t>((gScanCursor + 1) % TOTAL_CARDS);
+  if (gScanCursor == 0) publishExchangeImage();
 
-  if (honorBreakpoints && gRunMode == RUN_BREAKPOINT && gCardBreakpoint[cardId]) {
+  if (honorBreakpoints && gRunMode == RUN_BREAKPOINT &&
+      (gCardBreakpoint[cardId] ||
+       gCardHookHead[cardId] != kNoBreakpointHookSlot) &&
+      checkCardBreakpoints(cardId)) {
     gBreakpointPaused = true;
   }
 }
 
 bool runFullScanCycle(uint32_t nowMs, bool honorBreakpoints) {
-  for (uint8_t i = 0; i < TOTAL_CARDS; ++i) {
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
     processOneScanOrderedCard(nowMs, honorBreakpoints);
     if (gBreakpointPaused) return false;
   }
   return true;
 }
 
+bool shadowOutputDiffers(const LogicCard& live, const LogicCard& shadow) {
+  return live.physicalState != shadow.physicalState ||
+         live.logicalState != shadow.logicalState || live.state != shadow.state;
+}
+
+// Runs one full shadow scan right after a completed live scan, on the same
+// input image and nowMs. Outputs are never driven. Cost is tracked apart from
+// the live scan; the shadow stops itself after kShadowOverrunLimit scans in a
+// row exceed its share of the scan budget or push the total past the interval.
+void runShadowScanCycle(uint32_t nowMs, uint32_t liveCostUs,
+                        uint32_t scanIntervalMs) {
+  const uint32_t startUs = micros();
+  const KernelEvalContext ctx = shadowEvalContext();
+  for (uint16_t cursor = 0; cursor < TOTAL_CARDS; ++cursor) {
+    processCardById(ctx, scanOrderCardIdFromCursor(cursor), nowMs);
+  }
+
+  bool diverged = false;
+  for (uint16_t id = DO_START; id < AI_START; ++id) {
+    if (!shadowOutputDiffers(logicCards[id], gShadow.cards[id])) continue;
+    gShadow.divergences[id] += 1;
+    diverged = true;
+  }
+  for (uint16_t id = SIO_START; id < TOTAL_CARDS; ++id) {
+    // SoftIO, Script and Plugin cards
+    if (!shadowOutputDiffers(logicCards[id], gShadow.cards[id])) continue;
+    gShadow.divergences[id] += 1;
+    diverged = true;
+  }
+  const uint32_t costUs = micros() - startUs;
+
+  gShadow.scans += 1;
+  if (diverged) gShadow.divergentScans += 1;
+  gShadow.lastCostUs = costUs;
+  if (costUs > gShadow.maxCostUs) gShadow.maxCostUs = costUs;
+
+  const uint32_t intervalUs = scanIntervalMs * 1000UL;
+  const uint32_t capUs = (intervalUs / 100UL) * AT_SHADOW_BUDGET_PERCENT;
+  const bool overrun = costUs > capUs || (liveCostUs + costUs) > intervalUs;
+  gShadow.overrunStreak = overrun ? gShadow.overrunStreak + 1 : 0;
+  if (gShadow.overrunStreak >= kShadowOverrunLimit) {
+    gShadowActive = false;
+    gShadowStopReason = "budget";
+    emitJournalFault(Fault_ShadowBudget, kInvalidCardId, costUs);
+  }
+}
+
+uint16_t outputSlotForCard(uint16_t id) {
+  return (id < AI_START) ? static_cast<uint16_t>(id - DO_START)
+                         : static_cast<uint16_t>(NUM_DO + (id - SIO_START));
+}
+
+void clearStatisticsBucket(uint8_t bucket) {
+  for (uint16_t i = 0; i < NUM_OUTPUT_CARDS; ++i) {
+    gStatistics.outputs[i].cycleBuckets[bucket] = 0;
+  }
+  for (uint16_t i = 0; i < NUM_DI; ++i) {
+    gStatistics.di[i].edgeBuckets[bucket] = 0;
+  }
+  for (uint16_t i = 0; i < NUM_AI; ++i) {
+    AnalogInputStats& ai = gStatistics.ai[i];
+    ai.min[bucket] = UINT32_MAX;
+    ai.max[bucket] = 0;
+    ai.sum[bucket] = 0;
+    ai.count[bucket] = 0;
+  }
+}
+
+// Clears at most one full window of buckets per call, so the cost of a
+// rollover is bounded and happens once per bucket period.
+void advanceStatisticsBuckets(uint32_t nowMs) {
+  const uint32_t epoch = nowMs / AT_STATS_BUCKET_MS;
+  if (epoch == gStatistics.bucketEpoch) return;
+  uint32_t steps = epoch - gStatistics.bucketEpoch;
+  if (steps > AT_STATS_BUCKETS) steps = AT_STATS_BUCKETS;
+  for (uint32_t i = 0; i < steps; ++i) {
+    gStatistics.bucket =
+        static_cast<uint8_t>((gStatistics.bucket + 1) % AT_STATS_BUCKETS);
+    clearStatisticsBucket(gStatistics.bucket);
+  }
+  gStatistics.bucketEpoch = epoch;
+}
+
+void updateOutputCardStatistics(uint16_t id, uint32_t dtMs, uint8_t bucket) {
+  OutputCardStats& out = gStatistics.outputs[outputSlotForCard(id)];
+  const bool physical = logicCards[id].physicalState;
+  if (out.prevPhysical) out.onMs += dtMs;
+  if (physical && !out.prevPhysical) {
+    out.cycles += 1;
+    out.cycleBuckets[bucket] += 1;
+  }
+  out.prevPhysical = physical;
+}
+
+// Runs once per completed scan: O(1) work per card.
+void updateCardStatistics(uint32_t nowMs) {
+  if (!gStatistics.started) {
+    for (uint8_t b = 0; b < AT_STATS_BUCKETS; ++b) clearStatisticsBucket(b);
+    gStatistics.startMs = nowMs;
+    gStatistics.lastMs = nowMs;
+    gStatistics.bucketEpoch = nowMs / AT_STATS_BUCKET_MS;
+    gStatistics.started = true;
+  }
+  advanceStatisticsBuckets(nowMs);
+  const uint32_t dtMs = nowMs - gStatistics.lastMs;
+  const uint8_t bucket = gStatistics.bucket;
+
+  for (uint16_t id = DI_START; id < DO_START; ++id) {
+    DigitalInputStats& di = gStatistics.di[id - DI_START];
+    const bool physical = logicCards[id].physicalState;
+    if (di.primed && physical != di.prevPhysical) di.edgeBuckets[bucket] += 1;
+    di.prevPhysical = physical;
+    di.primed = true;
+  }
+  for (uint16_t id = AI_START; id < SIO_START; ++id) {
+    AnalogInputStats& ai = gStatistics.ai[id - AI_START];
+    const uint32_t value = logicCards[id].currentValue;
+    if (value < ai.min[bucket]) ai.min[bucket] = value;
+    if (value > ai.max[bucket]) ai.max[bucket] = value;
+    ai.sum[bucket] += value;
+    ai.count[bucket] += 1;
+  }
+  for (uint16_t id = DO_START; id < AI_START; ++id) {
+    updateOutputCardStatistics(id, dtMs, bucket);
+  }
+  for (uint16_t id = SIO_START; id < SCRIPT_START; ++id) {
+    updateOutputCardStatistics(id, dtMs, bucket);
+  }
+  gStatistics.lastMs = nowMs;
+
+  static uint32_t lastPublishMs = 0;
+  if ((nowMs - lastPublishMs) < kStatsPublishMs) return;
+  lastPublishMs = nowMs;
+  portENTER_CRITICAL(&gSnapshotMux);
+  memcpy(&gSharedStatistics, &gStatistics, sizeof(gStatistics));
+  portEXIT_CRITICAL(&gSnapshotMux);
+}
+
+// Start-to-start period error of full scans, kept apart while an OTA
+// transfer is writing flash.
+void trackScanJitter(uint32_t scanStartUs, uint32_t scanIntervalMs) {
+  static bool wasWriting = false;
+  const bool writing = gOtaWriting.load(std::memory_order_relaxed);
+  if (writing && !wasWriting) gKernelMetrics.otaJitterMaxUs = 0;
+  wasWriting = writing;
+  if (gJitterPrevStartUs != 0) {
+    const uint32_t periodUs = scanStartUs - gJitterPrevStartUs;
+    const uint32_t targetUs = scanIntervalMs * 1000UL;
+    const uint32_t jitterUs =
+        (periodUs > targetUs) ? periodUs - targetUs : targetUs - periodUs;
+    uint32_t& maxUs =
+        writing ? gKernelMetrics.otaJitterMaxUs : gKernelMetrics.jitterMaxUs;
+    if (jitterUs > maxUs) maxUs = jitterUs;
+  }
+  gJitterPrevStartUs = scanStartUs;
+}
+
+void recordScanDuration(uint32_t durationUs, uint32_t scanIntervalMs) {
+  uint8_t bucket = 0;
+  while (bucket + 1 < kScanHistogramBuckets &&
+         durationUs > kScanHistogramBoundsUs[bucket]) {
+    ++bucket;
+  }
+  gKernelMetrics.scanBuckets[bucket] += 1;
+  gKernelMetrics.scanSumUs += durationUs;
+  gKernelMetrics.scans += 1;
+  gKernelMetrics.scriptLastUs = gScriptScanUs;
+  if (gScriptScanUs > gKernelMetrics.scriptMaxUs) {
+    gKernelMetrics.scriptMaxUs = gScriptScanUs;
+  }
+  // Only the first scan of an overrun streak is journaled.
+  static bool overrunStreak = false;
+  const bool overrun = durationUs > scanIntervalMs * 1000UL;
+  if (overrun) {
+    gKernelMetrics.overruns += 1;
+    if (!overrunStreak) emitJournalFault(Fault_ScanOverrun, kInvalidCardId, durationUs);
+  }
+  overrunStreak = overrun;
+}
+
+// Kernel side of the time-sync seqlock. False without a fresh model.
+bool readMasterTimeUs(int64_t localUs, uint32_t nowMs, int64_t& masterUs) {
+  const TimeSyncModel& model = gTimeSyncModel;
+  const uint32_t before = model.version.load(std::memory_order_acquire);
+  if (before & 1U) return false;
+  const bool valid = model.valid;
+  const int64_t offsetUs = model.offsetUs;
+  const int64_t refLocalUs = model.refLocalUs;
+  const int32_t driftPpb = model.driftPpb;
+  const uint32_t updatedMs = model.updatedMs;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (model.version.load(std::memory_order_relaxed) != before) return false;
+  if (!valid || (nowMs - updatedMs) > AT_TIMESYNC_HOLDOVER_MS) return false;
+  masterUs = projectMasterTimeUs(localUs, offsetUs, refLocalUs, driftPpb);
+  return true;
+}
+
+// Called at each scan release: records the release phase against
+// master-time multiples of the interval and nudges the next deadline.
+void alignScanRelease(uint32_t nowMs, uint32_t latenessMs,
+                      uint32_t scanIntervalMs, uint32_t& lastScanMs) {
+  int64_t masterUs = 0;
+  if (!readMasterTimeUs(esp_timer_get_time(), nowMs, masterUs)) {
+    gKernelMetrics.alignActive = false;
+    return;
+  }
+  const int64_t periodUs = static_cast<int64_t>(scanIntervalMs) * 1000;
+  int64_t phaseUs = masterUs % periodUs;
+  if (phaseUs < 0) phaseUs += periodUs;
+  if (phaseUs >= periodUs / 2) phaseUs -= periodUs;  // > 0: released late
+  const int32_t errorUs = static_cast<int32_t>(phaseUs);
+  const uint32_t absErrorUs = static_cast<uint32_t>(errorUs < 0 ? -errorUs : errorUs);
+  KernelMetrics& m = gKernelMetrics;
+  m.alignActive = true;
+  m.alignLastErrorUs = errorUs;
+  if (absErrorUs > m.alignMaxAbsErrorUs) m.alignMaxAbsErrorUs = absErrorUs;
+  const int64_t meanUs = m.alignMeanAbsErrorUs;
+  m.alignMeanAbsErrorUs = (m.alignSamples == 0)
+                              ? absErrorUs
+                              : static_cast<uint32_t>(meanUs + (absErrorUs - meanUs) / 16);
+  m.alignSamples += 1;
+
+  // A late release says nothing about where the schedule itself sits.
+  if (latenessMs > 0) return;
+  if (errorUs > kScanAlignToleranceUs && scanIntervalMs > 1) {
+    lastScanMs -= 1;
+    m.alignSlews += 1;
+  } else if (errorUs < -kScanAlignToleranceUs) {
+    lastScanMs += 1;
+    m.alignSlews += 1;
+  }
+}
+
 void runEngineIteration(uint32_t nowMs, uint32_t& lastScanMs) {
   processKernelCommandQueue();
   if (gKernelPauseRequested) {
     gKernelPaused = true;
+    gJitterPrevStartUs = 0;
     updateSharedRuntimeSnapshot(nowMs, false);
     return;
   }
   gKernelPaused = false;
+  // Recipe swaps wait for a scan boundary so no scan mixes two programs.
+  if (gPendingRecipeSlot != kNoRecipe && gScanCursor == 0) {
+    applyPendingRecipeSwitch();
+  }
   if (lastScanMs == 0) {
     lastScanMs = nowMs;
   }
 
-  uint32_t scanInterval = (gRunMode == RUN_SLOW) ? SLOW_SCAN_INTERVAL_MS
-                                                 : gScanIntervalMs;
+  uint32_t scanInterval = effectiveScanIntervalMs();
   if ((nowMs - lastScanMs) < scanInterval) {
     updateSharedRuntimeSnapshot(nowMs, false);
     return;
   }
+  const uint32_t latenessMs = nowMs - lastScanMs - scanInterval;
+  if (latenessMs > 0) {
+    gKernelMetrics.lateScans += 1;
+    gKernelMetrics.latenessSumMs += latenessMs;
+    if (latenessMs > gKernelMetrics.maxLatenessMs) {
+      gKernelMetrics.maxLatenessMs = latenessMs;
+    }
+  }
   lastScanMs += scanInterval;
+  alignScanRelease(nowMs, latenessMs, scanInterval, lastScanMs);
 
   if (gRunMode == RUN_STEP) {
+    gJitterPrevStartUs = 0;
     if (gStepRequested) {
       processOneScanOrderedCard(nowMs, false);
       gStepRequested = false;
+      if (gTestModeActive) recordRewindFrame(nowMs);
       updateSharedRuntimeSnapshot(nowMs, true);
       return;
     }
@@ -2354,15 +10225,29 @@ void runEngineIteration(uint32_t nowMs, uint32_t& lastScanMs) {
   }
 
   if (gRunMode == RUN_BREAKPOINT && gBreakpointPaused) {
+    gJitterPrevStartUs = 0;
     updateSharedRuntimeSnapshot(nowMs, false);
     return;
   }
 
   uint32_t scanStartUs = micros();
+  trackScanJitter(scanStartUs, scanInterval);
+  gScriptScanUs = 0;
   bool completedFullScan = runFullScanCycle(nowMs, gRunMode == RUN_BREAKPOINT);
   uint32_t scanEndUs = micros();
+  if (gTestModeActive) recordRewindFrame(nowMs);
   if (completedFullScan) {
     gLastCompleteScanUs = (scanEndUs - scanStartUs);
+    recordScanDuration(gLastCompleteScanUs, scanInterval);
+    updateCardStatistics(nowMs);
+    if (gShadowActive) {
+      runShadowScanCycle(nowMs, gLastCompleteScanUs, scanInterval);
+    }
+    gScanCompleteSeq.fetch_add(1, std::memory_order_release);
+    if (gScanGapWaiting.load(std::memory_order_relaxed) &&
+        gCore1TaskHandle != nullptr) {
+      xTaskNotifyGive(gCore1TaskHandle);
+    }
   }
   updateSharedRuntimeSnapshot(nowMs, true);
 }
@@ -2382,6 +10267,10 @@ void core1PortalTask(void* param) {
   if (wifiOk) {
     initPortalServer();
     initWebSocketServer();
+#if AT_ENABLE_MODBUS_TCP
+    initModbusServer();
+#endif
+    initExchange();
   }
   for (;;) {
     if (wifiOk) {
@@ -2391,52 +10280,103 @@ void core1PortalTask(void* param) {
         if (wifiOk) {
           initPortalServer();
           initWebSocketServer();
+#if AT_ENABLE_MODBUS_TCP
+          initModbusServer();
+#endif
+          initExchange();
         }
       }
+      publishAlarmEvents();
       handlePortalServerLoop();
+      stepFastForward();
       handleWebSocketLoop();
+#if AT_ENABLE_MODBUS_TCP
+      handleModbusLoop();
+#endif
+#if AT_ENABLE_MQTT
+      handleMqttLoop();
+#endif
+      handleExchangeLoop();
+      handleTrendLoop();
+      handleJournalLoop();
+      handleOtaLoop();
+      publishAlarmEvents();
       publishRuntimeSnapshotWebSocket();
-      vTaskDelay(pdMS_TO_TICKS(2));
+      publishDiagnosticsWebSocket();
+      // Up to 2 ms between passes; an alarm wakes the task early.
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2));
       continue;
     }
-    // Optional low-frequency retry in offline mode.
-    static uint32_t lastRetryMs = 0;
-    uint32_t nowMs = millis();
-    if (nowMs - lastRetryMs >= 30000) {
-      lastRetryMs = nowMs;
-      wifiOk = connectWiFiWithPolicy();
-      if (wifiOk) {
-        initPortalServer();
-        initWebSocketServer();
-      }
+#if AT_ENABLE_SERIAL_LINK
+    handleSerialLink();
+#endif
+    handleTrendLoop();
+    handleJournalLoop();
+    handleOtaLoop();
+    // Low-frequency, non-blocking retry in offline mode.
+    if (stepOfflineWifiRetry(millis())) {
+      wifiOk = true;
+#if AT_ENABLE_SERIAL_LINK
+      stopSerialLink();
+#endif
+      gConsole.print("WiFi reconnected. IP: ");
+      gConsole.println(WiFi.localIP());
+      initPortalServer();
+      initWebSocketServer();
+#if AT_ENABLE_MODBUS_TCP
+      initModbusServer();
+#endif
+      initExchange();
     }
+#if AT_ENABLE_SERIAL_LINK
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2));
+#else
     vTaskDelay(pdMS_TO_TICKS(50));
+#endif
   }
 }
 
 void setup() {
-  Serial.begin(115200);
+#if AT_ENABLE_SERIAL_LINK
+  // Driver-side ring buffers so offline link writes never wait on the UART.
+  Serial.setRxBufferSize(AT_SERIAL_LINK_RX_BUFFER);
+  Serial.setTxBufferSize(AT_SERIAL_LINK_TX_BUFFER);
+#endif
+  Serial.begin(kSerialConsoleBaud);
   configureHardwarePinsSafeState();
   initializeRuntimeControlState();
 
   bool fsReady = LittleFS.begin(true);
+  const otaTrialAction otaBootAction = fsReady ? initOtaTrial() : OtaAction_None;
   if (!fsReady) {
-    Serial.println("LittleFS mount failed");
+    gConsole.println("LittleFS mount failed");
     initializeAllCardsSafeDefaults();
   } else {
     if (!loadPortalSettingsFromLittleFS()) {
       savePortalSettingsToLittleFS();
     }
     bootstrapCardsFromStorage();
+    initConfigHistory();
+    loadRecipesFromStorage();
+    if (!ensureV2MigrationCurrent()) {
+      gConsole.println("V2 config migration incomplete; will retry next boot");
+    }
   }
 
-  gKernelCommandQueue = xQueueCreate(16, sizeof(KernelCommand));
+  gKernelCommandQueue = xQueueCreate(AT_KERNEL_QUEUE_DEPTH, sizeof(KernelCommand));
   if (gKernelCommandQueue == nullptr) {
-    Serial.println("Failed to create kernel command queue");
+    gConsole.println("Failed to create kernel command queue");
     return;
   }
 
   updateSharedRuntimeSnapshot(millis(), false);
+  initTrendStore();
+  if (fsReady) {
+    initJournal();
+    recordJournalEvent(Journal_Boot, static_cast<uint8_t>(esp_reset_reason()),
+                       kInvalidCardId, headConfigId(), gConfigVersionCounter);
+    if (otaBootAction != OtaAction_None) journalOtaTrial();
+  }
 
   xTaskCreatePinnedToCore(core0EngineTask, "core0_engine", 8192, nullptr, 3,
                           &gCore0TaskHandle, 0);
@@ -2448,6 +10388,323 @@ void loop() {
   vTaskDelay(pdMS_TO_TICKS(1000));
 }
 
+struct TimingCacheEntry {
+  bool valid;
+  uint16_t cardId;
+  uint32_t configVersion;
+  uint32_t recipeSwitchCount;
+  uint32_t scanIntervalMs;
+  uint32_t triggerMs;
+  uint32_t horizonMs;
+  uint32_t gateMs;
+  String body;
+};
+
+bool parseUInt32Arg(const char* name, uint32_t fallback, uint32_t& out) {
+  out = fallback;
+  if (!gPortalServer.hasArg(name)) return true;
+  const String text = gPortalServer.arg(name);
+  if (text.length() == 0) return false;
+  char* end = nullptr;
+  const unsigned long value = strtoul(text.c_str(), &end, 10);
+  if (end == nullptr || *end != '\0' || text.c_str()[0] == '-') return false;
+  out = static_cast<uint32_t>(value);
+  return true;
+}
+
+// Default horizon covers the whole mission (or three cycles when repeat is
+// unlimited) plus two scans of idle tail.
+uint32_t defaultTimingHorizonMs(const LogicCard& card, uint32_t triggerMs,
+                                uint32_t stepMs) {
+  const uint64_t cycles = (card.setting3 == 0) ? 3 : card.setting3;
+  uint64_t horizon = static_cast<uint64_t>(triggerMs) + card.setting1 +
+                     (static_cast<uint64_t>(card.setting1) + card.setting2) *
+                         cycles +
+                     2ULL * stepMs;
+  if (horizon < 10ULL * stepMs) horizon = 10ULL * stepMs;
+  return (horizon > UINT32_MAX) ? UINT32_MAX : static_cast<uint32_t>(horizon);
+}
+
+// Expected DO/SIO waveform from the card's config alone. A private copy of the
+// card, reset to Idle and with its set/reset replaced by the assumed trigger,
+// is stepped through processCardById at the scan interval, so the result
+// carries the kernel's own transition and scan quantization rules.
+void buildCardTimingBody(uint16_t cardId, const LogicCard& source,
+                         uint32_t stepMs, uint32_t triggerMs,
+                         uint32_t horizonMs, uint32_t gateMs, String& outBody) {
+  VirtualRun& run = gVirtualRun;
+  memset(&run, 0, sizeof(run));
+  LogicCard& card = run.cards[cardId];
+  card = source;
+  forceDOIdle(card, true);
+  card.setA_ID = cardId;
+  card.setCombine = Combine_None;
+  card.resetA_ID = cardId;
+  card.resetA_Operator = Op_AlwaysFalse;
+  card.resetCombine = Combine_None;
+  const KernelEvalContext ctx = {run.cards,         run.prevSetCondition,
+                                 run.prevDISample,  run.prevDIPrimed,
+                                 run.setResult,     run.resetResult,
+                                 run.resetOverride, run.inputDI,
+                                 run.inputAI,       false,
+                                 gScriptPrograms};
+
+  bool truncated = (horizonMs / stepMs) > kTimingMaxSteps;
+  if (truncated) horizonMs = stepMs * kTimingMaxSteps;
+
+  JsonDocument doc;
+  doc["ok"] = true;
+  doc["cardId"] = cardId;
+  doc["configVersion"] = gActiveVersion;
+  doc["mode"] = toString(card.mode);
+  doc["stepMs"] = stepMs;
+  doc["triggerMs"] = triggerMs;
+  doc["horizonMs"] = horizonMs;
+  doc["assumption"] = (card.mode == Mode_DO_Gated)
+                          ? "set TRUE from triggerMs for gateMs, reset FALSE"
+                          : "set TRUE for one scan at triggerMs, reset FALSE";
+  JsonArray segments = doc["segments"].to<JsonArray>();
+
+  const bool gated = (card.mode == Mode_DO_Gated);
+  uint16_t segmentCount = 0;
+  uint32_t segmentStartMs = 0;
+  cardState segmentState = card.state;
+  bool segmentLevel = card.physicalState;
+  bool triggered = false;
+
+  for (uint32_t t = 0; t <= horizonMs; t += stepMs) {
+    bool setHigh = false;
+    if (t >= triggerMs) {
+      // Normal/Immediate see a single-scan trigger; Gated holds set for gateMs.
+      setHigh = gated ? (t - triggerMs) < gateMs : !triggered;
+      triggered = true;
+    }
+    card.setA_Operator = setHigh ? Op_AlwaysTrue : Op_AlwaysFalse;
+    processCardById(ctx, cardId, t);
+
+    if (card.state != segmentState || card.physicalState != segmentLevel) {
+      if (segmentCount >= kTimingMaxSegments) {
+        truncated = true;
+        break;
+      }
+      JsonObject segment = segments.add<JsonObject>();
+      segment["startMs"] = segmentStartMs;
+      segment["endMs"] = t;
+      segment["physicalState"] = segmentLevel;
+      segment["state"] = toString(segmentState);
+      segmentCount += 1;
+      segmentStartMs = t;
+      segmentState = card.state;
+      segmentLevel = card.physicalState;
+    }
+    // Nothing changes once a non-gated mission has finished.
+    if (triggered && !setHigh && card.state == State_DO_Finished) break;
+    if (t > UINT32_MAX - stepMs) break;
+  }
+  JsonObject last = segments.add<JsonObject>();
+  last["startMs"] = segmentStartMs;
+  last["endMs"] = horizonMs;
+  last["physicalState"] = segmentLevel;
+  last["state"] = toString(segmentState);
+
+  doc["truncated"] = truncated;
+  doc["error"] = nullptr;
+  outBody = "";
+  serializeJson(doc, outBody);
+}
+
+void handleHttpGetCardTiming() {
+  const String idText = gPortalServer.pathArg(0);
+  char* end = nullptr;
+  const unsigned long parsedId = strtoul(idText.c_str(), &end, 10);
+  if (idText.length() == 0 || end == nullptr || *end != '\0' ||
+      parsedId >= TOTAL_CARDS) {
+    writeConfigErrorResponse(404, "NOT_FOUND", "card not found");
+    return;
+  }
+  const uint16_t cardId = static_cast<uint16_t>(parsedId);
+  if (!isDigitalOutputCard(cardId) && !isSoftIOCard(cardId)) {
+    writeConfigErrorResponse(400, "VALIDATION_FAILED",
+                             "timing is only defined for DO/SIO cards");
+    return;
+  }
+
+  SharedRuntimeSnapshot& snapshot = gPortalSnapshot;
+  copySharedRuntimeSnapshot(snapshot);
+  const LogicCard& source = snapshot.cards[cardId];
+  const uint32_t stepMs = gScanIntervalMs;
+  uint32_t triggerMs = 0;
+  uint32_t horizonMs = 0;
+  uint32_t gateMs = 0;
+  if (!parseUInt32Arg("triggerMs", 0, triggerMs) ||
+      !parseUInt32Arg("horizonMs",
+                      defaultTimingHorizonMs(source, triggerMs, stepMs),
+                      horizonMs) ||
+      !parseUInt32Arg("gateMs", UINT32_MAX, gateMs)) {
+    writeConfigErrorResponse(400, "INVALID_REQUEST", "invalid query parameter");
+    return;
+  }
+
+  // Results depend only on config, so they are reused until the active
+  // config (commit/restore or recipe switch) or scan interval changes.
+  static TimingCacheEntry cache[kTimingCacheEntries];
+  static uint8_t nextEntry = 0;
+  for (uint8_t i = 0; i < kTimingCacheEntries; ++i) {
+    const TimingCacheEntry& entry = cache[i];
+    if (entry.valid && entry.cardId == cardId &&
+        entry.configVersion == gConfigVersionCounter &&
+        entry.recipeSwitchCount == snapshot.recipeSwitchCount &&
+        entry.scanIntervalMs == stepMs && entry.triggerMs == triggerMs &&
+        entry.horizonMs == horizonMs && entry.gateMs == gateMs) {
+      gPortalServer.send(200, "application/json", entry.body);
+      return;
+    }
+  }
+
+  // The preview steps in gVirtualRun, which a running fast-forward owns.
+  if (gFastForward.running) {
+    writeConfigErrorResponse(409, "BUSY", "fast-forward running");
+    return;
+  }
+  TimingCacheEntry& entry = cache[nextEntry];
+  nextEntry = static_cast<uint8_t>((nextEntry + 1) % kTimingCacheEntries);
+  entry.valid = true;
+  entry.cardId = cardId;
+  entry.configVersion = gConfigVersionCounter;
+  entry.recipeSwitchCount = snapshot.recipeSwitchCount;
+  entry.scanIntervalMs = stepMs;
+  entry.triggerMs = triggerMs;
+  entry.horizonMs = horizonMs;
+  entry.gateMs = gateMs;
+  buildCardTimingBody(cardId, source, stepMs, triggerMs, horizonMs, gateMs,
+                      entry.body);
+  gPortalServer.send(200, "application/json", entry.body);
+}
+
+void serializeHotState(const CardHotState& hot, JsonObject& json) {
+  json["state"] = toString(hot.state);
+  json["logicalState"] = (hot.flags & kHotLogical) != 0;
+  json["physicalState"] = (hot.flags & kHotPhysical) != 0;
+  json["triggerFlag"] = (hot.flags & kHotTrigger) != 0;
+  json["currentValue"] = hot.currentValue;
+  json["startOnMs"] = hot.startOnMs;
+  json["startOffMs"] = hot.startOffMs;
+  json["repeatCounter"] = hot.repeatCounter;
+}
+
+// Asks the kernel to rebuild one recorded frame and returns its card states.
+void handleHttpGetRewindFrame() {
+  uint32_t frame = 0;
+  if (!gPortalServer.hasArg("frame") ||
+      !parseUInt32Arg("frame", 0, frame)) {
+    writeConfigErrorResponse(400, "INVALID_REQUEST", "frame is required");
+    return;
+  }
+  if (gRewindInspectState == RewindInspect_Pending) {
+    writeConfigErrorResponse(409, "BUSY", "inspect already pending");
+    return;
+  }
+  gRewindInspectState = RewindInspect_Pending;
+  KernelCommand command = {};
+  command.type = KernelCmd_InspectRewindFrame;
+  command.value = frame;
+  if (!enqueueKernelCommand(command)) {
+    gRewindInspectState = RewindInspect_Idle;
+    writeConfigErrorResponse(503, "BUSY", "kernel command queue full");
+    return;
+  }
+  const uint32_t startMs = millis();
+  while (gRewindInspectState == RewindInspect_Pending &&
+         (millis() - startMs) < kRewindInspectTimeoutMs) {
+    vTaskDelay(pdMS_TO_TICKS(2));
+  }
+  const rewindInspectState state = gRewindInspectState;
+  if (state == RewindInspect_Pending) {
+    // A late kernel reply just leaves the state at Ready/Unavailable.
+    writeConfigErrorResponse(503, "BUSY", "kernel did not answer in time");
+    return;
+  }
+  if (state != RewindInspect_Ready) {
+    gRewindInspectState = RewindInspect_Idle;
+    writeConfigErrorResponse(404, "NOT_FOUND", "frame not retained");
+    return;
+  }
+  // Core1-only copy; taken under the mux the kernel publishes with.
+  static RewindInspectImage image;
+  portENTER_CRITICAL(&gSnapshotMux);
+  memcpy(&image, &gRewindInspect, sizeof(image));
+  portEXIT_CRITICAL(&gSnapshotMux);
+
+  JsonDocument doc;
+  doc["ok"] = true;
+  doc["frame"] = image.frame;
+  doc["tsMs"] = image.tsMs;
+  doc["scanCursor"] = image.scanCursor;
+  JsonArray cards = doc["cards"].to<JsonArray>();
+  for (uint16_t i = 0; i < TOTAL_CARDS; ++i) {
+    JsonObject card = cards.add<JsonObject>();
+    card["id"] = i;
+    serializeHotState(image.cards[i], card);
+  }
+  doc["error"] = nullptr;
+  gRewindInspectState = RewindInspect_Idle;
+  String body;
+  serializeJson(doc, body);
+  gPortalServer.send(200, "application/json", body);
+}
+
+// Stages a stimulus for one forced input; the kernel adopts it on the next
+// command pass. Rejected while a previous upload is still pending.
+bool stageInputStimulus(JsonObjectConst payload) {
+  const uint16_t cardId = payload["cardId"] | kInvalidCardId;
+  if (!isInputCard(cardId)) return false;
+  if (gStimulusUploadPending) return false;
+
+  StimulusSpec spec = {};
+  if (!tryParseStimulusWaveform(payload["waveform"] | "", spec.waveform)) {
+    return false;
+  }
+  const bool digital = isDigitalInputCard(cardId);
+  if (digital && (spec.waveform == Stimulus_Ramp ||
+                  spec.waveform == Stimulus_Sine)) {
+    return false;
+  }
+  spec.periodMs = payload["periodMs"] | 0UL;
+  spec.widthMs = payload["widthMs"] | 0UL;
+  spec.low = payload["low"] | 0UL;
+  spec.high = payload["high"] | (digital ? 1UL : 0UL);
+  spec.loop = payload["loop"] | false;
+  if (spec.waveform != Stimulus_Trace && spec.periodMs == 0) return false;
+  if (spec.waveform == Stimulus_Pulse && spec.widthMs > spec.periodMs) {
+    return false;
+  }
+
+  uint32_t previousAtMs = 0;
+  for (JsonVariantConst point : payload["trace"].as<JsonArrayConst>()) {
+    if (spec.traceLength >= kStimulusTracePoints) return false;
+    const uint32_t atMs = point["atMs"] | 0UL;
+    if (atMs < previousAtMs) return false;
+    gStimulusUpload.trace[spec.traceLength].atMs = atMs;
+    gStimulusUpload.trace[spec.traceLength].value = point["value"] | 0UL;
+    previousAtMs = atMs;
+    spec.traceLength += 1;
+  }
+  if (spec.waveform == Stimulus_Trace && spec.traceLength == 0) return false;
+
+  gStimulusUpload.cardId = cardId;
+  gStimulusUpload.spec = spec;
+  gStimulusUploadPending = true;
+
+  KernelCommand command = {};
+  command.type = KernelCmd_SetInputStimulus;
+  command.cardId = cardId;
+  if (!enqueueKernelCommand(command)) {
+    gStimulusUploadPending = false;
+    return false;
+  }
+  return true;
+}
+
 bool applyCommand(JsonObjectConst command) {
   const char* name = command["name"] | "";
   JsonObjectConst payload = command["payload"].as<JsonObjectConst>();
@@ -2484,11 +10741,44 @@ bool applyCommand(JsonObjectConst command) {
 
   if (strcmp(name, "set_breakpoint") == 0) {
     kernelCommand.type = KernelCmd_SetBreakpoint;
-    kernelCommand.cardId = payload["cardId"] | 255;
+    kernelCommand.cardId = payload["cardId"] | kInvalidCardId;
     kernelCommand.flag = payload["enabled"] | false;
     return enqueueKernelCommand(kernelCommand);
   }
 
+  if (strcmp(name, "add_breakpoint_hook") == 0) {
+    kernelCommand.type = KernelCmd_AddBreakpointHook;
+    kernelCommand.cardId = payload["cardId"] | kInvalidCardId;
+    BreakpointHook& hook = kernelCommand.hook;
+    if (!tryParseHookKind(payload["kind"] | "", hook.kind)) return false;
+    if (hook.kind == Hook_Condition) {
+      if (!tryParseLogicOperator(payload["operator"] | "", hook.op)) {
+        return false;
+      }
+      hook.operand = payload["threshold"] | 0UL;
+    } else if (hook.kind == Hook_EnterState) {
+      cardState state = State_None;
+      if (!tryParseCardState(payload["state"] | "", state)) return false;
+      hook.operand = static_cast<uint32_t>(state);
+    } else if (!tryParseWatchField(payload["field"] | "", hook.field)) {
+      return false;
+    }
+    return enqueueKernelCommand(kernelCommand);
+  }
+
+  if (strcmp(name, "clear_breakpoint_hooks") == 0) {
+    kernelCommand.type = KernelCmd_ClearBreakpointHooks;
+    kernelCommand.cardId = payload["cardId"] | kInvalidCardId;
+    return enqueueKernelCommand(kernelCommand);
+  }
+
+  if (strcmp(name, "rewind_to_frame") == 0) {
+    if (!payload["frame"].is<uint32_t>()) return false;
+    kernelCommand.type = KernelCmd_RewindToFrame;
+    kernelCommand.value = payload["frame"].as<uint32_t>();
+    return enqueueKernelCommand(kernelCommand);
+  }
+
   if (strcmp(name, "set_test_mode") == 0) {
     kernelCommand.type = KernelCmd_SetTestMode;
     kernelCommand.flag = payload["active"] | false;
@@ -2496,7 +10786,7 @@ bool applyCommand(JsonObjectConst command) {
   }
 
   if (strcmp(name, "set_input_force") == 0) {
-    uint8_t cardId = payload["cardId"] | 255;
+    uint16_t cardId = payload["cardId"] | kInvalidCardId;
     bool forced = payload["forced"] | false;
     kernelCommand.type = KernelCmd_SetInputForce;
     kernelCommand.cardId = cardId;
@@ -2521,13 +10811,21 @@ bool applyCommand(JsonObjectConst command) {
     return false;
   }
 
+  if (strcmp(name, "set_input_stimulus") == 0) {
+    return stageInputStimulus(payload);
+  }
+
   if (strcmp(name, "set_output_mask") == 0) {
     kernelCommand.type = KernelCmd_SetOutputMask;
-    kernelCommand.cardId = payload["cardId"] | 255;
+    kernelCommand.cardId = payload["cardId"] | kInvalidCardId;
     kernelCommand.flag = payload["masked"] | false;
     return enqueueKernelCommand(kernelCommand);
   }
 
+  if (strcmp(name, "switch_recipe") == 0) {
+    return requestRecipeSwitch(payload["name"] | "");
+  }
+
   if (strcmp(name, "set_output_mask_global") == 0) {
     kernelCommand.type = KernelCmd_SetOutputMaskGlobal;
     kernelCommand.flag = payload["masked"] | false;
@@ -0,0 +1,152 @@
+// Modbus TCP framing and function dispatch for the server in main.cpp. The
+// register map is a template parameter with no Arduino dependency, so the
+// host tests in test/host can serve a fake map over a local socket.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+const uint16_t kModbusInputRegsPerCard = 8;
+const uint16_t kModbusHoldingRegsPerCard = 4;
+const uint16_t kModbusMaxFrame = 260;
+const uint8_t kModbusExIllegalFunction = 0x01;
+const uint8_t kModbusExIllegalAddress = 0x02;
+const uint8_t kModbusExIllegalValue = 0x03;
+const uint8_t kModbusExDeviceFailure = 0x04;
+const uint8_t kModbusExDeviceBusy = 0x06;
+
+inline uint16_t readBe16(const uint8_t* p) {
+  return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+inline void writeBe16(uint8_t* p, uint16_t value) {
+  p[0] = static_cast<uint8_t>(value >> 8);
+  p[1] = static_cast<uint8_t>(value & 0xFF);
+}
+
+// Length of the ADU at the start of rx once all of it has arrived, 0 while
+// more bytes are needed, or -1 when the header is not Modbus TCP.
+inline int modbusFrameLength(const uint8_t* rx, uint16_t rxLen) {
+  if (rxLen < 8) return 0;
+  const uint16_t length = readBe16(rx + 4);
+  if (readBe16(rx + 2) != 0 || length < 2 || length > kModbusMaxFrame - 6) {
+    return -1;
+  }
+  const uint16_t frameLen = static_cast<uint16_t>(6 + length);
+  return (rxLen < frameLen) ? 0 : frameLen;
+}
+
+// Kernel commands a holding-register write turns into: one per card whose
+// force words (0-2) are touched, one per card whose mask word (3) is, and
+// one for the global mask register.
+inline uint16_t modbusHoldingWriteCommands(uint16_t start, uint16_t quantity,
+                                           uint16_t globalMaskAddress) {
+  uint16_t count = 0;
+  const uint32_t end = static_cast<uint32_t>(start) + quantity;
+  uint32_t address = start;
+  while (address < end) {
+    if (address == globalMaskAddress) {
+      count += 1;
+      address += 1;
+      continue;
+    }
+    const uint32_t base = address - address % kModbusHoldingRegsPerCard;
+    const uint32_t cardEnd = (end < base + kModbusHoldingRegsPerCard)
+                                 ? end
+                                 : base + kModbusHoldingRegsPerCard;
+    if (address < base + 3) count += 1;
+    if (cardEnd > base + 3) count += 1;
+    address = cardEnd;
+  }
+  return count;
+}
+
+// Writes the response to the ADU in rx (frameLen from modbusFrameLength) into
+// tx and returns its length. Map provides:
+//   uint32_t addressCount(uint8_t function)
+//       table size behind function 1-4
+//   void read(uint8_t function, uint16_t start, uint16_t quantity,
+//             uint8_t* data)
+//       bits LSB first into zeroed bytes (1/2) or big-endian words (3/4)
+//   uint8_t writeHolding(uint16_t start, uint16_t quantity,
+//                        const uint8_t* values)
+//       big-endian words; 0 or an exception code
+template <typename Map>
+uint16_t serviceModbusAdu(Map& map, const uint8_t* rx, uint16_t frameLen,
+                          uint8_t* tx) {
+  const uint8_t* request = rx + 7;
+  const uint16_t requestLen = frameLen - 7;
+  uint8_t* pdu = tx + 7;
+  const uint8_t function = request[0];
+  pdu[0] = function;
+  uint16_t pduLen = 0;
+  uint8_t exception = 0;
+
+  switch (function) {
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04: {
+      if (requestLen != 5) {
+        exception = kModbusExIllegalValue;
+        break;
+      }
+      const bool bits = (function == 0x01 || function == 0x02);
+      const uint16_t start = readBe16(request + 1);
+      const uint16_t quantity = readBe16(request + 3);
+      if (quantity == 0 || quantity > (bits ? 2000 : 125)) {
+        exception = kModbusExIllegalValue;
+        break;
+      }
+      if (static_cast<uint32_t>(start) + quantity > map.addressCount(function)) {
+        exception = kModbusExIllegalAddress;
+        break;
+      }
+      const uint16_t byteCount =
+          static_cast<uint16_t>(bits ? (quantity + 7) / 8 : quantity * 2);
+      if (bits) memset(pdu + 2, 0, byteCount);
+      map.read(function, start, quantity, pdu + 2);
+      pdu[1] = static_cast<uint8_t>(byteCount);
+      pduLen = static_cast<uint16_t>(2 + byteCount);
+      break;
+    }
+    case 0x06:
+      if (requestLen != 5) {
+        exception = kModbusExIllegalValue;
+        break;
+      }
+      exception = map.writeHolding(readBe16(request + 1), 1, request + 3);
+      if (exception == 0) {
+        memcpy(pdu + 1, request + 1, 4);
+        pduLen = 5;
+      }
+      break;
+    case 0x10: {
+      const uint16_t quantity = (requestLen >= 6) ? readBe16(request + 3) : 0;
+      if (quantity == 0 || quantity > 123 || request[5] != quantity * 2 ||
+          requestLen != 6 + quantity * 2) {
+        exception = kModbusExIllegalValue;
+        break;
+      }
+      exception = map.writeHolding(readBe16(request + 1), quantity, request + 6);
+      if (exception == 0) {
+        memcpy(pdu + 1, request + 1, 4);
+        pduLen = 5;
+      }
+      break;
+    }
+    default:
+      exception = kModbusExIllegalFunction;
+      break;
+  }
+
+  if (exception != 0) {
+    pdu[0] = static_cast<uint8_t>(function | 0x80);
+    pdu[1] = exception;
+    pduLen = 2;
+  }
+  memcpy(tx, rx, 4);  // transaction + protocol id
+  writeBe16(tx + 4, static_cast<uint16_t>(pduLen + 1));
+  tx[6] = rx[6];  // unit id
+  return static_cast<uint16_t>(7 + pduLen);
+}
@@ -0,0 +1,94 @@
+// MQTT command result bodies, built into a fixed buffer without ArduinoJson
+// so the host tests in test/host can check them. A result that does not fit
+// is replaced by a fixed INTERNAL_ERROR result rather than cut off.
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// Appends text as a JSON string literal. Returns false when it does not fit;
+// length is left unchanged then.
+inline bool appendJsonString(char* out, size_t size, size_t& length,
+                             const char* text) {
+  size_t at = length;
+  if (at + 1 >= size) return false;
+  out[at++] = '"';
+  for (const char* p = text; *p != '\0'; ++p) {
+    const unsigned char c = static_cast<unsigned char>(*p);
+    char escaped[7];
+    size_t n = 0;
+    if (c == '"' || c == '\\') {
+      escaped[0] = '\\';
+      escaped[1] = static_cast<char>(c);
+      n = 2;
+    } else if (c < 0x20) {
+      n = static_cast<size_t>(snprintf(escaped, sizeof(escaped), "\\u%04x", c));
+    } else {
+      escaped[0] = static_cast<char>(c);
+      n = 1;
+    }
+    if (at + n + 1 >= size) return false;
+    memcpy(out + at, escaped, n);
+    at += n;
+  }
+  if (at + 2 > size) return false;
+  out[at++] = '"';
+  out[at] = '\0';
+  length = at;
+  return true;
+}
+
+inline bool appendJsonText(char* out, size_t size, size_t& length,
+                           const char* text) {
+  const size_t n = strlen(text);
+  if (length + n + 1 > size) return false;
+  memcpy(out + length, text, n + 1);
+  length += n;
+  return true;
+}
+
+// {"type":"command_result","schemaVersion":1,"requestId":...,"ok":...,
+// "error":null|{"code":...}}. requestId may be null (envelope not parsed) and
+// errorCode is null on success. Returns the length, or 0 if it does not fit.
+inline size_t formatCommandResult(char* out, size_t size, const char* requestId,
+                                  const char* errorCode) {
+  size_t length = 0;
+  if (size == 0) return 0;
+  out[0] = '\0';
+  bool fits =
+      appendJsonText(out, size, length,
+                     "{\"type\":\"command_result\",\"schemaVersion\":1,");
+  if (fits && requestId != nullptr) {
+    fits = appendJsonText(out, size, length, "\"requestId\":") &&
+           appendJsonString(out, size, length, requestId) &&
+           appendJsonText(out, size, length, ",");
+  }
+  if (fits && errorCode == nullptr) {
+    fits = appendJsonText(out, size, length, "\"ok\":true,\"error\":null}");
+  } else if (fits) {
+    fits = appendJsonText(out, size, length,
+                          "\"ok\":false,\"error\":{\"code\":") &&
+           appendJsonString(out, size, length, errorCode) &&
+           appendJsonText(out, size, length, "}}");
+  }
+  return fits ? length : 0;
+}
+
+// Sent in place of a result that did not fit. applied tells the client
+// whether the command itself took effect, since its requestId is lost.
+inline size_t formatOversizeCommandResult(char* out, size_t size,
+                                          bool applied) {
+  size_t length = 0;
+  if (size == 0) return 0;
+  out[0] = '\0';
+  const bool fits =
+      appendJsonText(out, size, length,
+                     "{\"type\":\"command_result\",\"schemaVersion\":1,"
+                     "\"ok\":false,\"applied\":") &&
+      appendJsonText(out, size, length, applied ? "true" : "false") &&
+      appendJsonText(out, size, length,
+                     ",\"error\":{\"code\":\"INTERNAL_ERROR\","
+                     "\"message\":\"result too large\"}}");
+  return fits ? length : 0;
+}
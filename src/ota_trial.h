@@ -0,0 +1,106 @@
+// OTA receive chunking and the trial-boot rules. No Arduino or ESP-IDF
+// dependency, so the host tests in test/host drive them against a fake
+// partition.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LIST_OTA_TRIAL_STATES(X) \
+  X(OtaTrial_None)               \
+  X(OtaTrial_Pending)            \
+  X(OtaTrial_Testing)            \
+  X(OtaTrial_Confirmed)          \
+  X(OtaTrial_RolledBack)
+
+#define OTA_TRIAL_AS_ENUM(name) name,
+enum otaTrialState { LIST_OTA_TRIAL_STATES(OTA_TRIAL_AS_ENUM) };
+#undef OTA_TRIAL_AS_ENUM
+
+const size_t kOtaChunkBytes = 4096;  // one flash sector
+
+enum otaTrialEvent { OtaEvent_Boot, OtaEvent_Healthy, OtaEvent_Unhealthy };
+enum otaTrialAction {
+  OtaAction_None,
+  OtaAction_Save,
+  OtaAction_Confirm,
+  OtaAction_RollBack
+};
+
+// Persisted across the switch.
+struct OtaTrial {
+  otaTrialState state;
+  char previous[17];  // partition labels
+  char target[17];
+  char sha256[65];
+  uint32_t bytes;
+  uint8_t boots;
+  char reason[24];
+};
+
+// Buffers body bytes into sector-sized chunks for session.writeChunk. Session
+// has received, written, fill, buffer[kOtaChunkBytes] and
+// writeChunk(Session&, const uint8_t*, size_t).
+template <typename Session>
+bool otaAcceptBytes(Session& session, const uint8_t* data, size_t length) {
+  session.received += length;
+  while (length > 0) {
+    size_t n = kOtaChunkBytes - session.fill;
+    if (n > length) n = length;
+    memcpy(session.buffer + session.fill, data, n);
+    session.fill += n;
+    data += n;
+    length -= n;
+    if (session.fill < kOtaChunkBytes) continue;
+    if (!session.writeChunk(session, session.buffer, kOtaChunkBytes)) return false;
+    session.written += kOtaChunkBytes;
+    session.fill = 0;
+  }
+  return true;
+}
+
+template <typename Session>
+bool otaFlushBytes(Session& session) {
+  if (session.fill == 0) return true;
+  if (!session.writeChunk(session, session.buffer, session.fill)) return false;
+  session.written += session.fill;
+  session.fill = 0;
+  return true;
+}
+
+// Trial rules, free of I/O. runningTarget: the running app is the image on
+// trial. More than maxBoots boots before confirming is a boot loop.
+inline otaTrialAction stepOtaTrial(OtaTrial& trial, otaTrialEvent event,
+                                   bool runningTarget, uint8_t maxBoots) {
+  if (trial.state != OtaTrial_Pending && trial.state != OtaTrial_Testing) {
+    return OtaAction_None;
+  }
+  switch (event) {
+    case OtaEvent_Boot:
+      if (!runningTarget) {
+        trial.state = OtaTrial_RolledBack;
+        snprintf(trial.reason, sizeof(trial.reason), "%s", "image did not boot");
+        return OtaAction_Save;
+      }
+      trial.boots += 1;
+      if (trial.boots > maxBoots) {
+        trial.state = OtaTrial_RolledBack;
+        snprintf(trial.reason, sizeof(trial.reason), "%s", "boot loop");
+        return OtaAction_RollBack;
+      }
+      trial.state = OtaTrial_Testing;
+      return OtaAction_Save;
+    case OtaEvent_Healthy:
+      if (trial.state != OtaTrial_Testing) return OtaAction_None;
+      trial.state = OtaTrial_Confirmed;
+      return OtaAction_Confirm;
+    case OtaEvent_Unhealthy:
+      if (trial.state != OtaTrial_Testing) return OtaAction_None;
+      trial.state = OtaTrial_RolledBack;
+      snprintf(trial.reason, sizeof(trial.reason), "%s", "health check");
+      return OtaAction_RollBack;
+  }
+  return OtaAction_None;
+}
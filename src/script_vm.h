@@ -0,0 +1,366 @@
+// Script card compiler and VM. No Arduino dependency, so the host tests in
+// test/host build them; main.cpp binds card references and fields.
+//
+// A script card runs a straight-line register program compiled at commit from
+// its "script" source. With no jumps, a program executes exactly its length in
+// instructions, so validation bounds the per-scan cost of every script card.
+#pragma once
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef AT_SCRIPT_MAX_INSTRUCTIONS
+#define AT_SCRIPT_MAX_INSTRUCTIONS 32
+#endif
+static_assert(AT_SCRIPT_MAX_INSTRUCTIONS <= 255,
+              "script program length is stored in a uint8_t");
+const uint8_t kScriptRegisters = 8;
+// Parentheses, unary operators and '?:' recurse without taking a register,
+// so they are bounded separately. Each level costs about 600 bytes of the
+// compiling task's stack (core1_portal has 8 KB).
+const uint8_t kScriptMaxDepth = 6;
+
+enum scriptOp : uint8_t {
+  ScriptOp_Const,   // r[dst] = imm
+  ScriptOp_Load,    // r[dst] = field a of card imm
+  ScriptOp_Add,     // r[dst] = r[a] op r[b] for Add..Or
+  ScriptOp_Sub,
+  ScriptOp_Mul,
+  ScriptOp_Div,
+  ScriptOp_Mod,
+  ScriptOp_Eq,
+  ScriptOp_Ne,
+  ScriptOp_Lt,
+  ScriptOp_Le,
+  ScriptOp_Gt,
+  ScriptOp_Ge,
+  ScriptOp_And,
+  ScriptOp_Or,
+  ScriptOp_Not,     // r[dst] = !r[a]
+  ScriptOp_Neg,     // r[dst] = -r[a]
+  ScriptOp_Select,  // r[dst] = r[a] ? r[b] : r[imm]
+  ScriptOp_Store    // own output field a = r[b]
+};
+enum scriptField : uint8_t {
+  ScriptField_State,  // logicalState
+  ScriptField_Phys,   // physicalState
+  ScriptField_Trig,   // triggerFlag
+  ScriptField_Value,  // currentValue
+  ScriptField_Count   // repeatCounter
+};
+
+struct ScriptInsn {
+  uint8_t op;
+  uint8_t dst;
+  uint8_t a;
+  uint8_t b;
+  int32_t imm;
+};
+
+struct ScriptProgram {
+  uint8_t length;
+  ScriptInsn code[AT_SCRIPT_MAX_INSTRUCTIONS];
+};
+
+// ---------------------------------------------------------------------------
+// Compiler (Core1). Grammar, lowest precedence first:
+//   script   := [stmt (';' stmt)* [';']]
+//   stmt     := ('state' | 'value') '=' expr
+//   expr     := or ['?' expr ':' expr]
+//   or       := and ('||' and)*           and := equal ('&&' equal)*
+//   equal    := rel (('==' | '!=') rel)*  rel := sum (('<=' | '<' | ...) sum)*
+//   sum      := prod (('+' | '-') prod)*  prod := unary (('*' | '/' | '%') unary)*
+//   unary    := ('!' | '-') unary | primary
+//   primary  := number | 'true' | 'false' | '(' expr ')' | 'C' id '.' field
+// A subexpression lands in the register named by its nesting depth, so the
+// register file bounds expression width; depth bounds the recursion. The
+// compiler is the only producer of programs and checks register, reference
+// and length bounds, so the VM trusts what it runs.
+// ---------------------------------------------------------------------------
+typedef bool (*ScriptReferenceCheck)(uint16_t id);
+
+struct ScriptCompiler {
+  const char* src;
+  size_t pos;
+  ScriptProgram* out;
+  ScriptReferenceCheck isReference;
+  uint8_t depth;
+  const char* error;
+};
+
+struct ScriptBinaryOp {
+  const char* token;
+  scriptOp op;
+};
+// Longer tokens first where one is a prefix of another.
+const ScriptBinaryOp kScriptBinaryLevels[][5] = {
+    {{"||", ScriptOp_Or}, {nullptr, ScriptOp_Const}},
+    {{"&&", ScriptOp_And}, {nullptr, ScriptOp_Const}},
+    {{"==", ScriptOp_Eq}, {"!=", ScriptOp_Ne}, {nullptr, ScriptOp_Const}},
+    {{"<=", ScriptOp_Le},
+     {">=", ScriptOp_Ge},
+     {"<", ScriptOp_Lt},
+     {">", ScriptOp_Gt},
+     {nullptr, ScriptOp_Const}},
+    {{"+", ScriptOp_Add}, {"-", ScriptOp_Sub}, {nullptr, ScriptOp_Const}},
+    {{"*", ScriptOp_Mul},
+     {"/", ScriptOp_Div},
+     {"%", ScriptOp_Mod},
+     {nullptr, ScriptOp_Const}}};
+const uint8_t kScriptBinaryLevelCount =
+    sizeof(kScriptBinaryLevels) / sizeof(kScriptBinaryLevels[0]);
+
+inline bool scriptFail(ScriptCompiler& c, const char* error) {
+  if (c.error == nullptr) c.error = error;
+  return false;
+}
+
+// Paired with scriptLeave once the nested construct has compiled.
+inline bool scriptEnter(ScriptCompiler& c) {
+  if (c.depth >= kScriptMaxDepth) return scriptFail(c, "expression too deep");
+  c.depth += 1;
+  return true;
+}
+
+inline void scriptLeave(ScriptCompiler& c) { c.depth -= 1; }
+
+inline void scriptSkipSpace(ScriptCompiler& c) {
+  while (isspace(static_cast<unsigned char>(c.src[c.pos]))) ++c.pos;
+}
+
+inline bool scriptAccept(ScriptCompiler& c, const char* token) {
+  scriptSkipSpace(c);
+  const size_t length = strlen(token);
+  if (strncmp(c.src + c.pos, token, length) != 0) return false;
+  c.pos += length;
+  return true;
+}
+
+// Identifier-like word ([A-Za-z_][A-Za-z0-9_]*); false if absent or too long.
+inline bool scriptReadWord(ScriptCompiler& c, char* out, size_t outSize) {
+  scriptSkipSpace(c);
+  size_t length = 0;
+  while (isalnum(static_cast<unsigned char>(c.src[c.pos])) ||
+         c.src[c.pos] == '_') {
+    if (length + 1 >= outSize) return false;
+    out[length++] = c.src[c.pos++];
+  }
+  out[length] = '\0';
+  return length > 0 && !isdigit(static_cast<unsigned char>(out[0]));
+}
+
+inline bool scriptEmit(ScriptCompiler& c, scriptOp op, uint8_t dst, uint8_t a,
+                       uint8_t b, int32_t imm) {
+  if (dst >= kScriptRegisters) return scriptFail(c, "expression too deep");
+  ScriptProgram& program = *c.out;
+  if (program.length >= AT_SCRIPT_MAX_INSTRUCTIONS) {
+    return scriptFail(c, "script too long");
+  }
+  ScriptInsn& insn = program.code[program.length++];
+  insn.op = op;
+  insn.dst = dst;
+  insn.a = a;
+  insn.b = b;
+  insn.imm = imm;
+  return true;
+}
+
+inline bool compileScriptExpr(ScriptCompiler& c, uint8_t reg);
+
+inline bool compileScriptPrimary(ScriptCompiler& c, uint8_t reg) {
+  scriptSkipSpace(c);
+  if (isdigit(static_cast<unsigned char>(c.src[c.pos]))) {
+    uint32_t value = 0;
+    while (isdigit(static_cast<unsigned char>(c.src[c.pos]))) {
+      value = value * 10 + static_cast<uint32_t>(c.src[c.pos++] - '0');
+      if (value > INT32_MAX) return scriptFail(c, "constant out of range");
+    }
+    return scriptEmit(c, ScriptOp_Const, reg, 0, 0, static_cast<int32_t>(value));
+  }
+  if (scriptAccept(c, "(")) {
+    if (!scriptEnter(c) || !compileScriptExpr(c, reg)) return false;
+    scriptLeave(c);
+    return scriptAccept(c, ")") || scriptFail(c, "expected ')'");
+  }
+  char word[8];
+  if (!scriptReadWord(c, word, sizeof(word))) {
+    return scriptFail(c, "expected operand");
+  }
+  if (strcmp(word, "true") == 0 || strcmp(word, "false") == 0) {
+    return scriptEmit(c, ScriptOp_Const, reg, 0, 0, word[0] == 't' ? 1 : 0);
+  }
+  char* end = nullptr;
+  const unsigned long id = (word[0] == 'C') ? strtoul(word + 1, &end, 10) : 0;
+  if (end == nullptr || end == word + 1 || *end != '\0' || id >= UINT16_MAX ||
+      !c.isReference(static_cast<uint16_t>(id))) {
+    return scriptFail(c, "unknown card reference");
+  }
+  static const char* const kFieldNames[] = {"state", "phys", "trig", "value",
+                                            "count"};
+  if (!scriptAccept(c, ".") || !scriptReadWord(c, word, sizeof(word))) {
+    return scriptFail(c, "expected card field");
+  }
+  for (uint8_t field = 0; field < 5; ++field) {
+    if (strcmp(word, kFieldNames[field]) == 0) {
+      return scriptEmit(c, ScriptOp_Load, reg, field, 0,
+                        static_cast<int32_t>(id));
+    }
+  }
+  return scriptFail(c, "unknown card field");
+}
+
+inline bool compileScriptUnary(ScriptCompiler& c, uint8_t reg) {
+  const scriptOp op = scriptAccept(c, "!")   ? ScriptOp_Not
+                      : scriptAccept(c, "-") ? ScriptOp_Neg
+                                             : ScriptOp_Const;
+  if (op == ScriptOp_Const) return compileScriptPrimary(c, reg);
+  if (!scriptEnter(c) || !compileScriptUnary(c, reg)) return false;
+  scriptLeave(c);
+  return scriptEmit(c, op, reg, reg, 0, 0);
+}
+
+inline bool compileScriptBinary(ScriptCompiler& c, uint8_t level, uint8_t reg) {
+  if (level == kScriptBinaryLevelCount) return compileScriptUnary(c, reg);
+  if (!compileScriptBinary(c, level + 1, reg)) return false;
+  for (;;) {
+    const ScriptBinaryOp* match = nullptr;
+    for (const ScriptBinaryOp* op = kScriptBinaryLevels[level];
+         op->token != nullptr; ++op) {
+      if (scriptAccept(c, op->token)) {
+        match = op;
+        break;
+      }
+    }
+    if (match == nullptr) return true;
+    if (!compileScriptBinary(c, level + 1, reg + 1) ||
+        !scriptEmit(c, match->op, reg, reg, reg + 1, 0)) {
+      return false;
+    }
+  }
+}
+
+inline bool compileScriptExpr(ScriptCompiler& c, uint8_t reg) {
+  if (!compileScriptBinary(c, 0, reg)) return false;
+  if (!scriptAccept(c, "?")) return true;
+  if (!scriptEnter(c) || !compileScriptExpr(c, reg + 1)) return false;
+  if (!scriptAccept(c, ":")) return scriptFail(c, "expected ':'");
+  if (!compileScriptExpr(c, reg + 2)) return false;
+  scriptLeave(c);
+  return scriptEmit(c, ScriptOp_Select, reg, reg, reg + 1, reg + 2);
+}
+
+// An empty source compiles to an empty program: the card stays off. On
+// failure, error and errorOffset locate the first problem.
+inline bool compileScriptSource(const char* source,
+                                ScriptReferenceCheck isReference,
+                                ScriptProgram& out, const char*& error,
+                                size_t& errorOffset) {
+  memset(&out, 0, sizeof(out));
+  ScriptCompiler c = {source != nullptr ? source : "", 0, &out, isReference, 0,
+                      nullptr};
+  for (;;) {
+    scriptSkipSpace(c);
+    if (c.src[c.pos] == '\0') break;
+    char target[8];
+    if (!scriptReadWord(c, target, sizeof(target)) ||
+        (strcmp(target, "state") != 0 && strcmp(target, "value") != 0)) {
+      scriptFail(c, "expected 'state =' or 'value ='");
+      break;
+    }
+    if (!scriptAccept(c, "=")) {
+      scriptFail(c, "expected '='");
+      break;
+    }
+    if (!compileScriptExpr(c, 0)) break;
+    const uint8_t field =
+        (target[0] == 's') ? ScriptField_State : ScriptField_Value;
+    if (!scriptEmit(c, ScriptOp_Store, 0, field, 0, 0)) break;
+    if (scriptAccept(c, ";")) continue;
+    scriptSkipSpace(c);
+    if (c.src[c.pos] != '\0') {
+      scriptFail(c, "expected ';'");
+      break;
+    }
+  }
+  error = c.error;
+  errorOffset = c.pos;
+  return c.error == nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// VM (kernel).
+// ---------------------------------------------------------------------------
+// Integer ops wrap; division or modulo by zero yields 0.
+inline int32_t applyScriptBinary(uint8_t op, int32_t a, int32_t b) {
+  const uint32_t ua = static_cast<uint32_t>(a);
+  const uint32_t ub = static_cast<uint32_t>(b);
+  switch (op) {
+    case ScriptOp_Add:
+      return static_cast<int32_t>(ua + ub);
+    case ScriptOp_Sub:
+      return static_cast<int32_t>(ua - ub);
+    case ScriptOp_Mul:
+      return static_cast<int32_t>(ua * ub);
+    case ScriptOp_Div:
+      if (b == 0) return 0;
+      return (b == -1) ? static_cast<int32_t>(0U - ua) : a / b;
+    case ScriptOp_Mod:
+      return (b == 0 || b == -1) ? 0 : a % b;
+    case ScriptOp_Eq:
+      return a == b;
+    case ScriptOp_Ne:
+      return a != b;
+    case ScriptOp_Lt:
+      return a < b;
+    case ScriptOp_Le:
+      return a <= b;
+    case ScriptOp_Gt:
+      return a > b;
+    case ScriptOp_Ge:
+      return a >= b;
+    case ScriptOp_And:
+      return (a != 0) && (b != 0);
+    case ScriptOp_Or:
+      return (a != 0) || (b != 0);
+    default:
+      return 0;
+  }
+}
+
+// Retires exactly program.length instructions. load(field, id) reads a card
+// field; store(field, value) writes the running card's output field.
+template <typename Load, typename Store>
+void runScriptInstructions(const ScriptProgram& program, Load load,
+                           Store store) {
+  int32_t r[kScriptRegisters] = {};
+  for (uint8_t pc = 0; pc < program.length; ++pc) {
+    const ScriptInsn& insn = program.code[pc];
+    int32_t& dst = r[insn.dst];
+    switch (insn.op) {
+      case ScriptOp_Const:
+        dst = insn.imm;
+        break;
+      case ScriptOp_Load:
+        dst = load(insn.a, static_cast<uint16_t>(insn.imm));
+        break;
+      case ScriptOp_Not:
+        dst = (r[insn.a] == 0);
+        break;
+      case ScriptOp_Neg:
+        dst = static_cast<int32_t>(0U - static_cast<uint32_t>(r[insn.a]));
+        break;
+      case ScriptOp_Select:
+        dst = (r[insn.a] != 0) ? r[insn.b] : r[insn.imm];
+        break;
+      case ScriptOp_Store:
+        store(insn.a, r[insn.b]);
+        break;
+      default:
+        dst = applyScriptBinary(insn.op, r[insn.a], r[insn.b]);
+        break;
+    }
+  }
+}
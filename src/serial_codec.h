@@ -0,0 +1,124 @@
+// Serial link framing helpers: CRC-16/CCITT-FALSE and COBS. Pure functions
+// with no Arduino dependency so the host tests in test/host can build them.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+inline uint16_t crc16Ccitt(const uint8_t* data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; ++i) {
+    crc ^= static_cast<uint16_t>(data[i]) << 8;
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021)
+                           : static_cast<uint16_t>(crc << 1);
+    }
+  }
+  return crc;
+}
+
+// Encodes without the trailing delimiter. out needs length + length/254 + 1.
+inline size_t cobsEncode(const uint8_t* in, size_t length, uint8_t* out) {
+  size_t read = 0;
+  size_t write = 1;
+  size_t codeIndex = 0;
+  uint8_t code = 1;
+  while (read < length) {
+    if (in[read] == 0) {
+      out[codeIndex] = code;
+      codeIndex = write++;
+      code = 1;
+    } else {
+      out[write++] = in[read];
+      if (++code == 0xFF) {
+        out[codeIndex] = code;
+        codeIndex = write++;
+        code = 1;
+      }
+    }
+    ++read;
+  }
+  out[codeIndex] = code;
+  return write;
+}
+
+// Decodes one frame (no delimiters). Returns 0 on malformed input.
+inline size_t cobsDecode(const uint8_t* in, size_t length, uint8_t* out) {
+  size_t read = 0;
+  size_t write = 0;
+  while (read < length) {
+    const uint8_t code = in[read++];
+    if (code == 0 || read + code - 1 > length) return 0;
+    for (uint8_t i = 1; i < code; ++i) out[write++] = in[read++];
+    if (code != 0xFF && read < length) out[write++] = 0;
+  }
+  return write;
+}
+
+// Encoded size of a frame with a body of length bytes, both delimiters
+// included.
+constexpr size_t serialFrameBytes(size_t length) {
+  return length + 6 + (length + 3) / 254;
+}
+
+// Builds 0x00 COBS(type, body, crc16) 0x00 into out, the CRC little-endian
+// over type and body. raw is scratch for length + 3 bytes; out needs
+// serialFrameBytes(length). Returns the bytes written.
+inline size_t encodeSerialFrame(uint8_t type, const uint8_t* body,
+                                size_t length, uint8_t* raw, uint8_t* out) {
+  raw[0] = type;
+  memcpy(raw + 1, body, length);
+  const uint16_t crc = crc16Ccitt(raw, length + 1);
+  raw[length + 1] = static_cast<uint8_t>(crc & 0xFF);
+  raw[length + 2] = static_cast<uint8_t>(crc >> 8);
+  out[0] = 0;
+  size_t written = 1 + cobsEncode(raw, length + 3, out + 1);
+  out[written++] = 0;
+  return written;
+}
+
+// Receive side: encoded bytes collect in buffer until a delimiter.
+struct SerialFrameReader {
+  uint8_t* buffer;
+  size_t capacity;
+  size_t length;
+  bool overflow;
+};
+
+enum serialReadResult : uint8_t {
+  SerialRead_Pending,
+  SerialRead_Frame,
+  SerialRead_Rejected
+};
+
+// Feeds one received byte. On SerialRead_Frame, frame (capacity bytes) holds
+// type + body with the CRC checked and stripped, and frameLength their
+// length. Back-to-back delimiters yield nothing; bad COBS, a bad CRC or an
+// overlong run (such as stray text) yield SerialRead_Rejected.
+inline serialReadResult feedSerialFrameByte(SerialFrameReader& reader,
+                                            uint8_t byte, uint8_t* frame,
+                                            size_t& frameLength) {
+  if (byte != 0) {
+    if (reader.length < reader.capacity) {
+      reader.buffer[reader.length++] = byte;
+    } else {
+      reader.overflow = true;
+    }
+    return SerialRead_Pending;
+  }
+  const size_t length = reader.length;
+  const bool overflow = reader.overflow;
+  reader.length = 0;
+  reader.overflow = false;
+  if (overflow) return SerialRead_Rejected;
+  if (length == 0) return SerialRead_Pending;
+  const size_t decoded = cobsDecode(reader.buffer, length, frame);
+  if (decoded < 3 ||
+      crc16Ccitt(frame, decoded - 2) !=
+          static_cast<uint16_t>(frame[decoded - 2] | (frame[decoded - 1] << 8))) {
+    return SerialRead_Rejected;
+  }
+  frameLength = decoded - 2;
+  return SerialRead_Frame;
+}
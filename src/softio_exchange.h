@@ -0,0 +1,130 @@
+// SoftIO exchange frame codec, the receive rules and the remote-slot seqlock.
+// No Arduino dependency, so the host tests in test/host can run two
+// endpoints over a fake transport. Frame, little-endian:
+//   "ATSX", u8 version, u8 nodeId, u16 count, u32 scanSeq,
+//   count x { u16 sioIndex, u8 state, u8 bits (logical, physical), u32 value }
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+const uint8_t kExchangeVersion = 1;
+const size_t kExchangeHeaderBytes = 12;
+const size_t kExchangeEntryBytes = 8;
+
+struct ExchangeEntry {
+  uint16_t sioIndex;
+  uint8_t state;
+  uint8_t bits;  // bit0 logicalState, bit1 physicalState
+  uint32_t value;
+};
+
+struct ExchangeFrameHeader {
+  uint8_t node;
+  uint16_t count;
+  uint32_t scanSeq;
+};
+
+// out needs kExchangeHeaderBytes + count * kExchangeEntryBytes.
+inline size_t encodeExchangeFrame(uint8_t nodeId, uint32_t scanSeq,
+                                  const ExchangeEntry* entries, uint16_t count,
+                                  uint8_t* out) {
+  memcpy(out, "ATSX", 4);
+  out[4] = kExchangeVersion;
+  out[5] = nodeId;
+  out[6] = static_cast<uint8_t>(count & 0xFF);
+  out[7] = static_cast<uint8_t>(count >> 8);
+  memcpy(out + 8, &scanSeq, sizeof(scanSeq));
+  uint8_t* p = out + kExchangeHeaderBytes;
+  for (uint16_t i = 0; i < count; ++i, p += kExchangeEntryBytes) {
+    p[0] = static_cast<uint8_t>(entries[i].sioIndex & 0xFF);
+    p[1] = static_cast<uint8_t>(entries[i].sioIndex >> 8);
+    p[2] = entries[i].state;
+    p[3] = entries[i].bits;
+    memcpy(p + 4, &entries[i].value, sizeof(entries[i].value));
+  }
+  return kExchangeHeaderBytes + count * kExchangeEntryBytes;
+}
+
+// False for a wrong magic or version, or a length that disagrees with count.
+inline bool parseExchangeFrame(const uint8_t* frame, size_t length,
+                               ExchangeFrameHeader& header) {
+  if (length < kExchangeHeaderBytes || memcmp(frame, "ATSX", 4) != 0 ||
+      frame[4] != kExchangeVersion) {
+    return false;
+  }
+  header.node = frame[5];
+  header.count = static_cast<uint16_t>(frame[6] | (frame[7] << 8));
+  memcpy(&header.scanSeq, frame + 8, sizeof(header.scanSeq));
+  return length == kExchangeHeaderBytes + header.count * kExchangeEntryBytes;
+}
+
+// Finds the entry for sioIndex in a parsed frame.
+inline bool findExchangeEntry(const uint8_t* frame, uint16_t count,
+                              uint16_t sioIndex, ExchangeEntry& entry) {
+  const uint8_t* p = frame + kExchangeHeaderBytes;
+  for (uint16_t i = 0; i < count; ++i, p += kExchangeEntryBytes) {
+    if (static_cast<uint16_t>(p[0] | (p[1] << 8)) != sioIndex) continue;
+    entry.sioIndex = sioIndex;
+    entry.state = p[2];
+    entry.bits = p[3];
+    memcpy(&entry.value, p + 4, sizeof(entry.value));
+    return true;
+  }
+  return false;
+}
+
+// Written by the receiving core, read by the kernel at scan start.
+struct RemoteSioSlot {
+  std::atomic<uint32_t> version;
+  uint32_t receivedMs;
+  uint32_t frameSeq;
+  ExchangeEntry entry;
+};
+
+// Drop reordered frames, but accept a restarted sender once the old stream
+// has gone stale. receivedMs 0 means the slot never received.
+inline bool acceptExchangeFrame(const RemoteSioSlot& slot, uint32_t frameSeq,
+                                uint32_t nowMs, uint32_t timeoutMs) {
+  if (slot.receivedMs == 0) return true;
+  const bool newer = static_cast<int32_t>(frameSeq - slot.frameSeq) > 0;
+  const bool expired = (nowMs - slot.receivedMs) > timeoutMs;
+  return newer || expired;
+}
+
+inline bool remoteSlotFresh(uint32_t receivedMs, uint32_t nowMs,
+                            uint32_t timeoutMs) {
+  return receivedMs != 0 && (nowMs - receivedMs) <= timeoutMs;
+}
+
+// Seqlock write (odd version = write in progress); the reader never waits.
+inline void writeRemoteSlot(RemoteSioSlot& slot, const ExchangeEntry& entry,
+                            uint32_t frameSeq, uint32_t nowMs) {
+  const uint32_t version = slot.version.load(std::memory_order_relaxed);
+  slot.version.store(version + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.entry = entry;
+  slot.frameSeq = frameSeq;
+  slot.receivedMs = (nowMs == 0) ? 1 : nowMs;
+  slot.version.store(version + 2, std::memory_order_release);
+}
+
+// Seqlock read. Gives up after a few attempts and keeps the previous image;
+// the next scan tries again.
+inline bool readRemoteSlot(const RemoteSioSlot& slot, ExchangeEntry& entry,
+                           uint32_t& receivedMs) {
+  for (uint8_t attempt = 0; attempt < 3; ++attempt) {
+    const uint32_t before = slot.version.load(std::memory_order_acquire);
+    if (before & 1U) continue;
+    entry = slot.entry;
+    receivedMs = slot.receivedMs;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.version.load(std::memory_order_relaxed) == before) {
+      return before != 0;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,85 @@
+// Time-sync estimator: four-timestamp samples against the master clock,
+// lowest-delay filtering over a window and a smoothed drift estimate. No
+// Arduino dependency, so the host tests in test/host can feed it skewed and
+// delayed samples.
+#pragma once
+
+#include <stdint.h>
+
+const int32_t kTimeSyncMaxDriftPpb = 500000;
+// A window best this much slower than the held one does not replace it...
+const int64_t kTimeSyncDelaySlackUs = 200;
+// ...until the held one is this old, since its error grows with the drift
+// estimate's (1 ppm costs 60 us here).
+const int64_t kTimeSyncMaxHoldUs = 60000000;
+
+struct TimeSyncSample {
+  int64_t offsetUs;
+  int64_t delayUs;
+  int64_t localUs;
+};
+
+template <uint8_t Window>
+struct TimeSyncEstimator {
+  TimeSyncSample window[Window];
+  uint8_t count;
+  uint8_t next;
+  TimeSyncSample best;
+  bool anchored;
+  TimeSyncSample anchor;
+  uint32_t driftEstimates;
+  int32_t driftPpb;
+};
+
+// Adds one exchange: t1 client send, t2 master receive, t3 master send, t4
+// client receive. With
+//   offset = ((t2 - t1) + (t3 - t4)) / 2,  delay = (t4 - t1) - (t3 - t2)
+// the lowest-delay sample of the last Window becomes best, which discards
+// most of the queuing asymmetry on a busy network. When every sample in the
+// window queued, the previous best is held instead (see kTimeSyncDelaySlackUs).
+// Returns false, changing nothing, for a negative delay or one above
+// maxDelayUs.
+template <uint8_t Window>
+bool addTimeSyncSample(TimeSyncEstimator<Window>& sync, int64_t t1, int64_t t2,
+                       int64_t t3, int64_t t4, int64_t maxDelayUs,
+                       int64_t driftSpanUs) {
+  const int64_t delayUs = (t4 - t1) - (t3 - t2);
+  if (delayUs < 0 || delayUs > maxDelayUs) return false;
+  sync.window[sync.next] = {((t2 - t1) + (t3 - t4)) / 2, delayUs, t4};
+  sync.next = static_cast<uint8_t>((sync.next + 1) % Window);
+  if (sync.count < Window) sync.count += 1;
+  TimeSyncSample best = sync.window[0];
+  for (uint8_t i = 1; i < sync.count; ++i) {
+    if (sync.window[i].delayUs < best.delayUs) best = sync.window[i];
+  }
+  if (sync.anchored && best.delayUs > sync.best.delayUs + kTimeSyncDelaySlackUs &&
+      (t4 - sync.best.localUs) < kTimeSyncMaxHoldUs) {
+    return true;
+  }
+
+  // Drift is the slope between best estimates at least driftSpanUs apart,
+  // smoothed so one unlucky pair cannot swing the model.
+  if (!sync.anchored) {
+    sync.anchor = best;
+    sync.anchored = true;
+  } else if ((best.localUs - sync.anchor.localUs) >= driftSpanUs) {
+    int64_t rawPpb = (best.offsetUs - sync.anchor.offsetUs) * 1000000000LL /
+                     (best.localUs - sync.anchor.localUs);
+    if (rawPpb > kTimeSyncMaxDriftPpb) rawPpb = kTimeSyncMaxDriftPpb;
+    if (rawPpb < -kTimeSyncMaxDriftPpb) rawPpb = -kTimeSyncMaxDriftPpb;
+    sync.driftPpb = (sync.driftEstimates == 0)
+                        ? static_cast<int32_t>(rawPpb)
+                        : sync.driftPpb +
+                              static_cast<int32_t>((rawPpb - sync.driftPpb) / 4);
+    sync.driftEstimates += 1;
+    sync.anchor = best;
+  }
+  sync.best = best;
+  return true;
+}
+
+// masterUs = localUs + offsetUs + (localUs - refLocalUs) * driftPpb / 1e9
+inline int64_t projectMasterTimeUs(int64_t localUs, int64_t offsetUs,
+                                   int64_t refLocalUs, int32_t driftPpb) {
+  return localUs + offsetUs + (localUs - refLocalUs) * driftPpb / 1000000000LL;
+}
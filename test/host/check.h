@@ -0,0 +1,35 @@
+// Minimal assertion helpers shared by the host tests.
+#pragma once
+
+#include <stdio.h>
+
+static int gCheckFailures = 0;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      gCheckFailures += 1;                                             \
+    }                                                                  \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                        \
+  do {                                                                    \
+    const long long checkActual = static_cast<long long>(actual);         \
+    const long long checkExpected = static_cast<long long>(expected);     \
+    if (checkActual != checkExpected) {                                   \
+      fprintf(stderr, "%s:%d: %s == %lld, expected %lld\n", __FILE__,     \
+              __LINE__, #actual, checkActual, checkExpected);             \
+      gCheckFailures += 1;                                                \
+    }                                                                     \
+  } while (0)
+
+inline int finishChecks(const char* suite) {
+  if (gCheckFailures > 0) {
+    fprintf(stderr, "%s: %d check(s) failed\n", suite, gCheckFailures);
+    return 1;
+  }
+  printf("%s: ok\n", suite);
+  return 0;
+}
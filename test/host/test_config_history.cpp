@@ -0,0 +1,312 @@
+// Config history records: compression round trip, and the flash traffic of a
+// commit through the content-addressed pack (as appendConfigHistoryVersion,
+// reserveConfigHistoryCapacity and saveConfigHistoryIndex do it) against the
+// full-copy LKG/SLOT1..3 rotation it replaced.
+#include <stdio.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "config_history.h"
+
+namespace {
+
+const size_t kVersions = 24;  // AT_CONFIG_HISTORY_VERSIONS default
+
+std::string expand(const uint8_t* stored, size_t length) {
+  std::string out;
+  for (size_t i = 0; i < length; ++i) {
+    const char* token = configHistoryToken(stored[i]);
+    if (token != nullptr) {
+      out += token;
+    } else {
+      out += static_cast<char>(stored[i]);
+    }
+  }
+  return out;
+}
+
+// A card document in serializeCardToJson's field order. revision stands in
+// for whatever the operator edited.
+std::string cardDocument(uint16_t id, uint16_t total, uint32_t revision) {
+  static const char* const kTypes[] = {"DigitalInput", "DigitalOutput",
+                                       "AnalogInput", "SoftIO"};
+  static const char* const kModes[] = {"Mode_DI_Rising", "Mode_DO_Normal",
+                                       "Mode_AI_Continuous", "Mode_None"};
+  static const char* const kStates[] = {"State_DI_Idle", "State_DO_Idle",
+                                        "State_AI_Streaming", "State_None"};
+  const int family = (id < 4) ? 0 : (id < 8) ? 1 : (id < 10) ? 2 : 3;
+  char text[kConfigHistoryMaxCardBytes];
+  int n = snprintf(
+      text, sizeof(text),
+      "{\"id\":%u,\"type\":\"%s\",\"index\":%u,\"hwPin\":%u,\"invert\":false,"
+      "\"setting1\":%u,\"setting2\":%u,\"setting3\":%s,"
+      "\"logicalState\":false,\"physicalState\":false,\"triggerFlag\":false,"
+      "\"currentValue\":0,\"startOnMs\":0,\"startOffMs\":0,"
+      "\"repeatCounter\":0,\"mode\":\"%s\",\"state\":\"%s\","
+      "\"setA_ID\":%u,\"setA_Operator\":\"Op_LogicalTrue\","
+      "\"setA_Threshold\":0,\"setB_ID\":0,"
+      "\"setB_Operator\":\"Op_AlwaysFalse\",\"setB_Threshold\":0,"
+      "\"setCombine\":\"Combine_None\",\"resetA_ID\":%u,"
+      "\"resetA_Operator\":\"Op_LogicalFalse\",\"resetA_Threshold\":0,"
+      "\"resetB_ID\":0,\"resetB_Operator\":\"Op_AlwaysFalse\","
+      "\"resetB_Threshold\":0,\"resetCombine\":\"Combine_None\","
+      "\"alarm\":false,\"journal\":false",
+      id, kTypes[family], id, family == 3 ? 255 : 20 + id, 50 + revision * 10,
+      family == 1 ? 1000 : 0, family == 2 ? "0.5" : "0", kModes[family],
+      kStates[family], (id + 1) % total, (id + 2) % total);
+  if (family == 3) n += snprintf(text + n, sizeof(text) - n,
+                                 ",\"exchangePublish\":false");
+  if (family == 2) {
+    n += snprintf(text + n, sizeof(text) - n,
+                  ",\"reportDeadbandMode\":\"Deadband_Absolute\","
+                  "\"reportDeadband\":5");
+  }
+  if (id % 3 == 0) {
+    n += snprintf(text + n, sizeof(text) - n,
+                  ",\"label\":\"Line %u station\",\"engineeringUnit\":\"\"",
+                  id);
+  }
+  snprintf(text + n, sizeof(text) - n, "}");
+  return text;
+}
+
+struct Io {
+  uint64_t readBytes = 0;
+  uint64_t writtenBytes = 0;
+};
+
+struct Blob {
+  uint32_t hash;
+  uint32_t offset;
+  uint16_t rawLength;
+  uint16_t storedLength;
+  std::string raw;  // what expandCardDocument would stream back
+};
+
+struct Version {
+  uint32_t configId;
+  uint32_t parentId;
+  uint32_t number;
+  std::vector<uint32_t> cardOffsets;
+};
+
+// The pack store, with file traffic counted instead of performed.
+struct PackStore {
+  uint16_t totalCards;
+  size_t blobCapacity;  // AT_CONFIG_HISTORY_BLOBS default
+  std::vector<Blob> blobs;
+  std::deque<Version> versions;
+  uint32_t packBytes = 0;
+  uint32_t indexBytes = 0;
+  uint32_t compactions = 0;
+  Io io;
+
+  explicit PackStore(uint16_t cards)
+      : totalCards(cards), blobCapacity(2 * cards + 164) {}
+
+  bool referenced(uint32_t offset) const {
+    for (const Version& version : versions) {
+      for (uint32_t o : version.cardOffsets) {
+        if (o == offset) return true;
+      }
+    }
+    return false;
+  }
+  void compact() {
+    std::vector<Blob> kept;
+    uint32_t offset = 0;
+    for (const Blob& blob : blobs) {
+      if (!referenced(blob.offset)) continue;
+      const uint32_t record = kConfigHistoryRecordHeaderBytes + blob.storedLength;
+      io.readBytes += record;
+      io.writtenBytes += record;
+      for (Version& version : versions) {
+        for (uint32_t& o : version.cardOffsets) {
+          if (o == blob.offset) o = offset;
+        }
+      }
+      kept.push_back(blob);
+      kept.back().offset = offset;
+      offset += record;
+    }
+    blobs.swap(kept);
+    packBytes = offset;
+    compactions += 1;
+    saveIndex();
+  }
+  bool reserve() {
+    if (versions.size() >= kVersions) versions.pop_front();
+    while (blobs.size() + totalCards > blobCapacity) {
+      const size_t before = blobs.size();
+      compact();
+      if (blobs.size() < before) continue;
+      if (versions.size() <= 1) return false;
+      versions.pop_front();
+    }
+    return true;
+  }
+  // Same shape ArduinoJson writes for saveConfigHistoryIndex.
+  void saveIndex() {
+    std::string text = "{\"versions\":[";
+    char item[96];
+    for (size_t v = 0; v < versions.size(); ++v) {
+      const Version& version = versions[v];
+      snprintf(item, sizeof(item),
+               "%s{\"configId\":\"%08x\",\"parentId\":\"%08x\",\"number\":%u,"
+               "\"cards\":[",
+               v > 0 ? "," : "", version.configId, version.parentId,
+               version.number);
+      text += item;
+      for (size_t id = 0; id < version.cardOffsets.size(); ++id) {
+        snprintf(item, sizeof(item), "%s%u", id > 0 ? "," : "",
+                 version.cardOffsets[id]);
+        text += item;
+      }
+      text += "]}";
+    }
+    text += "],\"blobs\":[";
+    for (size_t b = 0; b < blobs.size(); ++b) {
+      snprintf(item, sizeof(item), "%s[%u,%u,%u]", b > 0 ? "," : "",
+               blobs[b].offset, blobs[b].hash, blobs[b].rawLength);
+      text += item;
+    }
+    text += "]}";
+    indexBytes = static_cast<uint32_t>(text.size());
+    io.writtenBytes += indexBytes;
+  }
+  bool append(const std::vector<std::string>& cards, uint32_t number) {
+    if (!reserve()) return false;
+    const uint32_t firstNewOffset = packBytes;
+    Version next = {kFnv1aSeed, 0, number, {}};
+    uint8_t packed[kConfigHistoryMaxCardBytes];
+    for (const std::string& raw : cards) {
+      const uint32_t hash = fnv1a32(kFnv1aSeed, raw.data(), raw.size());
+      next.configId = fnv1a32(next.configId, &hash, sizeof(hash));
+      const Blob* found = nullptr;
+      for (const Blob& blob : blobs) {
+        if (blob.hash != hash || blob.rawLength != raw.size() ||
+            blob.offset >= firstNewOffset) {
+          continue;
+        }
+        io.readBytes += blob.storedLength;  // byte-for-byte confirmation
+        if (blob.raw == raw) {
+          found = &blob;
+          break;
+        }
+      }
+      if (found == nullptr) {
+        size_t storedLength = compressCardDocument(raw.data(), raw.size(), packed);
+        if (storedLength == 0) storedLength = raw.size();
+        blobs.push_back({hash, packBytes, static_cast<uint16_t>(raw.size()),
+                         static_cast<uint16_t>(storedLength), raw});
+        io.writtenBytes += kConfigHistoryRecordHeaderBytes + storedLength;
+        packBytes += kConfigHistoryRecordHeaderBytes + storedLength;
+        found = &blobs.back();
+      }
+      next.cardOffsets.push_back(found->offset);
+    }
+    next.parentId = versions.empty() ? 0 : versions.back().configId;
+    versions.push_back(next);
+    saveIndex();
+    return true;
+  }
+};
+
+size_t configFileBytes(const std::vector<std::string>& cards) {
+  size_t bytes = 2 + (cards.empty() ? 0 : cards.size() - 1);  // [ , ]
+  for (const std::string& card : cards) bytes += card.size();
+  return bytes;
+}
+
+void testCompression() {
+  for (uint16_t id = 0; id < 14; ++id) {
+    const std::string raw = cardDocument(id, 14, id);
+    uint8_t packed[kConfigHistoryMaxCardBytes];
+    const size_t n = compressCardDocument(raw.data(), raw.size(), packed);
+    CHECK(n > 0 && n < raw.size() / 2);
+    CHECK(expand(packed, n) == raw);
+  }
+  uint8_t packed[8];
+  CHECK_EQ(compressCardDocument("{\"a\":\"\x01\"}", 9, packed), 0);
+  CHECK(configHistoryToken('{') == nullptr);
+  CHECK(configHistoryToken(0) == nullptr);
+  CHECK(configHistoryToken(kConfigHistoryDictionarySize + 1) == nullptr);
+}
+
+// Each commit edits changedPerCommit cards; every tenth restores the config
+// of five commits earlier, which the pack serves without new blobs.
+void measureCommits(uint16_t totalCards, uint16_t changedPerCommit) {
+  const int kCommits = 120;
+  std::vector<uint32_t> revision(totalCards, 0);
+  std::vector<std::vector<std::string>> configs;
+  PackStore store(totalCards);
+  Io slots;
+  uint64_t activeBytes = 0;
+  uint32_t seed = 12345;
+  for (int commit = 0; commit < kCommits; ++commit) {
+    std::vector<std::string> cards;
+    if (commit % 10 == 9 && configs.size() >= 5) {
+      cards = configs[configs.size() - 5];
+    } else {
+      for (uint16_t i = 0; i < changedPerCommit; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        revision[(seed >> 8) % totalCards] += 1;
+      }
+      for (uint16_t id = 0; id < totalCards; ++id) {
+        cards.push_back(cardDocument(id, totalCards, revision[id]));
+      }
+    }
+    configs.push_back(cards);
+    const size_t fileBytes = configFileBytes(cards);
+    activeBytes = fileBytes;
+
+    // Old commit: copy SLOT2>3, SLOT1>2, LKG>1, active>LKG, write active.
+    if (commit > 0) {
+      const uint64_t copied = configFileBytes(configs[configs.size() - 2]);
+      const int copies = (commit >= 4) ? 4 : commit;
+      slots.readBytes += copies * copied;
+      slots.writtenBytes += copies * copied;
+    }
+    slots.writtenBytes += fileBytes;
+
+    // New commit: history append and index, then the active file.
+    CHECK(store.append(cards, static_cast<uint32_t>(commit + 1)));
+    store.io.writtenBytes += fileBytes;
+  }
+  // Bulk edits run out of blob table before they run out of versions.
+  if (changedPerCommit * kVersions + 2 * totalCards <= store.blobCapacity) {
+    CHECK_EQ(store.versions.size(), kVersions);
+  }
+
+  const double oldWrite = static_cast<double>(slots.writtenBytes) / kCommits;
+  const double oldRead = static_cast<double>(slots.readBytes) / kCommits;
+  const double newWrite = static_cast<double>(store.io.writtenBytes) / kCommits;
+  const double newRead = static_cast<double>(store.io.readBytes) / kCommits;
+  const uint64_t oldStorage = 5 * activeBytes;  // active, LKG, SLOT1..3
+  const uint64_t newStorage = activeBytes + store.packBytes + store.indexBytes;
+  printf("config_history: %4u cards, %3u changed/commit: per commit written "
+         "%7.0f -> %6.0f B, read %7.0f -> %6.0f B (%u compactions); "
+         "%zu versions + active %llu B vs LKG, SLOT1..3 + active %llu B\n",
+         totalCards, changedPerCommit, oldWrite, newWrite, oldRead, newRead,
+         store.compactions, store.versions.size(),
+         static_cast<unsigned long long>(newStorage),
+         static_cast<unsigned long long>(oldStorage));
+  CHECK(newWrite < oldWrite);
+  CHECK(newRead < oldRead);
+  CHECK(newStorage < oldStorage);
+}
+
+}  // namespace
+
+int main() {
+  testCompression();
+  measureCommits(14, 1);    // default profile
+  measureCommits(14, 4);
+  measureCommits(96, 1);    // AT_SIO_CAPACITY=86
+  measureCommits(96, 24);
+  measureCommits(256, 1);
+  return finishChecks("config_history");
+}
@@ -0,0 +1,309 @@
+// Journal append and query cost against in-memory segments. The store below
+// mirrors appendJournalRecord, flushJournal, nextJournalRecord and the two
+// seeks in main.cpp with the default build flags; segment files are vectors
+// and every file append or stride read is counted as one flash access.
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#include "check.h"
+#include "journal_index.h"
+
+namespace {
+
+const uint16_t kBatchRecords = 128;      // AT_JOURNAL_BATCH_RECORDS
+const uint16_t kSegmentRecords = 1024;   // AT_JOURNAL_SEGMENT_RECORDS
+const uint8_t kSegments = 6;             // AT_JOURNAL_SEGMENTS
+const uint16_t kMarks = kSegmentRecords / kJournalIndexStride;
+const uint8_t kKindTransition = 1;
+const uint8_t kKindCommit = 3;
+
+struct Segment {
+  uint32_t number;
+  uint32_t firstSeq;
+  uint16_t count;
+  uint32_t lastTimeS;
+  uint32_t marks[kMarks];
+  std::vector<JournalRecord> file;
+};
+
+struct Store {
+  Segment segments[kSegments];
+  uint8_t segmentCount = 0;
+  uint32_t nextSeq = 1;
+  uint32_t lastTimeS = 0;
+  uint16_t pending = 0;
+  JournalRecord batch[kBatchRecords];
+  uint32_t fileAppends = 0;
+  uint64_t bytesWritten = 0;
+  uint32_t strideReads = 0;
+
+  void openSegment() {
+    if (segmentCount == kSegments) {
+      for (uint8_t i = 1; i < kSegments; ++i) {
+        segments[i - 1] = std::move(segments[i]);
+      }
+      segmentCount -= 1;
+    }
+    const uint32_t number =
+        segmentCount > 0 ? segments[segmentCount - 1].number + 1 : 1;
+    Segment& segment = segments[segmentCount++];
+    segment.number = number;
+    segment.firstSeq = 0;
+    segment.count = 0;
+    segment.lastTimeS = 0;
+    memset(segment.marks, 0, sizeof(segment.marks));
+    segment.file.clear();
+  }
+  void flush() {
+    uint16_t done = 0;
+    while (done < pending) {
+      if (segmentCount == 0 ||
+          segments[segmentCount - 1].count >= kSegmentRecords) {
+        openSegment();
+      }
+      Segment& segment = segments[segmentCount - 1];
+      uint16_t n = pending - done;
+      if (n > kSegmentRecords - segment.count) n = kSegmentRecords - segment.count;
+      segment.file.insert(segment.file.end(), batch + done, batch + done + n);
+      fileAppends += 1;
+      bytesWritten += n * sizeof(JournalRecord);
+      if (segment.count == 0) segment.firstSeq = batch[done].seq;
+      markJournalRecords(segment.marks, segment.count, &batch[done], n);
+      segment.count += n;
+      segment.lastTimeS = batch[done + n - 1].timeS;
+      done += n;
+    }
+    pending = 0;
+  }
+  void append(JournalRecord record, uint32_t timeS) {
+    if (pending >= kBatchRecords) flush();
+    if (timeS < lastTimeS) timeS = lastTimeS;
+    record.seq = nextSeq++;
+    record.timeS = timeS;
+    lastTimeS = timeS;
+    batch[pending++] = record;
+  }
+};
+
+struct Cursor {
+  uint8_t segment = 0;
+  uint16_t index = 0;
+  uint16_t bufferStart = 0;
+  uint16_t bufferCount = 0;
+  JournalRecord buffer[kJournalIndexStride];
+};
+
+bool next(Store& store, Cursor& cursor, JournalRecord& record) {
+  while (cursor.segment < store.segmentCount) {
+    const Segment& segment = store.segments[cursor.segment];
+    if (cursor.index >= segment.count) {
+      cursor.segment += 1;
+      cursor.index = 0;
+      cursor.bufferCount = 0;
+      continue;
+    }
+    if (cursor.bufferCount == 0 || cursor.index < cursor.bufferStart ||
+        cursor.index >= cursor.bufferStart + cursor.bufferCount) {
+      uint16_t n = segment.count - cursor.index;
+      if (n > kJournalIndexStride) n = kJournalIndexStride;
+      memcpy(cursor.buffer, &segment.file[cursor.index],
+             n * sizeof(JournalRecord));
+      store.strideReads += 1;
+      cursor.bufferStart = cursor.index;
+      cursor.bufferCount = n;
+    }
+    record = cursor.buffer[cursor.index - cursor.bufferStart];
+    cursor.index += 1;
+    return true;
+  }
+  if (cursor.index >= store.pending) return false;
+  record = store.batch[cursor.index++];
+  return true;
+}
+
+struct Query {
+  bool bySeq;
+  uint32_t fromSeq;
+  uint32_t from;
+  int kind;  // -1: any
+  uint32_t limit;
+};
+
+struct QueryResult {
+  uint32_t emitted;
+  uint32_t skipped;  // flash records read before the first one in range
+  uint32_t strideReads;
+  uint32_t firstSeq;
+};
+
+// handleHttpGetJournal without the output.
+QueryResult runQuery(Store& store, const Query& query) {
+  Cursor cursor;
+  if (query.bySeq) {
+    cursor.segment = findJournalSegmentBySeq(store.segments, store.segmentCount,
+                                             query.fromSeq);
+    const uint32_t firstSeq =
+        cursor.segment < store.segmentCount ? store.segments[cursor.segment].firstSeq
+        : store.pending > 0                 ? store.batch[0].seq
+                                            : query.fromSeq;
+    cursor.index = query.fromSeq > firstSeq ? query.fromSeq - firstSeq : 0;
+  } else {
+    cursor.segment = findJournalSegmentByTime(store.segments, store.segmentCount,
+                                              query.from);
+    cursor.index = cursor.segment < store.segmentCount
+                       ? findJournalIndexByTime(store.segments[cursor.segment],
+                                                query.from)
+                       : 0;
+  }
+  const uint32_t readsBefore = store.strideReads;
+  QueryResult result = {0, 0, 0, 0};
+  JournalRecord record = {};
+  while (next(store, cursor, record)) {
+    if (record.seq < query.fromSeq || record.timeS < query.from) {
+      // The open batch is in RAM and not indexed.
+      if (cursor.segment < store.segmentCount) result.skipped += 1;
+      continue;
+    }
+    if (result.emitted == query.limit) break;
+    if (query.kind >= 0 && record.kind != query.kind) continue;
+    if (result.emitted == 0) result.firstSeq = record.seq;
+    result.emitted += 1;
+  }
+  result.strideReads = store.strideReads - readsBefore;
+  return result;
+}
+
+struct Lcg {
+  uint32_t state;
+  uint32_t next() {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+  }
+};
+
+// Mostly transitions, a commit now and then, about two records a second.
+void fill(Store& store, uint32_t records, uint32_t seed) {
+  Lcg rng = {seed};
+  uint32_t timeS = 1700000000;
+  for (uint32_t i = 0; i < records; ++i) {
+    timeS += rng.next() % 2;
+    JournalRecord record = {};
+    record.kind = (rng.next() % 100 == 0) ? kKindCommit : kKindTransition;
+    record.cardId = static_cast<uint16_t>(rng.next() % 14);
+    record.code = static_cast<uint8_t>(rng.next() % 4);
+    store.append(record, timeS);
+  }
+}
+
+void testSeekCorrectness() {
+  static Store store;
+  fill(store, 3 * kSegmentRecords + 300, 1);
+  CHECK_EQ(store.segmentCount, 4);
+  // Every seq lands on itself; every time lands on its first record.
+  for (uint32_t seq = 1; seq < store.nextSeq; seq += 37) {
+    const QueryResult r = runQuery(store, {true, seq, 0, -1, 1});
+    CHECK_EQ(r.firstSeq, seq);
+    CHECK_EQ(r.skipped, 0);
+  }
+  Cursor all;
+  JournalRecord record = {};
+  uint32_t previousTime = 0;
+  while (next(store, all, record)) {
+    if (record.timeS == previousTime) continue;
+    previousTime = record.timeS;
+    const QueryResult r = runQuery(store, {false, 0, record.timeS, -1, 1});
+    CHECK_EQ(r.firstSeq, record.seq);
+    CHECK(r.skipped <= kJournalIndexStride);
+  }
+  // Past the end: nothing, and no flash read.
+  const QueryResult r = runQuery(store, {false, 0, store.lastTimeS + 1, -1, 10});
+  CHECK_EQ(r.emitted, 0);
+  CHECK_EQ(r.strideReads, 0);
+}
+
+double microsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void measureAppend() {
+  static Store store;
+  const uint32_t kRecords = 1000000;
+  const auto start = std::chrono::steady_clock::now();
+  fill(store, kRecords, 2);
+  store.flush();
+  const double us = microsSince(start);
+  printf("journal_index: append %u records: %.1f M records/s host, "
+         "%.2f file appends and %.0f B written per 1000 records\n",
+         kRecords, kRecords / us, store.fileAppends * 1000.0 / kRecords,
+         store.bytesWritten * 1000.0 / kRecords);
+  // One append per batch, plus one per segment boundary inside a batch.
+  CHECK(store.fileAppends <= kRecords / kBatchRecords + kRecords / kSegmentRecords + 1);
+  CHECK_EQ(store.bytesWritten, static_cast<uint64_t>(kRecords) * sizeof(JournalRecord));
+  CHECK_EQ(store.segmentCount, kSegments);
+}
+
+void measureQueries() {
+  static Store store;
+  fill(store, kSegments * kSegmentRecords + 77, 3);  // full, with a batch open
+  const uint32_t firstSeq = store.segments[0].firstSeq;
+  const uint32_t span = store.nextSeq - firstSeq;
+  const uint32_t firstTime = store.segments[0].marks[0];
+  const uint32_t timeSpan = store.lastTimeS - firstTime;
+  const uint32_t kLimit = 100;  // kJournalDefaultResults
+  const uint32_t maxReads = (kLimit + kJournalIndexStride - 1) / kJournalIndexStride + 2;
+  const int kQueries = 2000;
+  Lcg rng = {4};
+
+  struct Case {
+    const char* name;
+    bool bySeq;
+    int kind;
+  };
+  const Case cases[] = {{"fromSeq", true, -1},
+                        {"from (time)", false, -1},
+                        {"kind=Commit, all", false, kKindCommit}};
+  for (const Case& c : cases) {
+    uint32_t worstReads = 0;
+    uint32_t worstSkipped = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kQueries; ++i) {
+      Query query = {c.bySeq, 0, 0, c.kind, kLimit};
+      if (c.kind >= 0) {
+        query.from = firstTime;  // filter over the whole journal
+      } else if (c.bySeq) {
+        query.fromSeq = firstSeq + rng.next() % span;
+      } else {
+        query.from = firstTime + rng.next() % timeSpan;
+      }
+      const QueryResult r = runQuery(store, query);
+      if (r.strideReads > worstReads) worstReads = r.strideReads;
+      if (r.skipped > worstSkipped) worstSkipped = r.skipped;
+    }
+    const double us = microsSince(start) / kQueries;
+    printf("journal_index: query %-17s limit %u over %u records: %5.1f us host, "
+           "worst %2u stride reads, %2u records skipped\n",
+           c.name, kLimit, span, us, worstReads, worstSkipped);
+    if (c.kind < 0) {
+      // Independent of journal size: the seek lands within a stride.
+      CHECK(worstReads <= maxReads);
+      CHECK(worstSkipped <= kJournalIndexStride);
+    } else {
+      // A sparse filter is bounded by the journal, read once.
+      CHECK(worstReads <= kSegments * kMarks);
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  testSeekCorrectness();
+  measureAppend();
+  measureQueries();
+  return finishChecks("journal_index");
+}
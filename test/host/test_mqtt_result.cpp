@@ -0,0 +1,159 @@
+// MQTT command result bodies, and a command round trip through an in-process
+// broker: client publishes on <root>/cmd, the device answers on cmd/result.
+#include <string.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "mqtt_result.h"
+
+namespace {
+
+const size_t kResultBytes = 160;  // kMqttResultBytes in main.cpp
+
+std::string result(const char* requestId, const char* errorCode,
+                   size_t size = kResultBytes) {
+  std::vector<char> body(size);
+  const size_t n = formatCommandResult(body.data(), size, requestId, errorCode);
+  return std::string(body.data(), n);
+}
+
+void testFormat() {
+  CHECK(result("cmd-1", nullptr) ==
+        "{\"type\":\"command_result\",\"schemaVersion\":1,"
+        "\"requestId\":\"cmd-1\",\"ok\":true,\"error\":null}");
+  CHECK(result("cmd-2", "COMMAND_REJECTED") ==
+        "{\"type\":\"command_result\",\"schemaVersion\":1,"
+        "\"requestId\":\"cmd-2\",\"ok\":false,"
+        "\"error\":{\"code\":\"COMMAND_REJECTED\"}}");
+  CHECK(result(nullptr, "INVALID_REQUEST") ==
+        "{\"type\":\"command_result\",\"schemaVersion\":1,\"ok\":false,"
+        "\"error\":{\"code\":\"INVALID_REQUEST\"}}");
+  CHECK(result("a\"b\\c\n", nullptr) ==
+        "{\"type\":\"command_result\",\"schemaVersion\":1,"
+        "\"requestId\":\"a\\\"b\\\\c\\u000a\",\"ok\":true,\"error\":null}");
+}
+
+// Every size below the exact fit reports 0 and never writes past size.
+void testNoTruncation() {
+  const std::string full = result("cmd-0001", "COMMAND_REJECTED");
+  CHECK(!full.empty());
+  for (size_t size = 0; size <= full.size(); ++size) {
+    std::vector<char> body(size + 8, '#');
+    const size_t n =
+        formatCommandResult(body.data(), size, "cmd-0001", "COMMAND_REJECTED");
+    CHECK_EQ(n, 0);
+    for (size_t i = size; i < body.size(); ++i) CHECK(body[i] == '#');
+  }
+  CHECK(result("cmd-0001", "COMMAND_REJECTED", full.size() + 1) == full);
+}
+
+void testOversize() {
+  char body[kResultBytes];
+  const size_t n = formatOversizeCommandResult(body, sizeof(body), true);
+  CHECK(n > 0);
+  CHECK(std::string(body, n) ==
+        "{\"type\":\"command_result\",\"schemaVersion\":1,\"ok\":false,"
+        "\"applied\":true,\"error\":{\"code\":\"INTERNAL_ERROR\","
+        "\"message\":\"result too large\"}}");
+  CHECK_EQ(formatOversizeCommandResult(body, 20, false), 0);
+}
+
+// Exact-topic broker: delivers each publish to every subscriber of the topic.
+struct FakeBroker {
+  typedef std::function<void(const std::string&)> Handler;
+  std::map<std::string, std::vector<Handler>> subscriptions;
+  uint32_t delivered = 0;
+
+  void subscribe(const std::string& topic, Handler handler) {
+    subscriptions[topic].push_back(handler);
+  }
+  void publish(const std::string& topic, const std::string& payload) {
+    for (Handler& handler : subscriptions[topic]) {
+      delivered += 1;
+      handler(payload);
+    }
+  }
+};
+
+// Device side, shaped like handleMqttMessage. The envelope here is just
+// "<requestId>|<ok>", or anything without '|' for a parse failure.
+struct FakeDevice {
+  FakeBroker& broker;
+  std::string root;
+  uint32_t oversizeResults = 0;
+
+  void attach() {
+    broker.subscribe(root + "/cmd",
+                     [this](const std::string& payload) { onCommand(payload); });
+  }
+  void onCommand(const std::string& payload) {
+    char body[kResultBytes];
+    size_t length = 0;
+    bool ok = false;
+    const size_t bar = payload.find('|');
+    if (bar == std::string::npos) {
+      length = formatCommandResult(body, sizeof(body), nullptr,
+                                   "INVALID_REQUEST");
+    } else {
+      const std::string requestId = payload.substr(0, bar);
+      ok = payload.compare(bar + 1, std::string::npos, "1") == 0;
+      length = formatCommandResult(body, sizeof(body), requestId.c_str(),
+                                   ok ? nullptr : "COMMAND_REJECTED");
+    }
+    if (length == 0) {
+      length = formatOversizeCommandResult(body, sizeof(body), ok);
+      oversizeResults += 1;
+    }
+    broker.publish(root + "/cmd/result", std::string(body, length));
+  }
+};
+
+void testBrokerRoundTrip() {
+  FakeBroker broker;
+  FakeDevice device{broker, "advancedtimer/test"};
+  device.attach();
+  std::vector<std::string> results;
+  broker.subscribe("advancedtimer/test/cmd/result",
+                   [&results](const std::string& payload) {
+                     results.push_back(payload);
+                   });
+
+  broker.publish("advancedtimer/test/cmd", "cmd-1|1");
+  broker.publish("advancedtimer/test/cmd", "cmd-2|0");
+  broker.publish("advancedtimer/test/cmd", "not json");
+  broker.publish("advancedtimer/test/cmd", std::string(200, 'x') + "|1");
+  broker.publish("advancedtimer/other/cmd", "cmd-3|1");
+
+  CHECK_EQ(results.size(), 4);
+  if (results.size() != 4) return;
+  CHECK(results[0] == result("cmd-1", nullptr));
+  CHECK(results[1] == result("cmd-2", "COMMAND_REJECTED"));
+  CHECK(results[2] == result(nullptr, "INVALID_REQUEST"));
+  CHECK(results[3].find("\"INTERNAL_ERROR\"") != std::string::npos);
+  CHECK(results[3].find("\"applied\":true") != std::string::npos);
+  CHECK_EQ(device.oversizeResults, 1);
+  for (const std::string& body : results) CHECK(body.size() < kResultBytes);
+
+  // The longest requestId that still round-trips intact.
+  const size_t fixed = result("", nullptr).size();
+  const std::string longest(kResultBytes - 1 - fixed, 'r');
+  results.clear();
+  broker.publish("advancedtimer/test/cmd", longest + "|1");
+  CHECK_EQ(results.size(), 1);
+  CHECK(results.size() == 1 && results[0] == result(longest.c_str(), nullptr));
+  CHECK_EQ(device.oversizeResults, 1);
+}
+
+}  // namespace
+
+int main() {
+  testFormat();
+  testNoTruncation();
+  testOversize();
+  testBrokerRoundTrip();
+  return finishChecks("mqtt_result");
+}
@@ -0,0 +1,170 @@
+// OTA receive chunking against a fake partition, and the trial-boot rules.
+#include <string.h>
+
+#include <vector>
+
+#include "check.h"
+#include "ota_trial.h"
+
+namespace {
+
+struct FakeSession;
+typedef bool (*FakeChunkWriter)(FakeSession& session, const uint8_t* data,
+                                size_t length);
+
+// Mirrors the OtaSession fields the chunking touches. The partition is a
+// byte vector; failAtChunk makes that write (0-based) fail.
+struct FakeSession {
+  FakeChunkWriter writeChunk;
+  uint32_t received;
+  uint32_t written;
+  uint16_t fill;
+  uint8_t buffer[kOtaChunkBytes];
+  std::vector<uint8_t> partition;
+  std::vector<size_t> chunkSizes;
+  int failAtChunk;
+};
+
+bool writeFakeChunk(FakeSession& session, const uint8_t* data, size_t length) {
+  if (static_cast<int>(session.chunkSizes.size()) == session.failAtChunk) {
+    return false;
+  }
+  session.partition.insert(session.partition.end(), data, data + length);
+  session.chunkSizes.push_back(length);
+  return true;
+}
+
+FakeSession makeSession() {
+  FakeSession session = {};
+  session.writeChunk = writeFakeChunk;
+  session.failAtChunk = -1;
+  return session;
+}
+
+std::vector<uint8_t> makeImage(size_t length) {
+  std::vector<uint8_t> image(length);
+  for (size_t i = 0; i < length; ++i) {
+    image[i] = static_cast<uint8_t>((i * 131) ^ (i >> 8));
+  }
+  return image;
+}
+
+// Feeds the image in pieces of the given size, as HTTP upload callbacks do.
+bool stream(FakeSession& session, const std::vector<uint8_t>& image,
+            size_t piece) {
+  for (size_t at = 0; at < image.size(); at += piece) {
+    const size_t n = (image.size() - at < piece) ? image.size() - at : piece;
+    if (!otaAcceptBytes(session, image.data() + at, n)) return false;
+  }
+  return otaFlushBytes(session);
+}
+
+void testChunking() {
+  const std::vector<uint8_t> image = makeImage(3 * kOtaChunkBytes + 1000);
+  const size_t pieces[] = {1, 7, 1436, kOtaChunkBytes, 3 * kOtaChunkBytes};
+  for (size_t piece : pieces) {
+    FakeSession session = makeSession();
+    CHECK(stream(session, image, piece));
+    CHECK(session.partition == image);
+    CHECK_EQ(session.received, image.size());
+    CHECK_EQ(session.written, image.size());
+    CHECK_EQ(session.fill, 0);
+    CHECK_EQ(session.chunkSizes.size(), 4);
+    for (size_t i = 0; i + 1 < session.chunkSizes.size(); ++i) {
+      CHECK_EQ(session.chunkSizes[i], kOtaChunkBytes);
+    }
+    CHECK_EQ(session.chunkSizes.back(), 1000);
+  }
+}
+
+void testExactChunksAndEmptyFlush() {
+  const std::vector<uint8_t> image = makeImage(2 * kOtaChunkBytes);
+  FakeSession session = makeSession();
+  CHECK(stream(session, image, 500));
+  CHECK(session.partition == image);
+  CHECK_EQ(session.chunkSizes.size(), 2);
+  CHECK(otaFlushBytes(session));
+  CHECK_EQ(session.chunkSizes.size(), 2);
+}
+
+void testWriteFailure() {
+  const std::vector<uint8_t> image = makeImage(3 * kOtaChunkBytes);
+  FakeSession session = makeSession();
+  session.failAtChunk = 1;
+  CHECK(!stream(session, image, 1024));
+  CHECK_EQ(session.written, kOtaChunkBytes);
+  CHECK_EQ(session.partition.size(), kOtaChunkBytes);
+
+  FakeSession tail = makeSession();
+  tail.failAtChunk = 0;
+  const uint8_t bytes[10] = {};
+  CHECK(otaAcceptBytes(tail, bytes, sizeof(bytes)));
+  CHECK(!otaFlushBytes(tail));
+  CHECK_EQ(tail.written, 0);
+}
+
+OtaTrial pendingTrial() {
+  OtaTrial trial = {};
+  trial.state = OtaTrial_Pending;
+  return trial;
+}
+
+void testTrialConfirm() {
+  OtaTrial trial = pendingTrial();
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Healthy, true, 3), OtaAction_None);
+  CHECK_EQ(trial.state, OtaTrial_Pending);
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Boot, true, 3), OtaAction_Save);
+  CHECK_EQ(trial.state, OtaTrial_Testing);
+  CHECK_EQ(trial.boots, 1);
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Healthy, true, 3), OtaAction_Confirm);
+  CHECK_EQ(trial.state, OtaTrial_Confirmed);
+  // A confirmed image ignores everything after.
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Boot, true, 3), OtaAction_None);
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Unhealthy, true, 3), OtaAction_None);
+  CHECK_EQ(trial.state, OtaTrial_Confirmed);
+}
+
+void testTrialBootLoop() {
+  OtaTrial trial = pendingTrial();
+  for (int boot = 1; boot <= 3; ++boot) {
+    CHECK_EQ(stepOtaTrial(trial, OtaEvent_Boot, true, 3), OtaAction_Save);
+    CHECK_EQ(trial.state, OtaTrial_Testing);
+  }
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Boot, true, 3), OtaAction_RollBack);
+  CHECK_EQ(trial.state, OtaTrial_RolledBack);
+  CHECK(strcmp(trial.reason, "boot loop") == 0);
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Boot, false, 3), OtaAction_None);
+}
+
+void testTrialUnhealthy() {
+  OtaTrial trial = pendingTrial();
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Unhealthy, true, 3), OtaAction_None);
+  stepOtaTrial(trial, OtaEvent_Boot, true, 3);
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Unhealthy, true, 3), OtaAction_RollBack);
+  CHECK_EQ(trial.state, OtaTrial_RolledBack);
+  CHECK(strcmp(trial.reason, "health check") == 0);
+}
+
+// The bootloader fell back before the trial confirmed: the previous image is
+// running, so the trial is closed without another switch.
+void testTrialBootedPrevious() {
+  OtaTrial trial = pendingTrial();
+  stepOtaTrial(trial, OtaEvent_Boot, true, 3);
+  CHECK_EQ(stepOtaTrial(trial, OtaEvent_Boot, false, 3), OtaAction_Save);
+  CHECK_EQ(trial.state, OtaTrial_RolledBack);
+  CHECK(strcmp(trial.reason, "image did not boot") == 0);
+  CHECK_EQ(trial.boots, 1);
+}
+
+}  // namespace
+
+int main() {
+  testChunking();
+  testExactChunksAndEmptyFlush();
+  testWriteFailure();
+  testTrialConfirm();
+  testTrialBootLoop();
+  testTrialUnhealthy();
+  testTrialBootedPrevious();
+  return finishChecks("ota_trial");
+}
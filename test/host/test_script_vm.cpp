@@ -0,0 +1,452 @@
+// Script card compiler and VM against a small table of fake cards, and the
+// scan cost of a script card against the SoftIO chain it replaces.
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "script_vm.h"
+
+namespace {
+
+const uint16_t kFakeCards = 4;
+
+struct FakeCard {
+  int32_t fields[5];  // indexed by scriptField
+};
+
+FakeCard gCards[kFakeCards];
+
+bool isFakeReference(uint16_t id) { return id < kFakeCards; }
+
+struct Compiled {
+  bool ok;
+  ScriptProgram program;
+  std::string error;
+  size_t offset;
+};
+
+Compiled compile(const std::string& source) {
+  Compiled result = {};
+  const char* error = nullptr;
+  result.ok = compileScriptSource(source.c_str(), isFakeReference,
+                                  result.program, error, result.offset);
+  if (error != nullptr) result.error = error;
+  return result;
+}
+
+struct Outputs {
+  int32_t state;
+  int32_t value;
+};
+
+Outputs run(const ScriptProgram& program) {
+  Outputs out = {-1, -1};
+  runScriptInstructions(
+      program,
+      [](uint8_t field, uint16_t id) { return gCards[id].fields[field]; },
+      [&out](uint8_t field, int32_t value) {
+        (field == ScriptField_State ? out.state : out.value) = value;
+      });
+  return out;
+}
+
+// Compiles "value = <expr>" and returns what it stores.
+int32_t eval(const std::string& expr) {
+  const Compiled c = compile("value = " + expr);
+  CHECK(c.ok);
+  if (!c.ok) {
+    fprintf(stderr, "  %s: %s at %zu\n", expr.c_str(), c.error.c_str(),
+            c.offset);
+    return 0;
+  }
+  return run(c.program).value;
+}
+
+std::string repeat(const char* piece, int count) {
+  std::string out;
+  for (int i = 0; i < count; ++i) out += piece;
+  return out;
+}
+
+void testArithmetic() {
+  CHECK_EQ(eval("1 + 2 * 3"), 7);
+  CHECK_EQ(eval("(1 + 2) * 3"), 9);
+  CHECK_EQ(eval("10 - 4 - 3"), 3);
+  CHECK_EQ(eval("17 % 5"), 2);
+  CHECK_EQ(eval("-7 / 2"), -3);
+  CHECK_EQ(eval("5 / 0"), 0);
+  CHECK_EQ(eval("5 % 0"), 0);
+  CHECK_EQ(eval("2147483647 + 1"), INT32_MIN);
+  CHECK_EQ(eval("-2147483647 - 1"), INT32_MIN);
+  CHECK_EQ(eval("(-2147483647 - 1) / -1"), INT32_MIN);
+  CHECK_EQ(eval("1 < 2 && 3 >= 3"), 1);
+  CHECK_EQ(eval("1 == 2 || !0"), 1);
+  CHECK_EQ(eval("2 != 2"), 0);
+  CHECK_EQ(eval("true ? 4 : 5"), 4);
+  CHECK_EQ(eval("false ? 4 : 0 ? 6 : 7"), 7);
+}
+
+void testCardFields() {
+  memset(gCards, 0, sizeof(gCards));
+  gCards[2].fields[ScriptField_Value] = 1200;
+  gCards[3].fields[ScriptField_State] = 1;
+  const Compiled c =
+      compile("state = C3.state && C2.value > 1000; value = C2.value / 10");
+  CHECK(c.ok);
+  const Outputs out = run(c.program);
+  CHECK_EQ(out.state, 1);
+  CHECK_EQ(out.value, 120);
+  gCards[2].fields[ScriptField_Value] = 900;
+  CHECK_EQ(run(c.program).state, 0);
+}
+
+void testEmptyScript() {
+  const Compiled c = compile("  ");
+  CHECK(c.ok);
+  CHECK_EQ(c.program.length, 0);
+  const Outputs out = run(c.program);
+  CHECK_EQ(out.state, -1);
+  CHECK_EQ(out.value, -1);
+}
+
+void checkError(const std::string& source, const char* error) {
+  const Compiled c = compile(source);
+  CHECK(!c.ok);
+  if (c.error != error) {
+    fprintf(stderr, "  '%s': got '%s', expected '%s'\n", source.c_str(),
+            c.error.c_str(), error);
+    CHECK(c.error == error);
+  }
+}
+
+void testErrors() {
+  checkError("state = C4.state", "unknown card reference");
+  checkError("state = C70000.state", "unknown card reference");
+  checkError("state = C1.bogus", "unknown card field");
+  checkError("state = (1", "expected ')'");
+  checkError("state = 1 ? 2", "expected ':'");
+  checkError("state = 1 2", "expected ';'");
+  checkError("output = 1", "expected 'state =' or 'value ='");
+  checkError("value = 2147483648", "constant out of range");
+  checkError("value = " + repeat("1 + ", AT_SCRIPT_MAX_INSTRUCTIONS) + "1",
+             "script too long");
+  // Each chained '?:' takes two registers; the fourth runs out.
+  CHECK_EQ(eval("0 ? 1 : 0 ? 2 : 0 ? 3 : 4"), 4);
+  checkError("value = 0 ? 1 : 0 ? 2 : 0 ? 3 : 0 ? 4 : 5", "expression too deep");
+}
+
+// Parentheses and unary chains recurse without taking a register; the depth
+// limit stops them before they exhaust the compiling task's stack.
+void testNestingDepth() {
+  const std::string atLimit = repeat("(", kScriptMaxDepth) + "1" +
+                              repeat(")", kScriptMaxDepth);
+  CHECK_EQ(eval(atLimit), 1);
+  CHECK_EQ(eval(repeat("-", kScriptMaxDepth) + "5"), 5);
+  CHECK_EQ(eval(repeat("!", kScriptMaxDepth - 1) + "0"), 1);
+
+  checkError("value = " + repeat("(", kScriptMaxDepth + 1) + "1" +
+                 repeat(")", kScriptMaxDepth + 1),
+             "expression too deep");
+  checkError("value = " + repeat("(", 120) + "1" + repeat(")", 120),
+             "expression too deep");
+  checkError("value = " + repeat("!", 120) + "1", "expression too deep");
+  checkError("value = " + repeat("-(", 60) + "1" + repeat(")", 60),
+             "expression too deep");
+
+  // Depth is released after each nested construct, so siblings do not add up.
+  std::string siblings = "value = 0";
+  for (int i = 0; i < 3; ++i) {
+    siblings += " + " + repeat("(", kScriptMaxDepth) + "1" +
+                repeat(")", kScriptMaxDepth);
+  }
+  const Compiled c = compile(siblings);
+  CHECK(c.ok);
+  CHECK_EQ(run(c.program).value, 3);
+}
+
+// --- Script card against the SoftIO chain it replaces -----------------------
+// BenchCard and processChainCard mirror the LogicCard fields, evalOperator,
+// evalCondition and the latching path of processDOCard (Mode_DO_Immediate,
+// no timers) that a virtual SoftIO card takes each scan.
+enum benchOp : uint8_t {
+  Bench_LogicalTrue,
+  Bench_LogicalFalse,
+  Bench_GT,
+  Bench_LT,
+  Bench_GTE,
+  Bench_LTE
+};
+enum benchCombine : uint8_t { Bench_None, Bench_AND, Bench_OR };
+enum benchState : uint8_t { Bench_Idle, Bench_Active };
+
+struct BenchClause {
+  uint16_t aId;
+  uint8_t aOp;
+  uint32_t aTh;
+  uint16_t bId;
+  uint8_t bOp;
+  uint32_t bTh;
+  uint8_t combine;
+};
+
+struct BenchCard {
+  bool logicalState;
+  bool physicalState;
+  bool triggerFlag;
+  uint32_t currentValue;
+  uint32_t repeatCounter;
+  uint8_t state;
+  bool prevSet;
+  BenchClause set;
+  BenchClause reset;
+};
+
+const uint16_t kBenchCards = 16;  // inputs C0..C5, chain C10..C15
+BenchCard gBench[kBenchCards];
+
+bool isBenchReference(uint16_t id) { return id < kBenchCards; }
+
+bool benchOperator(const BenchCard& target, uint8_t op, uint32_t threshold) {
+  switch (op) {
+    case Bench_LogicalTrue:
+      return target.logicalState;
+    case Bench_LogicalFalse:
+      return !target.logicalState;
+    case Bench_GT:
+      return target.currentValue > threshold;
+    case Bench_LT:
+      return target.currentValue < threshold;
+    case Bench_GTE:
+      return target.currentValue >= threshold;
+    case Bench_LTE:
+      return target.currentValue <= threshold;
+    default:
+      return false;
+  }
+}
+
+bool benchCondition(const BenchClause& c) {
+  const bool a = benchOperator(gBench[c.aId], c.aOp, c.aTh);
+  if (c.combine == Bench_None) return a;
+  const bool b = benchOperator(gBench[c.bId], c.bOp, c.bTh);
+  if (c.combine == Bench_AND) return a && b;
+  if (c.combine == Bench_OR) return a || b;
+  return false;
+}
+
+void processChainCard(BenchCard& card) {
+  const bool previousPhysical = card.physicalState;
+  const bool setCondition = benchCondition(card.set);
+  const bool resetCondition = benchCondition(card.reset);
+  const bool setRisingEdge = setCondition && !card.prevSet;
+  card.prevSet = setCondition;
+  if (resetCondition) {
+    card.logicalState = false;
+    card.physicalState = false;
+    card.triggerFlag = false;
+    card.repeatCounter = 0;
+    card.currentValue = 0;
+    card.state = Bench_Idle;
+    return;
+  }
+  card.triggerFlag =
+      card.state == Bench_Idle && (setRisingEdge || setCondition);
+  if (card.triggerFlag) {
+    card.logicalState = true;
+    card.repeatCounter = 0;
+    card.state = Bench_Active;
+  }
+  const bool effectiveOutput = card.state == Bench_Active;
+  if (!previousPhysical && effectiveOutput) card.currentValue += 1;
+  card.physicalState = effectiveOutput;
+}
+
+// processScriptCard's bookkeeping around the VM.
+void processBenchScript(const ScriptProgram& program, BenchCard& card) {
+  const bool previous = card.logicalState;
+  runScriptInstructions(
+      program,
+      [](uint8_t field, uint16_t id) -> int32_t {
+        const BenchCard& target = gBench[id];
+        switch (field) {
+          case ScriptField_State:
+            return target.logicalState;
+          case ScriptField_Phys:
+            return target.physicalState;
+          case ScriptField_Trig:
+            return target.triggerFlag;
+          case ScriptField_Value:
+            return static_cast<int32_t>(target.currentValue);
+          default:
+            return static_cast<int32_t>(target.repeatCounter);
+        }
+      },
+      [&card](uint8_t field, int32_t value) {
+        if (field == ScriptField_State) {
+          card.logicalState = (value != 0);
+        } else {
+          card.currentValue = (value < 0) ? 0 : static_cast<uint32_t>(value);
+        }
+      });
+  card.physicalState = card.logicalState;
+  card.triggerFlag = card.logicalState && !previous;
+}
+
+// Card a is set while both inputs hold and reset as soon as one drops, which
+// is how a SoftIO card computes a level AND; OR is the mirror image.
+BenchClause clause(uint16_t aId, uint8_t aOp, uint32_t aTh, uint8_t combine,
+                   uint16_t bId, uint8_t bOp, uint32_t bTh) {
+  return BenchClause{aId, aOp, aTh, bId, bOp, bTh, combine};
+}
+BenchCard andCard(uint16_t a, uint16_t b) {
+  BenchCard card = {};
+  card.set = clause(a, Bench_LogicalTrue, 0, Bench_AND, b, Bench_LogicalTrue, 0);
+  card.reset = clause(a, Bench_LogicalFalse, 0, Bench_OR, b, Bench_LogicalFalse, 0);
+  return card;
+}
+BenchCard orCard(uint16_t a, uint16_t b) {
+  BenchCard card = {};
+  card.set = clause(a, Bench_LogicalTrue, 0, Bench_OR, b, Bench_LogicalTrue, 0);
+  card.reset = clause(a, Bench_LogicalFalse, 0, Bench_AND, b, Bench_LogicalFalse, 0);
+  return card;
+}
+
+struct BenchCase {
+  const char* name;
+  const char* script;
+  std::vector<BenchCard> chain;  // C10.., evaluated in id order; last is output
+};
+
+struct Lcg {
+  uint32_t state;
+  uint32_t next() {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+  }
+};
+
+// Inputs C0..C5 change every scan; C0..C2 are digital, C3..C5 analog.
+void randomizeInputs(Lcg& rng) {
+  for (uint16_t id = 0; id < 6; ++id) {
+    if (id < 3) {
+      gBench[id].logicalState = (rng.next() & 3) != 0;
+    } else {
+      gBench[id].currentValue = rng.next() % 1000;
+    }
+  }
+}
+
+double nsPerScan(std::chrono::steady_clock::time_point start, int scans) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         scans;
+}
+
+void benchmarkAgainstSoftIOChain() {
+  const uint16_t kScript = 9;
+  std::vector<BenchCase> cases;
+  {
+    // (C0 && C3 > 500) || (C1 && C4 < 100): two comparator cards and an OR.
+    BenchCase c = {"interlock",
+                   "state = (C0.state && C3.value > 500) || "
+                   "(C1.state && C4.value < 100)",
+                   {}};
+    BenchCard high = {};
+    high.set = clause(0, Bench_LogicalTrue, 0, Bench_AND, 3, Bench_GT, 500);
+    high.reset = clause(0, Bench_LogicalFalse, 0, Bench_OR, 3, Bench_LTE, 500);
+    BenchCard low = {};
+    low.set = clause(1, Bench_LogicalTrue, 0, Bench_AND, 4, Bench_LT, 100);
+    low.reset = clause(1, Bench_LogicalFalse, 0, Bench_OR, 4, Bench_GTE, 100);
+    c.chain = {high, low, orCard(10, 11)};
+    cases.push_back(c);
+  }
+  {
+    // Two of three: three pair ANDs folded by two ORs.
+    BenchCase c = {"2-of-3 vote",
+                   "state = C0.state + C1.state + C2.state >= 2",
+                   {andCard(0, 1), andCard(0, 2), andCard(1, 2), orCard(10, 11),
+                    orCard(13, 12)}};
+    cases.push_back(c);
+  }
+
+  const int kScans = 1000000;
+  for (const BenchCase& c : cases) {
+    ScriptProgram program = {};
+    const char* error = nullptr;
+    size_t offset = 0;
+    CHECK(compileScriptSource(c.script, isBenchReference, program, error,
+                              offset));
+    memset(gBench, 0, sizeof(gBench));
+    for (size_t i = 0; i < c.chain.size(); ++i) gBench[10 + i] = c.chain[i];
+    const uint16_t chainOut = static_cast<uint16_t>(10 + c.chain.size() - 1);
+
+    // Same output on every scan once the chain runs in id order.
+    Lcg rng = {7};
+    uint32_t mismatches = 0;
+    uint32_t onScans = 0;
+    for (int scan = 0; scan < 20000; ++scan) {
+      randomizeInputs(rng);
+      for (uint16_t id = 10; id <= chainOut; ++id) processChainCard(gBench[id]);
+      processBenchScript(program, gBench[kScript]);
+      if (gBench[chainOut].logicalState != gBench[kScript].logicalState) {
+        mismatches += 1;
+      }
+      onScans += gBench[kScript].logicalState;
+    }
+    CHECK_EQ(mismatches, 0);
+    CHECK(onScans > 1000 && onScans < 19000);
+
+    // Against the id order, each level of the chain lags one scan.
+    uint32_t lagged = 0;
+    for (int scan = 0; scan < 20000; ++scan) {
+      randomizeInputs(rng);
+      for (uint16_t id = chainOut; id >= 10; --id) processChainCard(gBench[id]);
+      processBenchScript(program, gBench[kScript]);
+      if (gBench[chainOut].logicalState != gBench[kScript].logicalState) {
+        lagged += 1;
+      }
+    }
+
+    rng.state = 11;
+    uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int scan = 0; scan < kScans; ++scan) {
+      gBench[0].logicalState = rng.next() & 1;
+      gBench[3].currentValue = rng.next() % 1000;
+      for (uint16_t id = 10; id <= chainOut; ++id) processChainCard(gBench[id]);
+      sink += gBench[chainOut].logicalState;
+    }
+    const double chainNs = nsPerScan(start, kScans);
+    rng.state = 11;
+    start = std::chrono::steady_clock::now();
+    for (int scan = 0; scan < kScans; ++scan) {
+      gBench[0].logicalState = rng.next() & 1;
+      gBench[3].currentValue = rng.next() % 1000;
+      processBenchScript(program, gBench[kScript]);
+      sink += gBench[kScript].logicalState;
+    }
+    const double scriptNs = nsPerScan(start, kScans);
+    CHECK(sink > 0);
+    printf("script_vm: %-12s %u SoftIO cards (%4.1f ns/scan, %4.1f%% of scans "
+           "off when ids run against the chain) vs 1 script card of %u "
+           "instructions (%4.1f ns/scan)\n",
+           c.name, static_cast<unsigned>(c.chain.size()), chainNs,
+           100.0 * lagged / 20000, program.length, scriptNs);
+  }
+}
+
+}  // namespace
+
+int main() {
+  testArithmetic();
+  testCardFields();
+  testEmptyScript();
+  testErrors();
+  testNestingDepth();
+  benchmarkAgainstSoftIOChain();
+  return finishChecks("script_vm");
+}
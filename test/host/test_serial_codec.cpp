@@ -0,0 +1,293 @@
+// CRC-16/CCITT-FALSE and COBS framing used by the offline serial link, and
+// the frame reader fed from a pseudo-terminal as the device's UART would be.
+#include <fcntl.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "serial_codec.h"
+
+namespace {
+
+std::vector<uint8_t> encode(const std::vector<uint8_t>& in) {
+  std::vector<uint8_t> out(in.size() + in.size() / 254 + 1);
+  out.resize(cobsEncode(in.data(), in.size(), out.data()));
+  return out;
+}
+
+std::vector<uint8_t> decode(const std::vector<uint8_t>& in) {
+  std::vector<uint8_t> out(in.size());
+  out.resize(cobsDecode(in.data(), in.size(), out.data()));
+  return out;
+}
+
+void testCrc() {
+  const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  CHECK_EQ(crc16Ccitt(check, sizeof(check)), 0x29B1);
+  CHECK_EQ(crc16Ccitt(check, 0), 0xFFFF);
+  const uint8_t zero = 0;
+  CHECK_EQ(crc16Ccitt(&zero, 1), 0xE1F0);
+}
+
+void testCobsVectors() {
+  struct Vector {
+    std::vector<uint8_t> raw;
+    std::vector<uint8_t> encoded;
+  };
+  const Vector vectors[] = {
+      {{0x00}, {0x01, 0x01}},
+      {{0x00, 0x00}, {0x01, 0x01, 0x01}},
+      {{0x00, 0x11, 0x00}, {0x01, 0x02, 0x11, 0x01}},
+      {{0x11, 0x22, 0x00, 0x33}, {0x03, 0x11, 0x22, 0x02, 0x33}},
+      {{0x11, 0x22, 0x33, 0x44}, {0x05, 0x11, 0x22, 0x33, 0x44}},
+      {{0x11, 0x00, 0x00, 0x00}, {0x02, 0x11, 0x01, 0x01, 0x01}},
+  };
+  for (const Vector& v : vectors) {
+    CHECK(encode(v.raw) == v.encoded);
+    CHECK(decode(v.encoded) == v.raw);
+  }
+}
+
+void testCobsLongBlocks() {
+  // 254 non-zero bytes fill one block; the encoder closes it with a code
+  // byte and an empty trailing block, which the decoder must not turn into
+  // an extra zero.
+  for (size_t length : {253u, 254u, 255u, 508u, 509u, 600u}) {
+    std::vector<uint8_t> raw(length);
+    for (size_t i = 0; i < length; ++i) raw[i] = static_cast<uint8_t>(1 + i % 255);
+    const std::vector<uint8_t> encoded = encode(raw);
+    CHECK(encoded.size() <= length + length / 254 + 1);
+    CHECK(memchr(encoded.data(), 0, encoded.size()) == nullptr);
+    CHECK(decode(encoded) == raw);
+  }
+}
+
+void testCobsRoundTrip() {
+  uint32_t seed = 12345;
+  for (int round = 0; round < 2000; ++round) {
+    seed = seed * 1103515245u + 12345u;
+    const size_t length = 1 + (seed >> 8) % 400;
+    std::vector<uint8_t> raw(length);
+    for (size_t i = 0; i < length; ++i) {
+      seed = seed * 1103515245u + 12345u;
+      // Bias toward zeros so runs and block boundaries both show up.
+      raw[i] = ((seed >> 16) % 5 == 0) ? 0 : static_cast<uint8_t>(seed >> 24);
+    }
+    const std::vector<uint8_t> encoded = encode(raw);
+    CHECK(memchr(encoded.data(), 0, encoded.size()) == nullptr);
+    CHECK(decode(encoded) == raw);
+  }
+}
+
+void testCobsMalformed() {
+  // A zero code byte and a code running past the end are both rejected.
+  CHECK(decode({0x02, 0x00, 0x11}).empty());
+  CHECK(decode({0x05, 0x11, 0x22}).empty());
+  CHECK(decode({0x03, 0x11, 0x22, 0x04, 0x33}).empty());
+}
+
+void testFrame() {
+  // Same layout as sendSerialFrame: type, body, crc16 little-endian.
+  std::vector<uint8_t> raw = {0x04, 0x34, 0x12, 0x01};
+  const uint16_t crc = crc16Ccitt(raw.data(), raw.size());
+  raw.push_back(static_cast<uint8_t>(crc & 0xFF));
+  raw.push_back(static_cast<uint8_t>(crc >> 8));
+  const std::vector<uint8_t> frame = decode(encode(raw));
+  CHECK_EQ(frame.size(), raw.size());
+  const size_t n = frame.size();
+  CHECK_EQ(crc16Ccitt(frame.data(), n - 2), frame[n - 2] | (frame[n - 1] << 8));
+
+  std::vector<uint8_t> corrupted = frame;
+  corrupted[1] ^= 0x01;
+  CHECK(crc16Ccitt(corrupted.data(), n - 2) !=
+        static_cast<uint16_t>(corrupted[n - 2] | (corrupted[n - 1] << 8)));
+}
+
+std::vector<uint8_t> frameBytes(uint8_t type, const std::vector<uint8_t>& body) {
+  std::vector<uint8_t> raw(body.size() + 3);
+  std::vector<uint8_t> out(serialFrameBytes(body.size()));
+  out.resize(encodeSerialFrame(type, body.data(), body.size(), raw.data(),
+                               out.data()));
+  return out;
+}
+
+struct ReadCounts {
+  std::vector<std::vector<uint8_t>> frames;  // type + body
+  uint32_t rejected = 0;
+};
+
+struct Receiver {
+  uint8_t buffer[64];
+  uint8_t frame[64];
+  SerialFrameReader reader = {buffer, sizeof(buffer), 0, false};
+  ReadCounts counts;
+
+  void feed(const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+      size_t frameLength = 0;
+      switch (feedSerialFrameByte(reader, data[i], frame, frameLength)) {
+        case SerialRead_Frame:
+          counts.frames.emplace_back(frame, frame + frameLength);
+          break;
+        case SerialRead_Rejected:
+          counts.rejected += 1;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+  void feed(const std::vector<uint8_t>& data) { feed(data.data(), data.size()); }
+  void feed(const char* text) {
+    feed(reinterpret_cast<const uint8_t*>(text), strlen(text));
+  }
+};
+
+void testReader() {
+  const std::vector<uint8_t> a = frameBytes(0x04, {0x34, 0x12, 0x01});
+  CHECK_EQ(a.size(), 9);
+  CHECK_EQ(a.front(), 0);
+  CHECK_EQ(a.back(), 0);
+
+  Receiver rx;
+  rx.feed(a);
+  rx.feed(a);  // back-to-back: the shared 0x00 0x00 yields nothing extra
+  CHECK_EQ(rx.counts.frames.size(), 2);
+  CHECK_EQ(rx.counts.rejected, 0);
+  CHECK(rx.counts.frames.size() == 2 &&
+        rx.counts.frames[0] == std::vector<uint8_t>({0x04, 0x34, 0x12, 0x01}));
+
+  // Text between frames is cut off by the next frame's leading delimiter and
+  // rejected as one run, without losing the frame after it.
+  Receiver text;
+  text.feed("boot: hello\r\n");
+  text.feed(a);
+  CHECK_EQ(text.counts.frames.size(), 1);
+  CHECK_EQ(text.counts.rejected, 1);
+
+  // A run longer than the buffer is rejected at its delimiter.
+  Receiver overflow;
+  overflow.feed(std::vector<uint8_t>(100, 0x41));
+  overflow.feed(a);
+  CHECK_EQ(overflow.counts.rejected, 1);
+  CHECK_EQ(overflow.counts.frames.size(), 1);
+
+  // A flipped bit fails the CRC.
+  std::vector<uint8_t> corrupted = a;
+  corrupted[3] ^= 0x10;
+  Receiver crc;
+  crc.feed(corrupted);
+  crc.feed(a);
+  CHECK_EQ(crc.counts.rejected, 1);
+  CHECK_EQ(crc.counts.frames.size(), 1);
+}
+
+// Opens a raw pseudo-terminal pair. Returns false where ptys are missing.
+bool openPty(int& master, int& slave) {
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0) return false;
+  if (grantpt(master) != 0 || unlockpt(master) != 0) {
+    close(master);
+    return false;
+  }
+  slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (slave < 0) {
+    close(master);
+    return false;
+  }
+  termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  return true;
+}
+
+bool writeAll(int fd, const uint8_t* data, size_t length) {
+  while (length > 0) {
+    const ssize_t n = write(fd, data, length);
+    if (n <= 0) return false;
+    data += n;
+    length -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// Device -> host over a pty: revision-sized frames with console text mixed
+// in, read back in arbitrary chunks. Every frame must arrive intact and in
+// order; the text runs are the only rejections.
+void testPtyLink() {
+  int master = -1;
+  int slave = -1;
+  if (!openPty(master, slave)) {
+    printf("serial_codec: no pty available, link test skipped\n");
+    return;
+  }
+  const uint32_t kFrames = 5000;
+  const uint32_t kTextEvery = 500;
+  std::thread device([slave, kFrames, kTextEvery]() {
+    for (uint32_t i = 0; i < kFrames; ++i) {
+      if (i % kTextEvery == 0) {
+        const char* text = "log line\r\n";
+        writeAll(slave, reinterpret_cast<const uint8_t*>(text), strlen(text));
+      }
+      std::vector<uint8_t> body(40);
+      for (size_t b = 0; b < body.size(); ++b) {
+        body[b] = static_cast<uint8_t>((i + b) % 7 == 0 ? 0 : i * 31 + b);
+      }
+      body[0] = static_cast<uint8_t>(i);
+      body[1] = static_cast<uint8_t>(i >> 8);
+      const std::vector<uint8_t> frame = frameBytes(0x01, body);
+      writeAll(slave, frame.data(), frame.size());
+    }
+  });
+
+  Receiver host;
+  uint8_t chunk[777];
+  uint64_t bytes = 0;
+  const auto start = std::chrono::steady_clock::now();
+  while (host.counts.frames.size() < kFrames) {
+    const ssize_t n = read(master, chunk, sizeof(chunk));
+    if (n <= 0) break;
+    bytes += static_cast<uint64_t>(n);
+    host.feed(chunk, static_cast<size_t>(n));
+  }
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  device.join();
+  close(slave);
+  close(master);
+
+  CHECK_EQ(host.counts.frames.size(), kFrames);
+  CHECK_EQ(host.counts.rejected, kFrames / kTextEvery);
+  for (uint32_t i = 0; i < host.counts.frames.size(); ++i) {
+    const std::vector<uint8_t>& frame = host.counts.frames[i];
+    if (frame.size() != 41 || frame[0] != 0x01 ||
+        (frame[1] | (frame[2] << 8)) != static_cast<int>(i & 0xFFFF)) {
+      CHECK(false);
+      break;
+    }
+  }
+  printf("serial_codec: pty %u frames, %.0f frames/s, %.1f MB/s\n", kFrames,
+         kFrames / seconds, bytes / seconds / 1e6);
+}
+
+}  // namespace
+
+int main() {
+  testCrc();
+  testCobsVectors();
+  testCobsLongBlocks();
+  testCobsRoundTrip();
+  testCobsMalformed();
+  testFrame();
+  testReader();
+  testPtyLink();
+  return finishChecks("serial_codec");
+}
@@ -0,0 +1,301 @@
+// SoftIO exchange: two endpoints over a fake multicast transport, covering
+// delivery, reordering, own loopback, staleness and sender restarts, plus
+// the remote-slot seqlock under a concurrent writer.
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "softio_exchange.h"
+
+namespace {
+
+const uint32_t kTimeoutMs = 500;
+
+// Every send reaches every endpoint, the sender included, as multicast
+// loopback does. Frames queue until deliver(); reverse swaps their order.
+struct FakeTransport {
+  std::vector<std::vector<uint8_t>> queued;
+
+  void send(const uint8_t* frame, size_t length) {
+    queued.emplace_back(frame, frame + length);
+  }
+  template <typename Receive>
+  void deliver(Receive receive, bool reverse = false) {
+    if (reverse) {
+      std::vector<std::vector<uint8_t>>(queued.rbegin(), queued.rend())
+          .swap(queued);
+    }
+    for (const std::vector<uint8_t>& frame : queued) receive(frame);
+    queued.clear();
+  }
+};
+
+struct Binding {
+  uint8_t node;
+  uint16_t sioIndex;
+};
+
+// Mirrors sendExchangeFrame, receiveExchangeFrames and sampleRemoteInputs.
+struct Endpoint {
+  uint8_t nodeId;
+  uint32_t scanSeq = 0;
+  std::vector<ExchangeEntry> published;
+  std::vector<Binding> bindings;
+  RemoteSioSlot slots[4] = {};
+  uint32_t sampledMs[4] = {};
+  uint32_t received = 0;
+  uint32_t rejected = 0;
+
+  void publish(FakeTransport& bus) {
+    uint8_t frame[kExchangeHeaderBytes + 8 * kExchangeEntryBytes];
+    scanSeq += 1;
+    bus.send(frame, encodeExchangeFrame(nodeId, scanSeq, published.data(),
+                                        static_cast<uint16_t>(published.size()),
+                                        frame));
+  }
+  void receive(const std::vector<uint8_t>& frame, uint32_t nowMs) {
+    ExchangeFrameHeader header = {};
+    if (!parseExchangeFrame(frame.data(), frame.size(), header)) {
+      rejected += 1;
+      return;
+    }
+    if (header.node == nodeId) return;
+    received += 1;
+    for (size_t slot = 0; slot < bindings.size(); ++slot) {
+      if (bindings[slot].node != header.node) continue;
+      if (!acceptExchangeFrame(slots[slot], header.scanSeq, nowMs, kTimeoutMs)) {
+        continue;
+      }
+      ExchangeEntry entry = {};
+      if (findExchangeEntry(frame.data(), header.count, bindings[slot].sioIndex,
+                            entry)) {
+        writeRemoteSlot(slots[slot], entry, header.scanSeq, nowMs);
+      }
+    }
+  }
+  // Value the kernel would see for slot at nowMs; false when stale.
+  bool sample(size_t slot, uint32_t nowMs, uint32_t& value) {
+    ExchangeEntry entry = {};
+    uint32_t receivedMs = sampledMs[slot];
+    if (readRemoteSlot(slots[slot], entry, receivedMs)) {
+      sampledMs[slot] = receivedMs;
+    }
+    if (!remoteSlotFresh(sampledMs[slot], nowMs, kTimeoutMs)) return false;
+    value = entry.value;
+    return true;
+  }
+};
+
+ExchangeEntry entry(uint16_t sioIndex, uint32_t value) {
+  ExchangeEntry e = {};
+  e.sioIndex = sioIndex;
+  e.state = 1;
+  e.bits = static_cast<uint8_t>(value & 1 ? 0x03 : 0x00);
+  e.value = value;
+  return e;
+}
+
+void exchange(FakeTransport& bus, Endpoint& a, Endpoint& b, uint32_t nowMs,
+              bool reverse = false) {
+  bus.deliver(
+      [&](const std::vector<uint8_t>& frame) {
+        a.receive(frame, nowMs);
+        b.receive(frame, nowMs);
+      },
+      reverse);
+}
+
+void testFrameCodec() {
+  const ExchangeEntry entries[] = {entry(0, 7), entry(513, 0xDEADBEEF)};
+  uint8_t frame[kExchangeHeaderBytes + 2 * kExchangeEntryBytes];
+  const size_t length = encodeExchangeFrame(9, 0x01020304, entries, 2, frame);
+  CHECK_EQ(length, sizeof(frame));
+  CHECK(memcmp(frame, "ATSX", 4) == 0);
+  ExchangeFrameHeader header = {};
+  CHECK(parseExchangeFrame(frame, length, header));
+  CHECK_EQ(header.node, 9);
+  CHECK_EQ(header.count, 2);
+  CHECK_EQ(header.scanSeq, 0x01020304);
+  ExchangeEntry found = {};
+  CHECK(findExchangeEntry(frame, header.count, 513, found));
+  CHECK_EQ(found.value, 0xDEADBEEF);
+  CHECK(!findExchangeEntry(frame, header.count, 1, found));
+
+  CHECK(!parseExchangeFrame(frame, length - 1, header));
+  CHECK(!parseExchangeFrame(frame, kExchangeHeaderBytes - 1, header));
+  uint8_t bad[sizeof(frame)];
+  memcpy(bad, frame, sizeof(frame));
+  bad[4] = kExchangeVersion + 1;
+  CHECK(!parseExchangeFrame(bad, length, header));
+  memcpy(bad, frame, sizeof(frame));
+  bad[0] = 'X';
+  CHECK(!parseExchangeFrame(bad, length, header));
+}
+
+void testTwoEndpoints() {
+  FakeTransport bus;
+  Endpoint a;
+  a.nodeId = 1;
+  a.published = {entry(0, 100), entry(1, 101)};
+  a.bindings = {{2, 3}};
+  Endpoint b;
+  b.nodeId = 2;
+  b.published = {entry(3, 203)};
+  b.bindings = {{1, 1}, {1, 0}, {3, 0}};
+
+  uint32_t value = 0;
+  CHECK(!b.sample(0, 10, value));  // nothing received yet
+
+  a.publish(bus);
+  b.publish(bus);
+  exchange(bus, a, b, 10);
+  CHECK_EQ(a.received, 1);  // own frame ignored
+  CHECK_EQ(b.received, 1);
+  CHECK(b.sample(0, 10, value) && value == 101);
+  CHECK(b.sample(1, 10, value) && value == 100);
+  CHECK(!b.sample(2, 10, value));  // node 3 never sent
+  CHECK(a.sample(0, 10, value) && value == 203);
+
+  // Values follow the sender's scans.
+  a.published[1].value = 111;
+  a.publish(bus);
+  exchange(bus, a, b, 20);
+  CHECK(b.sample(0, 20, value) && value == 111);
+}
+
+void testReorderAndStaleness() {
+  FakeTransport bus;
+  Endpoint a;
+  a.nodeId = 1;
+  a.published = {entry(0, 1)};
+  Endpoint b;
+  b.nodeId = 2;
+  b.bindings = {{1, 0}};
+
+  // Two scans in flight arrive swapped: the older one must not win.
+  a.publish(bus);
+  a.published[0].value = 2;
+  a.publish(bus);
+  exchange(bus, a, b, 100, true);
+  uint32_t value = 0;
+  CHECK(b.sample(0, 100, value) && value == 2);
+
+  // Duplicates change nothing.
+  a.publish(bus);
+  bus.queued.push_back(bus.queued.back());
+  exchange(bus, a, b, 150);
+  CHECK(b.sample(0, 150, value) && value == 2);
+
+  // Silence beyond the timeout turns the slot stale; the next frame revives it.
+  CHECK(b.sample(0, 150 + kTimeoutMs, value));
+  CHECK(!b.sample(0, 151 + kTimeoutMs, value));
+  a.published[0].value = 3;
+  a.publish(bus);
+  exchange(bus, a, b, 200 + kTimeoutMs);
+  CHECK(b.sample(0, 200 + kTimeoutMs, value) && value == 3);
+}
+
+void testSenderRestart() {
+  FakeTransport bus;
+  Endpoint a;
+  a.nodeId = 1;
+  a.published = {entry(0, 50)};
+  a.scanSeq = 1000;
+  Endpoint b;
+  b.nodeId = 2;
+  b.bindings = {{1, 0}};
+  a.publish(bus);
+  exchange(bus, a, b, 1000);
+
+  // The sender reboots and counts from 1. Inside the timeout its frames look
+  // old and are dropped; once the old stream expired they are accepted.
+  Endpoint restarted;
+  restarted.nodeId = 1;
+  restarted.published = {entry(0, 60)};
+  restarted.publish(bus);
+  exchange(bus, restarted, b, 1000 + kTimeoutMs);
+  uint32_t value = 0;
+  CHECK(b.sample(0, 1000 + kTimeoutMs, value) && value == 50);
+  restarted.publish(bus);
+  exchange(bus, restarted, b, 1001 + kTimeoutMs);
+  CHECK(b.sample(0, 1001 + kTimeoutMs, value) && value == 60);
+
+  // Sequence wrap is "newer", not a restart.
+  RemoteSioSlot slot = {};
+  writeRemoteSlot(slot, entry(0, 1), 0xFFFFFFFF, 5);
+  CHECK(acceptExchangeFrame(slot, 0, 6, kTimeoutMs));
+  CHECK(!acceptExchangeFrame(slot, 0xFFFFFFFE, 6, kTimeoutMs));
+}
+
+void testMalformedFrames() {
+  Endpoint b;
+  b.nodeId = 2;
+  b.bindings = {{1, 0}};
+  b.receive({'A', 'T', 'S', 'X'}, 1);
+  b.receive(std::vector<uint8_t>(40, 0), 1);
+  CHECK_EQ(b.rejected, 2);
+  CHECK_EQ(b.received, 0);
+  uint32_t value = 0;
+  CHECK(!b.sample(0, 1, value));
+}
+
+// A writer thread (the receive side) hammers one slot while the reader (the
+// kernel) samples it. Each entry is self-consistent, so a torn read shows up
+// as a mismatch; a busy slot may only make the reader keep its old image.
+void testSeqlock() {
+  RemoteSioSlot slot = {};
+  std::atomic<bool> stop(false);
+  std::atomic<uint32_t> writes(0);
+  std::thread writer([&]() {
+    for (uint32_t n = 1; !stop.load(std::memory_order_relaxed); ++n) {
+      ExchangeEntry e = {};
+      e.sioIndex = static_cast<uint16_t>(n);
+      e.state = static_cast<uint8_t>(n);
+      e.bits = static_cast<uint8_t>(n >> 8);
+      e.value = n;
+      writeRemoteSlot(slot, e, n, n);
+      writes.store(n, std::memory_order_relaxed);
+    }
+  });
+  const uint32_t kReads = 200000;
+  uint32_t reads = 0;
+  uint32_t missed = 0;
+  uint32_t torn = 0;
+  uint32_t lastValue = 0;
+  while (reads < kReads) {
+    ExchangeEntry e = {};
+    uint32_t receivedMs = 0;
+    if (!readRemoteSlot(slot, e, receivedMs)) {
+      missed += 1;
+      continue;
+    }
+    reads += 1;
+    if (e.sioIndex != static_cast<uint16_t>(e.value) ||
+        e.state != static_cast<uint8_t>(e.value) ||
+        e.bits != static_cast<uint8_t>(e.value >> 8) ||
+        receivedMs != e.value || e.value < lastValue) {
+      torn += 1;
+    }
+    lastValue = e.value;
+  }
+  stop.store(true);
+  writer.join();
+  CHECK_EQ(torn, 0);
+  printf("softio_exchange: %u consistent reads, %u retries exhausted, during "
+         "%u writes\n",
+         reads, missed, writes.load());
+}
+
+}  // namespace
+
+int main() {
+  testFrameCodec();
+  testTwoEndpoints();
+  testReorderAndStaleness();
+  testSenderRestart();
+  testMalformedFrames();
+  testSeqlock();
+  return finishChecks("softio_exchange");
+}